@@ -1,24 +1,22 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "async.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <fcntl.h>
-
-/* suppress compilation warnings */
-static inline ssize_t write_wrapper(int fd, const void *buf, size_t count)
-{
-    ssize_t s;
-    if ((s = write(fd, buf, count)) < count) perror("write");
-    return s;
-}
-#undef write
-#define write write_wrapper
+#include <sched.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 /* the actual working thread */
-static void *worker_thread_cycle(void *async);
+static void *worker_thread_cycle(void *worker);
 
 /* signaling to finish */
 static void async_signal(async_p async);
@@ -40,6 +38,26 @@ static int create_thread(pthread_t *thr,
     return pthread_create(thr, NULL, thread_func, async);
 }
 
+/* pin a thread to a single CPU */
+static void pin_thread(pthread_t thread, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+/* futex helpers, used for waking up sleeping threads */
+static inline void futex_wait(int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(int *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
 /** A task node */
 struct AsyncTask {
     struct AsyncTask *next;
@@ -47,108 +65,603 @@ struct AsyncTask {
     void *arg;
 };
 
-/** The Async struct */
-struct Async {
-    /** the task queue - MUST be first in the struct */
+/** A mutex protected task list (a priority lane) */
+struct AsyncList {
     pthread_mutex_t lock;              /**< a mutex for data integrity */
     struct AsyncTask * volatile tasks;  /**< active tasks */
     struct AsyncTask * volatile pool;   /**< a task node pool */
     struct AsyncTask ** volatile pos;   /**< the position for new tasks */
+};
+
+/** A lock-free ring cell (a Vyukov bounded MPMC queue) */
+struct AsyncCell {
+    size_t seq; /**< the cell's sequence, marks the cell as full / empty */
+    void (*task)(void *);
+    void *arg;
+};
+
+/** A task slot in a worker's deque */
+struct AsyncSlot {
+    void (*task)(void *);
+    void *arg;
+};
 
-    /** The pipe used for thread wakeup */
+/** A worker thread, owning a Chase-Lev work-stealing deque */
+struct AsyncWorker {
+    struct Async *async; /**< the thread pool owning the worker */
+    pthread_t thread;    /**< the worker's thread */
+    /** the deque (only used when work stealing is enabled) */
     struct {
-        int in;  /**< read incoming data (opaque data), used for wakeup */
-        int out; /**< write opaque data (single byte),
-                      used for wakeup signaling */
-    } pipe;
+        struct AsyncSlot *slots;
+        long mask;
+        long top __attribute__((aligned(64)));    /**< the taking end */
+        long bottom __attribute__((aligned(64))); /**< the pushing end */
+    } deque;
+    unsigned int ticks; /**< task counter, used for shared queue fairness */
+    /** the high priority tasks performed in a row (see `next_task`) */
+    unsigned int high_run;
+    /** statistics, only updated by the worker (see `Async.stats`) */
+    size_t queued;   /**< tasks scheduled by the worker */
+    size_t executed; /**< tasks performed by the worker */
+} __attribute__((aligned(64)));
+
+/** The worker running on the current thread (if any) */
+static __thread struct AsyncWorker *current_worker = NULL;
+
+/** The Async struct */
+struct Async {
+    /**
+     * the priority lanes - MUST be first in the struct. The normal lane
+     * also holds the tasks overflowing the ring (or the deques).
+     */
+    struct AsyncList lanes[ASYNC_PRIORITIES];
+
+    /** the low priority lane's worker reservation (see `low_threads`) */
+    struct {
+        int running; /**< the workers performing low priority tasks */
+        int limit;
+    } low;
+
+    /** the lock-free ring (only used by ASYNC_QUEUE_RING) */
+    struct {
+        struct AsyncCell *cells;
+        size_t mask;
+        /* keep the producer and consumer positions on different lines */
+        size_t head __attribute__((aligned(64))); /**< enqueue position */
+        size_t tail __attribute__((aligned(64))); /**< dequeue position */
+    } ring;
+
+    /** The futex used for thread wakeup */
+    struct {
+        int seq __attribute__((aligned(64))); /**< bumped for every wakeup */
+        int sleeping; /**< the number of sleeping threads */
+    } wake;
 
     int count; /**< the number of initialized threads */
 
-    unsigned run : 1; /**< the running flag */
+    /** statistics for tasks scheduled (or performed) outside of the pool */
+    struct {
+        size_t queued;
+        size_t executed;
+    } external;
+
+    volatile int run; /**< the running flag */
+
+    unsigned stealing : 1; /**< the work stealing flag */
 
     /** the thread pool */
-    pthread_t threads[];
+    struct AsyncWorker workers[];
 };
 
+/* Statistics - each worker counts it's own tasks, other threads share the
+ * (atomic) external counters */
+
+static inline void count_task(size_t *own, size_t *external, size_t count)
+{
+    if (own)
+        __atomic_store_n(own, *own + count, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(external, count, __ATOMIC_RELAXED);
+}
+
+/* Wakeup management - only wake threads that are actually sleeping */
+
+static inline void wake_threads(async_p async, int count)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&async->wake.sleeping, __ATOMIC_RELAXED))
+        return;
+    __atomic_add_fetch(&async->wake.seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&async->wake.seq, count);
+}
+
+/* Lock-free ring - push / pop, return 0 when the ring is full / empty */
+
+static int ring_push(async_p async, void (*task)(void *), void *arg)
+{
+    struct AsyncCell *cell;
+    size_t pos = __atomic_load_n(&async->ring.head, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = async->ring.cells + (pos & async->ring.mask);
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&async->ring.head, &pos, pos + 1,
+                                            1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&async->ring.head, __ATOMIC_RELAXED);
+        }
+    }
+    cell->task = task;
+    cell->arg = arg;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int ring_pop(async_p async, void (**task)(void *), void **arg)
+{
+    struct AsyncCell *cell;
+    size_t pos = __atomic_load_n(&async->ring.tail, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = async->ring.cells + (pos & async->ring.mask);
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&async->ring.tail, &pos, pos + 1,
+                                            1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&async->ring.tail, __ATOMIC_RELAXED);
+        }
+    }
+    *task = cell->task;
+    *arg = cell->arg;
+    __atomic_store_n(&cell->seq, pos + async->ring.mask + 1,
+                     __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Chase-Lev deque - push and take are performed only by the owning worker
+ * (at the bottom, LIFO), steal is performed by any other thread (at the
+ * top, FIFO).
+ *
+ * Tasks waiting for an earlier task (i.e. `on_data` waiting for the
+ * connection's busy flag) must not be rescheduled on the deque, or a
+ * single worker would take them again and again (see `Async.defer`).
+ *
+ * All return 0 when the deque is full / empty.
+ */
+
+static int deque_push(struct AsyncWorker *w, void (*task)(void *), void *arg)
+{
+    long b = __atomic_load_n(&w->deque.bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&w->deque.top, __ATOMIC_ACQUIRE);
+    if (b - t > w->deque.mask)
+        return 0;
+    struct AsyncSlot *slot = w->deque.slots + (b & w->deque.mask);
+    __atomic_store_n(&slot->task, task, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->deque.bottom, b + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int deque_take(struct AsyncWorker *w,
+                      void (**task)(void *), void **arg)
+{
+    long b = __atomic_load_n(&w->deque.bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&w->deque.bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&w->deque.top, __ATOMIC_RELAXED);
+    if (t > b) {
+        /* empty */
+        __atomic_store_n(&w->deque.bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    struct AsyncSlot *slot = w->deque.slots + (b & w->deque.mask);
+    *task = __atomic_load_n(&slot->task, __ATOMIC_RELAXED);
+    *arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    if (t == b) {
+        /* the last task, race the thieves for it */
+        int won = __atomic_compare_exchange_n(&w->deque.top, &t, t + 1, 0,
+                                              __ATOMIC_SEQ_CST,
+                                              __ATOMIC_RELAXED);
+        __atomic_store_n(&w->deque.bottom, b + 1, __ATOMIC_RELAXED);
+        return won;
+    }
+    return 1;
+}
+
+static int deque_steal(struct AsyncWorker *w,
+                       void (**task)(void *), void **arg)
+{
+    long t = __atomic_load_n(&w->deque.top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&w->deque.bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return 0;
+    /* the slot might be overwritten once `top` moves, so read it before
+     * claiming it (a lost race discards the data). */
+    struct AsyncSlot *slot = w->deque.slots + (t & w->deque.mask);
+    void (*t_task)(void *) = __atomic_load_n(&slot->task, __ATOMIC_RELAXED);
+    void *t_arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&w->deque.top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return 0;
+    *task = t_task;
+    *arg = t_arg;
+    return 1;
+}
+
 /* Task Management - add a task and perform al tasks in queue */
 
-static int async_run(async_p async, void (*task)(void *), void *arg)
+/* push a task to a mutex protected list */
+static int list_push(struct AsyncList *list, void (*task)(void *), void *arg)
 {
     struct AsyncTask *c;  /* the container, storing the task */
 
-    if (!async || !task) return -1;
-
-    pthread_mutex_lock(&(async->lock));
+    pthread_mutex_lock(&(list->lock));
     /* get a container from the pool of grab a new container */
-    if (async->pool) {
-        c = async->pool;
-        async->pool = async->pool->next;
+    if (list->pool) {
+        c = list->pool;
+        list->pool = list->pool->next;
     } else {
         c = malloc(sizeof(*c));
         if (!c) {
-            pthread_mutex_unlock(&async->lock);
+            pthread_mutex_unlock(&list->lock);
             return -1;
         }
     }
     c->next = NULL;
     c->task = task;
     c->arg = arg;
-    if (async->tasks) {
-        *(async->pos) = c;
+    if (list->tasks) {
+        *(list->pos) = c;
     } else {
-        async->tasks = c;
+        list->tasks = c;
     }
-    async->pos = &(c->next);
-    pthread_mutex_unlock(&async->lock);
-    /* wake up any sleeping threads
-     * any activated threads will ask to require the mutex
-     * as soon as we write.
-     * we need to unlock before we write, or we will have excess
-     * context switches.
-     */
-    write(async->pipe.out, c->task, 1);
+    list->pos = &(c->next);
+    pthread_mutex_unlock(&list->lock);
     return 0;
 }
 
-/** Performs all the existing tasks in the queue. */
-static void perform_tasks(async_p async)
+/* pop a task from a mutex protected list */
+static int list_pop(struct AsyncList *list, void (**task)(void *), void **arg)
 {
-    struct AsyncTask *c = NULL;  /* c == container, will store the task */
-    do {
-        /* grab a task from the queue. */
-        pthread_mutex_lock(&(async->lock));
+    struct AsyncTask *c;
+    /* don't bother with the mutex when the list is empty */
+    if (!list->tasks) return 0;
+    pthread_mutex_lock(&(list->lock));
+    c = list->tasks;
+    if (c) {
+        /* move the queue forward. */
+        list->tasks = list->tasks->next;
+        *task = c->task;
+        *arg = c->arg;
         /* move the old task container to the pool. */
-        if (c) {
-            c->next = async->pool;
-            async->pool = c;
+        c->next = list->pool;
+        list->pool = c;
+    }
+    pthread_mutex_unlock(&(list->lock));
+    return c != NULL;
+}
+
+/* push a number of tasks to a mutex protected list (under a single lock).
+ * @return the number of tasks pushed (less than `count` if `malloc` failed)
+ */
+static int list_push_batch(struct AsyncList *list,
+                           const struct AsyncJob *jobs, int count)
+{
+    struct AsyncTask *head = NULL, **pos = &head, *c;
+    int i;
+
+    pthread_mutex_lock(&(list->lock));
+    for (i = 0; i < count; i++) {
+        /* get a container from the pool of grab a new container */
+        if (list->pool) {
+            c = list->pool;
+            list->pool = list->pool->next;
+        } else if (!(c = malloc(sizeof(*c)))) {
+            break;
         }
-        c = async->tasks;
-        if (c) {
-            /* move the queue forward. */
-            async->tasks = async->tasks->next;
+        c->next = NULL;
+        c->task = jobs[i].task;
+        c->arg = jobs[i].arg;
+        *pos = c;
+        pos = &(c->next);
+    }
+    /* link the new tasks at once */
+    if (head) {
+        if (list->tasks) {
+            *(list->pos) = head;
+        } else {
+            list->tasks = head;
         }
-        pthread_mutex_unlock(&(async->lock));
+        list->pos = pos;
+    }
+    pthread_mutex_unlock(&list->lock);
+    return i;
+}
+
+/* release a list's tasks and task pool */
+static void list_destroy(struct AsyncList *list)
+{
+    struct AsyncTask *to_free;
+    pthread_mutex_lock(&list->lock);
+    list->pos = NULL;
+    /* free all tasks */
+    struct AsyncTask *pos = list->tasks;
+    while ((to_free = pos)) {
+        pos = pos->next;
+        free(to_free);
+    }
+    list->tasks = NULL;
+    /* free task pool */
+    pos = list->pool;
+    while ((to_free = pos)) {
+        pos = pos->next;
+        free(to_free);
+    }
+    list->pool = NULL;
+    pthread_mutex_unlock(&list->lock);
+    pthread_mutex_destroy(&list->lock);
+}
+
+#define _lane_(async, priority) ((async)->lanes + (priority))
+
+/* @return true if the low priority lane may be reviewed (a worker is
+ * available for low priority tasks) */
+static inline int low_available(async_p async)
+{
+    return _lane_(async, ASYNC_PRIORITY_LOW)->tasks &&
+           __atomic_load_n(&async->low.running, __ATOMIC_RELAXED) <
+               async->low.limit;
+}
+
+/* @return true if any tasks might be waiting in the queue */
+static inline int has_tasks(async_p async)
+{
+    if (_lane_(async, ASYNC_PRIORITY_HIGH)->tasks ||
+        _lane_(async, ASYNC_PRIORITY_NORMAL)->tasks || low_available(async))
+        return 1;
+    if (async->ring.cells &&
+        __atomic_load_n(&async->ring.head, __ATOMIC_SEQ_CST) !=
+        __atomic_load_n(&async->ring.tail, __ATOMIC_SEQ_CST))
+        return 1;
+    if (async->stealing) {
+        for (int i = 0; i < async->count; i++) {
+            if (__atomic_load_n(&async->workers[i].deque.top,
+                                __ATOMIC_SEQ_CST) <
+                __atomic_load_n(&async->workers[i].deque.bottom,
+                                __ATOMIC_SEQ_CST))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/* schedule a task, `local` tasks scheduled by a worker use it's deque */
+static int schedule_task(async_p async, enum AsyncPriority priority,
+                         void (*task)(void *), void *arg, int local)
+{
+    if (!async || !task || priority < 0 || priority >= ASYNC_PRIORITIES)
+        return -1;
+
+    if (priority != ASYNC_PRIORITY_NORMAL) {
+        if (list_push(_lane_(async, priority), task, arg))
+            return -1;
+        goto wakeup;
+    }
+    /* tasks scheduled by a worker stay on the worker's deque, unless the
+     * deque is full. */
+    if (local && async->stealing && current_worker &&
+        current_worker->async == async &&
+        deque_push(current_worker, task, arg))
+        goto wakeup;
+    /* a full ring overflows into the mutex protected list */
+    if (!async->ring.cells || !ring_push(async, task, arg)) {
+        if (list_push(_lane_(async, ASYNC_PRIORITY_NORMAL), task, arg))
+            return -1;
+    }
+wakeup:
+    count_task((current_worker && current_worker->async == async)
+                   ? &current_worker->queued
+                   : NULL,
+               &async->external.queued, 1);
+    /* wake up a sleeping thread, if any. */
+    wake_threads(async, 1);
+    return 0;
+}
+
+static int async_run_priority(async_p async, enum AsyncPriority priority,
+                              void (*task)(void *), void *arg)
+{
+    return schedule_task(async, priority, task, arg, 1);
+}
+
+static int async_run(async_p async, void (*task)(void *), void *arg)
+{
+    return schedule_task(async, ASYNC_PRIORITY_NORMAL, task, arg, 1);
+}
+
+static int async_defer(async_p async, void (*task)(void *), void *arg)
+{
+    return schedule_task(async, ASYNC_PRIORITY_NORMAL, task, arg, 0);
+}
+
+static int async_run_batch(async_p async, const struct AsyncJob *jobs,
+                           int count)
+{
+    if (!async || !jobs || count <= 0) return -1;
+    struct AsyncWorker *self =
+        (current_worker && current_worker->async == async) ? current_worker
+                                                           : NULL;
+    int i = 0;
+    /* the same order as `run`: the worker's deque, the ring and the list */
+    if (async->stealing && self) {
+        while (i < count && deque_push(self, jobs[i].task, jobs[i].arg))
+            i++;
+    }
+    if (async->ring.cells) {
+        while (i < count && ring_push(async, jobs[i].task, jobs[i].arg))
+            i++;
+    }
+    if (i < count)
+        i += list_push_batch(_lane_(async, ASYNC_PRIORITY_NORMAL), jobs + i,
+                             count - i);
+    if (!i) return -1;
+    count_task(self ? &self->queued : NULL, &async->external.queued, i);
+    /* a single wakeup for all the sleeping threads that are needed */
+    wake_threads(async, i);
+    return i;
+}
+
+static int async_pending(async_p async)
+{
+    return async && has_tasks(async);
+}
+
+/* Steal a task from any worker other than `self` (which might be NULL) */
+static int steal_task(async_p async, struct AsyncWorker *self,
+                      void (**task)(void *), void **arg)
+{
+    int start = self ? (int) (self - async->workers) + 1 : 0;
+    for (int i = 0; i < async->count; i++) {
+        struct AsyncWorker *victim =
+            async->workers + ((start + i) % async->count);
+        if (victim != self && deque_steal(victim, task, arg))
+            return 1;
+    }
+    return 0;
+}
+
+/* grab a task from the shared queue */
+static inline int shared_task(async_p async,
+                              void (**task)(void *), void **arg)
+{
+    if (async->ring.cells && ring_pop(async, task, arg))
+        return 1;
+    return list_pop(_lane_(async, ASYNC_PRIORITY_NORMAL), task, arg);
+}
+
+/* grab the next normal priority task: the worker's own deque first, than
+ * the shared queue and than any other worker's deque.
+ * Every 64 tasks the shared queue is reviewed first, so a busy deque can't
+ * starve the tasks scheduled from outside the pool. */
+static inline int normal_task(async_p async, struct AsyncWorker *self,
+                              void (**task)(void *), void **arg)
+{
+    if (!async->stealing)
+        return shared_task(async, task, arg);
+    if (self && !(self->ticks & 63) && shared_task(async, task, arg))
+        return 1;
+    if (self && deque_take(self, task, arg))
+        return 1;
+    if (shared_task(async, task, arg))
+        return 1;
+    return steal_task(async, self, task, arg);
+}
+
+/* grab a low priority task, unless `low.limit` workers are already
+ * performing low priority tasks (the caller releases the reservation). */
+static int low_task(async_p async, void (**task)(void *), void **arg)
+{
+    if (!_lane_(async, ASYNC_PRIORITY_LOW)->tasks) return 0;
+    int running = __atomic_load_n(&async->low.running, __ATOMIC_RELAXED);
+    do {
+        if (running >= async->low.limit)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&async->low.running, &running,
+                                          running + 1, 1, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+    if (list_pop(_lane_(async, ASYNC_PRIORITY_LOW), task, arg))
+        return 1;
+    __atomic_sub_fetch(&async->low.running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* grab the next task, a high priority task first - unless the worker
+ * performed ASYNC_PRIORITY_BATCH high priority tasks in a row.
+ * @return the task's priority (-1 == no tasks)
+ */
+static inline int next_task(async_p async, struct AsyncWorker *self,
+                            void (**task)(void *), void **arg)
+{
+    struct AsyncList *high = _lane_(async, ASYNC_PRIORITY_HIGH);
+    int high_first = !self || self->high_run < ASYNC_PRIORITY_BATCH;
+    if (self)
+        self->ticks++;
+    if (high_first && list_pop(high, task, arg))
+        return ASYNC_PRIORITY_HIGH;
+    if (self && !(self->ticks & (ASYNC_LOW_SHARE - 1)) &&
+        low_task(async, task, arg))
+        return ASYNC_PRIORITY_LOW;
+    if (normal_task(async, self, task, arg))
+        return ASYNC_PRIORITY_NORMAL;
+    if (low_task(async, task, arg))
+        return ASYNC_PRIORITY_LOW;
+    if (!high_first && list_pop(high, task, arg))
+        return ASYNC_PRIORITY_HIGH;
+    return -1;
+}
+
+/** Performs all the existing tasks in the queue (`self` might be NULL).
+ * @return the number of tasks performed. */
+static size_t perform_tasks(async_p async, struct AsyncWorker *self)
+{
+    void (*task)(void *);
+    void *arg;
+    size_t count = 0;
+    int priority;
+    while ((priority = next_task(async, self, &task, &arg)) >= 0) {
         /* perform the task */
-        if (c) c->task(c->arg);
-    } while (c);
+        task(arg);
+        count++;
+        if (priority == ASYNC_PRIORITY_LOW)
+            __atomic_sub_fetch(&async->low.running, 1, __ATOMIC_RELEASE);
+        if (self)
+            self->high_run = priority == ASYNC_PRIORITY_HIGH
+                                 ? self->high_run + 1 : 0;
+        count_task(self ? &self->executed : NULL, &async->external.executed,
+                   1);
+    }
+    return count;
 }
 
 /* The worker threads */
 
 /* The worker cycle */
-static void *worker_thread_cycle(void *_async)
+static void *worker_thread_cycle(void *_worker)
 {
-    /* setup signal and thread's local-storage async variable. */
-    struct Async *async = _async;
-    char sig_buf;
+    struct AsyncWorker *worker = _worker;
+    struct Async *async = worker->async;
+    int seq;
 
-    /* pause for signal for as long as we're active. */
-    while (async->run && (read(async->pipe.in, &sig_buf, 1) >= 0)) {
-        perform_tasks(async);
-        sched_yield();
+    current_worker = worker;
+
+    /* perform tasks and sleep for as long as we're active. */
+    while (__atomic_load_n(&async->run, __ATOMIC_ACQUIRE)) {
+        if (perform_tasks(async, worker))
+            continue;
+        /* announce we're going to sleep, than review the queue again so
+         * that a task pushed in the meanwhile isn't missed.
+         */
+        seq = __atomic_load_n(&async->wake.seq, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&async->wake.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!has_tasks(async) &&
+            __atomic_load_n(&async->run, __ATOMIC_SEQ_CST))
+            futex_wait(&async->wake.seq, seq);
+        __atomic_sub_fetch(&async->wake.sleeping, 1, __ATOMIC_RELAXED);
     }
 
-    perform_tasks(async);
+    perform_tasks(async, worker);
+    current_worker = NULL;
     return 0;
 }
 
@@ -156,27 +669,25 @@ static void *worker_thread_cycle(void *_async)
 
 static void async_signal(async_p async)
 {
-    async->run = 0;
-    /* send `async->count` number of wakeup signales.
-     * data content is irrelevant. */
-    write(async->pipe.out, async, async->count);
+    __atomic_store_n(&async->run, 0, __ATOMIC_SEQ_CST);
+    /* wake all the sleeping threads. */
+    __atomic_add_fetch(&async->wake.seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&async->wake.seq, INT_MAX);
 }
 
 static void async_wait(async_p async)
 {
     if (!async) return;
 
-    /* wake threads (just in case) by sending `async->count`
-     * number of wakeups
-     */
-    if (async->pipe.out)
-        write(async->pipe.out, async, async->count);
+    /* wake threads (just in case) */
+    __atomic_add_fetch(&async->wake.seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&async->wake.seq, INT_MAX);
     /* join threads */
     for (int i = 0; i < async->count; i++) {
-        join_thread(async->threads[i]);
+        join_thread(async->workers[i].thread);
     }
     /* perform any pending tasks */
-    perform_tasks(async);
+    perform_tasks(async, NULL);
     /* release queue memory and resources */
     async_destroy(async);
 }
@@ -192,57 +703,106 @@ static void async_finish(async_p async)
 /** Destroys the Async object, releasing its memory. */
 static void async_destroy(async_p async)
 {
-    pthread_mutex_lock(&async->lock);
-    struct AsyncTask *to_free;
-    async->pos = NULL;
-    /* free all tasks */
-    struct AsyncTask *pos = async->tasks;
-    while ((to_free = pos)) {
-        pos = pos->next;
-        free(to_free);
-    }
-    async->tasks = NULL;
-    /* free task pool */
-    pos = async->pool;
-    while ((to_free = pos)) {
-        pos = pos->next;
-        free(to_free);
+    /* free the lanes (the normal lane's lock protects the rest) */
+    for (int i = 0; i < ASYNC_PRIORITIES; i++) {
+        if (i != ASYNC_PRIORITY_NORMAL)
+            list_destroy(_lane_(async, i));
     }
-    async->pool = NULL;
-    /* close pipe */
-    if (async->pipe.in) {
-        close(async->pipe.in);
-        async->pipe.in = 0;
+    pthread_mutex_lock(&_lane_(async, ASYNC_PRIORITY_NORMAL)->lock);
+    /* free the ring */
+    if (async->ring.cells) {
+        free(async->ring.cells);
+        async->ring.cells = NULL;
     }
-    if (async->pipe.out) {
-        close(async->pipe.out);
-        async->pipe.out = 0;
+    /* free the deques */
+    for (int i = 0; i < async->count; i++) {
+        if (async->workers[i].deque.slots)
+            free(async->workers[i].deque.slots);
     }
-    pthread_mutex_unlock(&async->lock);
-    pthread_mutex_destroy(&async->lock);
+    pthread_mutex_unlock(&_lane_(async, ASYNC_PRIORITY_NORMAL)->lock);
+    list_destroy(_lane_(async, ASYNC_PRIORITY_NORMAL));
+    free(async);
 }
 
-static async_p async_create(int threads)
+static async_p async_create_with(struct AsyncSettings settings)
 {
-    async_p async = malloc(sizeof(*async) + (threads * sizeof(pthread_t)));
-    async->tasks = NULL;
-    async->pool = NULL;
-    async->pipe.in = 0;
-    async->pipe.out = 0;
-    if (pthread_mutex_init(&(async->lock), NULL)) {
-        free(async);
-        return NULL;
-    };
-    if (pipe((int *) &(async->pipe))) {
-        free(async);
+    if (settings.threads <= 0)
+        settings.threads = 1;
+    async_p async;
+    if (posix_memalign((void **) &async, 64,
+                       sizeof(*async) +
+                       (settings.threads * sizeof(struct AsyncWorker))))
         return NULL;
-    };
-    fcntl(async->pipe.out, F_SETFL, O_NONBLOCK | O_WRONLY);
+    /* the statistics counters (and the rest) start at zero */
+    memset(async, 0,
+           sizeof(*async) + (settings.threads * sizeof(struct AsyncWorker)));
+    async->count = 0;
+    async->stealing = settings.work_stealing ? 1 : 0;
+    async->ring.cells = NULL;
+    async->wake.seq = 0;
+    async->wake.sleeping = 0;
+    async->low.running = 0;
+    async->low.limit = settings.low_threads > 0 ? settings.low_threads
+                       : settings.threads > 1 ? settings.threads - 1
+                                              : 1;
+    for (int i = 0; i < ASYNC_PRIORITIES; i++) {
+        struct AsyncList *lane = _lane_(async, i);
+        lane->tasks = NULL;
+        lane->pool = NULL;
+        lane->pos = NULL;
+        if (pthread_mutex_init(&lane->lock, NULL)) {
+            while (i--)
+                pthread_mutex_destroy(&_lane_(async, i)->lock);
+            free(async);
+            return NULL;
+        }
+    }
+    if (settings.queue == ASYNC_QUEUE_RING) {
+        size_t size = 2;
+        if (!settings.ring_size)
+            settings.ring_size = ASYNC_RING_SIZE;
+        while (size < settings.ring_size)
+            size <<= 1;
+        async->ring.cells = malloc(size * sizeof(struct AsyncCell));
+        if (!async->ring.cells) {
+            async_destroy(async);
+            return NULL;
+        }
+        for (size_t i = 0; i < size; i++)
+            async->ring.cells[i].seq = i;
+        async->ring.mask = size - 1;
+        async->ring.head = async->ring.tail = 0;
+    }
+    /* setup the workers (and their deques) */
+    if (!settings.deque_size)
+        settings.deque_size = ASYNC_DEQUE_SIZE;
+    for (int i = 0; i < settings.threads; i++) {
+        struct AsyncWorker *w = async->workers + i;
+        w->async = async;
+        w->deque.slots = NULL;
+        w->deque.top = w->deque.bottom = 0;
+        w->deque.mask = 0;
+        w->ticks = 0;
+        w->high_run = 0;
+        if (!async->stealing)
+            continue;
+        long size = 2;
+        while (size < settings.deque_size)
+            size <<= 1;
+        w->deque.slots = malloc(size * sizeof(struct AsyncSlot));
+        if (!w->deque.slots) {
+            async->count = i;
+            async_destroy(async);
+            return NULL;
+        }
+        w->deque.mask = size - 1;
+    }
     async->run = 1;
     /* create threads */
-    for (async->count = 0; async->count < threads; async->count++) {
-        if (create_thread(async->threads + async->count,
-                          worker_thread_cycle, async)) {
+    for (async->count = 0; async->count < settings.threads; async->count++) {
+        if (create_thread(&async->workers[async->count].thread,
+                          worker_thread_cycle,
+                          async->workers + async->count)) {
             /* signal */
             async_signal(async);
             /* wait for threads and destroy object */
@@ -250,15 +810,48 @@ static async_p async_create(int threads)
             /* return error */
             return NULL;
         };
+        if (settings.cpus && settings.cpu_count > 0)
+            pin_thread(async->workers[async->count].thread,
+                       settings.cpus[async->count % settings.cpu_count]);
     }
     return async;
 }
 
+static async_p async_create(int threads)
+{
+    return async_create_with((struct AsyncSettings) {.threads = threads});
+}
+
+static void async_stats(async_p async, struct AsyncStats *stats)
+{
+    *stats = (struct AsyncStats) {
+        .threads = async->count,
+        .queued = __atomic_load_n(&async->external.queued, __ATOMIC_RELAXED),
+        .executed =
+            __atomic_load_n(&async->external.executed, __ATOMIC_RELAXED),
+        .sleeping = __atomic_load_n(&async->wake.sleeping, __ATOMIC_RELAXED),
+    };
+    for (int i = 0; i < async->count; i++) {
+        stats->queued +=
+            __atomic_load_n(&async->workers[i].queued, __ATOMIC_RELAXED);
+        stats->executed +=
+            __atomic_load_n(&async->workers[i].executed, __ATOMIC_RELAXED);
+    }
+    stats->depth =
+        stats->queued > stats->executed ? stats->queued - stats->executed : 0;
+}
+
 /* API gateway */
 struct __ASYNC_API__ Async = {
     .create = async_create,
+    .create_with = async_create_with,
     .signal = async_signal,
     .wait = async_wait,
     .finish = async_finish,
     .run = async_run,
+    .run_priority = async_run_priority,
+    .run_batch = async_run_batch,
+    .defer = async_defer,
+    .pending = async_pending,
+    .stats = async_stats,
 };
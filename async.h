@@ -1,14 +1,125 @@
 #ifndef _ASYNC_H
 #define _ASYNC_H
 
+#include <stddef.h>
+
+#ifndef ASYNC_RING_SIZE
+#define ASYNC_RING_SIZE 4096
+#endif
+#ifndef ASYNC_DEQUE_SIZE
+#define ASYNC_DEQUE_SIZE 1024
+#endif
+/* the most high priority tasks a worker performs in a row (while lower
+ * priority tasks are waiting) */
+#ifndef ASYNC_PRIORITY_BATCH
+#define ASYNC_PRIORITY_BATCH 64
+#endif
+/* a worker reviews the low priority tasks first once every
+ * ASYNC_LOW_SHARE tasks (a power of 2), so they aren't starved */
+#ifndef ASYNC_LOW_SHARE
+#define ASYNC_LOW_SHARE 16
+#endif
+
 typedef struct Async *async_p;
 
+/**
+ * \brief The task queue implementation used by an Async object.
+ */
+enum AsyncQueueType {
+    /** a mutex protected linked list (the default). */
+    ASYNC_QUEUE_MUTEX = 0,
+    /**
+     * a bounded lock-free MPMC ring. Tasks that don't fit in the ring
+     * overflow into the mutex protected list, so `run` never fails
+     * because the ring is full.
+     */
+    ASYNC_QUEUE_RING,
+};
+
+/**
+ * \brief Task priorities (see `Async.run_priority`).
+ *
+ * Each priority has it's own lane. Workers perform a waiting high priority
+ * task first, but perform a lower priority task after
+ * `ASYNC_PRIORITY_BATCH` high priority tasks in a row, so high priority
+ * tasks that keep rescheduling (i.e. reactor cycles) can't starve the
+ * other lanes. The low priority lane is reviewed
+ * first once every `ASYNC_LOW_SHARE` tasks and only `low_threads` workers
+ * perform low priority tasks at the same time.
+ */
+enum AsyncPriority {
+    /** the reactor and I/O (accepting connections, timers). */
+    ASYNC_PRIORITY_HIGH = 0,
+    /** request handlers (the default, see `Async.run`). */
+    ASYNC_PRIORITY_NORMAL,
+    /** background tasks (i.e. broadcasts and slow user tasks). */
+    ASYNC_PRIORITY_LOW,
+    ASYNC_PRIORITIES,
+};
+
+/**
+ * \brief Settings for `Async.create_with`.
+ *
+ * Missing settings are filled in with default values.
+ */
+struct AsyncSettings {
+    int threads; /**< the number of worker threads. */
+    enum AsyncQueueType queue; /**< the task queue implementation. */
+    /** the ring's capacity (rounded up to a power of 2),
+     * defaults to ASYNC_RING_SIZE. Ignored by the mutex queue. */
+    size_t ring_size;
+    /**
+     * Enable work stealing: each worker owns a Chase-Lev deque. Tasks
+     * scheduled from within a worker are pushed to the worker's own deque
+     * and the worker performs it's newest task first (LIFO, preserving
+     * cache locality), while idle workers steal the oldest tasks of the
+     * others. Tasks scheduled from other threads use the shared queue.
+     */
+    unsigned char work_stealing;
+    /** each deque's capacity (rounded up to a power of 2), defaults
+     * to ASYNC_DEQUE_SIZE. A full deque overflows into the shared queue. */
+    long deque_size;
+    /**
+     * CPU affinity: when set, worker `i` is pinned to CPU
+     * `cpus[i % cpu_count]`. Defaults to NULL (workers inherit the
+     * creating thread's affinity).
+     */
+    const int *cpus;
+    int cpu_count; /**< the number of CPUs in `cpus` */
+    /**
+     * the most workers performing low priority tasks at the same time,
+     * reserving the rest for the higher priorities. Defaults to all the
+     * workers but one (a single worker performs everything).
+     */
+    int low_threads;
+};
+
+/**
+ * \brief A task, as scheduled by `Async.run_batch`.
+ */
+struct AsyncJob {
+    void (*task)(void *);
+    void *arg;
+};
+
+/**
+ * \brief A snapshot of an Async object's statistics (see `Async.stats`).
+ */
+struct AsyncStats {
+    size_t queued;   /**< the number of tasks scheduled */
+    size_t executed; /**< the number of tasks performed */
+    size_t depth;    /**< the number of tasks waiting in the queue */
+    int threads;     /**< the number of worker threads */
+    int sleeping;    /**< the number of idle (sleeping) worker threads */
+};
+
 /**
  * \brief A simple thread pool utilizing POSIX threads
  *
- * It uses a combination of a pipe (for wakeup signals) and mutexes (for
- * managing the task queue) to give a basic layer of protection to any
- * server implementation.
+ * Tasks are queued either in a mutex protected list or in a lock-free
+ * ring (see `enum AsyncQueueType`). Idle workers sleep on a futex and are
+ * only woken when they are actually asleep, so a burst of tasks doesn't
+ * cost a system call per task.
  *
  * The Async global object allows us access to the Async thread pool API. i.e.
  * @code
@@ -34,6 +145,20 @@ extern struct __ASYNC_API__ {
      */
     async_p (*create)(int threads);
 
+    /**
+     * \brief Create a new Async object (thread pool) using the settings
+     *        provided.
+     * @return a pointer using the `async_p` (Async Pointer) type
+     * @return NULL on error
+     *
+     * Use:
+     * @code
+     *   async_p async = Async.create_with((struct AsyncSettings) {
+     *       .threads = 8, .queue = ASYNC_QUEUE_RING });
+     * @endcode
+     */
+    async_p (*create_with)(struct AsyncSettings settings);
+
     /**
      * \brief Signal an Async object to finish up.
      *
@@ -78,6 +203,57 @@ extern struct __ASYNC_API__ {
      */
     int (*run)(async_p async, void (*task)(void *), void *arg);
 
+    /**
+     * \brief Schedules a task using the specified priority (see
+     *        `enum AsyncPriority`). `run` uses `ASYNC_PRIORITY_NORMAL`.
+     *
+     * High and low priority tasks use mutex protected lanes (and aren't
+     * pushed to the worker's deque when work stealing is enabled).
+     *
+     * Use:
+     * @code
+     *   Async.run_priority(async, ASYNC_PRIORITY_LOW, task, arg);
+     * @endcode
+     */
+    int (*run_priority)(async_p async, enum AsyncPriority priority,
+                        void (*task)(void *), void *arg);
+
+    /**
+     * \brief Schedules a number of (normal priority) tasks at once.
+     *
+     * The tasks are queued in order, as if `run` was called for each task,
+     * but the tasks that overflow into the mutex protected list are linked
+     * under a single lock and the sleeping threads are woken by a single
+     * system call.
+     *
+     * Use:
+     * @code
+     *   struct AsyncJob jobs[] = {{task, arg1}, {task, arg2}};
+     *   Async.run_batch(async, jobs, 2);
+     * @endcode
+     *
+     * @return the number of tasks scheduled (the first tasks), less than
+     *         `count` if memory ran out
+     * @return -1 on error (no tasks were scheduled)
+     */
+    int (*run_batch)(async_p async, const struct AsyncJob *jobs, int count);
+
+    /**
+     * \brief Schedules a (normal priority) task behind the queued tasks.
+     *
+     * Unlike `run`, a task scheduled from within a worker isn't pushed to
+     * the worker's deque (where the newest task is performed first), so
+     * tasks rescheduling themselves while waiting for another task should
+     * use `defer`. Without work stealing it's the same as `run`.
+     */
+    int (*defer)(async_p async, void (*task)(void *), void *arg);
+
+    /**
+     * \brief Returns non-zero if tasks are waiting for a worker (tasks
+     *        that are being performed aren't counted).
+     */
+    int (*pending)(async_p async);
+
     /**
      * \brief Both signals for an Async object to finish up and waits
      *        for it to finish.
@@ -95,6 +271,14 @@ extern struct __ASYNC_API__ {
      * @return -1 on error
      */
     void (*finish)(async_p);
+
+    /**
+     * \brief Collects the Async object's statistics.
+     *
+     * The counters are kept per worker thread (without any locks) and are
+     * summed up when read, so the snapshot is only approximately consistent.
+     */
+    void (*stats)(async_p async, struct AsyncStats *stats);
 } Async;
 
 #endif
@@ -0,0 +1,114 @@
+/* Async throughput: tasks scheduled by 1..N producers and performed by
+ * 1..N worker threads, for each queue type (and for batches scheduled by
+ * `Async.run_batch`). The "stealing worker" producers are tasks, so the
+ * tasks they schedule use (and are stolen from) the workers' deques. */
+
+#include "async.h"
+#include "bench.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#define TASKS (1024 * 1024)
+#define BATCH 64
+
+static size_t performed;
+static int produced; /**< the producers done (worker producers only) */
+
+static void count_task(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&performed, 1, __ATOMIC_RELAXED);
+}
+
+struct Producer {
+    pthread_t thread;
+    async_p async;
+    size_t tasks;
+    int batch; /**< the tasks per `Async.run_batch` (0 == `Async.run`) */
+};
+
+static void *produce(void *arg)
+{
+    struct Producer *producer = arg;
+    struct AsyncJob jobs[BATCH];
+    if (producer->batch) {
+        for (int i = 0; i < producer->batch; i++)
+            jobs[i] = (struct AsyncJob) {.task = count_task};
+        for (size_t i = 0; i < producer->tasks; i += producer->batch)
+            Async.run_batch(producer->async, jobs, producer->batch);
+        return NULL;
+    }
+    for (size_t i = 0; i < producer->tasks; i++)
+        Async.run(producer->async, count_task, NULL);
+    return NULL;
+}
+
+/* a producer performed by a worker */
+static void produce_task(void *arg)
+{
+    produce(arg);
+    __atomic_add_fetch(&produced, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_queue(const char *name, enum AsyncQueueType queue,
+                        unsigned char stealing, int batch, int producers,
+                        int consumers, int from_worker)
+{
+    /* whole batches per producer */
+    size_t tasks = bench_scale(TASKS) / (producers * BATCH) * producers *
+                   BATCH;
+    struct Producer producer[producers];
+    char label[64];
+    async_p async = Async.create_with((struct AsyncSettings) {
+                                          .threads = consumers,
+                                          .queue = queue,
+                                          .work_stealing = stealing});
+    if (!async) {
+        perror("Async creation failed");
+        exit(1);
+    }
+    performed = 0;
+    produced = 0;
+    double start = bench_now();
+    for (int i = 0; i < producers; i++) {
+        producer[i] = (struct Producer) {
+            .async = async, .tasks = tasks / producers, .batch = batch};
+        if (from_worker)
+            Async.run(async, produce_task, producer + i);
+        else
+            pthread_create(&producer[i].thread, NULL, produce, producer + i);
+    }
+    for (int i = 0; i < producers && !from_worker; i++)
+        pthread_join(producer[i].thread, NULL);
+    while (from_worker &&
+           __atomic_load_n(&produced, __ATOMIC_ACQUIRE) < producers)
+        sched_yield();
+    Async.finish(async);
+    double elapsed = bench_now() - start;
+    snprintf(label, sizeof(label), "%s p=%d c=%d", name, producers,
+             consumers);
+    bench_report("async", label, performed, 0, elapsed);
+}
+
+int main(void)
+{
+    static const int counts[] = {1, 2, 4, 8};
+    const int n = sizeof(counts) / sizeof(counts[0]);
+    for (int p = 0; p < n; p++)
+        for (int c = 0; c < n; c++) {
+            bench_queue("mutex", ASYNC_QUEUE_MUTEX, 0, 0, counts[p],
+                        counts[c], 0);
+            bench_queue("mutex batch", ASYNC_QUEUE_MUTEX, 0, BATCH,
+                        counts[p], counts[c], 0);
+            bench_queue("ring", ASYNC_QUEUE_RING, 0, 0, counts[p], counts[c],
+                        0);
+            bench_queue("ring batch", ASYNC_QUEUE_RING, 0, BATCH, counts[p],
+                        counts[c], 0);
+            bench_queue("stealing", ASYNC_QUEUE_RING, 1, 0, counts[p],
+                        counts[c], 0);
+            bench_queue("stealing worker", ASYNC_QUEUE_RING, 1, 0, counts[p],
+                        counts[c], 1);
+        }
+    return 0;
+}
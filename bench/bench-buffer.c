@@ -0,0 +1,80 @@
+/* Buffer throughput: `Buffer.write` + `Buffer.flush` of various write sizes
+ * into a non-blocking socketpair, drained by a reader thread */
+
+#include "buffer.h"
+#include "bench.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BYTES (256 * 1024 * 1024)
+
+static void *drain(void *arg)
+{
+    int fd = *(int *) arg;
+    static char sink[256 * 1024];
+    while (read(fd, sink, sizeof(sink)) > 0)
+        ;
+    return NULL;
+}
+
+static void bench_writes(const char *name, size_t size, int move)
+{
+    static char data[1024 * 1024];
+    size_t total = bench_scale(BYTES), writes = 0, written = 0;
+    int fds[2];
+    pthread_t reader;
+    char label[64];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        perror("socketpair failed");
+        exit(1);
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    pthread_create(&reader, NULL, drain, fds + 1);
+    void *buffer = Buffer.new(0);
+    double start = bench_now();
+    while (written < total) {
+        if (move) {
+            void *copy = malloc(size);
+            memcpy(copy, data, size);
+            Buffer.write_move(buffer, copy, size);
+        } else {
+            Buffer.write(buffer, data, size);
+        }
+        written += size;
+        writes++;
+        if (Buffer.flush(buffer, fds[0]) < 0)
+            break;
+        /* a full socket: wait for `on_ready`, as a server would */
+        if (!Buffer.is_empty(buffer)) {
+            poll(&(struct pollfd) {.fd = fds[0], .events = POLLOUT}, 1, -1);
+            Buffer.flush(buffer, fds[0]);
+        }
+    }
+    while (!Buffer.is_empty(buffer)) {
+        poll(&(struct pollfd) {.fd = fds[0], .events = POLLOUT}, 1, -1);
+        if (Buffer.flush(buffer, fds[0]) < 0)
+            break;
+    }
+    double elapsed = bench_now() - start;
+    Buffer.destroy(buffer);
+    close(fds[0]);
+    pthread_join(reader, NULL);
+    close(fds[1]);
+    snprintf(label, sizeof(label), "%s %zu", name, size);
+    bench_report("buffer", label, writes, written, elapsed);
+}
+
+int main(void)
+{
+    static const size_t sizes[] = {64, 512, 4096, 16384, 65536, 262144};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_writes("write", sizes[i], 0);
+        bench_writes("write_move", sizes[i], 1);
+    }
+    return 0;
+}
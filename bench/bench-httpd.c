@@ -0,0 +1,185 @@
+/* End to end HTTP requests per second: an `httpd` like server (forked) and
+ * a built-in load generator using keep-alive and pipelined connections */
+
+#define _GNU_SOURCE
+#include "protocol-server.h"
+#include "bench.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define REQUESTS (200 * 1000)
+
+static char request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "\r\n";
+
+static char reply[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Length: 12\r\n"
+    "Connection: keep-alive\r\n"
+    "Keep-Alive: timeout=2\r\n"
+    "\r\n"
+    "Hello World!";
+
+static char *port = "8181";
+
+/* the reply, shared by all the connections */
+static void *shared_reply;
+
+static void on_data(server_pt srv, int fd)
+{
+    size_t len;
+    char *data = Server.peek(srv, fd, &len), *end;
+    while (data && (end = memmem(data, len, "\r\n\r\n", 4))) {
+        Server.consume(srv, fd, end + 4 - data);
+        Server.write_shared(srv, fd, shared_reply);
+        data = Server.peek(srv, fd, &len);
+    }
+}
+
+/* pipelined replies are written one at a time, don't let Nagle's algorithm
+ * hold them back until the client's (delayed) ACK */
+static void on_open(server_pt srv, int fd)
+{
+    (void) srv;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+}
+
+/* @return a connected socket, retrying while the server starts up */
+static int connect_to_server(void)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                             .ai_socktype = SOCK_STREAM};
+    struct addrinfo *addr;
+    if (getaddrinfo("localhost", port, &hints, &addr))
+        return -1;
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int fd = socket(addr->ai_family, addr->ai_socktype,
+                        addr->ai_protocol);
+        if (fd >= 0 && !connect(fd, addr->ai_addr, addr->ai_addrlen)) {
+            freeaddrinfo(addr);
+            return fd;
+        }
+        if (fd >= 0)
+            close(fd);
+        usleep(10000);
+    }
+    freeaddrinfo(addr);
+    return -1;
+}
+
+struct Client {
+    pthread_t thread;
+    size_t requests; /**< the requests to send */
+    size_t replies;  /**< the complete replies received */
+    int pipeline;
+};
+
+static void *run_client(void *arg)
+{
+    struct Client *client = arg;
+    const size_t req_len = sizeof(request) - 1, rep_len = sizeof(reply) - 1;
+    char out[req_len * client->pipeline];
+    char in[64 * 1024];
+    int fd = connect_to_server();
+    if (fd < 0)
+        return NULL;
+    for (int i = 0; i < client->pipeline; i++)
+        memcpy(out + i * req_len, request, req_len);
+    while (client->replies < client->requests) {
+        size_t batch = client->requests - client->replies;
+        if (batch > (size_t) client->pipeline)
+            batch = client->pipeline;
+        if (write(fd, out, batch * req_len) != (ssize_t)(batch * req_len))
+            break;
+        for (size_t expected = batch * rep_len; expected;) {
+            ssize_t got = read(fd, in, expected < sizeof(in) ? expected
+                                                             : sizeof(in));
+            if (got <= 0)
+                goto done;
+            expected -= got;
+        }
+        client->replies += batch;
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+static void bench_load(enum ReactorBackend backend, int threads,
+                       int connections, int pipeline)
+{
+    size_t requests = bench_scale(REQUESTS), replies = 0;
+    struct Client client[connections];
+    char label[64];
+    pid_t server = fork();
+    if (server < 0) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (!server) {
+        /* keep stdout for the results */
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        struct Protocol protocol = {.on_open = on_open,
+                                    .on_data = on_data,
+                                    .inline_on_data = 1,
+                                    .read_buffer = 1};
+        shared_reply = Server.shared_new(reply, sizeof(reply) - 1);
+        start_server(.protocol = &protocol, .port = port, .timeout = 10,
+                     .threads = threads, .backend = backend);
+        exit(0);
+    }
+    /* wait for the server to start listening */
+    int probe = connect_to_server();
+    if (probe < 0) {
+        fprintf(stderr, "# couldn't connect to port %s\n", port);
+        kill(server, SIGINT);
+        waitpid(server, NULL, 0);
+        return;
+    }
+    close(probe);
+    double start = bench_now();
+    for (int i = 0; i < connections; i++) {
+        client[i] = (struct Client) {.requests = requests / connections,
+                                     .pipeline = pipeline};
+        pthread_create(&client[i].thread, NULL, run_client, client + i);
+    }
+    for (int i = 0; i < connections; i++) {
+        pthread_join(client[i].thread, NULL);
+        replies += client[i].replies;
+    }
+    double elapsed = bench_now() - start;
+    kill(server, SIGINT);
+    waitpid(server, NULL, 0);
+    snprintf(label, sizeof(label), "%s threads=%d conns=%d pipeline=%d",
+             backend == REACTOR_BACKEND_IO_URING ? "io_uring" : "epoll",
+             threads, connections, pipeline);
+    bench_report("httpd", label, replies, replies * (sizeof(reply) - 1),
+                 elapsed);
+}
+
+int main(void)
+{
+    static const int connections[] = {1, 16, 64};
+    static const enum ReactorBackend backends[] = {
+        REACTOR_BACKEND_EPOLL, REACTOR_BACKEND_IO_URING};
+    if (getenv("BENCH_PORT"))
+        port = getenv("BENCH_PORT");
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        for (size_t i = 0; i < sizeof(connections) / sizeof(int); i++) {
+            bench_load(backends[b], 1, connections[i], 1);  /* keep-alive */
+            bench_load(backends[b], 1, connections[i], 16); /* pipelined */
+            bench_load(backends[b], 4, connections[i], 16);
+        }
+    }
+    return 0;
+}
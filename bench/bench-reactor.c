@@ -0,0 +1,92 @@
+/* Reactor throughput: `reactor_review` events per second over a set of
+ * socketpairs, each made readable once per round */
+
+#include "reactor.h"
+#include "bench.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define EVENTS (2 * 1024 * 1024)
+
+static size_t handled;
+
+static void on_data(struct Reactor *reactor, int fd)
+{
+    char byte[64];
+    (void) reactor;
+    while (read(fd, byte, sizeof(byte)) > 0)
+        ;
+    handled++;
+}
+
+static void bench_reactor(const char *name, enum ReactorBackend backend,
+                          int max_events, unsigned char adaptive, int pairs)
+{
+    struct Reactor reactor = {.on_data = on_data,
+                              .maxfd = pairs * 2 + 64,
+                              .backend = backend,
+                              .max_events = max_events,
+                              .adaptive = adaptive,
+                              .tick = 10};
+    int peer[pairs];
+    size_t rounds = bench_scale(EVENTS) / pairs + 1, reviews = 0;
+    char label[64];
+    if (reactor_init(&reactor)) {
+        perror("reactor_init failed");
+        exit(1);
+    }
+    if (reactor.backend != backend) {
+        fprintf(stderr, "# %s isn't supported, skipped\n", name);
+        reactor_stop(&reactor);
+        return;
+    }
+    for (int i = 0; i < pairs; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+            perror("socketpair failed");
+            exit(1);
+        }
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        reactor_add(&reactor, fds[0]);
+        peer[i] = fds[1];
+    }
+    /* consume the initial (writable) events */
+    while (reactor_review(&reactor) > 0)
+        ;
+    handled = 0;
+    double start = bench_now();
+    for (size_t round = 0; round < rounds; round++) {
+        size_t expected = handled + pairs;
+        for (int i = 0; i < pairs; i++)
+            if (write(peer[i], "", 1) < 0)
+                perror("write failed");
+        while (handled < expected && reactor_review(&reactor) >= 0)
+            reviews++;
+    }
+    double elapsed = bench_now() - start;
+    reactor_stop(&reactor);
+    for (int i = 0; i < pairs; i++)
+        close(peer[i]);
+    snprintf(label, sizeof(label), "%s events=%d fds=%d", name,
+             max_events, pairs);
+    bench_report("reactor", label, handled, 0, elapsed);
+    fprintf(stderr, "# %s: %.1f events per review\n", label,
+            reviews ? (double) handled / reviews : 0.0);
+}
+
+int main(void)
+{
+    static const int pairs[] = {16, 256, 2048};
+    for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        bench_reactor("epoll", REACTOR_BACKEND_EPOLL, 64, 0, pairs[i]);
+        bench_reactor("epoll-adaptive", REACTOR_BACKEND_EPOLL, 64, 1,
+                      pairs[i]);
+        bench_reactor("io_uring", REACTOR_BACKEND_IO_URING, 64, 0,
+                      pairs[i]);
+        bench_reactor("io_uring-adaptive", REACTOR_BACKEND_IO_URING, 64, 1,
+                      pairs[i]);
+    }
+    return 0;
+}
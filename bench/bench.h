@@ -0,0 +1,55 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/**
+ * Shared helpers for the `make bench` programs.
+ *
+ * Each result is reported as a single JSON object per line (JSON Lines) on
+ * stdout, i.e.:
+ *
+ *     {"bench":"async","case":"ring p=2 c=4","ops":1048576,
+ *      "seconds":0.412345,"ops_per_sec":2542908.4,"bytes_per_sec":0}
+ *
+ * so results can be collected and compared across releases
+ * (`make bench > results.jsonl`). Human readable notes go to stderr.
+ *
+ * The amount of work per case is fixed, so runs are comparable. Set the
+ * `BENCH_SCALE` environment variable (i.e. `BENCH_SCALE=0.1`) to scale it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* @return the current CLOCK_MONOTONIC time, in seconds */
+static inline double bench_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* @return `count` scaled by the `BENCH_SCALE` environment variable */
+static inline size_t bench_scale(size_t count)
+{
+    char *scale = getenv("BENCH_SCALE");
+    double factor = scale ? atof(scale) : 1.0;
+    if (factor <= 0)
+        factor = 1.0;
+    count = (size_t)(count * factor);
+    return count ? count : 1;
+}
+
+/* print a result line (`bytes` == 0 for operation only benchmarks) */
+static inline void bench_report(const char *bench, const char *name,
+                                size_t ops, size_t bytes, double seconds)
+{
+    if (seconds <= 0)
+        seconds = 1e-9;
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"ops\":%zu,"
+           "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.1f}\n",
+           bench, name, ops, seconds, ops / seconds, bytes / seconds);
+    fflush(stdout);
+}
+
+#endif
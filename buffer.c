@@ -5,43 +5,166 @@
 #include "buffer.h"
 
 #include <string.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 
 /* The pre-allocated memory per packet */
 
-/* packet sizes */
+/* packet sizes (each size is a packet size class) */
 #ifndef BUFFER_PACKET_SIZE
 #define BUFFER_PACKET_SIZE (1024 * 64)
 #endif
+#ifndef BUFFER_MEDIUM_PACKET_SIZE
+#define BUFFER_MEDIUM_PACKET_SIZE (1024 * 4)
+#endif
+#ifndef BUFFER_SMALL_PACKET_SIZE
+#define BUFFER_SMALL_PACKET_SIZE 256
+#endif
+/* the maximum number of pooled packets (per size class) */
 #ifndef BUFFER_MAX_PACKET_POOL
 #define BUFFER_MAX_PACKET_POOL 127
 #endif
+#ifndef BUFFER_MAX_MEDIUM_PACKET_POOL
+#define BUFFER_MAX_MEDIUM_PACKET_POOL 1023
+#endif
+#ifndef BUFFER_MAX_SMALL_PACKET_POOL
+#define BUFFER_MAX_SMALL_PACKET_POOL 4095
+#endif
+/* the number of packets moved between a thread's cache and the global pool
+ * at once (a thread caches up to twice as many packets per size class) */
+#ifndef BUFFER_CACHE_BATCH
+#define BUFFER_CACHE_BATCH 32
+#endif
+/* the maximum number of packets gathered by a single `writev` */
+#ifndef BUFFER_FLUSH_IOV
+#ifdef IOV_MAX
+#define BUFFER_FLUSH_IOV IOV_MAX
+#else
+#define BUFFER_FLUSH_IOV 64
+#endif
+#endif
+
+/* the packet size classes */
+enum PacketClass {
+    PACKET_SMALL = 0,
+    PACKET_MEDIUM,
+    PACKET_LARGE,
+};
+
+static const size_t packet_class_size[BUFFER_SIZE_CLASSES] = {
+    BUFFER_SMALL_PACKET_SIZE, BUFFER_MEDIUM_PACKET_SIZE, BUFFER_PACKET_SIZE,
+};
+
+static const int packet_class_pool[BUFFER_SIZE_CLASSES] = {
+    BUFFER_MAX_SMALL_PACKET_POOL, BUFFER_MAX_MEDIUM_PACKET_POOL,
+    BUFFER_MAX_PACKET_POOL,
+};
+
+struct PacketInbox;
 
 /* Buffer packets */
 struct Packet {
     ssize_t length;
     struct Packet *next;
     void *data;
-    char mem[BUFFER_PACKET_SIZE];
+    struct PacketInbox *owner; /**< the allocating thread's inbox */
     struct {
         unsigned can_interrupt : 1;
         unsigned close_after : 1;
-        unsigned rsrv : 6;
+        unsigned is_fd : 1; /**< the packet holds a `struct PacketFile` */
+        unsigned is_shared : 1; /**< the data belongs to a `SharedBlob` */
+        unsigned rsrv : 4;
     } metadata;
+    unsigned char size_class; /**< the packet's `enum PacketClass` */
+    char mem[]; /**< the packet's memory (size depends on the class) */
+};
+
+/* A file descriptor packet's data (stored in the packet's memory), sent
+ * using `sendfile` when possible.
+ */
+struct PacketFile {
+    int fd;        /**< the file descriptor */
+    off_t offset;  /**< the offset of the next byte to be sent */
+    size_t length; /**< the number of bytes left to be sent */
+    FILE *file;    /**< the FILE object owning `fd` (if any) */
+    char no_sendfile; /**< set when `sendfile` isn't supported for `fd` */
+};
+
+/* An immutable, reference counted blob of data (see `Buffer.shared_new`),
+ * referenced by any number of packets. */
+struct SharedBlob {
+    size_t ref;    /**< the number of references (packets + the owner) */
+    size_t length; /**< the length of the data */
+    char data[];
+};
+
+#define _blob_(ptr) \
+    ((struct SharedBlob *)((char *)(ptr) - offsetof(struct SharedBlob, data)))
+
+/* The global packet container pool (a pool per size class) */
+struct PacketCache;
+
+/* The packets freed by other threads, waiting for the (allocating) thread
+ * to collect them. Inboxes are never freed while buffers exist (a thread
+ * might free a packet after the allocating thread exited), an exiting
+ * thread retires it's inbox and the next thread registering a cache
+ * adopts it.
+ */
+struct PacketInbox {
+    struct Packet *lists[BUFFER_SIZE_CLASSES]; /**< lock-free stacks */
+    struct PacketInbox *next; /**< the inboxes list */
+    char retired; /**< set once the owning thread exited */
 };
 
-/* The global packet container pool */
 static struct {
     int ref_count;
-    int pool_count;
-    struct Packet *pool;
-} ContainerPool = { 0, 0 };
+    struct {
+        int pool_count;
+        struct Packet *pool;
+        size_t in_use; /**< packets outside the pool (incl. thread caches) */
+        size_t hits;   /**< packets grabbed from the pool */
+        size_t misses; /**< packets allocated using `malloc` */
+    } classes[BUFFER_SIZE_CLASSES];
+    struct PacketCache *caches; /**< the registered thread caches */
+    struct PacketInbox *inboxes; /**< every thread's inbox */
+    struct {
+        size_t flushed; /**< the counters of exited threads */
+        size_t eagain;
+    } retired;
+} ContainerPool = { 0 };
 
 /* the packet pool mutex */
 static pthread_mutex_t container_pool_locker = PTHREAD_MUTEX_INITIALIZER;
 
+/* A thread's packet cache, avoiding the global pool's lock for most
+ * `get_packet` / `free_packet` calls. The cache is refilled from (and spilled
+ * to) the global pool in batches of `BUFFER_CACHE_BATCH` packets.
+ */
+struct PacketCache {
+    struct {
+        int count;
+        struct Packet *list;
+    } classes[BUFFER_SIZE_CLASSES];
+    struct PacketInbox *inbox; /**< the thread's inbox (NULL == none) */
+    /** the thread's flush statistics (see `Buffer.stats`) */
+    size_t flushed; /**< the number of bytes sent */
+    size_t eagain;  /**< the number of flushes stopped by a full socket */
+    struct PacketCache *next, *prev; /**< the registered caches list */
+    char registered; /**< set once the thread exit destructor is set */
+};
+
+static __thread struct PacketCache packet_cache;
+
+/* the key used to spill a thread's cache when the thread exits */
+static pthread_key_t packet_cache_key;
+static pthread_once_t packet_cache_once = PTHREAD_ONCE_INIT;
+
 /* register a buffer in the pool - the pool will self-distruct when the last
  * buffer unregisters.
  */
@@ -52,60 +175,335 @@ static void register_buffer(void)
     pthread_mutex_unlock(&container_pool_locker);
 }
 
-/* unregister a buffer in the pool */
+/* free a list of packets (not in use), @return the number freed */
+static size_t free_packet_list(struct Packet *packet)
+{
+    struct Packet *to_free;
+    size_t count = 0;
+    while ((to_free = packet)) {
+        packet = packet->next;
+        free(to_free);
+        count++;
+    }
+    return count;
+}
+
+/* unregister a buffer in the pool. The last buffer frees the pooled
+ * packets, including the packets cached by the threads and waiting in
+ * their inboxes (no packets are used without a buffer) */
 static void unregister_buffer(void)
 {
     pthread_mutex_lock(&container_pool_locker);
     ContainerPool.ref_count--;
     if (ContainerPool.ref_count <= 0) {
         ContainerPool.ref_count = 0;  // never fall from 0
-        struct Packet *to_free;
-        while ((to_free = ContainerPool.pool)) {
-            ContainerPool.pool = to_free->next;
-            free(to_free);
+        for (int i = 0; i < BUFFER_SIZE_CLASSES; i++) {
+            free_packet_list(ContainerPool.classes[i].pool);
+            ContainerPool.classes[i].pool = NULL;
+            ContainerPool.classes[i].pool_count = 0;
+            for (struct PacketCache *cache = ContainerPool.caches; cache;
+                 cache = cache->next) {
+                ContainerPool.classes[i].in_use -=
+                    free_packet_list(cache->classes[i].list);
+                cache->classes[i].list = NULL;
+                cache->classes[i].count = 0;
+            }
+            for (struct PacketInbox *inbox = ContainerPool.inboxes; inbox;
+                 inbox = inbox->next)
+                ContainerPool.classes[i].in_use -= free_packet_list(
+                    __atomic_exchange_n(inbox->lists + i, NULL,
+                                        __ATOMIC_ACQUIRE));
         }
     }
     pthread_mutex_unlock(&container_pool_locker);
 }
 
-/* grab a packet from the pool */
-static struct Packet *get_packet(void)
+/* @return the smallest packet size class that can hold `length` bytes
+ * (or the largest class). */
+static inline enum PacketClass packet_class_for(size_t length)
+{
+    if (length <= BUFFER_SMALL_PACKET_SIZE)
+        return PACKET_SMALL;
+    if (length <= BUFFER_MEDIUM_PACKET_SIZE)
+        return PACKET_MEDIUM;
+    return PACKET_LARGE;
+}
+
+/* move (up to) `count` packets from a thread's cache to the global pool,
+ * freeing any packets the pool has no room for. */
+static void spill_cache(struct PacketCache *cache, int size_class, int count)
 {
     struct Packet *packet;
     pthread_mutex_lock(&container_pool_locker);
-    packet = ContainerPool.pool;
-    if (packet) {
-        ContainerPool.pool = packet->next;
-        ContainerPool.pool_count--;
-    } else {
-        packet = malloc(sizeof(struct Packet));
+    while (count-- && (packet = cache->classes[size_class].list)) {
+        cache->classes[size_class].list = packet->next;
+        cache->classes[size_class].count--;
+        ContainerPool.classes[size_class].in_use--;
+        if (ContainerPool.classes[size_class].pool_count <=
+            packet_class_pool[size_class]) {
+            packet->next = ContainerPool.classes[size_class].pool;
+            ContainerPool.classes[size_class].pool = packet;
+            ContainerPool.classes[size_class].pool_count++;
+        } else
+            free(packet);
     }
     pthread_mutex_unlock(&container_pool_locker);
-    if (!packet)
+}
+
+/* move the packets freed by other threads to the thread's cache.
+ * @return the number of packets moved */
+static int collect_inbox(struct PacketCache *cache, int size_class)
+{
+    if (!cache->inbox ||
+        !__atomic_load_n(cache->inbox->lists + size_class, __ATOMIC_RELAXED))
         return 0;
+    struct Packet *packet = __atomic_exchange_n(
+        cache->inbox->lists + size_class, NULL, __ATOMIC_ACQUIRE);
+    int count = 0;
+    while (packet) {
+        struct Packet *next = packet->next;
+        packet->next = cache->classes[size_class].list;
+        cache->classes[size_class].list = packet;
+        packet = next;
+        count++;
+    }
+    cache->classes[size_class].count += count;
+    return count;
+}
+
+/* return an exiting thread's cached packets to the global pool (keeping
+ * it's statistics) and retire it's inbox */
+static void destroy_cache(void *_cache)
+{
+    struct PacketCache *cache = _cache;
+    if (cache->inbox)
+        __atomic_store_n(&cache->inbox->retired, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < BUFFER_SIZE_CLASSES; i++) {
+        collect_inbox(cache, i);
+        spill_cache(cache, i, cache->classes[i].count);
+    }
+    pthread_mutex_lock(&container_pool_locker);
+    ContainerPool.retired.flushed += cache->flushed;
+    ContainerPool.retired.eagain += cache->eagain;
+    if (cache->prev)
+        cache->prev->next = cache->next;
+    else
+        ContainerPool.caches = cache->next;
+    if (cache->next)
+        cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&container_pool_locker);
+}
+
+static void create_cache_key(void)
+{
+    pthread_key_create(&packet_cache_key, destroy_cache);
+}
+
+/* set the thread exit destructor, listing the cache for `Buffer.stats`
+ * (and adopting a retired inbox, or allocating one) */
+static void register_cache(struct PacketCache *cache)
+{
+    pthread_once(&packet_cache_once, create_cache_key);
+    pthread_setspecific(packet_cache_key, cache);
+    pthread_mutex_lock(&container_pool_locker);
+    for (cache->inbox = ContainerPool.inboxes; cache->inbox;
+         cache->inbox = cache->inbox->next)
+        if (cache->inbox->retired)
+            break;
+    if (!cache->inbox && (cache->inbox = calloc(1, sizeof(*cache->inbox)))) {
+        cache->inbox->next = ContainerPool.inboxes;
+        ContainerPool.inboxes = cache->inbox;
+    }
+    if (cache->inbox)
+        __atomic_store_n(&cache->inbox->retired, 0, __ATOMIC_SEQ_CST);
+    cache->prev = NULL;
+    cache->next = ContainerPool.caches;
+    if (cache->next)
+        cache->next->prev = cache;
+    ContainerPool.caches = cache;
+    pthread_mutex_unlock(&container_pool_locker);
+    cache->registered = 1;
+}
+
+/* count the thread's flushed bytes (and full sockets) */
+static inline void count_flush(size_t sent, int eagain)
+{
+    struct PacketCache *cache = &packet_cache;
+    if (!cache->registered)
+        register_cache(cache);
+    if (sent)
+        __atomic_store_n(&cache->flushed, cache->flushed + sent,
+                         __ATOMIC_RELAXED);
+    if (eagain)
+        __atomic_store_n(&cache->eagain, cache->eagain + 1,
+                         __ATOMIC_RELAXED);
+}
+
+/* move a batch of packets from the global pool to the thread's cache.
+ * @return the number of packets moved (0 if the pool is empty).
+ */
+static int refill_cache(struct PacketCache *cache, int size_class)
+{
+    struct Packet *packet;
+    int count = 0;
+    if (!cache->registered)
+        register_cache(cache);
+    pthread_mutex_lock(&container_pool_locker);
+    while (count < BUFFER_CACHE_BATCH &&
+           (packet = ContainerPool.classes[size_class].pool)) {
+        ContainerPool.classes[size_class].pool = packet->next;
+        ContainerPool.classes[size_class].pool_count--;
+        packet->next = cache->classes[size_class].list;
+        cache->classes[size_class].list = packet;
+        count++;
+    }
+    cache->classes[size_class].count += count;
+    ContainerPool.classes[size_class].in_use += count;
+    ContainerPool.classes[size_class].hits += count;
+    if (!count) {
+        /* the caller allocates a new packet */
+        ContainerPool.classes[size_class].in_use++;
+        ContainerPool.classes[size_class].misses++;
+    }
+    pthread_mutex_unlock(&container_pool_locker);
+    return count;
+}
+
+/* grab a packet from the thread's cache (or the pool) */
+static struct Packet *get_packet(enum PacketClass size_class)
+{
+    struct PacketCache *cache = &packet_cache;
+    struct Packet *packet = cache->classes[size_class].list;
+    if (packet || collect_inbox(cache, size_class) ||
+        refill_cache(cache, size_class)) {
+        packet = cache->classes[size_class].list;
+        cache->classes[size_class].list = packet->next;
+        cache->classes[size_class].count--;
+    } else {
+        packet = malloc(sizeof(struct Packet) +
+                        packet_class_size[size_class]);
+        if (!packet) {
+            pthread_mutex_lock(&container_pool_locker);
+            ContainerPool.classes[size_class].in_use--;
+            pthread_mutex_unlock(&container_pool_locker);
+            return 0;
+        }
+    }
     packet->data = packet->mem;
     packet->next = 0;
     packet->length = 0;
+    packet->owner = cache->inbox;
+    packet->size_class = size_class;
     *((char *) &packet->metadata) = 0;
     return packet;
 }
 
-/* return a packet to the pool, or free it (when the pool is full) */
+/* Shared blobs */
+
+static void *shared_new(void *data, size_t length)
+{
+    if (!data || !length)
+        return NULL;
+    struct SharedBlob *blob = malloc(sizeof(*blob) + length);
+    if (!blob)
+        return NULL;
+    blob->ref = 1;
+    blob->length = length;
+    memcpy(blob->data, data, length);
+    return blob;
+}
+
+static void shared_free(void *blob)
+{
+    if (blob && !__atomic_sub_fetch(&((struct SharedBlob *) blob)->ref, 1,
+                                    __ATOMIC_ACQ_REL))
+        free(blob);
+}
+
+static size_t shared_length(void *blob)
+{
+    return blob ? ((struct SharedBlob *) blob)->length : 0;
+}
+
+static size_t shared_refs(void *blob)
+{
+    return blob ? __atomic_load_n(&((struct SharedBlob *) blob)->ref,
+                                  __ATOMIC_ACQUIRE)
+                : 0;
+}
+
+/* return a packet to the allocating thread: to the thread's cache (spilling
+ * a batch to the pool when the cache is full) or to it's inbox, when freed
+ * by another thread (i.e. a reactor flushing a handler's writes) */
 static void free_packet(struct Packet* packet)
 {
-    if (packet->data != packet->mem && packet->data) {
+    if (packet->metadata.is_shared) {
+        shared_free(_blob_(packet->data));
+    } else if (packet->metadata.is_fd) {
+        struct PacketFile *file = packet->data;
+        if (file->file)
+            fclose(file->file);
+        else
+            close(file->fd);
+    } else if (packet->data != packet->mem && packet->data) {
         if (packet->length)
             free(packet->data);
         else
             fclose(packet->data);
     }
+    struct PacketCache *cache = &packet_cache;
+    int size_class = packet->size_class;
+    struct PacketInbox *owner = packet->owner;
+    if (owner && owner != cache->inbox &&
+        !__atomic_load_n(&owner->retired, __ATOMIC_RELAXED)) {
+        packet->next = __atomic_load_n(owner->lists + size_class,
+                                       __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(owner->lists + size_class,
+                                            &packet->next, packet, 1,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+        return;
+    }
+    packet->next = cache->classes[size_class].list;
+    cache->classes[size_class].list = packet;
+    if (++cache->classes[size_class].count > BUFFER_CACHE_BATCH * 2)
+        spill_cache(cache, size_class, BUFFER_CACHE_BATCH);
+}
+
+/* collect the packet pool statistics */
+static void buffer_pool_stats(struct BufferPoolStats *stats)
+{
+    pthread_mutex_lock(&container_pool_locker);
+    for (int i = 0; i < BUFFER_SIZE_CLASSES; i++) {
+        stats[i] = (struct BufferPoolStats) {
+            .size = packet_class_size[i],
+            .pooled = ContainerPool.classes[i].pool_count,
+            .in_use = ContainerPool.classes[i].in_use,
+            .hits = ContainerPool.classes[i].hits,
+            .misses = ContainerPool.classes[i].misses,
+        };
+    }
+    pthread_mutex_unlock(&container_pool_locker);
+}
+
+/* collect the flush statistics (and the packet pool's totals) */
+static void buffer_stats(struct BufferStats *stats)
+{
+    *stats = (struct BufferStats) {0};
     pthread_mutex_lock(&container_pool_locker);
-    if (ContainerPool.pool_count <= BUFFER_MAX_PACKET_POOL) {
-        packet->next = ContainerPool.pool;
-        ContainerPool.pool = packet;
-        ContainerPool.pool_count++;
-    } else
-        free(packet);
+    stats->flushed = ContainerPool.retired.flushed;
+    stats->eagain = ContainerPool.retired.eagain;
+    for (struct PacketCache *cache = ContainerPool.caches; cache;
+         cache = cache->next) {
+        stats->flushed += __atomic_load_n(&cache->flushed, __ATOMIC_RELAXED);
+        stats->eagain += __atomic_load_n(&cache->eagain, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < BUFFER_SIZE_CLASSES; i++) {
+        stats->packet_hits += ContainerPool.classes[i].hits;
+        stats->packet_misses += ContainerPool.classes[i].misses;
+        stats->packets_in_use += ContainerPool.classes[i].in_use;
+    }
     pthread_mutex_unlock(&container_pool_locker);
 }
 
@@ -114,6 +512,9 @@ struct Buffer {
     void *id;
     struct Packet *packet; /**< pointer to the actual data */
     size_t sent; /**< the amount of data sent from the first packet */
+    /** the number of unsent bytes held by the data packets (files aren't
+     * counted until they are read) */
+    size_t pending;
     pthread_mutex_t lock; /**< a mutex preventing buffer corruption */
 
     /**< a writing hook, allowing for SSL sockets or other extensions. */
@@ -136,7 +537,7 @@ static inline void *new_buffer(server_pt owner)
 
     *buffer = (struct Buffer) {
         .id = is_buffer,
-        .sent = 0, .packet = NULL,
+        .sent = 0, .packet = NULL, .pending = 0,
         .owner = owner,
     };
 
@@ -159,6 +560,8 @@ void clear_buffer(struct Buffer *buffer)
             buffer->packet = buffer->packet->next;
             free_packet(to_free);
         }
+        buffer->sent = 0;
+        __atomic_store_n(&buffer->pending, 0, __ATOMIC_RELAXED);
         buffer->writing_hook = NULL;
         pthread_mutex_unlock(&buffer->lock);
     }
@@ -188,7 +591,12 @@ static void
 insert_packets_to_buffer(struct Buffer *buffer, struct Packet *packet,
                          char urgent)
 {
+    size_t length = 0;
+    for (struct Packet *p = packet; p; p = p->next)
+        length += p->length;
     pthread_mutex_lock(&buffer->lock);
+    __atomic_store_n(&buffer->pending, buffer->pending + length,
+                     __ATOMIC_RELAXED);
     struct Packet *tail, **pos = &(buffer->packet);
     if (urgent) {
         while (*pos && (!(*pos)->next ||
@@ -223,7 +631,7 @@ size_t buffer_move_logic(struct Buffer *buffer,
 	 */
         return 0;
     }
-    struct Packet *np = get_packet();
+    struct Packet *np = get_packet(PACKET_SMALL);
     if (!np) return 0;
 
     np->data = data;
@@ -247,6 +655,23 @@ static size_t buffer_move_next(struct Buffer*buffer,
     return buffer_move_logic(buffer, data, length, 1);
 }
 
+/* push a packet referencing a shared blob (no copy) */
+static size_t buffer_write_shared(struct Buffer *buffer, void *_blob)
+{
+    struct SharedBlob *blob = _blob;
+    if (!is_buffer(buffer) || !blob) return 0;
+    struct Packet *np = get_packet(PACKET_SMALL);
+    if (!np) return 0;
+
+    __atomic_add_fetch(&blob->ref, 1, __ATOMIC_RELAXED);
+    np->data = blob->data;
+    np->length = blob->length;
+    np->metadata.can_interrupt = 1;
+    np->metadata.is_shared = 1;
+    insert_packets_to_buffer(buffer, np, 0);
+    return blob->length;
+}
+
 static size_t
 buffer_copy_logic(struct Buffer *buffer, void *data,
                   size_t length, char urgent)
@@ -258,8 +683,10 @@ buffer_copy_logic(struct Buffer *buffer, void *data,
 	     */
         return 0;
     }
+    /* chain large packets, using the smallest class that fits for the
+     * remainder. */
     size_t to_copy = length;
-    struct Packet *np = get_packet();
+    struct Packet *np = get_packet(packet_class_for(to_copy));
     if (!np) {
         /* FIXME: warn the message
 	     * "Couldn't allocate memory for the buffer (on copy)"
@@ -276,7 +703,7 @@ buffer_copy_logic(struct Buffer *buffer, void *data,
             data += BUFFER_PACKET_SIZE;
             to_copy -= BUFFER_PACKET_SIZE;
             tmp->length = BUFFER_PACKET_SIZE;
-            tmp->next = get_packet();
+            tmp->next = get_packet(packet_class_for(to_copy));
             if (!(tmp->next)) {
                 /* FIXME: warn the message
                  * "Couldn't allocate memory for the buffer (on copy)"
@@ -316,44 +743,117 @@ static ssize_t buffer_flush(struct Buffer* buffer, int fd)
 {
     if (!is_buffer(buffer)) return -1;
 
-    ssize_t sent = 0;
+    ssize_t sent = 0, total = 0;
+    size_t requested = 0;
     struct Packet *packet;
+    char close_after = 0;
 
     pthread_mutex_lock(&buffer->lock);
 start_flush:
     /* no packets to send */
     if (!buffer->packet) {
         pthread_mutex_unlock(&buffer->lock);
-        return 0;
+        if (total)
+            count_flush(total, 0);
+        return total;
     }
 
-    /* packet is a file */
-    if (!buffer->packet->length) {
+    /* packet is a file descriptor - send it without copying, unless a
+     * writing hook needs the data. */
+    if (buffer->packet->metadata.is_fd && !buffer->writing_hook &&
+        !((struct PacketFile *) buffer->packet->data)->no_sendfile) {
+        struct PacketFile *file = buffer->packet->data;
         /* make sure file sending isn't interrupted. */
         buffer->packet->metadata.can_interrupt = 0;
+        sent = 0;
+        requested = file->length;
+        if (file->length)
+            sent = sendfile(fd, file->fd, &file->offset, file->length);
+        if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            /* not supported for this file, read it chunk by chunk */
+            file->no_sendfile = 1;
+            goto start_flush;
+        }
+        if (sent < 0 && (errno == EWOULDBLOCK || errno == EAGAIN ||
+                         errno == EINTR)) {
+            sent = 0;
+            count_flush(0, 1);
+        } else if (!sent && file->length) {
+            /* the file ended early (it was truncated, or the range is past
+             * it's end), the promised length can't be sent */
+            file->length = 0;
+            buffer->packet->metadata.close_after = 1;
+        }
+        if (sent < 0) {
+            pthread_mutex_unlock(&buffer->lock);
+            return -1;
+        }
+        total += sent;
+        file->length -= sent;
+        if (!file->length) {
+            /* done sending file, move the buffer one step forward */
+            packet = buffer->packet;
+            buffer->packet = packet->next;
+            close_after = packet->metadata.close_after;
+            free_packet(packet);
+        }
+        goto finish;
+    }
+
+    /* packet is a file, read it chunk by chunk */
+    if (!buffer->packet->length) {
+        struct Packet *file = buffer->packet;
+        char done;
+        /* make sure file sending isn't interrupted. */
+        file->metadata.can_interrupt = 0;
         /* grab a packet from the pool */
-        packet = get_packet();
+        packet = get_packet(PACKET_LARGE);
+        if (!packet) {
+            pthread_mutex_unlock(&buffer->lock);
+            return -1;
+        }
         /* read the data */
-        packet->length =
-            fread(packet->data, 1, BUFFER_PACKET_SIZE, buffer->packet->data);
-        /* read less? done sending file */
-        if (packet->length < BUFFER_PACKET_SIZE) {
-            if (packet->length <= 0) {  /* no more data */
-                free_packet(packet);
-                /* move the buffer one step forward */
-                packet = buffer->packet;
-                buffer->packet = buffer->packet->next;
-                free_packet(packet);
-                packet = NULL;
-            } else {  /* this will be the last the file will offer */
-                /* set the next packet */
-                packet->next = buffer->packet->next;
-                free_packet(buffer->packet);
+        if (file->metadata.is_fd) {
+            struct PacketFile *pf = file->data;
+            size_t to_read = pf->length < BUFFER_PACKET_SIZE ?
+                             pf->length : BUFFER_PACKET_SIZE;
+            packet->length = to_read ?
+                pread(pf->fd, packet->data, to_read, pf->offset) : 0;
+            if (packet->length > 0) {
+                pf->offset += packet->length;
+                pf->length -= packet->length;
+            }
+            done = packet->length <= 0 || !pf->length;
+            /* the file ended early, the promised length can't be sent */
+            if (packet->length <= 0 && pf->length)
+                file->metadata.close_after = 1;
+        } else {
+            packet->length =
+                fread(packet->data, 1, BUFFER_PACKET_SIZE, file->data);
+            /* read less? done sending file */
+            done = packet->length < BUFFER_PACKET_SIZE;
+        }
+        if (packet->length > 0)
+            __atomic_store_n(&buffer->pending,
+                             buffer->pending + packet->length,
+                             __ATOMIC_RELAXED);
+        if (done) {
+            buffer->packet = file->next;
+            if (packet->length > 0) {
+                /* this will be the last the file will offer */
+                packet->next = file->next;
+                packet->metadata.close_after = file->metadata.close_after;
                 /* set the data packet as the buffer's packet */
                 buffer->packet = packet;
+            } else {  /* no more data */
+                close_after = file->metadata.close_after;
+                free_packet(packet);
             }
+            free_packet(file);
+            if (close_after)
+                goto finish;
         } else {
-            packet->next = buffer->packet;
+            packet->next = file;
             /* set the data packet as the buffer's packet,
              * the file packet is next.
              */
@@ -365,43 +865,114 @@ start_flush:
     }
     /* the packet, at this point, is always a data packet. send the data */
 
-    /* write using the writing hook if available. */
+    /* write using the writing hook if available (a packet at a time). */
     if (buffer->writing_hook) {
+        requested = buffer->packet->length - buffer->sent;
         sent = buffer->writing_hook(buffer->owner, fd,
                                     buffer->packet->data + buffer->sent,
-                                    buffer->packet->length - buffer->sent);
+                                    requested);
     } else {
-        sent = write(fd, buffer->packet->data + buffer->sent,
-                     buffer->packet->length - buffer->sent);
-        if (sent < 0 && (errno & (EWOULDBLOCK | EAGAIN | EINTR)))
+        /* gather the pending data packets, up to the next file or
+         * the packet that closes the connection. */
+        struct iovec iov[BUFFER_FLUSH_IOV];
+        int count = 0;
+        size_t offset = buffer->sent;
+        packet = buffer->packet;
+        requested = 0;
+        while (packet && packet->length && count < BUFFER_FLUSH_IOV) {
+            iov[count].iov_base = packet->data + offset;
+            iov[count].iov_len = packet->length - offset;
+            requested += iov[count].iov_len;
+            offset = 0;
+            count++;
+            if (packet->metadata.close_after)
+                break;
+            packet = packet->next;
+        }
+        sent = writev(fd, iov, count);
+        if (sent < 0 && (errno == EWOULDBLOCK || errno == EAGAIN ||
+                         errno == EINTR)) {
             sent = 0;
+            count_flush(0, 1);
+        }
     }
     if (sent < 0) {
         pthread_mutex_unlock(&buffer->lock);
         return -1;
-    } else if (sent > 0) {
-        buffer->sent += sent;
     }
-    if (buffer->sent >= buffer->packet->length) {
+    total += sent;
+    /* move the buffer forward, across packet boundaries */
+    buffer->sent += sent;
+    __atomic_store_n(&buffer->pending, buffer->pending - sent,
+                     __ATOMIC_RELAXED);
+    while (buffer->packet && buffer->packet->length &&
+           buffer->sent >= buffer->packet->length) {
+        packet = buffer->packet;
+        buffer->sent -= packet->length;
+        buffer->packet = packet->next;
         /* review the close connection flag means: "Close the connection" */
-        if (buffer->packet->metadata.close_after) {
-            Server.close(buffer->owner, fd);
-            /* buffer clearing should be performed by the Buffer's owner. */
+        close_after = packet->metadata.close_after;
+        free_packet(packet);
+        if (close_after)
+            break;
+    }
+finish:
+    /* keep sending until the socket is full (edge triggered events might
+     * not be fired again if the socket is still writable). */
+    if (!close_after && sent > 0 && (size_t) sent == requested)
+        goto start_flush;
+    if (close_after) {
+        /* data written after the connection was marked is discarded. */
+        while ((packet = buffer->packet)) {
+            buffer->packet = packet->next;
+            free_packet(packet);
         }
-        packet = buffer->packet;
         buffer->sent = 0;
-        buffer->packet = buffer->packet->next;
-        free_packet(packet);
+        __atomic_store_n(&buffer->pending, 0, __ATOMIC_RELAXED);
     }
     pthread_mutex_unlock(&(buffer->lock));
-    return sent;
+    if (total)
+        count_flush(total, 0);
+    /* close the connection outside the lock, as closing clears the buffer.
+     * buffer clearing should be performed by the Buffer's owner. */
+    if (close_after && buffer->owner)
+        Server.close(buffer->owner, fd);
+    else if (close_after)
+        close(fd);
+    return total;
+}
+
+/* push a file descriptor packet to the buffer */
+static int push_fd_packet(struct Buffer *buffer, int fd, FILE *file,
+                          off_t offset, size_t length)
+{
+    struct Packet *np = get_packet(PACKET_SMALL);
+    if (!np) return -1;
+
+    struct PacketFile *pf = (struct PacketFile *) np->mem;
+    *pf = (struct PacketFile) {
+        .fd = fd, .offset = offset, .length = length, .file = file,
+    };
+    np->data = pf;
+    np->metadata.is_fd = 1;
+    np->metadata.can_interrupt = 1;
+    insert_packets_to_buffer(buffer, np, 0);
+    return 0;
 }
 
 static int buffer_sendfile(struct Buffer *buffer, FILE *file)
 {
     if (!is_buffer(buffer)) return -1;
 
-    struct Packet *np = get_packet();
+    /* regular files are sent using their file descriptor (zero-copy) */
+    struct stat st;
+    int fd = fileno(file);
+    off_t offset = fd >= 0 ? ftello(file) : -1;
+    if (fd >= 0 && offset >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode))
+        return push_fd_packet(buffer, fd, file, offset,
+                              st.st_size > offset ? st.st_size - offset : 0);
+
+    struct Packet *np = get_packet(PACKET_SMALL);
     if (!np) return -1;
 
     np->data = file;
@@ -410,11 +981,30 @@ static int buffer_sendfile(struct Buffer *buffer, FILE *file)
     return 0;
 }
 
+static int buffer_sendfd(struct Buffer *buffer, int fd,
+                         off_t offset, size_t length)
+{
+    if (!is_buffer(buffer) || fd < 0) return -1;
+
+    /* a 0 length means "until the end of the file", a regular file's range
+     * is limited to it's end */
+    struct stat st;
+    if (fstat(fd, &st)) return -1;
+    size_t left = st.st_size > offset ? st.st_size - offset : 0;
+    if (!length || (S_ISREG(st.st_mode) && length > left))
+        length = left;
+    return push_fd_packet(buffer, fd, NULL, offset, length);
+}
+
 static void buffer_close_w_d(struct Buffer* buffer, int fd)
 {
     if (!is_buffer(buffer)) return;
     if (!buffer->packet) {
-        close(fd);
+        /* the server tracks it's connections - let it close the socket */
+        if (buffer->owner)
+            Server.close(buffer->owner, fd);
+        else
+            close(fd);
         return;
     }
 
@@ -429,25 +1019,10 @@ finish:
     pthread_mutex_unlock(&buffer->lock);
 }
 
-size_t buffer_pending(struct Buffer *buffer)
+static size_t buffer_pending(struct Buffer *buffer)
 {
     if (!is_buffer(buffer)) return 0;
-    size_t len = 0;
-    struct Packet *p;
-    pthread_mutex_lock(&buffer->lock);
-    p = buffer->packet;
-    while (p) {
-        if (p->data && p->length)
-            len += p->length;
-        else if (p->data)
-            len += 1;  /* if it is a file - can we check it's size? */
-        else
-            break;  /* no need to move beyond a close connection packet */
-        p = p->next;
-    }
-    len -= buffer->sent;
-    pthread_mutex_unlock(&buffer->lock);
-    return len;
+    return __atomic_load_n(&buffer->pending, __ATOMIC_RELAXED);
 }
 
 char buffer_is_empty(struct Buffer* buffer)
@@ -462,11 +1037,20 @@ const struct BufferClass Buffer = {
     .clear = (void (*)(void *)) clear_buffer,
     .set_whook = (void (*)(void *, ssize_t (*)())) set_whook,
     .sendfile = (int (*)(void *, FILE *)) buffer_sendfile,
+    .sendfd = (int (*)(void *, int, off_t, size_t)) buffer_sendfd,
     .write = (size_t (*)(void *, void *, size_t)) buffer_copy,
     .write_move = (size_t (*)(void *, void *, size_t)) buffer_move,
     .write_next = (size_t (*)(void *, void *, size_t)) buffer_copy_next,
     .write_move_next = (size_t (*)(void *, void *, size_t)) buffer_move_next,
+    .shared_new = shared_new,
+    .shared_free = shared_free,
+    .shared_length = shared_length,
+    .shared_refs = shared_refs,
+    .write_shared = (size_t (*)(void *, void *)) buffer_write_shared,
     .flush = (ssize_t (*)(void *, int)) buffer_flush,
     .close_when_done = (void (*)(void *, int)) buffer_close_w_d,
     .is_empty = (char (*)(void *)) buffer_is_empty,
+    .pending = (size_t (*)(void *)) buffer_pending,
+    .pool_stats = buffer_pool_stats,
+    .stats = buffer_stats,
 };
@@ -4,6 +4,31 @@
 #include <sys/types.h>
 #include "protocol-server.h"
 
+/** the number of packet size classes (see `Buffer.pool_stats`) */
+#define BUFFER_SIZE_CLASSES 3
+
+/**
+ * \brief Packet pool statistics for a single packet size class.
+ */
+struct BufferPoolStats {
+    size_t size;   /**< the size of the class's packets (in bytes) */
+    size_t pooled; /**< the number of packets waiting in the pool */
+    size_t in_use; /**< the number of packets in buffers or thread caches */
+    size_t hits;   /**< the number of packets grabbed from the pool */
+    size_t misses; /**< the number of packets allocated using `malloc` */
+};
+
+/**
+ * \brief Buffer statistics, for all the buffers (see `Buffer.stats`).
+ */
+struct BufferStats {
+    size_t flushed;        /**< the number of bytes sent by `Buffer.flush` */
+    size_t eagain;         /**< flushes that stopped on a full socket */
+    size_t packet_hits;    /**< packets grabbed from the pool */
+    size_t packet_misses;  /**< packets allocated using `malloc` */
+    size_t packets_in_use; /**< packets in buffers or thread caches */
+};
+
 /**
  * \brief packet-based Buffer object for network data output.
  *
@@ -22,7 +47,8 @@
  * @endcode
  *
  * To add data to a Buffer use any of:
- *   - `write` will copy the data to a new buffer packet.
+ *   - `write` will copy the data to a new buffer packet (the smallest
+ *     packet that can hold the data).
  *
  *   - `size_t Buffer.write(void *buffer, void *data, size_t length)`
  *
@@ -94,7 +120,8 @@ extern const struct BufferClass {
      *   ssize_t writing_hook(server_pt srv, int fd,
      *                        void *data, size_t len) {
      *       int sent = write(fd, data, len);
-     *       if (sent < 0 && (errno & (EWOULDBLOCK | EAGAIN | EINTR)))
+     *       if (sent < 0 && (errno == EWOULDBLOCK || errno == EAGAIN ||
+     *                        errno == EINTR))
      *           sent = 0;
      *        return sent;
      *   }
@@ -106,6 +133,10 @@ extern const struct BufferClass {
 
     /**
      * \brief Flush the buffer data through the socket
+     *
+     * Pending data packets are gathered and sent using a single `writev`
+     * system call. When a writing hook is set, the data is passed to the
+     * hook one packet at a time.
      * @return the number of bytes sent, if any.
      * @return -1 on error
      */
@@ -121,6 +152,23 @@ extern const struct BufferClass {
      */
     int (*sendfile)(void *buffer, FILE *file);
 
+    /**
+     * Take ownership of a file descriptor and buffers `length` bytes,
+     * starting at `offset` (a `length` of 0 sends everything up to the end
+     * of the file).
+     *
+     * The data is sent using `sendfile(2)`, without being copied through
+     * user space, unless a writing hook is set or the file doesn't support
+     * `sendfile` - in which case the data is read chunk by chunk (each chunk
+     * will be no more then ~64Kb in size).
+     *
+     * `Buffer.sendfile` uses the same zero-copy path for regular files.
+     *
+     * The file descriptor will be automatically closed once all the data
+     * was sent (or once the buffer is cleared).
+     */
+    int (*sendfd)(void *buffer, int fd, off_t offset, size_t length);
+
     /**
      * \brief Create a copy of the data and pushes the copy to the buffer.
      */
@@ -152,6 +200,35 @@ extern const struct BufferClass {
      */
     size_t (*write_move_next)(void *buffer, void *data, size_t length);
 
+    /**
+     * \brief Create an immutable, reference counted copy of the data (a
+     * shared blob) that can be written to any number of buffers using
+     * `write_shared`, without copying it again.
+     *
+     * The caller owns a reference, released using `shared_free`. Each
+     * buffer holds it's own reference until the data was sent, so the blob
+     * can be released as soon as it was written.
+     * @return NULL on error
+     */
+    void *(*shared_new)(void *data, size_t length);
+
+    /** \brief Release a reference to a shared blob (see `shared_new`). */
+    void (*shared_free)(void *blob);
+
+    /** @return the length of a shared blob's data */
+    size_t (*shared_length)(void *blob);
+
+    /** @return the number of references to a shared blob (the owner's and
+     * the unsent packets'), for diagnostics */
+    size_t (*shared_refs)(void *blob);
+
+    /**
+     * \brief Push a reference to a shared blob to the buffer (the data
+     * isn't copied, see `shared_new`).
+     * @return the length of the data, or 0 on error
+     */
+    size_t (*write_shared)(void *buffer, void *blob);
+
     /**
      * \brief Mark the connection to closes once the current
      *        buffer data was sent.
@@ -162,6 +239,32 @@ extern const struct BufferClass {
      * @return true (1) if the buffer is empty
      */
     char (*is_empty)(void *buffer);
+
+    /**
+     * @return the number of bytes waiting to be sent (O(1)). Files are only
+     * counted once they are read into the buffer (a chunk at a time), so
+     * the value reflects the memory held by the buffer.
+     */
+    size_t (*pending)(void *buffer);
+
+    /**
+     * \brief Collect the (process wide) packet pool statistics.
+     *
+     * Data is copied into packets of the smallest size class that fits
+     * (256B, 4KB or 64KB), larger data is chained using 64KB packets.
+     * Each thread caches packets it frees, moving them from and to the
+     * global pool in batches (`BUFFER_CACHE_BATCH`).
+     *
+     * `stats` should point to an array of `BUFFER_SIZE_CLASSES` objects,
+     * ordered by size.
+     */
+    void (*pool_stats)(struct BufferPoolStats *stats);
+
+    /**
+     * Collects the flush statistics (kept per thread and summed up when
+     * read) and the packet pool's totals.
+     */
+    void (*stats)(struct BufferStats *stats);
 } Buffer;
 
 #endif
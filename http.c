@@ -0,0 +1,499 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "http.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* the response head's buffer (longer `headers` are written separately) */
+#ifndef HTTP_HEAD_BUFFER
+#define HTTP_HEAD_BUFFER 512
+#endif
+
+/* A connection's parser state */
+struct HttpConn {
+    unsigned int progress; /**< the bytes searched for the end of the head */
+    unsigned int generation; /**< bumped whenever a connection opens */
+};
+
+static struct Protocol *http_protocol(struct HttpProtocol *http);
+static void http_destroy(struct HttpProtocol *http);
+static ssize_t http_parse(struct HttpRequest *request, const char *data,
+                          size_t length, unsigned int *progress);
+static const char *http_header(struct HttpRequest *request, const char *name,
+                               size_t *length);
+static ssize_t http_respond(struct HttpRequest *request, int status,
+                            const char *headers, const void *body,
+                            size_t length);
+static ssize_t http_respond_shared(struct HttpRequest *request, int status,
+                                   const char *headers, void *blob,
+                                   size_t length);
+static ssize_t http_write_head(struct HttpRequest *request, int status,
+                               const char *headers, size_t length);
+static const char *http_status_text(int status);
+
+/* Http API gateway */
+const struct __HTTP_API__ Http = {
+    .protocol = http_protocol,
+    .destroy = http_destroy,
+    .parse = http_parse,
+    .header = http_header,
+    .respond = http_respond,
+    .respond_shared = http_respond_shared,
+    .write_head = http_write_head,
+    .status_text = http_status_text,
+};
+
+/* Parsing */
+
+/* @return true if the line feed at `pos` ends the head (an empty line) */
+static inline int is_head_end(const char *data, size_t pos)
+{
+    return (pos >= 1 && data[pos - 1] == '\n') ||
+           (pos >= 2 && data[pos - 1] == '\r' && data[pos - 2] == '\n');
+}
+
+/* find the end of the head (the first empty line), searching from `from`
+ * @return the head's length, or 0 if the head isn't complete
+ */
+static size_t find_head_end(const char *data, size_t length, size_t from)
+{
+#ifdef __SSE2__
+    /* review the line feeds of 16 bytes at a time */
+    const __m128i line_feeds = _mm_set1_epi8('\n');
+    for (; from + 16 <= length; from += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + from));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, line_feeds));
+        for (; mask; mask &= mask - 1) {
+            size_t pos = from + __builtin_ctz(mask);
+            if (is_head_end(data, pos))
+                return pos + 1;
+        }
+    }
+#endif
+    const char *lf;
+    while (from < length && (lf = memchr(data + from, '\n', length - from))) {
+        if (is_head_end(data, lf - data))
+            return lf - data + 1;
+        from = lf - data + 1;
+    }
+    return 0;
+}
+
+/* @return true if the header's name is `name` (lower case) */
+static inline int header_is(struct HttpHeader *header, const char *name,
+                            size_t length)
+{
+    return header->name_len == length &&
+           !strncasecmp(header->name, name, length);
+}
+
+/* @return true if the comma separated list holds the (lower case) token */
+static int has_token(const char *list, size_t length, const char *token,
+                     size_t token_len)
+{
+    const char *end = list + length;
+    while (list < end) {
+        while (list < end && (*list == ' ' || *list == '\t' || *list == ','))
+            list++;
+        const char *next = memchr(list, ',', end - list);
+        const char *stop = next ? next : end;
+        while (stop > list && (stop[-1] == ' ' || stop[-1] == '\t'))
+            stop--;
+        if (stop - list == (ssize_t) token_len &&
+            !strncasecmp(list, token, token_len))
+            return 1;
+        list = next ? next + 1 : end;
+    }
+    return 0;
+}
+
+/* parse the request line ("METHOD target HTTP/1.x")
+ * @return 0 on success, -400 for malformed requests
+ */
+static int parse_request_line(struct HttpRequest *request, const char *line,
+                              const char *end)
+{
+    const char *sp = memchr(line, ' ', end - line), *target;
+    if (!sp || sp == line)
+        return -400;
+    request->method = line;
+    request->method_len = sp - line;
+    target = sp + 1;
+    if (!(sp = memchr(target, ' ', end - target)) || sp == target)
+        return -400;
+    request->path = target;
+    request->path_len = sp - target;
+    if ((request->query = memchr(target, '?', sp - target))) {
+        request->query++;
+        request->query_len = sp - request->query;
+    } else {
+        request->query_len = 0;
+    }
+    sp++;
+    if (end - sp != 8 || memcmp(sp, "HTTP/1.", 7) || sp[7] < '0' ||
+        sp[7] > '9')
+        return -400;
+    request->version = sp[7] == '0' ? 0 : 1;
+    return 0;
+}
+
+static ssize_t http_parse(struct HttpRequest *request, const char *data,
+                          size_t length, unsigned int *progress)
+{
+    size_t skip = 0, head, window, body = 0;
+    const char *pos, *eol, *end;
+    char has_length = 0;
+    int ret;
+
+    /* empty lines preceding a request are ignored */
+    while (skip < length && (data[skip] == '\r' || data[skip] == '\n'))
+        skip++;
+    /* the head's end is searched for once, resuming where the last partial
+     * read ended */
+    window = length - skip > HTTP_MAX_HEAD ? skip + HTTP_MAX_HEAD : length;
+    head = find_head_end(data, window, *progress > skip ? *progress : skip);
+    if (!head) {
+        if (window - skip >= HTTP_MAX_HEAD)
+            return -431;
+        *progress = window;
+        return 0;
+    }
+
+    /* the request line */
+    pos = data + skip;
+    end = data + head;
+    eol = memchr(pos, '\n', end - pos);
+    if ((ret = parse_request_line(request, pos,
+                                  eol > pos && eol[-1] == '\r' ? eol - 1
+                                                               : eol)))
+        return ret;
+    request->keep_alive = request->version;
+    request->header_count = 0;
+
+    /* the headers */
+    for (pos = eol + 1; pos < end; pos = eol + 1) {
+        const char *line_end, *colon, *value;
+        struct HttpHeader *header;
+        eol = memchr(pos, '\n', end - pos);
+        line_end = eol > pos && eol[-1] == '\r' ? eol - 1 : eol;
+        if (line_end == pos)
+            break;
+        /* obsolete line folding isn't supported */
+        if (*pos == ' ' || *pos == '\t')
+            return -400;
+        if (!(colon = memchr(pos, ':', line_end - pos)) || colon == pos ||
+            colon[-1] == ' ' || colon[-1] == '\t')
+            return -400;
+        if (request->header_count == HTTP_MAX_HEADERS)
+            return -431;
+        header = request->headers + request->header_count++;
+        header->name = pos;
+        header->name_len = colon - pos;
+        value = colon + 1;
+        while (value < line_end && (*value == ' ' || *value == '\t'))
+            value++;
+        while (line_end > value && (line_end[-1] == ' ' ||
+                                    line_end[-1] == '\t'))
+            line_end--;
+        header->value = value;
+        header->value_len = line_end - value;
+
+        /* the headers that frame the request */
+        if (header_is(header, "content-length", 14)) {
+            size_t value_length = 0;
+            if (!header->value_len)
+                return -400;
+            for (size_t i = 0; i < header->value_len; i++) {
+                if (value[i] < '0' || value[i] > '9' ||
+                    value_length > HTTP_MAX_REQUEST)
+                    return -400;
+                value_length = value_length * 10 + (value[i] - '0');
+            }
+            if (has_length && value_length != body)
+                return -400;
+            has_length = 1;
+            body = value_length;
+        } else if (header_is(header, "transfer-encoding", 17)) {
+            return -501;
+        } else if (header_is(header, "connection", 10)) {
+            if (has_token(value, header->value_len, "close", 5))
+                request->keep_alive = 0;
+            else if (has_token(value, header->value_len, "keep-alive", 10))
+                request->keep_alive = 1;
+        }
+    }
+
+    /* the body */
+    if (head - skip + body > HTTP_MAX_REQUEST)
+        return -413;
+    if (head + body > length) {
+        /* the head is found right away once the body arrives */
+        *progress = head - 1;
+        return 0;
+    }
+    request->body = body ? data + head : NULL;
+    request->body_len = body;
+    *progress = 0;
+    return head + body;
+}
+
+static const char *http_header(struct HttpRequest *request, const char *name,
+                               size_t *length)
+{
+    size_t name_len = strlen(name);
+    for (int i = 0; i < request->header_count; i++) {
+        if (request->headers[i].name_len == name_len &&
+            !strncasecmp(request->headers[i].name, name, name_len)) {
+            if (length)
+                *length = request->headers[i].value_len;
+            return request->headers[i].value;
+        }
+    }
+    if (length)
+        *length = 0;
+    return NULL;
+}
+
+/* Responses */
+
+static const char *http_status_text(int status)
+{
+    switch (status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 411: return "Length Required";
+    case 413: return "Content Too Large";
+    case 414: return "URI Too Long";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    case 505: return "HTTP Version Not Supported";
+    default: return status < 300 ? "OK" : status < 400 ? "Redirect" : "Error";
+    }
+}
+
+/* the `Date` header's value, formatted once a second (per thread) */
+static const char *http_date(void)
+{
+    static const char days[7][4] = {"Sun", "Mon", "Tue", "Wed",
+                                    "Thu", "Fri", "Sat"};
+    static const char months[12][4] = {"Jan", "Feb", "Mar", "Apr",
+                                       "May", "Jun", "Jul", "Aug",
+                                       "Sep", "Oct", "Nov", "Dec"};
+    static __thread struct {
+        time_t second;
+        char text[32];
+    } date;
+    time_t now = time(NULL);
+    if (now != date.second) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        snprintf(date.text, sizeof(date.text),
+                 "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday],
+                 tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour,
+                 tm.tm_min, tm.tm_sec);
+        date.second = now;
+    }
+    return date.text;
+}
+
+/* append a string to the head's buffer */
+static inline char *head_copy(char *pos, const char *str, size_t length)
+{
+    memcpy(pos, str, length);
+    return pos + length;
+}
+
+/* append a number to the head's buffer */
+static inline char *head_number(char *pos, size_t number)
+{
+    char digits[24], *d = digits + sizeof(digits);
+    do {
+        *--d = '0' + number % 10;
+    } while ((number /= 10));
+    return head_copy(pos, d, digits + sizeof(digits) - d);
+}
+
+static ssize_t http_write_head(struct HttpRequest *request, int status,
+                               const char *headers, size_t length)
+{
+    char head[HTTP_HEAD_BUFFER], *pos = head;
+    const char *text = http_status_text(status);
+    size_t headers_len = headers ? strlen(headers) : 0;
+
+    if (status < 100 || status > 999)
+        return -1;
+    pos = head_copy(pos, "HTTP/1.1 ", 9);
+    pos = head_number(pos, status);
+    *pos++ = ' ';
+    pos = head_copy(pos, text, strlen(text));
+    pos = head_copy(pos, "\r\nDate: ", 8);
+    pos = head_copy(pos, http_date(), 29);
+    pos = head_copy(pos, "\r\n", 2);
+    /* responses without a body don't state it's length */
+    if (status >= 200 && status != 204 && status != 304) {
+        pos = head_copy(pos, "Content-Length: ", 16);
+        pos = head_number(pos, length);
+        pos = head_copy(pos, "\r\n", 2);
+    }
+    if (!request->keep_alive)
+        pos = head_copy(pos, "Connection: close\r\n", 19);
+    else if (!request->version)
+        pos = head_copy(pos, "Connection: keep-alive\r\n", 24);
+    /* the user's headers are copied when they fit (a single packet) */
+    if (headers_len + 2 <= (size_t) (head + sizeof(head) - pos)) {
+        pos = head_copy(pos, headers, headers_len);
+        pos = head_copy(pos, "\r\n", 2);
+        return Server.write(request->server, request->fd, head, pos - head);
+    }
+    if (Server.write(request->server, request->fd, head, pos - head) < 0 ||
+        Server.write(request->server, request->fd, (void *) headers,
+                     headers_len) < 0)
+        return -1;
+    return Server.write(request->server, request->fd, "\r\n", 2);
+}
+
+/* a HEAD request gets the head only */
+static inline int is_head_request(struct HttpRequest *request)
+{
+    return request->method_len == 4 && !memcmp(request->method, "HEAD", 4);
+}
+
+static ssize_t http_respond(struct HttpRequest *request, int status,
+                            const char *headers, const void *body,
+                            size_t length)
+{
+    if (http_write_head(request, status, headers, length) < 0)
+        return -1;
+    if (!body || !length || is_head_request(request))
+        return 0;
+    return Server.write(request->server, request->fd, (void *) body, length);
+}
+
+static ssize_t http_respond_shared(struct HttpRequest *request, int status,
+                                   const char *headers, void *blob,
+                                   size_t length)
+{
+    if (http_write_head(request, status, headers, length) < 0)
+        return -1;
+    if (!blob || !length || is_head_request(request))
+        return 0;
+    return Server.write_shared(request->server, request->fd, blob);
+}
+
+/* The protocol */
+
+/* answer an invalid request and close the connection */
+static void http_error(server_pt server, int fd, int status)
+{
+    struct HttpRequest request = {.server = server, .fd = fd};
+    const char *text = http_status_text(status);
+    http_write_head(&request, status, "Content-Type: text/plain\r\n",
+                    strlen(text));
+    Server.write(server, fd, (void *) text, strlen(text));
+    Server.close(server, fd);
+}
+
+static void http_on_open(server_pt server, int fd)
+{
+    struct HttpProtocol *http =
+        (struct HttpProtocol *) Server.get_protocol(server, fd);
+    http->conns[fd].progress = 0;
+    http->conns[fd].generation++;
+    if (http->on_open)
+        http->on_open(server, fd);
+}
+
+static void http_on_data(server_pt server, int fd)
+{
+    struct HttpProtocol *http =
+        (struct HttpProtocol *) Server.get_protocol(server, fd);
+    struct HttpRequest request;
+    unsigned int generation;
+    size_t unread;
+    ssize_t length;
+    char *data;
+    if (!http)
+        return;
+    /* answer each complete (possibly pipelined) request, in order */
+    while ((data = Server.peek(server, fd, &unread)) && unread) {
+        length = http_parse(&request, data, unread,
+                            &http->conns[fd].progress);
+        if (!length)
+            return;
+        if (length < 0) {
+            http_error(server, fd, -length);
+            return;
+        }
+        request.server = server;
+        request.fd = fd;
+        generation = http->conns[fd].generation;
+        http->on_request(&request);
+        /* the handler might have closed (or hijacked) the connection, a
+         * suspended handler (`Protocol.fiber`) might find the fd reused */
+        if (Server.get_protocol(server, fd) != &http->protocol ||
+            http->conns[fd].generation != generation)
+            return;
+        Server.consume(server, fd, length);
+        if (!request.keep_alive) {
+            Server.close(server, fd);
+            return;
+        }
+    }
+}
+
+static struct Protocol *http_protocol(struct HttpProtocol *http)
+{
+    if (!http || !http->on_request)
+        return NULL;
+    /* each connection's state, indexed by it's fd */
+    if (!http->conns &&
+        !(http->conns = calloc(Server.capacity(), sizeof(*http->conns))))
+        return NULL;
+    if (http->protocol.on_open != http_on_open) {
+        http->on_open = http->protocol.on_open;
+        http->protocol.on_open = http_on_open;
+    }
+    if (!http->protocol.service)
+        http->protocol.service = "http";
+    http->protocol.on_data = http_on_data;
+    http->protocol.read_buffer = 1;
+    return &http->protocol;
+}
+
+static void http_destroy(struct HttpProtocol *http)
+{
+    free(http->conns);
+    http->conns = NULL;
+}
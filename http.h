@@ -0,0 +1,160 @@
+#ifndef _HTTP_H
+#define _HTTP_H
+
+#include "protocol-server.h"
+
+/* the most headers a request can hold (any more fail with 431) */
+#ifndef HTTP_MAX_HEADERS
+#define HTTP_MAX_HEADERS 32
+#endif
+/* the longest request head, the request line and the headers (431) */
+#ifndef HTTP_MAX_HEAD
+#define HTTP_MAX_HEAD (1024 * 8)
+#endif
+/* the longest request, including the body (413). Requests are parsed in
+ * place, within the connection's read buffer, so this shouldn't exceed
+ * `SERVER_READ_BUFFER`. */
+#ifndef HTTP_MAX_REQUEST
+#define HTTP_MAX_REQUEST (1024 * 16)
+#endif
+
+/** A header, pointing into the request's data (not NUL terminated) */
+struct HttpHeader {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+};
+
+/**
+ * \brief A parsed request.
+ *
+ * The strings point into the connection's read buffer, they aren't NUL
+ * terminated and they are only valid until the `on_request` callback
+ * returns.
+ */
+struct HttpRequest {
+    server_pt server;
+    int fd;
+    const char *method;
+    size_t method_len;
+    /** the request target (the path, including the query) */
+    const char *path;
+    size_t path_len;
+    /** the query, following the '?' (NULL == none) */
+    const char *query;
+    size_t query_len;
+    const char *body;
+    size_t body_len;
+    int header_count;
+    /** the minor version (0 == HTTP/1.0, 1 == HTTP/1.1) */
+    unsigned char version;
+    /**
+     * set if the connection stays open once the request was answered
+     * (clear it to close the connection after the response).
+     */
+    unsigned char keep_alive;
+    struct HttpHeader headers[HTTP_MAX_HEADERS];
+};
+
+/**
+ * \brief The HTTP/1.1 protocol.
+ *
+ * Requests are parsed in place, from the connection's read buffer, without
+ * allocating any memory. A request spread over a number of reads is parsed
+ * once it's complete, resuming the search for the end of it's head where
+ * the last read ended. Pipelined requests are answered in order and
+ * keep-alive connections stay open until the connection's timeout (see
+ * `ServerSettings.timeout` and `Server.set_timeout`).
+ *
+ * Request bodies require a `Content-Length` (requests using
+ * `Transfer-Encoding` fail with 501).
+ *
+ * @code
+ * static void on_request(struct HttpRequest *request)
+ * {
+ *     Http.respond(request, 200, NULL, "Hello World!", 12);
+ * }
+ *
+ * static struct HttpProtocol http = {.on_request = on_request};
+ * start_server(.protocol = Http.protocol(&http));
+ * @endcode
+ */
+struct HttpProtocol {
+    /**
+     * the server's protocol (filled by `Http.protocol`). The service
+     * defaults to "http", other callbacks and flags (i.e. `fiber` or
+     * `inline_on_data`) are kept, `on_open` is wrapped.
+     */
+    struct Protocol protocol;
+    /** called for each complete request (required). */
+    void (*on_request)(struct HttpRequest *request);
+    /* private */
+    void (*on_open)(server_pt server, int sockfd); /**< the user's on_open */
+    struct HttpConn *conns; /**< each connection's parser state */
+};
+
+extern const struct __HTTP_API__ {
+    /**
+     * Prepare the HTTP protocol object, so it can be used as the server's
+     * protocol (or with `Server.attach` and `Server.set_protocol`).
+     * @return the `struct Protocol` to use, or NULL on error.
+     */
+    struct Protocol *(*protocol)(struct HttpProtocol *http);
+
+    /** release the data held by a protocol object (once it isn't used). */
+    void (*destroy)(struct HttpProtocol *http);
+
+    /**
+     * Parse a request, resuming from `*progress` (the bytes already searched
+     * for the end of the head, start with 0).
+     * @return the request's length (the head and the body) once it's
+     *         complete.
+     * @return 0 if more data is needed (`*progress` is updated).
+     * @return a negative HTTP status code for invalid requests (-400, -413,
+     *         -431 or -501).
+     */
+    ssize_t (*parse)(struct HttpRequest *request, const char *data,
+                     size_t length, unsigned int *progress);
+
+    /**
+     * Find a header (case insensitive).
+     * @return the header's value (not NUL terminated), or NULL if the
+     *         request doesn't have the header.
+     */
+    const char *(*header)(struct HttpRequest *request, const char *name,
+                          size_t *length);
+
+    /**
+     * Send a response: the status line, the `Date`, `Content-Length` and
+     * `Connection` headers, the optional `headers` (complete "Name: value"
+     * lines, each ending with "\r\n") and the body (not sent to HEAD
+     * requests). The writes are batched by the server, so the head and the
+     * body are sent together.
+     * @return -1 on error.
+     */
+    ssize_t (*respond)(struct HttpRequest *request, int status,
+                       const char *headers, const void *body, size_t length);
+
+    /**
+     * Send a response with a shared body (see `Server.shared_new`) of
+     * `length` bytes, queued without copying it, see `respond`.
+     * @return -1 on error.
+     */
+    ssize_t (*respond_shared)(struct HttpRequest *request, int status,
+                              const char *headers, void *blob, size_t length);
+
+    /**
+     * Send the response's head only, for bodies sent separately (i.e.
+     * using `Server.sendfile`), see `respond`. The caller shouldn't send the
+     * body to HEAD requests.
+     * @return -1 on error.
+     */
+    ssize_t (*write_head)(struct HttpRequest *request, int status,
+                          const char *headers, size_t length);
+
+    /** @return the status code's reason phrase ("OK" for 200). */
+    const char *(*status_text)(int status);
+} Http;
+
+#endif
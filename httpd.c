@@ -1,23 +1,22 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define THREAD_COUNT 1
 
-#include "protocol-server.h"
+#include "http.h"
 
-static void on_data(server_pt srv, int fd)
+static char reply[] = "Hello World!";
+
+/* the reply's body, shared by all the connections (never copied) */
+static void *shared_reply;
+
+/* reply to each complete (possibly pipelined) request */
+static void on_request(struct HttpRequest *request)
 {
-    static char reply[] =
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Length: 12\r\n"
-        "Connection: keep-alive\r\n"
-        "Keep-Alive: timeout=2\r\n"
-        "\r\n"
-        "Hello World!";
-    char buff[1024];
-
-    if (Server.read(srv, fd, buff, 1024))
-        Server.write(srv, fd, reply, sizeof(reply));
+    Http.respond_shared(request, 200, "Content-Type: text/plain\r\n",
+                        shared_reply, sizeof(reply) - 1);
 }
 
 void print_conn(server_pt srv, int fd, void *arg)
@@ -43,10 +42,14 @@ void on_init(server_pt srv)
 
 int main(int argc, char *argv[])
 {
-    struct Protocol protocol = { .on_data = on_data };
-    start_server(.protocol = &protocol,
+    static struct HttpProtocol http = {.on_request = on_request,
+                                       .protocol.inline_on_data = 1};
+    shared_reply = Server.shared_new(reply, sizeof(reply) - 1);
+    start_server(.protocol = Http.protocol(&http),
                  .timeout = 2,
                  .on_init = on_init,
                  .threads = THREAD_COUNT);
+    Server.shared_free(shared_reply);
+    Http.destroy(&http);
     return 0;
 }
@@ -13,14 +13,25 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ucontext.h>
 
 /* socket binding and server limits helpers */
-static int bind_server_socket(struct Server *);
+static int bind_server_socket(struct Server *, int reuse_port);
 static int set_non_blocking_socket(int fd);
 static long srv_capacity(void);
 
@@ -36,15 +47,293 @@ struct FDTask {
     void (*fallback)(struct Server *server, int fd, void *arg);
 };
 
-/* A self handling task structure */
+/* A slice of a group task, performed by a single worker at a time */
+struct GroupChunk {
+    struct GroupTask *group;
+    int start; /**< the first pending connection (in `group->fds`) */
+    int end;
+};
+
+/* A self handling task structure, performing a task for a snapshot of the
+ * live connections (`Server.each`), a chunk per worker. */
 struct GroupTask {
-    struct GroupTask *next;
     struct Server *server;
     int fd_origin;
     void (*task)(struct Server *server, int fd, void *arg);
     void *arg;
     void (*on_finished)(struct Server *server, int fd, void *arg);
-    unsigned char fds[];
+    int pending; /**< the number of unfinished chunks */
+    int *fds;    /**< the connections (following the chunks) */
+    struct GroupChunk chunks[];
+};
+
+/* the smallest number of connections per `Server.each` chunk */
+#ifndef SERVER_EACH_BATCH
+#define SERVER_EACH_BATCH 256
+#endif
+
+/* A dense array of the live connections using a service */
+struct ServiceIndex {
+    struct ServiceIndex *next; /**< the interned services list */
+    char *name;
+    int *fds;
+    int count;
+    int capacity;
+};
+
+/* the number of connections per connection table chunk (a power of 2) */
+#ifndef SERVER_CONN_CHUNK
+#define SERVER_CONN_CHUNK 256
+#endif
+
+/* the number of timeout wheel slots (a slot per second), must be a power of
+ * 2 greater than the maximum timeout (255 seconds) */
+#define SERVER_WHEEL_SIZE 256
+/* the number of timed out connections handled by each wheel lock cycle */
+#ifndef SERVER_WHEEL_BATCH
+#define SERVER_WHEEL_BATCH 64
+#endif
+
+/* the number of bits in a timer handle used for the timer's slot (the rest
+ * hold the slot's generation, invalidating stale handles) */
+#define SERVER_TIMER_SLOT_BITS 20
+
+/* A user timer (see `run_every`) */
+struct ServerTimer {
+    uint64_t due;      /**< the next run (CLOCK_MONOTONIC, in nanoseconds) */
+    uint64_t interval; /**< the timer's interval (in nanoseconds) */
+    void (*task)(void *);
+    void *arg;
+    int repeat;        /**< the remaining repetitions (< 0 == forever) */
+    int pos;           /**< the timer's heap position (-1 == unused) */
+    int next_free;     /**< the next unused slot (unused slots only) */
+    unsigned generation; /**< bumped whenever the slot is released */
+};
+
+/* the size of a connection's read buffer (see `Protocol.read_buffer`) */
+#ifndef SERVER_READ_BUFFER
+#define SERVER_READ_BUFFER (1024 * 16)
+#endif
+/* the maximum number of pooled read buffers */
+#ifndef SERVER_READ_POOL
+#define SERVER_READ_POOL 64
+#endif
+
+/* the bytes a write batch holds before flushing anyway (see
+ * `Server.begin_batch`) */
+#ifndef SERVER_BATCH_LIMIT
+#define SERVER_BATCH_LIMIT (1024 * 64)
+#endif
+
+/* the default number of connections accepted per wakeup (or task) */
+#ifndef SERVER_ACCEPT_BATCH
+#define SERVER_ACCEPT_BATCH 64
+#endif
+
+/* the time (in milliseconds) accepting backs off once the process runs out of
+ * file descriptors (and the spare descriptor is in use) */
+#ifndef SERVER_ACCEPT_BACKOFF
+#define SERVER_ACCEPT_BACKOFF 10
+#endif
+
+/* the most `on_data` tasks collected by a reactor review before they are
+ * scheduled (at once, see `dispatch_flush`) */
+#ifndef SERVER_DISPATCH_BATCH
+#define SERVER_DISPATCH_BATCH 64
+#endif
+
+/* the longest time (in seconds) a draining server waits for it's
+ * connections (see `ServerSettings.handoff`) */
+#ifndef SERVER_DRAIN_TIMEOUT
+#define SERVER_DRAIN_TIMEOUT 30
+#endif
+/* the number of file descriptors passed by each hot reload message */
+#define SERVER_HANDOFF_BATCH 64
+
+/* the default size of a fiber's stack (see `ServerSettings.fiber_stack`), a
+ * guard page is added below the stack */
+#ifndef SERVER_FIBER_STACK
+#define SERVER_FIBER_STACK (1024 * 64)
+#endif
+
+/* the default number of idle connections pooled per destination (see
+ * `Server.release`) */
+#ifndef SERVER_POOL_SIZE
+#define SERVER_POOL_SIZE 16
+#endif
+/* the default time (in seconds) an idle pooled connection is kept */
+#ifndef SERVER_POOL_TIMEOUT
+#define SERVER_POOL_TIMEOUT 30
+#endif
+/* the time (in seconds) a destination's resolved address is cached (see
+ * `Server.connect`) */
+#ifndef SERVER_DNS_TTL
+#define SERVER_DNS_TTL 60
+#endif
+
+/* An outbound connections' destination: the cached address and the idle
+ * (pooled) connections */
+struct ServerPool {
+    struct ServerPool *next;
+    char *host;
+    char *port;
+    struct sockaddr_storage addr; /**< the cached address */
+    socklen_t addr_len;           /**< the address's length (0 == none) */
+    time_t resolved;              /**< the address's lookup time */
+    int count;                    /**< the number of idle connections */
+    int idle[];                   /**< the idle connections */
+};
+
+/* A destination looked up by a low priority task (see `srv_connect`) */
+struct ServerLookup {
+    struct Server *server;
+    struct ServerPool *pool;
+    struct Protocol *protocol;
+};
+
+/* A connection's read buffer, only held while it has unread data */
+struct ReadBuffer {
+    struct ReadBuffer *next; /**< the pool's list */
+    size_t start; /**< the first unread byte */
+    size_t end;   /**< the end of the data */
+    char data[SERVER_READ_BUFFER];
+};
+
+/* A suspendable `on_data` handler (see `Protocol.fiber`) */
+struct ServerFiber {
+    ucontext_t context; /**< the fiber's context */
+    ucontext_t caller;  /**< the context of the thread running the fiber */
+    struct ServerFiber *next; /**< the pool's list */
+    struct ServerFiber *all;  /**< every fiber (released with the server) */
+    struct Server *server;
+    struct Protocol *protocol; /**< the connection's protocol */
+    void *stack; /**< the stack's mapping (including the guard page) */
+    size_t mapped; /**< the mapping's size */
+    int fd;      /**< the connection */
+    int timer;   /**< the fiber's timerfd (`Server.await` timeouts) */
+    int waited;  /**< the awaited fd (-1 == none) */
+    int events;  /**< the awaited events */
+    int wake;    /**< the await's outcome (0 == waiting) */
+    int settled; /**< the parties done suspending (see `fiber_settle`) */
+    char done;   /**< set once `on_data` returned */
+};
+
+/* an await's outcome (`ServerFiber.wake`) */
+enum { FIBER_READY = 1, FIBER_TIMEOUT, FIBER_CLOSED };
+
+/* A thread's connection counters (see `Server.stats`) */
+struct ServerCounters {
+    struct ServerCounters *next;
+    pthread_t thread;
+    size_t accepted;
+    size_t rejected;
+    size_t closed;
+    size_t timeouts;
+    size_t busy;
+#if SERVER_LATENCY
+    struct ServiceLatency *latency; /**< pushed only by the owning thread */
+#endif
+};
+
+#if SERVER_LATENCY
+/* A thread's latency histograms for a single service */
+struct ServiceLatency {
+    struct ServiceLatency *next;
+    struct ServiceIndex *service; /**< the interned service (or NULL) */
+    struct ServerLatency histograms[SERVER_LATENCY_KINDS];
+};
+#endif
+
+/* the thread's counters, valid while `id` matches the server's id */
+static __thread struct {
+    unsigned long id;
+    struct ServerCounters *counters;
+} thread_counters;
+
+/* the last server id (ids start at 1, so zeroed counters never match) */
+static unsigned long last_server_id = 0;
+
+/* A connection's handle, passed to the connection's `on_data` task. */
+struct ConnRef {
+    struct Server *server;
+    int fd;
+};
+
+/* A connection table chunk, holding the data for `SERVER_CONN_CHUNK`
+ * consecutive file descriptors. Chunks are allocated once a connection is
+ * attached within the chunk's range and live as long as the server does.
+ *
+ * Each field is an array (struct of arrays), the fields reviewed for every
+ * event (hot) are placed before the rest (cold).
+ */
+struct ConnChunk {
+    /** maps each connection to its protocol. */
+    struct Protocol * volatile protocol[SERVER_CONN_CHUNK];
+    /** the connection's buffer (allocated on attach, reused after close) */
+    void *buffer[SERVER_CONN_CHUNK];
+    /**
+     * a connection's "busy" flag, preventing the same connection
+     * from running `on_data` on two threads.
+     */
+    volatile char busy[SERVER_CONN_CHUNK];
+    /** the connection's timeout value. */
+    unsigned char tout[SERVER_CONN_CHUNK];
+    /** the connection's last active tick (see `conn_touch`). */
+    time_t active[SERVER_CONN_CHUNK];
+
+    /** maps each connection to the reactor it is attached to. */
+    struct Reactor *reactor[SERVER_CONN_CHUNK] __attribute__((aligned(64)));
+    /** the connection's udata */
+    void *udata[SERVER_CONN_CHUNK];
+    /** the connection's read buffer (`Protocol.read_buffer` only) */
+    struct ReadBuffer *input[SERVER_CONN_CHUNK];
+    /** the connection's reading hook */
+    ssize_t (*reading_hook[SERVER_CONN_CHUNK])(server_pt srv, int fd,
+                                               void *buffer, size_t size);
+    /** the connection's handle (the `on_data` task's argument) */
+    struct ConnRef ref[SERVER_CONN_CHUNK];
+    /** the tick of the wheel slot listing the connection (0 == none) */
+    time_t deadline[SERVER_CONN_CHUNK];
+    /** the timeout wheel's list links (file descriptors, -1 == none) */
+    int wheel_next[SERVER_CONN_CHUNK];
+    int wheel_prev[SERVER_CONN_CHUNK];
+    /** the connection's service index (NULL == no service) */
+    struct ServiceIndex *service[SERVER_CONN_CHUNK];
+    /** the connection's position in the live connection indexes (+1, 0 ==
+     * not listed) */
+    int live_pos[SERVER_CONN_CHUNK];
+    int service_pos[SERVER_CONN_CHUNK];
+    /** the connection's write batch depth (see `Server.begin_batch`) */
+    unsigned char batch[SERVER_CONN_CHUNK];
+    /** a file was queued during the batch (corks the final flush) */
+    unsigned char batch_file[SERVER_CONN_CHUNK];
+    /** the bytes queued since the batch's last flush */
+    size_t batched[SERVER_CONN_CHUNK];
+    /** set once the high watermark was reached (until `on_drain`) */
+    char full[SERVER_CONN_CHUNK];
+    /** the connection's running fiber (`Protocol.fiber`), the lowest bit is
+     * set once the connection was closed */
+    uintptr_t fiber[SERVER_CONN_CHUNK];
+    /** events arrived while the fiber was running (`on_data` runs again) */
+    char pending[SERVER_CONN_CHUNK];
+    /** the fiber awaiting the (non connection) fd, see `Server.await` */
+    struct ServerFiber *waiting[SERVER_CONN_CHUNK];
+    /** an outbound connection's destination (see `Server.connect`) */
+    struct ServerPool *origin[SERVER_CONN_CHUNK];
+#if SERVER_LATENCY
+    /** pending latency measurements (CLOCK_MONOTONIC ns, 0 == none) */
+    uint64_t ready_ns[SERVER_CONN_CHUNK]; /**< the first pending event */
+    uint64_t write_ns[SERVER_CONN_CHUNK]; /**< the first pending write */
+#endif
+};
+
+/* An additional event loop (multi-reactor mode) */
+struct ServerLoop {
+    struct Reactor reactor; /**< the loop's reactor (must be first) */
+    struct Server *server;  /**< the server owning the loop */
+    pthread_t thread;       /**< the loop's thread */
+    int srvfd;              /**< the loop's listening socket */
+    char running;           /**< set once the loop's thread is running */
 };
 
 /** The server data object container */
@@ -58,51 +347,109 @@ struct Server {
     struct ServerSettings *settings;
     struct Async *async; /**< a pointer to the thread pool object */
     pthread_mutex_t lock; /**< a mutex for server data integrity */
-    struct Protocol * volatile *protocol_map; /**< maps each connection
-                                                   to its protocol. */
 
     /**
-     * Used to send the server data + sockfd number to any worker threads.
-     * pointer offset calculations are used to calculate the sockfd.
+     * the connection table, a chunk of connections per `SERVER_CONN_CHUNK`
+     * file descriptors (NULL until used).
      */
-    struct Server **server_map;
+    struct ConnChunk **conns;
+    long conn_chunks; /**< the length of the `conns` array */
 
-    void **udata_map; /**< maps each udata with its associated
-                           connection fd */
-    /* reading hook maps */
-    ssize_t (**reading_hooks)(server_pt srv, int fd,
-                              void *buffer, size_t size);
+    struct ServerLoop *loops; /**< the event loops (multi-reactor mode) */
+    int loop_count; /**< the number of event loops (0 == single reactor) */
 
     /**
-     * map a connection's "busy" flag, preventing the same connection
-     * from running `on_data` on two threads. use busy[fd] to get the
-     * status of the flag.
+     * the user timers, ordered by a binary min-heap and driven by a single
+     * timerfd (armed for the earliest timer).
      */
-    volatile char *busy;
+    struct {
+        pthread_mutex_t lock;
+        struct ServerTimer *slots;
+        int *heap;    /**< slot indexes, ordered by `due` */
+        int count;    /**< the number of scheduled timers */
+        int capacity; /**< the number of allocated slots */
+        int unused;   /**< the first unused slot (-1 == none) */
+        int fd;       /**< the timerfd */
+    } timers;
 
     /**
-     * map all connection's timeout values. use tout[fd] to get/set the
-     * timeout.
+     * the connection timeout wheel. Each slot lists the connections that
+     * might time out during its tick (timeouts are reviewed lazily, touching
+     * a connection only updates its `active` tick).
      */
-    unsigned char *tout;
- 
+    struct {
+        pthread_mutex_t lock;
+        time_t tick; /**< the last reviewed tick */
+        int armed;   /**< the number of listed connections */
+        int slots[SERVER_WHEEL_SIZE];
+    } wheel;
+
     /**
-     * map all connection's idle cycle count values. use idle[fd] to
-     * get/set the count.
+     * the live connection index: a dense array of the open connections and
+     * one for each (interned) service, so `Server.each` and `Server.count`
+     * don't review the whole connection table.
      */
-    unsigned char *idle;
+    struct {
+        pthread_mutex_t lock;
+        struct ServiceIndex all;
+        struct ServiceIndex *services;
+    } index;
 
     pthread_mutex_t task_lock; /**< a mutex for server data integrity */
 
+    struct ServerCounters *counters; /**< the threads' counters */
+    struct ReactorStats loop_stats; /**< the stopped event loops' stats */
+    unsigned long id; /**< a unique id, validating `thread_counters` */
+
+    /**
+     * the `on_data` tasks collected while reviewing the main reactor, only
+     * used by the reviewing thread (see `dispatch_flush`).
+     */
+    struct {
+        struct AsyncJob jobs[SERVER_DISPATCH_BATCH];
+        int count;
+    } dispatch;
+
     struct FDTask *fd_task_pool;
-    struct GroupTask *group_task_pool;
+    struct ReadBuffer *read_pool; /**< the read buffer pool */
+    struct {
+        struct ServerFiber *pool; /**< the idle fibers */
+        struct ServerFiber *all;  /**< every fiber (see `ServerFiber.all`) */
+    } fibers;
+    /** the outbound connections' destinations (see `Server.connect`) */
+    struct {
+        pthread_mutex_t lock;
+        struct ServerPool *list;
+    } pools;
     size_t fd_task_pool_size; /**< task pool size */
-    size_t group_task_pool_size;
-    void **buffer_map;
+    size_t read_pool_size;
     long capacity; /**< socket capacity */
     time_t last_to; /**< the last timeout review */
     int srvfd; /**< the server socket */
+    /** a spare descriptor, released to reject a pending connection once the
+     * process runs out of file descriptors (-1 == none) */
+    int spare_fd;
+    /** held (shared) by each `accept`, and exclusively while the spare
+     * descriptor is released (so only the rejected connection takes it) */
+    pthread_rwlock_t accept_lock;
+    pthread_t acceptor; /**< the acceptor thread (SERVER_ACCEPT_THREAD) */
+    char acceptor_running; /**< set once the acceptor thread is running */
     pid_t root_pid; /**< the original process pid */
+    int process; /**< the process's index (0 == the root process) */
+    int *cpus; /**< the process's CPUs (`ServerSettings.affinity`) */
+    int cpu_count;
+    pid_t *workers; /**< the forked processes (root process only) */
+    /**
+     * hot reload (`ServerSettings.handoff`): the Unix socket listening for
+     * newer processes and the listening sockets adopted from an older one.
+     */
+    struct {
+        int fd;     /**< the Unix socket (-1 == none) */
+        char owner; /**< set while the path is bound by this server */
+        int count;  /**< the number of adopted listening sockets */
+        int listeners[SERVER_HANDOFF_BATCH];
+    } handoff;
+    time_t draining; /**< the time draining started (0 == serving) */
     volatile char run; /**< the flag that tells the server to stop */
 };
 
@@ -120,6 +467,14 @@ static struct ServerSettings *srv_settings(struct Server *server);
 /** return the computed capacity for any server instance on the system */
 static long srv_capacity(void);
 
+/* collect the server's statistics */
+static void srv_stats(struct Server *server, struct ServerStats *stats);
+static int srv_latency(struct Server *server, char *service,
+                       enum ServerLatencyKind kind,
+                       struct ServerLatency *histogram);
+static unsigned long long latency_percentile(struct ServerLatency *histogram,
+                                             double percentile);
+
 /* Server actions */
 
 /**
@@ -135,13 +490,22 @@ static void srv_stop(struct Server *server);
 static void srv_stop_all(void);
 
 static void srv_cycle_core(server_pt server);
+/* hot reload and draining (see `ServerSettings.handoff`) */
+static void handoff_accept(server_pt server);
+static void srv_drain(server_pt server);
 static int set_to_busy(server_pt server, int fd);
-static void async_on_data(server_pt *p_server);
+static void async_on_data(struct ConnRef *ref);
 static void on_ready(struct Reactor *reactor, int fd);
 static void on_shutdown(struct Reactor *reactor, int fd);
 static void on_close(struct Reactor *reactor, int fd);
+static void on_accept(struct Reactor *reactor, int fd, int client);
 static void clear_conn_data(server_pt server, int fd);
 static void accept_async(server_pt server);
+static int accept_connections(server_pt server, struct Reactor *reactor,
+                              int srvfd);
+static int attach_to_reactor(server_pt server, struct Reactor *reactor,
+                             int sockfd, struct Protocol *protocol,
+                             int flags);
 
 /* signal management */
 static void register_server(struct Server *server);
@@ -150,6 +514,10 @@ static void on_signal(int sig);
 /* Socket settings and data */
 
 static unsigned char is_busy(struct Server *server, int sockfd);
+static size_t srv_pending(struct Server *server, int sockfd);
+static inline void conn_watermarks(struct Server *server,
+                                   struct ConnChunk *chunk, int fd,
+                                   void *buffer);
 static struct Protocol *get_protocol(struct Server* server, int sockfd);
 static int set_protocol(struct Server *server,
                         int sockfd,
@@ -167,6 +535,11 @@ static void srv_close(struct Server *server, int sockfd);
 static int srv_hijack(struct Server *server, int sockfd);
 static long srv_count(struct Server *server, char *service);
 static void srv_touch(struct Server *server, int sockfd);
+/* outbound connections (see `Server.connect`) */
+static int srv_connect(struct Server *server, const char *host,
+                       const char *port, struct Protocol *protocol);
+static int srv_release(struct Server *server, int sockfd);
+static void destroy_pools(struct Server *server);
 
 /* Read and Write */
 
@@ -183,6 +556,8 @@ void rw_hooks(
                             void *data, size_t len));
 static ssize_t srv_read(server_pt srv, int fd,
                         void *buffer, size_t max_len);
+static void *srv_peek(server_pt srv, int fd, size_t *length);
+static void srv_consume(server_pt srv, int fd, size_t length);
 static ssize_t srv_write(struct Server *server, int sockfd,
                          void *data, size_t len);
 static ssize_t srv_write_move(struct Server *server, int sockfd,
@@ -192,6 +567,14 @@ static ssize_t srv_write_urgent(struct Server *server, int sockfd,
 static ssize_t srv_write_move_urgent(struct Server *server, int sockfd,
                                      void *data, size_t len);
 static ssize_t srv_sendfile(struct Server *server, int sockfd, FILE *file);
+static ssize_t srv_sendfd(struct Server *server, int sockfd, int file,
+                          off_t offset, size_t length);
+static void *srv_shared_new(void *data, size_t len);
+static void srv_shared_free(void *blob);
+static ssize_t srv_write_shared(struct Server *server, int sockfd,
+                                void *blob);
+static int srv_begin_batch(struct Server *server, int sockfd);
+static int srv_end_batch(struct Server *server, int sockfd);
 
 /* Tasks + Async */
 
@@ -211,10 +594,21 @@ static int fd_task(struct Server *server,
                    void (*fallback)(struct Server *server,
                                     int fd, void *arg));
 static int run_async(struct Server *self, void task(void *), void *arg);
+static int run_async_priority(struct Server *self,
+                              enum AsyncPriority priority,
+                              void task(void *), void *arg);
 static int run_after(struct Server *self, long milliseconds,
                      void task(void *), void *arg);
 static int run_every(struct Server *self, long milliseconds, int repetitions,
                      void task(void *), void *arg);
+static int run_after_us(struct Server *self, long microseconds,
+                        void task(void *), void *arg);
+static int run_every_us(struct Server *self, long microseconds,
+                        int repetitions, void task(void *), void *arg);
+static int cancel_timer(struct Server *self, int timer);
+static void review_timers(struct Server *server);
+static long srv_next_timer(struct Reactor *reactor);
+static int srv_has_work(struct Reactor *reactor);
 
 static inline
 int perform_single_task(server_pt srv, int fd,
@@ -225,20 +619,32 @@ struct FDTask *new_fd_task(server_pt srv);
 void destroy_fd_task(server_pt srv, struct FDTask *task);
 static void perform_fd_task(struct FDTask *task);
 
-struct GroupTask *new_group_task(server_pt srv);
-void destroy_group_task(server_pt srv, struct GroupTask *task);
-static void perform_group_task(struct GroupTask *task);
-void add_to_group_task(struct Server *server, int fd, void *arg);
+static int srv_await(server_pt server, int fd, int events, long milliseconds);
+static int fiber_start(server_pt server, struct ConnChunk *chunk, int fd,
+                       struct Protocol *protocol);
+static void fiber_ready(server_pt server, struct ConnChunk *chunk, int fd,
+                        int events);
+static void fiber_settle(struct ServerFiber *fiber);
+static void fiber_wake(struct ServerFiber *fiber, int wake);
+static void destroy_fibers(server_pt server);
+static ssize_t batch_flush(struct Server *server, struct ConnChunk *chunk,
+                           int fd);
+
+static void perform_group_chunk(struct GroupChunk *chunk);
 
 /* Server API gateway */
 const struct __SERVER_API__ Server = {
     .reactor = srv_reactor,
     .settings = srv_settings,
     .capacity = srv_capacity,
+    .stats = srv_stats,
+    .latency = srv_latency,
+    .latency_percentile = latency_percentile,
     .listen = srv_listen,
     .stop = srv_stop,
     .stop_all = srv_stop_all,
     .is_busy = is_busy,
+    .pending = srv_pending,
     .get_protocol = get_protocol,
     .set_protocol = set_protocol,
     .get_udata = get_udata,
@@ -247,87 +653,699 @@ const struct __SERVER_API__ Server = {
     .attach = srv_attach,
     .close = srv_close,
     .hijack = srv_hijack,
+    .connect = srv_connect,
+    .release = srv_release,
     .count = srv_count,
     .touch = srv_touch,
     .rw_hooks = rw_hooks,
     .read = srv_read,
+    .peek = srv_peek,
+    .consume = srv_consume,
     .write = srv_write,
     .write_move = srv_write_move,
     .write_urgent = srv_write_urgent,
     .write_move_urgent = srv_write_move_urgent,
     .sendfile = srv_sendfile,
+    .sendfd = srv_sendfd,
+    .shared_new = srv_shared_new,
+    .shared_free = srv_shared_free,
+    .write_shared = srv_write_shared,
+    .begin_batch = srv_begin_batch,
+    .end_batch = srv_end_batch,
     .each = each,
     .each_block = each_block,
+    .await = srv_await,
     .fd_task = fd_task,
     .run_async = run_async,
+    .run_async_priority = run_async_priority,
     .run_after = run_after,
     .run_every = run_every,
+    .run_after_us = run_after_us,
+    .run_every_us = run_every_us,
+    .cancel_timer = cancel_timer,
     .root_pid = root_pid,
 };
 
-/* timer protocol */
+/* Connection table */
 
-/* service name */
-static char *timer_protocol_name = "timer";
+#define _index_(fd) ((fd) & (SERVER_CONN_CHUNK - 1))
 
-/* a timer protocol, will be allocated for each timer */
-struct TimerProtocol {
-    /* must be first for pointer compatability */
-    struct Protocol parent;
-    void (*task)(void *);
-    void *arg;
-    int repeat;
-};
+/* @return the connection's chunk, or NULL if it wasn't allocated */
+static inline struct ConnChunk *conn_chunk(struct Server *server, int fd)
+{
+    if ((unsigned long) fd >= (unsigned long) server->capacity)
+        return NULL;
+    return __atomic_load_n(server->conns + fd / SERVER_CONN_CHUNK,
+                           __ATOMIC_ACQUIRE);
+}
 
-/* the timer's on_data callback */
-static void tp_perform_on_data(struct Server* self, int fd)
+/* @return the connection's chunk, allocating the chunk if needed */
+static struct ConnChunk *conn_chunk_new(struct Server *server, int fd)
 {
-    struct TimerProtocol *timer =
-        (struct TimerProtocol *) Server.get_protocol(self, fd);
-    if (timer) {
-        /* set local data copy, to avoid race contitions related to `free`. */
-        void (*task)(void *) = (void (*)(void *)) timer->task;
-        void *arg = timer->arg;
-        /* perform the task */
-        if (task) task(arg);
+    struct ConnChunk *chunk = conn_chunk(server, fd), *expected = NULL;
+    if (chunk || (unsigned long) fd >= (unsigned long) server->capacity)
+        return chunk;
+    if (posix_memalign((void **) &chunk, 64, sizeof(*chunk)))
+        return NULL;
+    memset(chunk, 0, sizeof(*chunk));
+    for (int i = 0; i < SERVER_CONN_CHUNK; i++) {
+        chunk->ref[i].server = server;
+        chunk->ref[i].fd = fd - _index_(fd) + i;
+        chunk->reactor[i] = (struct Reactor *) server;
+        chunk->wheel_next[i] = chunk->wheel_prev[i] = -1;
+    }
+    /* another thread might have allocated the chunk */
+    if (!__atomic_compare_exchange_n(server->conns + fd / SERVER_CONN_CHUNK,
+                                     &expected, chunk, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        free(chunk);
+        return expected;
+    }
+    return chunk;
+}
 
-        /* reset the timer */
-        reactor_reset_timer(fd);
-        /* close the file descriptor */
-        if (timer->repeat < 0) return;
-        if (timer->repeat == 0) {
-            reactor_close((struct Reactor *) self, fd);
+/* @return the connection's buffer, allocating the buffer if needed */
+static void *conn_buffer(struct Server *server, int fd)
+{
+    struct ConnChunk *chunk = conn_chunk_new(server, fd);
+    void *buffer, *expected = NULL;
+    if (!chunk) return NULL;
+    buffer = __atomic_load_n(chunk->buffer + _index_(fd), __ATOMIC_ACQUIRE);
+    if (buffer) return buffer;
+    if (!(buffer = Buffer.new(server)))
+        return NULL;
+    if (!__atomic_compare_exchange_n(chunk->buffer + _index_(fd), &expected,
+                                     buffer, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        Buffer.destroy(buffer);
+        return expected;
+    }
+    return buffer;
+}
+
+/* @return the connection's protocol (NULL if the connection is closed) */
+static inline struct Protocol *conn_protocol(struct Server *server, int fd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    return chunk ? chunk->protocol[_index_(fd)] : NULL;
+}
+
+/* reset the connection's timeout (the connection's data is only written
+ * once per tick) */
+static inline void conn_touch(struct Server *server, struct ConnChunk *chunk,
+                              int i)
+{
+    if (chunk->active[i] != server->reactor.last_tick)
+        chunk->active[i] = server->reactor.last_tick;
+}
+
+/* @return an open connection's buffer, resetting the connection's timeout
+ * (NULL if the connection is closed) */
+static inline void *conn_live_buffer(struct Server *server, int fd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    if (!chunk || !chunk->protocol[_index_(fd)])
+        return NULL;
+    conn_touch(server, chunk, _index_(fd));
+    return chunk->buffer[_index_(fd)];
+}
+
+/* Statistics */
+
+/* @return the current CLOCK_MONOTONIC time, in nanoseconds */
+static inline uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* @return the calling thread's counters (NULL == error) */
+static struct ServerCounters *thread_counters_for(struct Server *server)
+{
+    if (thread_counters.id == server->id)
+        return thread_counters.counters;
+    /* a thread pool thread, an event loop or an external thread */
+    pthread_t self = pthread_self();
+    struct ServerCounters *counters;
+    pthread_mutex_lock(&server->task_lock);
+    for (counters = server->counters; counters; counters = counters->next)
+        if (pthread_equal(counters->thread, self))
+            break;
+    if (!counters && (counters = calloc(1, sizeof(*counters)))) {
+        counters->thread = self;
+        counters->next = server->counters;
+        server->counters = counters;
+    }
+    pthread_mutex_unlock(&server->task_lock);
+    if (counters) {
+        thread_counters.id = server->id;
+        thread_counters.counters = counters;
+    }
+    return counters;
+}
+
+/* bump a counter (only the thread owning the counters writes to them) */
+#define count_event(server, field)                                        \
+    do {                                                                  \
+        struct ServerCounters *counters_ = thread_counters_for(server);   \
+        if (counters_)                                                    \
+            __atomic_store_n(&counters_->field, counters_->field + 1,     \
+                             __ATOMIC_RELAXED);                           \
+    } while (0)
+
+/* add a reactor's statistics */
+static void add_reactor_stats(struct Reactor *reactor,
+                              struct ServerStats *stats)
+{
+    struct ReactorStats rs;
+    reactor_stats(reactor, &rs);
+    stats->reviews += rs.reviews;
+    stats->events += rs.events;
+    stats->wait_us += rs.wait_us;
+    stats->reactor_accepted += rs.accepted;
+    stats->reactor_received += rs.received;
+}
+
+static void srv_stats(struct Server *server, struct ServerStats *stats)
+{
+    *stats = (struct ServerStats) {
+        .connections = srv_count(server, NULL),
+    };
+    pthread_mutex_lock(&server->task_lock);
+    for (struct ServerCounters *counters = server->counters; counters;
+         counters = counters->next) {
+        stats->accepted +=
+            __atomic_load_n(&counters->accepted, __ATOMIC_RELAXED);
+        stats->rejected +=
+            __atomic_load_n(&counters->rejected, __ATOMIC_RELAXED);
+        stats->closed += __atomic_load_n(&counters->closed, __ATOMIC_RELAXED);
+        stats->timeouts +=
+            __atomic_load_n(&counters->timeouts, __ATOMIC_RELAXED);
+        stats->busy_contention +=
+            __atomic_load_n(&counters->busy, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&server->task_lock);
+    add_reactor_stats(&server->reactor, stats);
+    for (int i = 0; i < server->loop_count; i++)
+        add_reactor_stats(&server->loops[i].reactor, stats);
+    stats->reviews += server->loop_stats.reviews;
+    stats->events += server->loop_stats.events;
+    stats->wait_us += server->loop_stats.wait_us;
+    stats->reactor_accepted += server->loop_stats.accepted;
+    stats->reactor_received += server->loop_stats.received;
+    if (server->async)
+        Async.stats(server->async, &stats->async);
+    struct BufferStats bs;
+    Buffer.stats(&bs);
+    stats->bytes_flushed = bs.flushed;
+    stats->flush_eagain = bs.eagain;
+    stats->packet_hits = bs.packet_hits;
+    stats->packet_misses = bs.packet_misses;
+}
+
+/* Connection timeouts */
+
+/* @return the tick in which the connection times out (0 == no timeout) */
+static inline time_t conn_deadline(struct ConnChunk *chunk, int i)
+{
+    return chunk->tout[i] ? chunk->active[i] + chunk->tout[i] : 0;
+}
+
+/* list a connection in the wheel's slot (the wheel's lock must be held) */
+static void wheel_link(struct Server *server, struct ConnChunk *chunk,
+                       int fd, time_t tick)
+{
+    int i = _index_(fd);
+    int *head = server->wheel.slots + (tick & (SERVER_WHEEL_SIZE - 1));
+    chunk->deadline[i] = tick;
+    chunk->wheel_prev[i] = -1;
+    chunk->wheel_next[i] = *head;
+    if (*head >= 0)
+        conn_chunk(server, *head)->wheel_prev[_index_(*head)] = fd;
+    *head = fd;
+    server->wheel.armed++;
+}
+
+/* remove a connection from the wheel (the wheel's lock must be held) */
+static void wheel_unlink(struct Server *server, struct ConnChunk *chunk,
+                         int fd)
+{
+    int i = _index_(fd);
+    int next = chunk->wheel_next[i], prev = chunk->wheel_prev[i];
+    if (!chunk->deadline[i]) return;
+    if (prev >= 0)
+        conn_chunk(server, prev)->wheel_next[_index_(prev)] = next;
+    else
+        server->wheel.slots[chunk->deadline[i] & (SERVER_WHEEL_SIZE - 1)] =
+            next;
+    if (next >= 0)
+        conn_chunk(server, next)->wheel_prev[_index_(next)] = prev;
+    chunk->deadline[i] = 0;
+    chunk->wheel_next[i] = chunk->wheel_prev[i] = -1;
+    server->wheel.armed--;
+}
+
+/* (re)arm the connection's timeout, according to it's last active tick */
+static void wheel_arm(struct Server *server, int fd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    if (!chunk) return;
+    pthread_mutex_lock(&server->wheel.lock);
+    wheel_unlink(server, chunk, fd);
+    time_t deadline = conn_deadline(chunk, _index_(fd));
+    if (deadline) {
+        /* never list a connection in a reviewed slot */
+        if (deadline <= server->wheel.tick)
+            deadline = server->wheel.tick + 1;
+        wheel_link(server, chunk, fd, deadline);
+    }
+    pthread_mutex_unlock(&server->wheel.lock);
+}
+
+/* remove the connection's timeout */
+static void wheel_disarm(struct Server *server, int fd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    if (!chunk) return;
+    pthread_mutex_lock(&server->wheel.lock);
+    wheel_unlink(server, chunk, fd);
+    pthread_mutex_unlock(&server->wheel.lock);
+}
+
+/* handle a timed out connection (pings it or closes it) */
+static void conn_timeout(struct Server *server, int fd, time_t tick)
+{
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    int i = _index_(fd);
+    struct Protocol *protocol = chunk->protocol[i];
+    if (!protocol) return;
+    /* the connection might have been active since it was reviewed */
+    if (conn_deadline(chunk, i) <= tick) {
+        if (protocol->ping) {
+            protocol->ping(server, fd);
+        } else if (!chunk->busy[i] || tick - chunk->active[i] >= 255) {
+            count_event(server, timeouts);
+            reactor_close(chunk->reactor[i], fd);
             return;
         }
-        timer->repeat--;
     }
+    /* review the connection again (during the next tick, if still idle) */
+    wheel_arm(server, fd);
+}
+
+/* review the connections listed in the tick's wheel slot */
+static void wheel_review(struct Server *server, time_t tick)
+{
+    int expired[SERVER_WHEEL_BATCH];
+    int count;
+    do {
+        count = 0;
+        pthread_mutex_lock(&server->wheel.lock);
+        server->wheel.tick = tick;
+        int fd = server->wheel.slots[tick & (SERVER_WHEEL_SIZE - 1)];
+        while (fd >= 0 && count < SERVER_WHEEL_BATCH) {
+            struct ConnChunk *chunk = conn_chunk(server, fd);
+            int next = chunk->wheel_next[_index_(fd)];
+            time_t deadline = conn_deadline(chunk, _index_(fd));
+            wheel_unlink(server, chunk, fd);
+            if (deadline > tick)
+                /* the connection was touched, list it in it's new slot */
+                wheel_link(server, chunk, fd, deadline);
+            else if (deadline)
+                expired[count++] = fd;
+            fd = next;
+        }
+        pthread_mutex_unlock(&server->wheel.lock);
+        /* callbacks are performed without the lock (i.e. for `on_close`) */
+        for (int j = 0; j < count; j++)
+            conn_timeout(server, expired[j], tick);
+    } while (count == SERVER_WHEEL_BATCH);
 }
 
-/* the timer's on_close (cleanup) */
-static void tp_perform_on_close(struct Server *self, int fd)
+/* Live connection index */
+
+/* @return the interned service named `name` (the index's lock must be held) */
+static struct ServiceIndex *index_service(struct Server *server,
+                                          const char *name, int create)
 {
-    /* free the protocol object when it was "aborted" using `close`. */
-    struct TimerProtocol *timer =
-        (struct TimerProtocol *) Server.get_protocol(self, fd);
-    if (timer)
-        free(timer);
+    struct ServiceIndex *service = server->index.services;
+    while (service && strcmp(service->name, name))
+        service = service->next;
+    if (service || !create)
+        return service;
+    service = calloc(1, sizeof(*service));
+    if (!service)
+        return NULL;
+    if (!(service->name = strdup(name))) {
+        free(service);
+        return NULL;
+    }
+    service->next = server->index.services;
+    server->index.services = service;
+    return service;
 }
 
-/* create a new TimeProtocol object */
-static struct TimerProtocol *TimerProtocol(void *task, void *arg,
-                                           int repetitions)
+/* append a connection to an index (the index's lock must be held).
+ * @return the connection's position + 1 (0 == error)
+ */
+static int index_push(struct ServiceIndex *index, int fd)
 {
-    struct TimerProtocol *tp = malloc(sizeof(struct TimerProtocol));
+    if (index->count == index->capacity) {
+        int capacity = index->capacity ? index->capacity << 1 : 64;
+        int *fds = realloc(index->fds, capacity * sizeof(*fds));
+        if (!fds)
+            return 0;
+        index->fds = fds;
+        index->capacity = capacity;
+    }
+    index->fds[index->count++] = fd;
+    return index->count;
+}
 
-    *tp = (struct TimerProtocol) {
-        .parent.on_data = tp_perform_on_data,
-        .parent.on_close = tp_perform_on_close,
-        .parent.service = timer_protocol_name,
-        .task = task,
-        .arg = arg,
-        .repeat = repetitions - 1
-    };
-    return tp;
+/* remove the connection at `pos` (+1), moving the last connection into its
+ * place (the index's lock must be held).
+ * @return the moved connection (-1 == none)
+ */
+static int index_pop(struct ServiceIndex *index, int pos)
+{
+    int last = index->fds[--index->count];
+    if (pos - 1 == index->count)
+        return -1;
+    index->fds[pos - 1] = last;
+    return last;
+}
+
+/* remove a connection from it's service's index (the lock must be held) */
+static void index_unlink_service(struct Server *server,
+                                 struct ConnChunk *chunk, int i)
+{
+    int moved = index_pop(chunk->service[i], chunk->service_pos[i]);
+    if (moved >= 0)
+        conn_chunk(server, moved)->service_pos[_index_(moved)] =
+            chunk->service_pos[i];
+    chunk->service[i] = NULL;
+    chunk->service_pos[i] = 0;
+}
+
+/* list a (new or updated) connection in the live connection index */
+static void index_link(struct Server *server, int fd,
+                       struct Protocol *protocol)
+{
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    int i = _index_(fd);
+    pthread_mutex_lock(&server->index.lock);
+    if (!chunk->live_pos[i])
+        chunk->live_pos[i] = index_push(&server->index.all, fd);
+    struct ServiceIndex *service =
+        (protocol && protocol->service)
+            ? index_service(server, protocol->service, 1)
+            : NULL;
+    if (service != chunk->service[i]) {
+        if (chunk->service[i])
+            index_unlink_service(server, chunk, i);
+        if (service && (chunk->service_pos[i] = index_push(service, fd)))
+            chunk->service[i] = service;
+    }
+    pthread_mutex_unlock(&server->index.lock);
+}
+
+/* remove a closed connection from the live connection index */
+static void index_unlink(struct Server *server, int fd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    int i = _index_(fd), moved;
+    if (!chunk->live_pos[i] && !chunk->service[i])
+        return;
+    pthread_mutex_lock(&server->index.lock);
+    if (chunk->live_pos[i] &&
+        (moved = index_pop(&server->index.all, chunk->live_pos[i])) >= 0)
+        conn_chunk(server, moved)->live_pos[_index_(moved)] =
+            chunk->live_pos[i];
+    chunk->live_pos[i] = 0;
+    if (chunk->service[i])
+        index_unlink_service(server, chunk, i);
+    pthread_mutex_unlock(&server->index.lock);
+}
+
+/* copy the service's connections (NULL == all the connections), following
+ * `head` bytes of a newly allocated memory block.
+ * @return the memory block (NULL == error)
+ */
+static void *index_snapshot(struct Server *server, const char *name,
+                            size_t head, int *count)
+{
+    pthread_mutex_lock(&server->index.lock);
+    struct ServiceIndex *index =
+        name ? index_service(server, name, 0) : &server->index.all;
+    *count = index ? index->count : 0;
+    char *block = malloc(head + (*count ? *count : 1) * sizeof(int));
+    if (block && *count)
+        memcpy(block + head, index->fds, *count * sizeof(int));
+    pthread_mutex_unlock(&server->index.lock);
+    return block;
+}
+
+/* Latency histograms */
+
+/* @return the histogram bucket for `ns` (see `struct ServerLatency`) */
+static inline int latency_bucket(uint64_t ns)
+{
+    if (ns < 8)
+        return ns;
+    int e = 63 - __builtin_clzll(ns);
+    int bucket = (e - 2) * 8 + (int)(ns >> (e - 3)) - 8;
+    return bucket < SERVER_LATENCY_BUCKETS ? bucket
+                                           : SERVER_LATENCY_BUCKETS - 1;
+}
+
+/* @return the largest value held by a histogram bucket */
+static inline unsigned long long latency_bucket_max(int bucket)
+{
+    if (bucket < 8)
+        return bucket;
+    int e = bucket / 8 + 2;
+    return ((unsigned long long)(bucket % 8 + 9) << (e - 3)) - 1;
+}
+
+static unsigned long long latency_percentile(struct ServerLatency *histogram,
+                                             double percentile)
+{
+    if (!histogram->count)
+        return 0;
+    size_t rank = (size_t)(histogram->count * (percentile / 100.0) + 0.5);
+    size_t seen = 0;
+    if (!rank)
+        rank = 1;
+    for (int i = 0; i < SERVER_LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            return latency_bucket_max(i);
+    }
+    return latency_bucket_max(SERVER_LATENCY_BUCKETS - 1);
+}
+
+#if SERVER_LATENCY
+/* add a measurement to the thread's histogram for the connection's service */
+static void latency_record(struct Server *server, int fd,
+                           enum ServerLatencyKind kind, uint64_t ns)
+{
+    struct ServerCounters *counters = thread_counters_for(server);
+    if (!counters)
+        return;
+    struct ServiceIndex *service = conn_chunk(server, fd)->service[_index_(fd)];
+    struct ServiceLatency *latency = counters->latency;
+    while (latency && latency->service != service)
+        latency = latency->next;
+    if (!latency) {
+        if (!(latency = calloc(1, sizeof(*latency))))
+            return;
+        latency->service = service;
+        latency->next = counters->latency;
+        /* readers walk the list without a lock */
+        __atomic_store_n(&counters->latency, latency, __ATOMIC_RELEASE);
+    }
+    struct ServerLatency *histogram = latency->histograms + kind;
+    int bucket = latency_bucket(ns);
+    __atomic_store_n(histogram->buckets + bucket,
+                     histogram->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, histogram->count + 1,
+                     __ATOMIC_RELAXED);
+}
+#endif
+
+/* a connection's event was reported (starts the queue measurement) */
+static inline void latency_ready(struct Server *server,
+                                 struct ConnChunk *chunk, int i)
+{
+#if SERVER_LATENCY
+    if (!chunk->ready_ns[i])
+        chunk->ready_ns[i] = monotonic_ns();
+#endif
+}
+
+/* the connection's `on_data` task started (ends the queue measurement)
+ * @return the current time (0 when compiled out)
+ */
+static inline uint64_t latency_started(struct Server *server,
+                                       struct ConnChunk *chunk, int fd)
+{
+#if SERVER_LATENCY
+    uint64_t now = monotonic_ns(), ready = chunk->ready_ns[_index_(fd)];
+    chunk->ready_ns[_index_(fd)] = 0;
+    if (ready)
+        latency_record(server, fd, SERVER_LATENCY_QUEUE, now - ready);
+    return now;
+#else
+    return 0;
+#endif
+}
+
+/* measure an `on_data` callback that started at `since` */
+static inline void latency_on_data(struct Server *server, int fd,
+                                   uint64_t since)
+{
+#if SERVER_LATENCY
+    latency_record(server, fd, SERVER_LATENCY_ON_DATA,
+                   monotonic_ns() - since);
+#endif
+}
+
+/* data was written to the connection's buffer (starts the flush
+ * measurement, unless earlier data is still pending) */
+static inline void latency_write(struct Server *server, int fd)
+{
+#if SERVER_LATENCY
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    if (chunk && !chunk->write_ns[_index_(fd)])
+        chunk->write_ns[_index_(fd)] = monotonic_ns();
+#endif
+}
+
+/* the connection's buffer was flushed (ends the flush measurement once the
+ * buffer is empty) */
+static inline void latency_flushed(struct Server *server, int fd,
+                                   void *buffer)
+{
+#if SERVER_LATENCY
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    uint64_t since;
+    if (!chunk || !chunk->write_ns[_index_(fd)] || !Buffer.is_empty(buffer))
+        return;
+    since = __atomic_exchange_n(chunk->write_ns + _index_(fd), 0,
+                                __ATOMIC_RELAXED);
+    if (since)
+        latency_record(server, fd, SERVER_LATENCY_FLUSH,
+                       monotonic_ns() - since);
+#endif
+}
+
+static int srv_latency(struct Server *server, char *service,
+                       enum ServerLatencyKind kind,
+                       struct ServerLatency *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+#if SERVER_LATENCY
+    if (kind < 0 || kind >= SERVER_LATENCY_KINDS)
+        return -1;
+    struct ServiceIndex *index = NULL;
+    if (service) {
+        pthread_mutex_lock(&server->index.lock);
+        index = index_service(server, service, 0);
+        pthread_mutex_unlock(&server->index.lock);
+        if (!index)
+            return 0;
+    }
+    pthread_mutex_lock(&server->task_lock);
+    for (struct ServerCounters *counters = server->counters; counters;
+         counters = counters->next) {
+        for (struct ServiceLatency *latency =
+                 __atomic_load_n(&counters->latency, __ATOMIC_ACQUIRE);
+             latency; latency = latency->next) {
+            if (service && latency->service != index)
+                continue;
+            struct ServerLatency *h = latency->histograms + kind;
+            histogram->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            for (int i = 0; i < SERVER_LATENCY_BUCKETS; i++)
+                histogram->buckets[i] +=
+                    __atomic_load_n(h->buckets + i, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&server->task_lock);
+    return 0;
+#else
+    (void) server;
+    (void) service;
+    (void) kind;
+    return -1;
+#endif
+}
+
+/* Read buffers */
+
+/* grab a read buffer from the pool */
+static struct ReadBuffer *new_read_buffer(struct Server *server)
+{
+    struct ReadBuffer *ret = NULL;
+    pthread_mutex_lock(&server->task_lock);
+    if (server->read_pool) {
+        ret = server->read_pool;
+        server->read_pool = ret->next;
+        --server->read_pool_size;
+    }
+    pthread_mutex_unlock(&server->task_lock);
+    if (!ret && !(ret = malloc(sizeof(*ret))))
+        return NULL;
+    ret->start = ret->end = 0;
+    return ret;
+}
+
+/* return a read buffer to the pool (NULL frees the pool) */
+static void destroy_read_buffer(struct Server *server,
+                                struct ReadBuffer *buffer)
+{
+    pthread_mutex_lock(&server->task_lock);
+    if (buffer == NULL) {
+        while ((buffer = server->read_pool)) {
+            server->read_pool = buffer->next;
+            free(buffer);
+        }
+        server->read_pool_size = 0;
+    } else if (server->read_pool_size >= SERVER_READ_POOL) {
+        free(buffer);
+    } else {
+        buffer->next = server->read_pool;
+        server->read_pool = buffer;
+        ++server->read_pool_size;
+    }
+    pthread_mutex_unlock(&server->task_lock);
+}
+
+/* release the connection's read buffer */
+static inline void release_input(struct Server *server,
+                                 struct ConnChunk *chunk, int i)
+{
+    struct ReadBuffer *input =
+        __atomic_exchange_n(chunk->input + i, NULL, __ATOMIC_ACQ_REL);
+    if (input)
+        destroy_read_buffer(server, input);
+}
+
+/* release the connection table (and the connection buffers) */
+static void destroy_conns(struct Server *server)
+{
+    for (long i = 0; i < server->conn_chunks; i++) {
+        struct ConnChunk *chunk = server->conns[i];
+        if (!chunk) continue;
+        for (int j = 0; j < SERVER_CONN_CHUNK; j++) {
+            if (chunk->buffer[j])
+                Buffer.destroy(chunk->buffer[j]);
+            free(chunk->input[j]);
+        }
+        free(chunk);
+    }
+    free(server->conns);
+    server->conns = NULL;
 }
 
 /* Server settings and objects */
@@ -350,12 +1368,13 @@ static struct ServerSettings *srv_settings(struct Server *server)
 
 static unsigned char is_busy(struct Server *server, int sockfd)
 {
-    return server->busy[sockfd];
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    return chunk ? chunk->busy[_index_(sockfd)] : 0;
 }
 
 static struct Protocol *get_protocol(struct Server *server, int sockfd)
 {
-    return server->protocol_map[sockfd];
+    return conn_protocol(server, sockfd);
 }
 
 static int set_protocol(struct Server *server, int sockfd,
@@ -364,7 +1383,7 @@ static int set_protocol(struct Server *server, int sockfd,
     /* before bothering with the mutex,
      * make sure we have a valid connection.
      */
-    if (!server->protocol_map[sockfd]) {
+    if (!conn_protocol(server, sockfd)) {
         // FIXME: warn the message
         // "ERROR: Cannot set a protocol for a disconnected socket."
         return -1;
@@ -377,7 +1396,7 @@ static int set_protocol(struct Server *server, int sockfd,
         return -1;
 
     /* review the connection's validity again (in proteceted state) */
-    if (!server->protocol_map[sockfd]) {
+    if (!conn_protocol(server, sockfd)) {
         pthread_mutex_unlock(&(server->lock));
         // FIXME: warn the message
         // "ERROR: Cannot set a protocol for a disconnected socket."
@@ -385,50 +1404,100 @@ static int set_protocol(struct Server *server, int sockfd,
     }
 
     /* set the new protocol */
-    server->protocol_map[sockfd] = new_protocol;
+    conn_chunk(server, sockfd)->protocol[_index_(sockfd)] = new_protocol;
+    index_link(server, sockfd, new_protocol);
     pthread_mutex_unlock(&(server->lock));
     return 0;
 }
 
 static void *get_udata(struct Server *server, int sockfd)
 {
-    return server->udata_map[sockfd];
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    return chunk ? chunk->udata[_index_(sockfd)] : NULL;
 }
 
 static void *set_udata(struct Server *server, int sockfd, void *udata)
 {
-    void *old = server->udata_map[sockfd];
-    server->udata_map[sockfd] = udata;
+    struct ConnChunk *chunk = conn_chunk_new(server, sockfd);
+    if (!chunk) return NULL;
+    void *old = chunk->udata[_index_(sockfd)];
+    chunk->udata[_index_(sockfd)] = udata;
     return old;
 }
 
 static void set_timeout(server_pt server, int fd, unsigned char timeout)
 {
-    server->tout[fd] = timeout;
+    struct ConnChunk *chunk = conn_chunk_new(server, fd);
+    if (!chunk) return;
+    chunk->tout[_index_(fd)] = timeout;
+    /* new connections are armed by `srv_attach` */
+    if (chunk->protocol[_index_(fd)])
+        wheel_arm(server, fd);
 }
 
 /* Server actions & Core */
 
 #define _reactor_(server) ((struct Reactor *)(server))
 #define _server_(reactor) ((server_pt)(reactor))
-#define _protocol_(reactor, fd) (_server_(reactor)->protocol_map[(fd)])
+#define _protocol_(reactor, fd) conn_protocol(_server_(reactor), (fd))
+#define _fd_reactor_(server, fd) \
+    (conn_chunk((server), (fd))->reactor[_index_(fd)])
+#define _loop_(reactor) ((struct ServerLoop *)(reactor))
 
 /* clear a connection's data */
 static void clear_conn_data(server_pt server, int fd)
 {
-    server->protocol_map[fd] = 0;
-    server->busy[fd] = 0;
-    server->tout[fd] = 0;
-    server->idle[fd] = 0;
-    server->udata_map[fd] = NULL;
-    server->reading_hooks[fd] = NULL;
-    Buffer.clear(server->buffer_map[fd]);
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    if (!chunk) return;
+    int i = _index_(fd);
+    char expected = 0;
+    wheel_disarm(server, fd);
+    /* a busy connection's read buffer is released by `perform_on_data` */
+    if (chunk->input[i] &&
+        __atomic_compare_exchange_n(chunk->busy + i, &expected, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        release_input(server, chunk, i);
+    index_unlink(server, fd);
+    chunk->protocol[i] = 0;
+    /* a running fiber keeps the busy flag, releasing it once it returns
+     * (a suspended fiber is woken up) */
+    uintptr_t fiber = __atomic_fetch_or(chunk->fiber + i, 1, __ATOMIC_SEQ_CST);
+    if (fiber & ~(uintptr_t) 1)
+        fiber_wake((struct ServerFiber *) (fiber & ~(uintptr_t) 1),
+                   FIBER_CLOSED);
+    else
+        chunk->busy[i] = 0;
+    chunk->tout[i] = 0;
+    chunk->active[i] = 0;
+    chunk->udata[i] = NULL;
+    chunk->origin[i] = NULL;
+    chunk->reading_hook[i] = NULL;
+    chunk->batch[i] = 0;
+    chunk->batch_file[i] = 0;
+    chunk->batched[i] = 0;
+    chunk->full[i] = 0;
+    /* the buffer is kept for the next connection using the fd */
+    if (chunk->buffer[i])
+        Buffer.clear(chunk->buffer[i]);
 }
 
 static void on_ready(struct Reactor *reactor, int fd)
 {
-    if (Buffer.flush(_server_(reactor)->buffer_map[fd], fd) > 0)
-        _server_(reactor)->idle[fd] = 0;
+    struct ConnChunk *chunk = conn_chunk(_server_(reactor), fd);
+    if (!chunk) return;
+    int i = _index_(fd);
+    if (__atomic_load_n(chunk->waiting + i, __ATOMIC_ACQUIRE)) {
+        fiber_ready(_server_(reactor), chunk, fd, SERVER_AWAIT_WRITE);
+        return;
+    }
+    /* a batching connection is flushed once the batch ends */
+    if (chunk->buffer[i] &&
+        !__atomic_load_n(chunk->batch + i, __ATOMIC_ACQUIRE) &&
+        Buffer.flush(chunk->buffer[i], fd) > 0) {
+        conn_touch(_server_(reactor), chunk, i);
+        latency_flushed(_server_(reactor), fd, chunk->buffer[i]);
+        conn_watermarks(_server_(reactor), chunk, fd, chunk->buffer[i]);
+    }
     if (_protocol_(reactor, fd) && _protocol_(reactor, fd)->on_ready)
         _protocol_(reactor, fd)->on_ready(_server_(reactor), fd);
 }
@@ -458,6 +1527,7 @@ static void on_close(struct Reactor *reactor, int fd)
         pthread_mutex_lock(&(_server_(reactor)->lock));
     }
     if (_protocol_(reactor, fd)) {
+        count_event(_server_(reactor), closed);
         if (_protocol_(reactor, fd)->on_close)
             _protocol_(reactor, fd)->on_close(_server_(reactor), fd);
         clear_conn_data(_server_(reactor), fd);
@@ -471,89 +1541,1385 @@ static void on_close(struct Reactor *reactor, int fd)
  */
 static int set_to_busy(struct Server *server, int sockfd)
 {
-    static pthread_mutex_t locker = PTHREAD_MUTEX_INITIALIZER;
-    if (!server->protocol_map[sockfd]) return 0;
+    char expected = 0;
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    if (!chunk || !chunk->protocol[_index_(sockfd)]) return 0;
 
-    pthread_mutex_lock(&locker);
-    if (server->busy[sockfd] == 1) {
-        pthread_mutex_unlock(&locker);
-        return 0;
-    }
-    server->busy[sockfd] = 1;
-    pthread_mutex_unlock(&locker);
-    return 1;
+    if (__atomic_compare_exchange_n(chunk->busy + _index_(sockfd),
+                                    &expected, 1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+        return 1;
+    count_event(server, busy);
+    return 0;
+}
+
+/* release the "busy" flag set by `set_to_busy` */
+static inline void release_busy(struct Server *server, int sockfd)
+{
+    __atomic_store_n(conn_chunk(server, sockfd)->busy + _index_(sockfd), 0,
+                     __ATOMIC_RELEASE);
 }
 
-/* accepts new connections */
+/* accepts new connections (a batch per task) */
 static void accept_async(server_pt server)
 {
-    static socklen_t cl_addrlen = 0;
-    int client = 1;
-    while (1) {
-#ifdef SOCK_NONBLOCK
-        client = accept4(server->srvfd, NULL, &cl_addrlen, SOCK_NONBLOCK);
-        if (client <= 0)
-            return;
-#else
-        client = accept(server->srvfd, NULL, &cl_addrlen);
-        if (client <= 0)
-            return;
+    /* the listening socket is edge triggered, so a task is rescheduled
+     * (behind the queued tasks) for the rest of the connections */
+    if (accept_connections(server, _reactor_(server), server->srvfd) &&
+        server->run && !server->draining)
+        Async.run_priority(server->async, ASYNC_PRIORITY_HIGH,
+                           (void (*)(void *)) accept_async, server);
+}
+
+/* the acceptor thread (SERVER_ACCEPT_THREAD) */
+static void *accept_cycle(void *arg)
+{
+    server_pt server = arg;
+    struct pollfd pfd = {.fd = server->srvfd, .events = POLLIN};
+    while (server->run && !server->draining) {
+        if (poll(&pfd, 1, _reactor_(server)->tick) > 0)
+            accept_connections(server, _reactor_(server), server->srvfd);
+    }
+    return NULL;
+}
+
+/* reports a connection accepted while the server is at capacity (the
+ * caller closes it) */
+static void accept_reject(server_pt server, int client)
+{
+    count_event(server, rejected);
+    if (server->settings->on_busy)
+        server->settings->on_busy(server, client);
+    else if (server->settings->busy_msg) {
+        /* the socket is non-blocking, a full socket buffer cuts it short */
+        (void) send(client, server->settings->busy_msg,
+                    strlen(server->settings->busy_msg),
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
+
+/* the process (or the system) ran out of file descriptors. The pending
+ * connection is accepted using the spare descriptor and rejected (as if the
+ * server was at capacity), otherwise the listening socket keeps reporting it
+ * (level triggered listeners spin). Without a spare descriptor accepting
+ * backs off for `SERVER_ACCEPT_BACKOFF` milliseconds.
+ *
+ * Descriptors might be released meanwhile (`accept` fails before looking for
+ * a pending connection), so the connection is only rejected if the spare
+ * can't be reopened.
+ * @return 0 once a connection was rejected (more might be pending), -1 if
+ * accepting backed off, or the accepted connection (the caller attaches it).
+ */
+static int accept_exhausted(server_pt server, int srvfd)
+{
+    int client, spare = __atomic_exchange_n(&server->spare_fd, -1,
+                                            __ATOMIC_ACQ_REL);
+    if (spare < 0 && (spare = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        usleep(SERVER_ACCEPT_BACKOFF * 1000);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&server->accept_lock);
+    close(spare);
+#ifdef SOCK_NONBLOCK
+    client = accept4(srvfd, NULL, NULL, SOCK_NONBLOCK);
+#else
+    if ((client = accept(srvfd, NULL, NULL)) >= 0)
         set_non_blocking_socket(client);
 #endif
-        /* handle server overload */
-        if (client >= _reactor_(server)->maxfd) {
-            if (server->settings->busy_msg)
-                if (write(client, server->settings->busy_msg,
-                          strlen(server->settings->busy_msg)) < 0)
-                    ;
-            close(client);
-            continue;
+    if (client >= 0 &&
+        (spare = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        accept_reject(server, client);
+        /* the disconnected socket is the next spare (once closed, a
+         * concurrent `accept` might take the descriptor) */
+        shutdown(client, SHUT_RDWR);
+        spare = client;
+        client = 0;
+    } else if (client < 0) {
+        spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    pthread_rwlock_unlock(&server->accept_lock);
+    __atomic_store_n(&server->spare_fd, spare, __ATOMIC_RELEASE);
+    return client;
+}
+
+/* attach a new connection to `reactor` (rejected once the server is at
+ * capacity) */
+static void accept_attach(server_pt server, struct Reactor *reactor,
+                          int client)
+{
+    /* handle server overload */
+    if (client >= _reactor_(server)->maxfd) {
+        accept_reject(server, client);
+        close(client);
+        return;
+    }
+    /* attach the new client (performs on_close if needed) */
+    if (!attach_to_reactor(server, reactor, client,
+                           server->settings->protocol, 0))
+        count_event(server, accepted);
+}
+
+/* accepts (up to `accept_batch`) new connections from `srvfd`, attaching
+ * them to `reactor`.
+ * @return 1 if the batch was exhausted (more connections might be pending)
+ */
+static int accept_connections(server_pt server, struct Reactor *reactor,
+                              int srvfd)
+{
+    int client = 1;
+    /* a draining server leaves the connections to the newer process */
+    if (server->draining)
+        return 0;
+    for (int i = 0; i < server->settings->accept_batch; i++) {
+        pthread_rwlock_rdlock(&server->accept_lock);
+#ifdef SOCK_NONBLOCK
+        client = reactor_accept(reactor, srvfd);
+#else
+        client = accept(srvfd, NULL, NULL);
+#endif
+        pthread_rwlock_unlock(&server->accept_lock);
+#ifndef SOCK_NONBLOCK
+        if (client > 0)
+            set_non_blocking_socket(client);
+#endif
+        if (client < 0 && (errno == EMFILE || errno == ENFILE)) {
+            /* the listener is reviewed again after backing off */
+            if ((client = accept_exhausted(server, srvfd)) < 0)
+                return 1;
+            if (!client)
+                continue;
         }
-        /* attach the new client (performs on_close if needed) */
-        srv_attach(server, client, server->settings->protocol);
+        if (client <= 0)
+            return 0;
+        accept_attach(server, reactor, client);
     }
+    return 1;
 }
 
-/* make sure that the on_data callback isn't overlapping a previous on_data */
-static void async_on_data(server_pt *p_server)
+/* a connection accepted by the reactor's backend (see `REACTOR_ACCEPT`) */
+static void on_accept(struct Reactor *reactor, int fd, int client)
 {
-    /* compute sockfd by comparing the distance between the original pointer
-     * and the passed pointer's address.
-     */
-    if (!(*p_server)) return;
+    (void) fd;
+    accept_attach(_server_(reactor), reactor, client);
+}
+
+/* the listening socket's `reactor_add_listener` flags */
+static int listener_flags(server_pt server)
+{
+    /* the io_uring backend accepts the connections itself (see `on_accept`),
+     * once the accept loops drained the listener */
+    int flags = REACTOR_ACCEPT;
+    /* bounded batches on the reactor's thread rely on level triggering */
+    if (server->loop_count || server->settings->accept == SERVER_ACCEPT_REACTOR)
+        flags |= REACTOR_LEVEL_TRIGGERED;
+    /* forked processes share the listening socket, wake only one */
+    if (server->settings->processes > 1)
+        flags |= REACTOR_EXCLUSIVE;
+    return flags;
+}
+
+/* @return non-zero if the reactor's backend should receive the data of it's
+ * connections (`REACTOR_RECV`): io_uring completes the receives on the thread
+ * that requested them, which works best when a single thread reviews the
+ * reactor (the event loops, or a single threaded server) */
+static int conn_receives(server_pt server, struct Reactor *reactor)
+{
+    return reactor != _reactor_(server) || server->settings->threads <= 1;
+}
+
+/* read from the socket, using the reading hook if set (the `Server.read`
+ * return values, ignoring the read buffer) */
+static ssize_t conn_recv(server_pt srv, struct ConnChunk *chunk, int fd,
+                         void *buffer, size_t max_len)
+{
+    if (chunk && chunk->reading_hook[_index_(fd)])  /* check for reading hook */
+        return chunk->reading_hook[_index_(fd)](srv, fd, buffer, max_len);
+
+    ssize_t read = 0;
+    struct Reactor *reactor = chunk ? chunk->reactor[_index_(fd)] : NULL;
+    if ((read = reactor ? reactor_read(reactor, fd, buffer, max_len)
+                        : recv(fd, buffer, max_len, 0)) > 0) {
+        /* reset timeout */
+        if (chunk)
+            conn_touch(srv, chunk, _index_(fd));
+        /* return data */
+        return read;
+    } else {
+        if (read && (errno == EWOULDBLOCK || errno == EAGAIN))
+            return 0;
+    }
+    return -1;
+}
+
+/* read from the socket into the connection's read buffer.
+ * @return 0 if the buffer was filled before the socket was drained.
+ */
+static int fill_input(server_pt server, struct ConnChunk *chunk, int fd)
+{
+    int i = _index_(fd);
+    struct ReadBuffer *input = chunk->input[i];
+    ssize_t read;
+    if (!input && !(input = chunk->input[i] = new_read_buffer(server)))
+        return 1;
+    /* make room for more data */
+    if (input->start) {
+        memmove(input->data, input->data + input->start,
+                input->end - input->start);
+        input->end -= input->start;
+        input->start = 0;
+    }
+    /* edge triggered, read until the socket is drained */
+    while (input->end < SERVER_READ_BUFFER) {
+        read = conn_recv(server, chunk, fd, input->data + input->end,
+                         SERVER_READ_BUFFER - input->end);
+        if (read <= 0)
+            return 1;
+        input->end += read;
+    }
+    return 0;
+}
+
+/* perform the protocol's `on_data` (the connection must be busy) */
+static void perform_on_data(server_pt server, struct ConnChunk *chunk,
+                            int fd, struct Protocol *protocol)
+{
+    int i = _index_(fd);
+    struct ReadBuffer *input;
+    size_t unread;
+    int drained;
+    uint64_t since = latency_started(server, chunk, fd);
+    /* writes are flushed once `on_data` returns (one flush per burst) */
+    srv_begin_batch(server, fd);
+    if (!protocol->read_buffer) {
+        protocol->on_data(server, fd);
+        latency_on_data(server, fd, since);
+        srv_end_batch(server, fd);
+        return;
+    }
+    do {
+        drained = fill_input(server, chunk, fd);
+        if (!(input = chunk->input[i]) || input->start == input->end)
+            break;
+        unread = input->end - input->start;
+        if (SERVER_LATENCY && !since)
+            since = monotonic_ns();
+        protocol->on_data(server, fd);
+        latency_on_data(server, fd, since);
+        since = 0;
+        /* a full buffer that wasn't consumed can't be filled */
+        if (input->end - input->start == unread &&
+            input->end == SERVER_READ_BUFFER && !input->start)
+            break;
+    } while (!drained && chunk->protocol[i] == protocol);
+    srv_end_batch(server, fd);
+    /* only connections with unread data hold a read buffer */
+    input = chunk->input[i];
+    if (input && (input->start == input->end || !chunk->protocol[i]))
+        release_input(server, chunk, i);
+}
+
+/* Fibers (see `Protocol.fiber` and `Server.await`) */
+
+/* the fiber running on the current thread (NULL == none) */
+static __thread struct ServerFiber *current_fiber;
+
+/* the fiber's entry point, performing `on_data` whenever it's started
+ * (makecontext passes the fiber's pointer as two ints) */
+static void fiber_main(unsigned int high, unsigned int low)
+{
+    struct ServerFiber *fiber =
+        (struct ServerFiber *) (((uintptr_t) high << 16 << 16) | low);
+    for (;;) {
+        perform_on_data(fiber->server, conn_chunk(fiber->server, fiber->fd),
+                        fiber->fd, fiber->protocol);
+        fiber->done = 1;
+        swapcontext(&fiber->context, &fiber->caller);
+    }
+}
+
+/* grab a fiber from the pool (or create one) */
+static struct ServerFiber *fiber_new(struct Server *server)
+{
+    struct ServerFiber *fiber;
+    struct ConnChunk *chunk;
+    long page = sysconf(_SC_PAGESIZE);
+    pthread_mutex_lock(&server->task_lock);
+    if ((fiber = server->fibers.pool))
+        server->fibers.pool = fiber->next;
+    pthread_mutex_unlock(&server->task_lock);
+    if (fiber)
+        return fiber;
+    if (!(fiber = calloc(1, sizeof(*fiber))))
+        return NULL;
+    fiber->server = server;
+    fiber->waited = -1;
+    /* whole pages, and the guard page */
+    fiber->mapped = (server->settings->fiber_stack + page - 1) / page * page +
+                    page;
+    fiber->stack = mmap(NULL, fiber->mapped,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (fiber->stack == MAP_FAILED)
+        goto error;
+    /* overflowing the stack faults instead of corrupting memory */
+    mprotect(fiber->stack, page, PROT_NONE);
+    /* the timeout timer stays in the reactor, it's events are validated by
+     * reading the timer (a disarmed timer has nothing to read) */
+    if ((fiber->timer = reactor_make_timer()) < 0)
+        goto unmap;
+    if (!(chunk = conn_chunk_new(server, fiber->timer)))
+        goto close_timer;
+    chunk->waiting[_index_(fiber->timer)] = fiber;
+    if (reactor_add(_reactor_(server), fiber->timer) < 0) {
+        chunk->waiting[_index_(fiber->timer)] = NULL;
+        goto close_timer;
+    }
+    getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp = (char *) fiber->stack + page;
+    fiber->context.uc_stack.ss_size = fiber->mapped - page;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, (void (*)(void)) fiber_main, 2,
+                (unsigned int) ((uintptr_t) fiber >> 16 >> 16),
+                (unsigned int) (uintptr_t) fiber);
+    pthread_mutex_lock(&server->task_lock);
+    fiber->all = server->fibers.all;
+    server->fibers.all = fiber;
+    pthread_mutex_unlock(&server->task_lock);
+    return fiber;
+close_timer:
+    close(fiber->timer);
+unmap:
+    munmap(fiber->stack, fiber->mapped);
+error:
+    free(fiber);
+    return NULL;
+}
+
+/* release every fiber (the timers are closed by the reactor) */
+static void destroy_fibers(struct Server *server)
+{
+    struct ServerFiber *fiber;
+    while ((fiber = server->fibers.all)) {
+        server->fibers.all = fiber->all;
+        munmap(fiber->stack, fiber->mapped);
+        free(fiber);
+    }
+    server->fibers.pool = NULL;
+}
+
+/* run the fiber until it's suspended or `on_data` returns */
+static void fiber_switch(struct ServerFiber *fiber)
+{
+    server_pt server = fiber->server;
+    struct ConnChunk *chunk;
+    int i = _index_(fiber->fd);
+    current_fiber = fiber;
+    swapcontext(&fiber->caller, &fiber->context);
+    current_fiber = NULL;
+    if (!fiber->done) {
+        /* suspended, the wakeup might have happened already */
+        fiber_settle(fiber);
+        return;
+    }
+    /* release the connection, keeping the fiber for the next handler */
+    chunk = conn_chunk(server, fiber->fd);
+    __atomic_store_n(chunk->fiber + i, 0, __ATOMIC_SEQ_CST);
+    release_busy(server, fiber->fd);
+    pthread_mutex_lock(&server->task_lock);
+    fiber->next = server->fibers.pool;
+    server->fibers.pool = fiber;
+    pthread_mutex_unlock(&server->task_lock);
+    /* events that arrived meanwhile */
+    if (__atomic_exchange_n(chunk->pending + i, 0, __ATOMIC_SEQ_CST) &&
+        chunk->protocol[i])
+        Async.run(server->async, (void (*)(void *)) async_on_data,
+                  chunk->ref + i);
+}
+
+/* start `on_data` on a fiber (the connection must be busy)
+ * @return -1 if a fiber couldn't be created
+ */
+static int fiber_start(struct Server *server, struct ConnChunk *chunk, int fd,
+                       struct Protocol *protocol)
+{
+    struct ServerFiber *fiber = fiber_new(server);
+    if (!fiber)
+        return -1;
+    fiber->fd = fd;
+    fiber->protocol = protocol;
+    fiber->done = 0;
+    /* closing the connection before the handler awaits wakes the fiber,
+     * there's nothing to unwatch yet */
+    fiber->waited = -1;
+    __atomic_store_n(chunk->fiber + _index_(fd), (uintptr_t) fiber,
+                     __ATOMIC_SEQ_CST);
+    fiber_switch(fiber);
+    return 0;
+}
+
+/* both the suspending thread and the wakeup settle the await, the second
+ * one resumes the fiber (the fiber can't resume before it's suspended) */
+static void fiber_settle(struct ServerFiber *fiber)
+{
+    if (__atomic_add_fetch(&fiber->settled, 1, __ATOMIC_ACQ_REL) == 2 &&
+        Async.run(fiber->server->async, (void (*)(void *)) fiber_switch,
+                  fiber))
+        fiber_switch(fiber);
+}
+
+/* (dis)arm the fiber's timeout timer (a negative value disarms) */
+static void fiber_timer(struct ServerFiber *fiber, long milliseconds)
+{
+    struct itimerspec value = {.it_interval = {0}};
+    if (milliseconds >= 0) {
+        value.it_value.tv_sec = milliseconds / 1000;
+        /* a zero value would disarm the timer */
+        value.it_value.tv_nsec = (milliseconds % 1000) * 1000000 + 1;
+    }
+    timerfd_settime(fiber->timer, 0, &value, NULL);
+}
+
+/* stop reviewing the awaited fd (and the timer) */
+static void fiber_unwatch(struct ServerFiber *fiber)
+{
+    struct ConnChunk *chunk;
+    fiber_timer(fiber, -1);
+    if (fiber->waited < 0 || !(chunk = conn_chunk(fiber->server,
+                                                  fiber->waited)))
+        return;
+    reactor_remove(_reactor_(fiber->server), fiber->waited);
+    __atomic_store_n(chunk->waiting + _index_(fiber->waited), NULL,
+                     __ATOMIC_RELEASE);
+    fiber->waited = -1;
+}
+
+/* wake a suspended fiber, the fd, the timer and closing the connection race
+ * for the wakeup */
+static void fiber_wake(struct ServerFiber *fiber, int wake)
+{
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&fiber->wake, &expected, wake, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+    fiber_unwatch(fiber);
+    fiber_settle(fiber);
+}
+
+/* an awaited fd (or a fiber's timer) reported an event */
+static void fiber_ready(struct Server *server, struct ConnChunk *chunk, int fd,
+                        int events)
+{
+    struct ServerFiber *fiber =
+        __atomic_load_n(chunk->waiting + _index_(fd), __ATOMIC_ACQUIRE);
+    int wake = FIBER_READY;
+    uint64_t expirations;
+    if (!fiber)
+        return;
+    if (fd == fiber->timer) {
+        /* a disarmed (or re-armed) timer's stale event has nothing to read */
+        if (!(events & SERVER_AWAIT_READ) ||
+            read(fd, &expirations, sizeof(expirations)) <= 0)
+            return;
+        wake = FIBER_TIMEOUT;
+    } else if (!(events & fiber->events)) {
+        return;
+    }
+    fiber_wake(fiber, wake);
+}
+
+/* @return 1 if the fiber's connection was closed */
+static inline int fiber_closed(struct ServerFiber *fiber)
+{
+    struct ConnChunk *chunk = conn_chunk(fiber->server, fiber->fd);
+    return __atomic_load_n(chunk->fiber + _index_(fiber->fd),
+                           __ATOMIC_SEQ_CST) & 1;
+}
 
-    int sockfd = p_server - (*p_server)->server_map;
+static int srv_await(server_pt server, int fd, int events, long milliseconds)
+{
+    struct ServerFiber *fiber = current_fiber;
+    struct ConnChunk *chunk = NULL;
+    if (!fiber || fiber->server != server || (fd < 0 && milliseconds < 0))
+        return -1;
+    if (fd >= 0 && (fd > _reactor_(server)->maxfd ||
+                    !(chunk = conn_chunk_new(server, fd)) ||
+                    chunk->protocol[_index_(fd)] ||
+                    chunk->waiting[_index_(fd)]))
+        return -1;
+    /* the handler's batched writes aren't held while it's suspended */
+    struct ConnChunk *conn = conn_chunk(server, fiber->fd);
+    if (conn->batch[_index_(fiber->fd)])
+        batch_flush(server, conn, fiber->fd);
+    fiber->events = events ? events : SERVER_AWAIT_READ;
+    fiber->settled = 0;
+    __atomic_store_n(&fiber->wake, 0, __ATOMIC_SEQ_CST);
+    /* from now on, closing the connection wakes the fiber */
+    if (fiber_closed(fiber))
+        return -1;
+    /* set once the await goes ahead (a stale fd would be unwatched by the
+     * next wakeup) */
+    fiber->waited = fd;
+    /* the timer is armed first, so the fd's wakeup always disarms it (an
+     * earlier wakeup is cleaned up below) */
+    if (milliseconds >= 0)
+        fiber_timer(fiber, milliseconds);
+    if (chunk) {
+        __atomic_store_n(chunk->waiting + _index_(fd), fiber,
+                         __ATOMIC_RELEASE);
+        /* the fd is left open on errors and hangups (it isn't ours) */
+        if (reactor_add_listener(_reactor_(server), fd, REACTOR_KEEP_OPEN)) {
+            int expected = 0;
+            if (__atomic_compare_exchange_n(&fiber->wake, &expected,
+                                            FIBER_READY, 0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED)) {
+                fiber_unwatch(fiber);
+                return -1;
+            }
+            /* another wakeup won, it's waiting for us to suspend */
+        }
+    }
+    /* a wakeup that happened before the fd and the timer were set up
+     * couldn't remove them */
+    if (__atomic_load_n(&fiber->wake, __ATOMIC_ACQUIRE))
+        fiber_unwatch(fiber);
+    swapcontext(&fiber->context, &fiber->caller);
+    /* resumed (possibly by another thread) */
+    if (fiber_closed(fiber))
+        return -1;
+    return fiber->wake == FIBER_READY;
+}
+
+/* make sure that the on_data callback isn't overlapping a previous on_data */
+static void async_on_data(struct ConnRef *ref)
+{
+    server_pt server = ref->server;
+    int sockfd = ref->fd;
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
      /* if we get the handle, perform the task */
-    if (set_to_busy(*p_server, sockfd)) {
-        struct Protocol *protocol = (*p_server)->protocol_map[sockfd];
-        if (!protocol || !protocol->on_data) return;
-        (*p_server)->idle[sockfd] = 0;
-        protocol->on_data((*p_server), sockfd);
+    if (set_to_busy(server, sockfd)) {
+        struct Protocol *protocol = chunk->protocol[_index_(sockfd)];
+        if (!protocol || !protocol->on_data) {
+            release_busy(server, sockfd);
+            return;
+        }
+        conn_touch(server, chunk, _index_(sockfd));
+        /* the fiber releases the handle once `on_data` returns */
+        if (protocol->fiber && !fiber_start(server, chunk, sockfd, protocol))
+            return;
+        perform_on_data(server, chunk, sockfd, protocol);
         // release the handle
-        (*p_server)->busy[sockfd] = 0;
+        release_busy(server, sockfd);
         return;
     }
+    /* a running fiber calls `on_data` again once it's done (it might be
+     * suspended for a while) */
+    if (chunk->fiber[_index_(sockfd)]) {
+        __atomic_store_n(chunk->pending + _index_(sockfd), 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(chunk->fiber + _index_(sockfd), __ATOMIC_SEQ_CST) &
+            ~(uintptr_t) 1)
+            return;
+    }
     /* we didn't get the handle, reschedule - but only if the connection
      * is still open.
      */
-    if ((*p_server)->protocol_map[sockfd])
-        Async.run((*p_server)->async,
-                  (void (*)(void *)) async_on_data, p_server);
+    if (chunk->protocol[_index_(sockfd)])
+        Async.defer(server->async, (void (*)(void *)) async_on_data, ref);
+}
+
+/* schedule the collected `on_data` tasks at once (a single lock and wakeup
+ * for the whole review), performing any tasks that couldn't be scheduled */
+static void dispatch_flush(server_pt server)
+{
+    int count = server->dispatch.count;
+    if (!count) return;
+    server->dispatch.count = 0;
+    int i = Async.run_batch(server->async, server->dispatch.jobs, count);
+    for (i = i < 0 ? 0 : i; i < count; i++)
+        server->dispatch.jobs[i].task(server->dispatch.jobs[i].arg);
+}
+
+/* collect a connection's `on_data` task (see `dispatch_flush`) */
+static inline void dispatch_push(server_pt server, struct ConnRef *ref)
+{
+    if (server->dispatch.count == SERVER_DISPATCH_BATCH)
+        dispatch_flush(server);
+    server->dispatch.jobs[server->dispatch.count++] = (struct AsyncJob) {
+        .task = (void (*)(void *)) async_on_data, .arg = ref};
 }
 
 static void on_data(struct Reactor *reactor, int fd)
 {
+    struct Protocol *protocol;
     if (fd == _server_(reactor)->srvfd) {
         /*listening socket. accept connections. */
-        Async.run(_server_(reactor)->async,
-                  (void (*)(void *)) accept_async, reactor);
-    } else if (_protocol_(reactor, fd) && _protocol_(reactor, fd)->on_data) {
-        _server_(reactor)->idle[fd] = 0;
-        /* clients, forward on */
-        Async.run(_server_(reactor)->async,
-                  (void (*)(void *)) async_on_data,
-                  &(_server_(reactor)->server_map[fd]));
+        if (_server_(reactor)->settings->accept == SERVER_ACCEPT_REACTOR)
+            accept_connections(_server_(reactor), reactor, fd);
+        else
+            Async.run_priority(_server_(reactor)->async, ASYNC_PRIORITY_HIGH,
+                               (void (*)(void *)) accept_async, reactor);
+    } else if (fd == _server_(reactor)->timers.fd) {
+        /* the earliest user timer is due */
+        Async.run_priority(_server_(reactor)->async, ASYNC_PRIORITY_HIGH,
+                           (void (*)(void *)) review_timers, reactor);
+    } else if (fd == _server_(reactor)->handoff.fd) {
+        /* a hot reload peer (see `ServerSettings.handoff`) */
+        Async.run_priority(_server_(reactor)->async, ASYNC_PRIORITY_HIGH,
+                           (void (*)(void *)) handoff_accept, reactor);
+    } else if ((protocol = _protocol_(reactor, fd)) && protocol->on_data) {
+        struct ConnChunk *chunk = conn_chunk(_server_(reactor), fd);
+        conn_touch(_server_(reactor), chunk, _index_(fd));
+        latency_ready(_server_(reactor), chunk, _index_(fd));
+        /* inline protocols are handled on the reactor's thread
+         * (reschedules if busy) */
+        if (protocol->inline_on_data) {
+            async_on_data(chunk->ref + _index_(fd));
+            return;
+        }
+        /* clients, forward on (once the review is done) */
+        dispatch_push(_server_(reactor), chunk->ref + _index_(fd));
+    } else {
+        /* a file descriptor awaited by a fiber (see `Server.await`) */
+        struct ConnChunk *chunk = conn_chunk(_server_(reactor), fd);
+        if (chunk)
+            fiber_ready(_server_(reactor), chunk, fd, SERVER_AWAIT_READ);
+    }
+}
+
+/* Thread and process placement */
+
+/* parse a CPU list ("0-3,8,10-11"), adding the CPUs to `set`
+ * @return the number of CPUs added
+ */
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    int count = 0;
+    while (list && *list) {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list)
+            break;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= 0 && !CPU_ISSET(cpu, set)) {
+                CPU_SET(cpu, set);
+                count++;
+            }
+        }
+        list = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            break;
+    }
+    return count;
+}
+
+/* read a sysfs CPU (or node) list file into `set`
+ * @return the number of CPUs read
+ */
+static int read_cpu_list(const char *path, cpu_set_t *set)
+{
+    char list[1024];
+    FILE *file = fopen(path, "r");
+    CPU_ZERO(set);
+    if (!file)
+        return 0;
+    int count = fgets(list, sizeof(list), file) ? parse_cpu_list(list, set)
+                                                : 0;
+    fclose(file);
+    return count;
+}
+
+/* read the allowed CPUs of the `index` NUMA node (of the online nodes)
+ * @return 0 if the node has no allowed CPUs (or doesn't exist)
+ */
+static int node_cpus(int index, cpu_set_t *allowed, cpu_set_t *node)
+{
+    cpu_set_t online;
+    char path[64];
+    read_cpu_list("/sys/devices/system/node/online", &online);
+    for (int n = 0; n < CPU_SETSIZE; n++) {
+        if (!CPU_ISSET(n, &online))
+            continue;
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", n);
+        read_cpu_list(path, node);
+        CPU_AND(node, node, allowed);
+        if (CPU_COUNT(node) && !index--)
+            return 1;
+    }
+    CPU_ZERO(node);
+    return 0;
+}
+
+/* select the process's share of the allowed CPUs: a NUMA node per process
+ * (round robin) when there are a number of nodes, otherwise an equal slice
+ * of the CPUs (sharing them when there are more processes than CPUs). */
+static void process_share(struct Server *server, cpu_set_t *allowed)
+{
+    int processes = server->settings->processes;
+    int nodes = 0, count = CPU_COUNT(allowed), pos = 0;
+    cpu_set_t share;
+    if (processes <= 1)
+        return;
+    while (node_cpus(nodes, allowed, &share))
+        nodes++;
+    if (nodes > 1) {
+        node_cpus(server->process % nodes, allowed, &share);
+    } else {
+        CPU_ZERO(&share);
+        for (int cpu = 0; cpu < CPU_SETSIZE && pos < count; cpu++) {
+            if (!CPU_ISSET(cpu, allowed))
+                continue;
+            if (count >= processes
+                    ? (long) pos * processes / count == server->process
+                    : pos == server->process % count)
+                CPU_SET(cpu, &share);
+            pos++;
+        }
     }
+    if (CPU_COUNT(&share))
+        *allowed = share;
+}
+
+/* restrict the process to it's CPUs (before any threads are created),
+ * listing them for pinning the threads */
+static void place_process(struct Server *server)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (!server->settings->affinity)
+        return;
+    if (server->settings->cpus
+            ? !parse_cpu_list(server->settings->cpus, &allowed)
+            : sched_getaffinity(0, sizeof(allowed), &allowed))
+        return;
+    process_share(server, &allowed);
+    if (sched_setaffinity(0, sizeof(allowed), &allowed)) {
+        perror("couldn't set the process's CPU affinity");
+        return;
+    }
+    server->cpus = malloc(CPU_COUNT(&allowed) * sizeof(int));
+    if (!server->cpus)
+        return;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            server->cpus[server->cpu_count++] = cpu;
+}
+
+/* @return the CPU of the `index` thread (-1 == not pinned) */
+static inline int thread_cpu(struct Server *server, int index)
+{
+    if (server->settings->affinity != SERVER_AFFINITY_THREAD ||
+        !server->cpu_count)
+        return -1;
+    return server->cpus[index % server->cpu_count];
+}
+
+/* Multi-reactor mode: each event loop runs on its own thread, accepting
+ * connections from its own (SO_REUSEPORT) listening socket and handling
+ * their events inline, so a connection stays on one thread for its whole
+ * life.
+ *
+ * The per-fd data is shared, so the callbacks (except `on_data`) simply
+ * forward to the main reactor's callbacks.
+ */
+static void loop_on_data(struct Reactor *reactor, int fd)
+{
+    server_pt server = _loop_(reactor)->server;
+    struct Protocol *protocol;
+    if (fd == _loop_(reactor)->srvfd) {
+        accept_connections(server, reactor, fd);
+    } else if ((protocol = conn_protocol(server, fd)) && protocol->on_data) {
+        struct ConnChunk *chunk = conn_chunk(server, fd);
+        conn_touch(server, chunk, _index_(fd));
+        latency_ready(server, chunk, _index_(fd));
+        /* perform the task on this thread (reschedules if busy) */
+        async_on_data(chunk->ref + _index_(fd));
+    }
+}
+
+static void loop_on_accept(struct Reactor *reactor, int fd, int client)
+{
+    (void) fd;
+    accept_attach(_loop_(reactor)->server, reactor, client);
+}
+
+static void loop_on_ready(struct Reactor *reactor, int fd)
+{
+    on_ready(_reactor_(_loop_(reactor)->server), fd);
+}
+
+static void loop_on_shutdown(struct Reactor *reactor, int fd)
+{
+    on_shutdown(_reactor_(_loop_(reactor)->server), fd);
+}
+
+static void loop_on_close(struct Reactor *reactor, int fd)
+{
+    on_close(_reactor_(_loop_(reactor)->server), fd);
+}
+
+/* the event loop's thread */
+static void *loop_cycle(void *arg)
+{
+    struct ServerLoop *loop = arg;
+    while (loop->server->run && reactor_review(&loop->reactor) >= 0)
+        ;
+    return NULL;
+}
+
+/* initialize the event loops, binding a listening socket for each loop. */
+static int start_loops(server_pt server)
+{
+    int count = server->settings->reactors;
+    server->loops = calloc(count, sizeof(struct ServerLoop));
+    if (!server->loops) return -1;
+    for (int i = 0; i < count; i++) {
+        struct ServerLoop *loop = server->loops + i;
+        *loop = (struct ServerLoop) {
+            .reactor.maxfd = _reactor_(server)->maxfd,
+            .reactor.backend = server->settings->backend,
+            .reactor.max_events = server->settings->max_events,
+            .reactor.tick = server->settings->tick,
+            .reactor.adaptive = server->settings->adaptive,
+            .reactor.busy_poll = server->settings->busy_poll,
+            .reactor.on_data = loop_on_data,
+            .reactor.on_ready = loop_on_ready,
+            .reactor.on_shutdown = loop_on_shutdown,
+            .reactor.on_close = loop_on_close,
+            .reactor.on_accept = loop_on_accept,
+            .server = server,
+            .srvfd = -1,
+        };
+        if (reactor_init(&loop->reactor) < 0) {
+            server->loop_count = i;
+            return -1;
+        }
+        server->loop_count = i + 1;
+        if (server->srvfd) {
+            /* the first loop uses the server's socket */
+            loop->srvfd = !i ? server->srvfd
+                          : i < server->handoff.count
+                              ? server->handoff.listeners[i]
+                              : bind_server_socket(server, 1);
+            if (loop->srvfd < 0 ||
+                reactor_add_listener(&loop->reactor, loop->srvfd,
+                                     listener_flags(server)) < 0)
+                return -1;
+#ifdef SO_INCOMING_CPU
+            /* prefer the connections arriving on the loop's CPU */
+            int cpu = thread_cpu(server, i);
+            if (cpu >= 0)
+                setsockopt(loop->srvfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                           sizeof(cpu));
+#endif
+        }
+    }
+    return 0;
+}
+
+/* run the event loops (after `server->run` was set) */
+static void run_loops(server_pt server)
+{
+    for (int i = 0; i < server->loop_count; i++) {
+        if (pthread_create(&server->loops[i].thread, NULL, loop_cycle,
+                           server->loops + i)) {
+            perror("FATAL ERROR: couldn't start an event loop thread");
+            exit(1);
+        }
+        server->loops[i].running = 1;
+        int cpu = thread_cpu(server, i);
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(server->loops[i].thread, sizeof(set),
+                                   &set);
+        }
+    }
+}
+
+/* join the event loops' threads and release their resources */
+static void stop_loops(server_pt server)
+{
+    if (!server->loops) return;
+    for (int i = 0; i < server->loop_count; i++) {
+        if (server->loops[i].running)
+            pthread_join(server->loops[i].thread, NULL);
+    }
+    for (int i = 0; i < server->loop_count; i++) {
+        /* the loop's listening socket isn't a connection */
+        if (server->loops[i].srvfd > 0) {
+            reactor_remove(&server->loops[i].reactor, server->loops[i].srvfd);
+            close(server->loops[i].srvfd);
+        }
+        reactor_stop(&server->loops[i].reactor);
+        /* keep the loop's statistics */
+        server->loop_stats.reviews += server->loops[i].reactor.stats.reviews;
+        server->loop_stats.events += server->loops[i].reactor.stats.events;
+        server->loop_stats.wait_us += server->loops[i].reactor.stats.wait_us;
+        server->loop_stats.accepted +=
+            server->loops[i].reactor.stats.accepted;
+        server->loop_stats.received +=
+            server->loops[i].reactor.stats.received;
+    }
+    free(server->loops);
+    server->loops = NULL;
+    server->loop_count = 0;
+}
+
+/* Hot reload: a newer process connects to the `handoff` Unix socket and
+ * receives the listening sockets (SCM_RIGHTS), the older process drains,
+ * passing it's idle connections to the `handoff` path (now the newer
+ * process's socket). Each message is a single byte (the message type) with
+ * up to `SERVER_HANDOFF_BATCH` file descriptors:
+ *
+ * 'A' - a newer process asks for the listening sockets.
+ * 'L' - the listening sockets (the server's socket first).
+ * 'C' - idle connections, for the default protocol.
+ */
+
+/* set by `SIGUSR1`, drains every server of the process */
+static volatile sig_atomic_t drain_signal = 0;
+/* set while the process supervises it's workers (`supervise`) */
+static volatile sig_atomic_t supervising = 0;
+/* set by `SIGINT` and `SIGTERM` while supervising */
+static volatile sig_atomic_t supervisor_stop = 0;
+
+static void on_drain_signal(int sig)
+{
+    (void)sig;
+    drain_signal = 1;
+}
+
+/* send a hot reload message.
+ * @return 0 on success, -1 on error
+ */
+static int handoff_send(int peer, char type, int *fds, int count)
+{
+    char control[CMSG_SPACE(sizeof(int) * SERVER_HANDOFF_BATCH)];
+    struct iovec iov = {.iov_base = &type, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    }
+    return sendmsg(peer, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/* receive a hot reload message, copying the file descriptors to `fds`
+ * (room for `SERVER_HANDOFF_BATCH` is required).
+ * @return the number of file descriptors (-1 == EOF or error, `errno` is
+ * `EAGAIN` while a non-blocking peer has no messages)
+ */
+static int handoff_recv(int peer, char *type, int *fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * SERVER_HANDOFF_BATCH)];
+    struct iovec iov = {.iov_base = type, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    int count = 0;
+    ssize_t got = recvmsg(peer, &msg, 0);
+    if (got != 1) {
+        if (!got)
+            errno = ECONNRESET;
+        return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n > SERVER_HANDOFF_BATCH - count)
+            n = SERVER_HANDOFF_BATCH - count;
+        memcpy(fds + count, CMSG_DATA(cmsg), sizeof(int) * n);
+        count += n;
+    }
+    return count;
+}
+
+/* connect to the `handoff` path (a blocking socket, `timeout` seconds per
+ * message).
+ * @return the socket (-1 == no server is listening)
+ */
+static int handoff_connect(server_pt server, int timeout)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct timeval tv = {.tv_sec = timeout};
+    strncpy(addr.sun_path, server->settings->handoff,
+            sizeof(addr.sun_path) - 1);
+    int peer = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (peer < 0)
+        return -1;
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(peer, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(peer);
+        return -1;
+    }
+    return peer;
+}
+
+/* adopt the listening sockets of the server listening on the `handoff`
+ * path (asking it to drain).
+ * @return the server's socket (-1 == no server, bind the port instead)
+ */
+static int handoff_adopt(server_pt server)
+{
+    int peer = handoff_connect(server, 5), count = -1;
+    char type = 0;
+    if (peer < 0)
+        return -1;
+    if (!handoff_send(peer, 'A', NULL, 0))
+        count = handoff_recv(peer, &type, server->handoff.listeners);
+    close(peer);
+    if (count <= 0 || type != 'L') {
+        while (count > 0)
+            close(server->handoff.listeners[--count]);
+        fprintf(stderr, "couldn't adopt the listening socket from %s\n",
+                server->settings->handoff);
+        return -1;
+    }
+    /* keep a listening socket per event loop */
+    while (count > 1 && count > server->settings->reactors)
+        close(server->handoff.listeners[--count]);
+    for (int i = 0; i < count; i++)
+        set_non_blocking_socket(server->handoff.listeners[i]);
+    server->handoff.count = count;
+    printf("(pid %d) Adopted %d listening socket(s) from %s\n", getpid(),
+           count, server->settings->handoff);
+    return server->handoff.listeners[0];
+}
+
+/* listen for newer processes on the `handoff` path. A temporary path is
+ * bound first, so the path is replaced (renamed) atomically.
+ */
+static void handoff_listen(server_pt server)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%d",
+                       server->settings->handoff, getpid());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || len >= (int)sizeof(addr.sun_path) ||
+        set_non_blocking_socket(fd) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0 ||
+        rename(addr.sun_path, server->settings->handoff) < 0) {
+        perror("couldn't listen for hot reloads");
+        if (fd >= 0) {
+            unlink(addr.sun_path);
+            close(fd);
+        }
+        return;
+    }
+    server->handoff.fd = fd;
+    server->handoff.owner = 1;
+}
+
+/* stop listening for newer processes (the path is removed unless a newer
+ * process took it over) */
+static void handoff_close(server_pt server)
+{
+    if (server->handoff.fd < 0)
+        return;
+    if (_reactor_(server)->priv)
+        reactor_remove(_reactor_(server), server->handoff.fd);
+    close(server->handoff.fd);
+    server->handoff.fd = -1;
+    if (server->handoff.owner)
+        unlink(server->settings->handoff);
+    server->handoff.owner = 0;
+}
+
+/* send the listening sockets to a newer process.
+ * @return 0 on success, -1 on error
+ */
+static int handoff_listeners(server_pt server, int peer)
+{
+    int fds[SERVER_HANDOFF_BATCH], count = 0;
+    if (server->srvfd > 0)
+        fds[count++] = server->srvfd;
+    for (int i = 1; count && i < server->loop_count &&
+                    count < SERVER_HANDOFF_BATCH; i++) {
+        if (server->loops[i].srvfd > 0)
+            fds[count++] = server->loops[i].srvfd;
+    }
+    return count ? handoff_send(peer, 'L', fds, count) : -1;
+}
+
+/* attach a connection passed by an older process.
+ * @return 0 on success, -1 on error (the connection should be closed)
+ */
+static int handoff_attach(server_pt server, int fd)
+{
+    if (supervising || fd >= _reactor_(server)->maxfd ||
+        set_non_blocking_socket(fd) < 0 ||
+        srv_attach(server, fd, server->settings->protocol))
+        return -1;
+    count_event(server, accepted);
+    return 0;
+}
+
+/* perform a hot reload message: a newer process asking for the listening
+ * sockets (draining this server) or a draining process passing it's idle
+ * connections.
+ * @return -1 once the peer is done (the peer's connection is closed)
+ */
+static int handoff_message(server_pt server, int peer, char type, int *fds,
+                           int count)
+{
+    if (type == 'A') {
+        if (!handoff_listeners(server, peer)) {
+            /* the newer process takes over the path */
+            server->handoff.owner = 0;
+            if (supervising)
+                drain_signal = 1;
+            else
+                srv_drain(server);
+        }
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (type != 'C' || handoff_attach(server, fds[i]))
+            close(fds[i]);
+    }
+    return 0;
+}
+
+/* a hot reload peer's messages (the peer is a non-blocking connection) */
+static void handoff_on_data(server_pt server, int peer)
+{
+    int count, fds[SERVER_HANDOFF_BATCH];
+    char type;
+    while ((count = handoff_recv(peer, &type, fds)) >= 0) {
+        if (handoff_message(server, peer, type, fds, count))
+            break;
+    }
+    if (count >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        srv_close(server, peer);
+}
+
+static struct Protocol handoff_protocol = {
+    .service = "handoff",
+    .on_data = handoff_on_data,
+};
+
+/* serve a hot reload peer until it's done, blocking (`timeout` seconds per
+ * message). Used by the supervisor, which doesn't run a reactor. */
+static void handoff_serve(server_pt server, int peer, int timeout)
+{
+    int count, fds[SERVER_HANDOFF_BATCH];
+    char type;
+    struct timeval tv = {.tv_sec = timeout};
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    while ((count = handoff_recv(peer, &type, fds)) >= 0 &&
+           !handoff_message(server, peer, type, fds, count))
+        ;
+    close(peer);
+}
+
+/* accept the hot reload peers. A serving process attaches them as
+ * (non-blocking) connections, so a slow peer never blocks a worker. A peer
+ * closes once it's messages were sent, the hangup is reported as data
+ * (`REACTOR_KEEP_OPEN`) so the messages are read before closing. */
+static void handoff_accept(server_pt server)
+{
+    int peer;
+    while (server->handoff.fd >= 0 &&
+           (peer = accept(server->handoff.fd, NULL, NULL)) >= 0) {
+        if (supervising) {
+            handoff_serve(server, peer, 1);
+            continue;
+        }
+        if (peer >= _reactor_(server)->maxfd ||
+            set_non_blocking_socket(peer) < 0 ||
+            attach_to_reactor(server, _reactor_(server), peer,
+                              &handoff_protocol, REACTOR_KEEP_OPEN))
+            close(peer);
+    }
+}
+
+/* stop accepting connections, the connections are reviewed by
+ * `drain_review` until none remain.
+ */
+static void srv_drain(server_pt server)
+{
+    time_t expected = 0;
+    if (!__atomic_compare_exchange_n(&server->draining, &expected,
+                                     time(NULL), 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_RELAXED))
+        return;
+    handoff_close(server);
+    if (server->loop_count) {
+        for (int i = 0; i < server->loop_count; i++) {
+            struct ServerLoop *loop = server->loops + i;
+            if (loop->srvfd <= 0)
+                continue;
+            reactor_remove(&loop->reactor, loop->srvfd);
+            /* the server's socket (the first loop's) is closed on stop */
+            if (i) {
+                close(loop->srvfd);
+                loop->srvfd = -1;
+            }
+        }
+    } else if (server->srvfd &&
+               server->settings->accept != SERVER_ACCEPT_THREAD) {
+        reactor_remove(_reactor_(server), server->srvfd);
+    }
+    /* the forked workers drain as well */
+    if (server->workers && getpid() == server->root_pid) {
+        for (int i = 1; i < server->settings->processes; i++)
+            kill(server->workers[i], SIGUSR1);
+    }
+    printf("(pid %d) Draining connections for port %s\n", getpid(),
+           server->settings->port);
+}
+
+/* pass the idle connections (no pending input or output) using the default
+ * protocol to the newer process, closing them when no process listens on
+ * the `handoff` path. Stops the server once no connections remain.
+ */
+static void drain_review(server_pt server)
+{
+    int count, idle = 0, peer = -1;
+    time_t draining = time(NULL) - server->draining;
+    int *fds = index_snapshot(server, NULL, 0, &count);
+    if (!fds)
+        return;
+    for (int i = 0; i < count; i++) {
+        struct ConnChunk *chunk = conn_chunk(server, fds[i]);
+        int c = _index_(fds[i]);
+        if (chunk->protocol[c] != server->settings->protocol ||
+            chunk->reading_hook[c] || !set_to_busy(server, fds[i]))
+            continue;
+        if ((chunk->input[c] &&
+             chunk->input[c]->start != chunk->input[c]->end) ||
+            !Buffer.is_empty(chunk->buffer[c])) {
+            release_busy(server, fds[i]);
+            continue;
+        }
+        fds[idle++] = fds[i];
+    }
+    if (idle && server->settings->handoff)
+        peer = handoff_connect(server, 1);
+    if (peer < 0 && draining < 2 && server->settings->handoff) {
+        /* give the newer process a moment to take over the path */
+        while (idle)
+            release_busy(server, fds[--idle]);
+    }
+    for (int i = 0; i < idle; i += SERVER_HANDOFF_BATCH) {
+        int n = idle - i < SERVER_HANDOFF_BATCH ? idle - i
+                                                : SERVER_HANDOFF_BATCH;
+        if (peer >= 0 && handoff_send(peer, 'C', fds + i, n)) {
+            close(peer);
+            peer = -1;
+        }
+        /* the connections are busy, `on_close` releases them */
+        for (int j = i; j < i + n; j++)
+            reactor_close(_fd_reactor_(server, fds[j]), fds[j]);
+    }
+    if (peer >= 0)
+        close(peer);
+    free(fds);
+    if (!srv_count(server, NULL) || draining >= SERVER_DRAIN_TIMEOUT)
+        srv_stop(server);
+}
+
+/* the supervisor's cycle (`ServerSettings.supervise`): forks the workers,
+ * restarting workers that crashed (at most once a second per worker) and
+ * forwarding signals, until all the workers exited.
+ * @return the worker's index (in the new worker), -1 once done (in the
+ * supervisor)
+ */
+static int supervise(server_pt server)
+{
+    int count = server->settings->processes, live = 0, pending, sts;
+    char stopping = 0;
+    pid_t pids[count], pid;
+    time_t started[count];
+    for (int i = 0; i < count; i++) {
+        pids[i] = 0; /* 0 == (re)start, -1 == done */
+        started[i] = 0;
+    }
+    supervising = 1;
+    if (server->settings->handoff)
+        handoff_listen(server);
+    struct pollfd pfd = {.fd = server->handoff.fd, .events = POLLIN};
+    for (;;) {
+        /* (re)start the missing workers */
+        time_t now = time(NULL);
+        pending = 0;
+        for (int i = 0; !stopping && i < count; i++) {
+            if (pids[i])
+                continue;
+            if (started[i] == now) {
+                pending++;
+                continue;
+            }
+            started[i] = now;
+            if (!(pid = fork())) {
+                supervising = 0;
+                if (server->handoff.fd >= 0)
+                    close(server->handoff.fd);
+                server->handoff.fd = -1;
+                server->handoff.owner = 0;
+                return i;
+            }
+            if (pid < 0) {
+                perror("couldn't fork a worker process");
+                pending++;
+                continue;
+            }
+            pids[i] = pid;
+            live++;
+        }
+        if (!live && !pending)
+            break;
+        if (poll(&pfd, pfd.fd >= 0, 1000) > 0)
+            handoff_accept(server);
+        /* forward the signals, the workers aren't restarted anymore */
+        if (!stopping && (supervisor_stop || drain_signal)) {
+            stopping = 1;
+            for (int i = 0; i < count; i++) {
+                if (pids[i] > 0)
+                    kill(pids[i], supervisor_stop ? SIGINT : SIGUSR1);
+            }
+        }
+        /* collect the workers that exited */
+        while ((pid = waitpid(-1, &sts, WNOHANG)) > 0) {
+            for (int i = 0; i < count; i++) {
+                if (pids[i] != pid)
+                    continue;
+                live--;
+                pids[i] = -1;
+                if (stopping || (WIFEXITED(sts) && !WEXITSTATUS(sts)))
+                    break;
+                fprintf(stderr, "(%d) worker %d (pid %d) %s %d, "
+                        "restarting\n", getpid(), i, pid,
+                        WIFSIGNALED(sts) ? "was killed by signal"
+                                         : "exited with status",
+                        WIFSIGNALED(sts) ? WTERMSIG(sts) : WEXITSTATUS(sts));
+                pids[i] = 0;
+                break;
+            }
+        }
+    }
+    supervising = 0;
+    handoff_close(server);
+    if (server->srvfd > 0)
+        close(server->srvfd);
+    printf("\n(%d) Stopped supervising port %s\n", getpid(),
+           server->settings->port);
+    return -1;
 }
 
 /* calls the reactor's core and checks for timeouts.
@@ -567,6 +2933,7 @@ static void srv_cycle_core(server_pt server)
     int delta;
     /* review reactor events */
     delta = reactor_review(_reactor_(server));
+    dispatch_flush(server);
     if (delta < 0) {
         srv_stop(server);
         return;
@@ -576,33 +2943,25 @@ static void srv_cycle_core(server_pt server)
         idle_performed = 1;
     } else
         idle_performed = 0;
-    /* timeout + local close management */
+    /* timeout management (reviews a wheel slot per second) */
     if (server->last_to != _reactor_(server)->last_tick) {
-        /* We use the delta with fuzzy logic (only after the first second) */
-        int delta = _reactor_(server)->last_tick - server->last_to;
-        for (long i = 3; i <= _reactor_(server)->maxfd; i++) {
-            if (server->protocol_map[i] && fcntl(i, F_GETFL) < 0 &&
-                errno == EBADF) {
-                reactor_close(_reactor_(server), i);
-            }
-            if (server->tout[i]) {
-                if (server->tout[i] > server->idle[i])
-                    server->idle[i] += server->idle[i] ? delta : 1;
-                else {
-                    if (server->protocol_map[i] &&
-                        server->protocol_map[i]->ping)
-                        server->protocol_map[i]->ping(server, i);
-                    else if (!server->busy[i] || server->idle[i] == 255)
-                        reactor_close(_reactor_(server), i);
-                }
-            }
-        }
+        time_t tick = server->last_to + 1;
+        /* after a long pause, reviewing each slot once is enough */
+        if (tick + SERVER_WHEEL_SIZE <= _reactor_(server)->last_tick)
+            tick = _reactor_(server)->last_tick - (SERVER_WHEEL_SIZE - 1);
+        for (; tick <= _reactor_(server)->last_tick; tick++)
+            wheel_review(server, tick);
         /* ready for next call */
         server->last_to = _reactor_(server)->last_tick;
+        /* draining (a hot reload or `SIGUSR1`) is reviewed once a second */
+        if (drain_signal)
+            srv_drain(server);
+        if (server->draining)
+            drain_review(server);
     }
     if (server->run &&
-        Async.run(server->async,
-                  (void (*)(void *)) srv_cycle_core, server)) {
+        Async.run_priority(server->async, ASYNC_PRIORITY_HIGH,
+                           (void (*)(void *)) srv_cycle_core, server)) {
         perror(
             "FATAL ERROR:"
             "couldn't schedule the server's reactor in the task queue");
@@ -628,96 +2987,173 @@ static int srv_listen(struct ServerSettings settings)
         settings.threads = 1;
     if (!settings.processes || settings.processes <= 0)
         settings.processes = 1;
-
-    /* We can use the stack for the server's core memory. */
+    if (settings.accept_batch <= 0)
+        settings.accept_batch = SERVER_ACCEPT_BATCH;
+    if (settings.pool_size <= 0)
+        settings.pool_size = SERVER_POOL_SIZE;
+    if (!settings.pool_timeout)
+        settings.pool_timeout = SERVER_POOL_TIMEOUT;
+    if (!settings.low_watermark ||
+        settings.low_watermark >= settings.high_watermark)
+        settings.low_watermark = settings.high_watermark / 2;
+    if (!settings.fiber_stack)
+        settings.fiber_stack = SERVER_FIBER_STACK;
+
+    /* the connection table grows (a chunk at a time) with the connections */
     long capacity = srv_capacity();
-    void *udata_map[capacity];
-    struct Protocol * volatile protocol_map[capacity];
-    struct Server *server_map[capacity];
-    void *buffer_map[capacity];
-    volatile char busy[capacity];
-    unsigned char tout[capacity];
-    unsigned char idle[capacity];
-    ssize_t (*reading_hooks[capacity])(server_pt srv, int fd,
-                                       void *buffer, size_t size);
+    long conn_chunks = capacity / SERVER_CONN_CHUNK + 1;
+    struct ConnChunk **conns = calloc(conn_chunks, sizeof(*conns));
+    if (!conns)
+        return -1;
 
     /* populate the Server structure with the data */
+    time_t now = time(NULL);
     struct Server srv = {
         .settings = &settings,  // store a pointer to the settings
-        .last_to = 0,           // last timeout review
+        .last_to = now,         // last timeout review
+        .wheel.tick = now,
+        .reactor.last_tick = now,
         .capacity = capacity,   // the server's capacity
-        .protocol_map = protocol_map,
-        .udata_map = udata_map,
-        .server_map = server_map,
-        .buffer_map = buffer_map,
-        .reading_hooks = reading_hooks,
-        .busy = busy,
-        .tout = tout,
-        .idle = idle,
+        .id = __atomic_add_fetch(&last_server_id, 1, __ATOMIC_RELAXED),
+        .conns = conns,
+        .conn_chunks = conn_chunks,
+        .timers.unused = -1,
+        .timers.fd = -1,
+        .handoff.fd = -1,
+        .spare_fd = -1,
+        .accept_lock = PTHREAD_RWLOCK_INITIALIZER,
+        .loops = NULL,
+        .loop_count = 0,
         .fd_task_pool = NULL,
         .fd_task_pool_size = 0,
-        .group_task_pool = NULL,
-        .group_task_pool_size = 0,
+        .read_pool = NULL,
+        .read_pool_size = 0,
         .reactor.maxfd = capacity - 1,
+        .reactor.backend = settings.backend,
+        .reactor.max_events = settings.max_events,
+        .reactor.tick = settings.tick,
+        .reactor.adaptive = settings.adaptive,
+        .reactor.busy_poll = settings.busy_poll,
+        .reactor.next_timer = srv_next_timer,
+        .reactor.has_work = srv_has_work,
         .reactor.on_data = on_data,
         .reactor.on_ready = on_ready,
         .reactor.on_shutdown = on_shutdown,
         .reactor.on_close = on_close,
+        .reactor.on_accept = on_accept,
     };
+    for (int i = 0; i < SERVER_WHEEL_SIZE; i++)
+        srv.wheel.slots[i] = -1;
+
     /* initialize the server data mutex */
-    if (pthread_mutex_init(&srv.lock, NULL))
+    if (pthread_mutex_init(&srv.lock, NULL)) {
+        free(conns);
         return -1;
+    }
 
     /* initialize the server task pool mutex */
     if (pthread_mutex_init(&srv.task_lock, NULL)) {
         pthread_mutex_destroy(&srv.lock);
+        free(conns);
         return -1;
     }
 
-    /* bind the server's socket - if relevent */
+    /* initialize the timeout wheel and user timer mutexes */
+    if (pthread_mutex_init(&srv.wheel.lock, NULL)) {
+        pthread_mutex_destroy(&srv.lock);
+        pthread_mutex_destroy(&srv.task_lock);
+        free(conns);
+        return -1;
+    }
+    if (pthread_mutex_init(&srv.timers.lock, NULL)) {
+        pthread_mutex_destroy(&srv.lock);
+        pthread_mutex_destroy(&srv.task_lock);
+        pthread_mutex_destroy(&srv.wheel.lock);
+        free(conns);
+        return -1;
+    }
+    if (pthread_mutex_init(&srv.index.lock, NULL)) {
+        pthread_mutex_destroy(&srv.lock);
+        pthread_mutex_destroy(&srv.task_lock);
+        pthread_mutex_destroy(&srv.wheel.lock);
+        pthread_mutex_destroy(&srv.timers.lock);
+        free(conns);
+        return -1;
+    }
+    if (pthread_mutex_init(&srv.pools.lock, NULL)) {
+        pthread_mutex_destroy(&srv.lock);
+        pthread_mutex_destroy(&srv.task_lock);
+        pthread_mutex_destroy(&srv.wheel.lock);
+        pthread_mutex_destroy(&srv.timers.lock);
+        pthread_mutex_destroy(&srv.index.lock);
+        free(conns);
+        return -1;
+    }
+
+    /* bind the server's socket - if relevent (adopting the listening
+     * socket of an older process, if any) */
     int srvfd = 0;
     if (settings.port > 0) {
-        srvfd = bind_server_socket(&srv);
+        srvfd = settings.handoff ? handoff_adopt(&srv) : -1;
+        if (srvfd < 0)
+            srvfd = bind_server_socket(&srv, settings.reactors > 1);
         /* if we did not get a socket, quit now. */
-        if (srvfd < 0) return -1;
+        if (srvfd < 0) {
+            free(conns);
+            return -1;
+        }
         srv.srvfd = srvfd;
-    }
-
-    for (int i = 0; i < capacity; i++) {
-        protocol_map[i] = 0;
-        server_map[i] = &srv;
-        busy[i] = 0;
-        tout[i] = 0;
-        idle[i] = 0;
-        udata_map[i] = 0;
-        buffer_map[i] = Buffer.new(&srv);
+        srv.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
     }
 
     /* register signals - do this before concurrency,
      * so that they are inherited.
      */
-    struct sigaction old_term, old_int, old_pipe, new_int, new_pipe;
+    struct sigaction old_term, old_int, old_pipe, old_usr1, new_int,
+        new_pipe, new_usr1;
     sigemptyset(&new_int.sa_mask);
     sigemptyset(&new_pipe.sa_mask);
-    new_pipe.sa_flags = new_int.sa_flags = 0;
+    sigemptyset(&new_usr1.sa_mask);
+    new_pipe.sa_flags = new_int.sa_flags = new_usr1.sa_flags = 0;
     new_pipe.sa_handler = SIG_IGN;
     new_int.sa_handler = on_signal;
+    new_usr1.sa_handler = on_drain_signal;
     sigaction(SIGINT, &new_int, &old_int);
     sigaction(SIGTERM, &new_int, &old_term);
     sigaction(SIGPIPE, &new_pipe, &old_pipe);
+    sigaction(SIGUSR1, &new_usr1, &old_usr1);
 
     /* setup concurrency */
     srv.root_pid = getpid();
     pid_t pids[settings.processes > 0 ? settings.processes : 0];
-    if (settings.processes > 1) {
+    if (settings.processes > 1 && settings.supervise) {
+        /* the root process supervises the workers */
+        if ((srv.process = supervise(&srv)) < 0)
+            goto supervised;
+    } else if (settings.processes > 1) {
+        srv.workers = pids;
         pids[0] = 0;
         for (int i = 1; i < settings.processes; i++) {
-            if (getpid() == srv.root_pid)
-                pids[i] = fork();
+            if (getpid() == srv.root_pid && !(pids[i] = fork()))
+                srv.process = i;
         }
     }
+    /* the root process listens for newer processes (hot reload) */
+    if (settings.handoff && getpid() == srv.root_pid)
+        handoff_listen(&srv);
+    /* pin the process before any thread (or connection data) exists */
+    place_process(&srv);
     /* once we forked, we can initiate a thread pool for each process */
-    srv.async = Async.create(settings.threads);
+    int pinned = thread_cpu(&srv, 0) >= 0;
+    srv.async = Async.create_with((struct AsyncSettings) {
+                                      .threads = settings.threads,
+                                      .queue = settings.task_queue,
+                                      .work_stealing =
+                                          settings.work_stealing,
+                                      .cpus = pinned ? srv.cpus : NULL,
+                                      .cpu_count = srv.cpu_count,
+                                      .low_threads = settings.low_threads,
+                                  });
     if (srv.async <= 0) {
         if (srvfd)
             close(srvfd);
@@ -741,25 +3177,65 @@ static int srv_listen(struct ServerSettings settings)
 
     /* initialize reactor */
     reactor_init(&srv.reactor);
-    /* bind server data to reactor loop */
-    if (srvfd)
-        reactor_add(&srv.reactor, srv.srvfd);
+    /* a single timerfd drives all the user timers */
+    srv.timers.fd = reactor_make_timer();
+    if (srv.timers.fd > 0 && reactor_add(&srv.reactor, srv.timers.fd) < 0) {
+        close(srv.timers.fd);
+        srv.timers.fd = -1;
+    }
+    if (srv.timers.fd < 0)
+        perror("couldn't initialize the server's timers");
+    if (srv.handoff.fd >= 0 && reactor_add(&srv.reactor, srv.handoff.fd) < 0)
+        handoff_close(&srv);
+    int loops_failed = 0;
+    if (settings.reactors > 1) {
+        /* each event loop listens to the port using it's own socket */
+        if (start_loops(&srv) < 0) {
+            perror("couldn't initialize the event loops");
+            loops_failed = 1;
+            srv_stop(&srv);
+        }
+    } else if (srvfd && settings.accept != SERVER_ACCEPT_THREAD) {
+        /* bind server data to reactor loop */
+        reactor_add_listener(&srv.reactor, srv.srvfd, listener_flags(&srv));
+    }
 
     /* call the on_init callback */
     if (settings.on_init)
         settings.on_init(&srv);
 
     /* initiate the core's cycle */
-    srv.run = 1;
-    Async.run(srv.async, (void (*)(void *)) srv_cycle_core, &srv);
+    if (!loops_failed) {
+        srv.run = 1;
+        run_loops(&srv);
+        if (srvfd && !srv.loop_count &&
+            settings.accept == SERVER_ACCEPT_THREAD) {
+            if (pthread_create(&srv.acceptor, NULL, accept_cycle, &srv)) {
+                perror("FATAL ERROR: couldn't start the acceptor thread");
+                exit(1);
+            }
+            srv.acceptor_running = 1;
+        }
+        Async.run_priority(srv.async, ASYNC_PRIORITY_HIGH,
+                           (void (*)(void *)) srv_cycle_core, &srv);
+    }
     Async.wait(srv.async);
+    /* the thread pool was destroyed */
+    srv.async = NULL;
     fprintf(stderr, "server done\n");
     /* cleanup */
+    if (srv.acceptor_running)
+        pthread_join(srv.acceptor, NULL);
+    stop_loops(&srv);
+    handoff_close(&srv);
     reactor_stop(&srv.reactor);
+    if (srv.spare_fd >= 0)
+        close(srv.spare_fd);
 
     if (settings.processes > 1 && getpid() == srv.root_pid) {
         int sts;
-        for (int i = 1; i < settings.processes; i++)
+        /* draining workers stop once their connections are done */
+        for (int i = 1; !srv.draining && i < settings.processes; i++)
             kill(pids[i], SIGINT);
         for (int i = 1; i < settings.processes; i++) {
             sts = 0;
@@ -775,100 +3251,450 @@ static int srv_listen(struct ServerSettings settings)
         fflush(NULL);
         exit(0);
     }
+supervised:
     /* restore signal state */
     sigaction(SIGINT, &old_int, NULL);
     sigaction(SIGTERM, &old_term, NULL);
     sigaction(SIGPIPE, &old_pipe, NULL);
+    sigaction(SIGUSR1, &old_usr1, NULL);
 
-    /* destroy the buffers */
-    for (int i = 0; i < srv_capacity(); i++)
-        Buffer.destroy(buffer_map[i]);
+    /* destroy the connection table (and buffers) */
+    destroy_conns(&srv);
     /* destroy the task pools */
     destroy_fd_task(&srv, NULL);
-    destroy_group_task(&srv, NULL);
+    destroy_read_buffer(&srv, NULL);
+    destroy_fibers(&srv);
+    /* destroy the outbound destinations (the connections were closed) */
+    destroy_pools(&srv);
+    /* destroy the threads' counters */
+    while (srv.counters) {
+        struct ServerCounters *counters = srv.counters;
+        srv.counters = counters->next;
+#if SERVER_LATENCY
+        while (counters->latency) {
+            struct ServiceLatency *latency = counters->latency;
+            counters->latency = latency->next;
+            free(latency);
+        }
+#endif
+        free(counters);
+    }
+    /* destroy the live connection index */
+    while (srv.index.services) {
+        struct ServiceIndex *service = srv.index.services;
+        srv.index.services = service->next;
+        free(service->name);
+        free(service->fds);
+        free(service);
+    }
+    free(srv.index.all.fds);
+    pthread_mutex_destroy(&srv.index.lock);
+
+    /* destroy the mutexes */
+    pthread_mutex_destroy(&srv.lock);
+    pthread_mutex_destroy(&srv.task_lock);
+    pthread_mutex_destroy(&srv.wheel.lock);
+    pthread_rwlock_destroy(&srv.accept_lock);
+
+    /* destroy the user timers (the timerfd was closed by the reactor) */
+    free(srv.timers.slots);
+    free(srv.timers.heap);
+    pthread_mutex_destroy(&srv.timers.lock);
+    free(srv.cpus);
+
+    return 0;
+}
+
+/* Socket actions */
+
+static int srv_attach(server_pt server, int sockfd, struct Protocol *protocol)
+{
+    return attach_to_reactor(server, _reactor_(server), sockfd, protocol, 0);
+}
+
+/* attach a connection to a specific reactor (event loop), `flags` are the
+ * `reactor_add_listener` flags (0 == a regular connection) */
+static int attach_to_reactor(server_pt server, struct Reactor *reactor,
+                             int sockfd, struct Protocol *protocol,
+                             int flags)
+{
+    if (sockfd < 0 || sockfd >= server->capacity)
+        return -1;
+    /* allocate the connection's buffer (and table chunk), if needed */
+    if (!conn_buffer(server, sockfd))
+        return -1;
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    int i = _index_(sockfd);
+    if (chunk->protocol[i])
+        on_close((struct Reactor *)server, sockfd);
+    /* a fiber of the closed connection might still hold the busy flag (it
+     * calls `on_data` for the new connection once it returns) */
+    int held = (__atomic_load_n(chunk->fiber + i, __ATOMIC_SEQ_CST) &
+                ~(uintptr_t) 1) != 0;
+    /* a read buffer might have been left by a (closed) busy connection, a
+     * fiber might still point into it (the data is discarded instead) */
+    if (chunk->input[i] && !held)
+        release_input(server, chunk, i);
+    else if (chunk->input[i])
+        chunk->input[i]->start = chunk->input[i]->end = 0;
+
+    /* setup protocol */
+    chunk->protocol[i] = protocol;
+    index_link(server, sockfd, protocol);
+    /* setup timeouts */
+    chunk->tout[i] = server->settings->timeout;
+    chunk->active[i] = _reactor_(server)->last_tick;
+
+    /* call `on_open` to register the client - start it off as
+     * busy, protocol still initializing.
+     * we don't need the mutex, because it is all fresh
+     */
+    if (!held)
+        chunk->busy[i] = 1;
+    /* attach the socket to the reactor (read buffers are filled using the
+     * data received by the reactor's backend, see `conn_recv`) */
+    chunk->reactor[i] = reactor;
+    if (protocol->read_buffer && conn_receives(server, reactor))
+        flags |= REACTOR_RECV;
+    if ((flags ? reactor_add_listener(reactor, sockfd, flags)
+               : reactor_add(reactor, sockfd)) < 0) {
+        clear_conn_data(server, sockfd);
+        return -1;
+    }
+    wheel_arm(server, sockfd);
+    if (protocol->on_open)
+        protocol->on_open(server, sockfd);
+    if (!held)
+        chunk->busy[i] = 0;
+    return 0;
+}
+
+static void srv_close(struct Server *server, int sockfd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    if (!chunk || !chunk->protocol[_index_(sockfd)]) return;
+
+    if (Buffer.is_empty(chunk->buffer[_index_(sockfd)]))
+        reactor_close(chunk->reactor[_index_(sockfd)], sockfd);
+    else
+        Buffer.close_when_done(chunk->buffer[_index_(sockfd)], sockfd);
+}
+
+static int srv_hijack(struct Server *server, int sockfd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    if (!chunk || !chunk->protocol[_index_(sockfd)]) return -1;
+    void *buffer = chunk->buffer[_index_(sockfd)];
+    reactor_remove(chunk->reactor[_index_(sockfd)], sockfd);
+    while (!Buffer.is_empty(buffer) && Buffer.flush(buffer, sockfd) >= 0)
+        /* wait */ ;
+    clear_conn_data(server, sockfd);
+    return 0;
+}
+
+static long srv_count(struct Server *server, char *service)
+{
+    pthread_mutex_lock(&server->index.lock);
+    struct ServiceIndex *index =
+        service ? index_service(server, service, 0) : &server->index.all;
+    long count = index ? index->count : 0;
+    pthread_mutex_unlock(&server->index.lock);
+    return count;
+}
+
+static void srv_touch(struct Server *server, int sockfd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    if (chunk)
+        conn_touch(server, chunk, _index_(sockfd));
+}
+
+/* Outbound connections */
+
+/* idle pooled connections: any data (or a timeout) closes the connection */
+static void pool_on_data(server_pt server, int fd) { srv_close(server, fd); }
+
+/* unlist a closed idle connection */
+static void pool_on_close(server_pt server, int fd)
+{
+    struct ServerPool *pool = conn_chunk(server, fd)->origin[_index_(fd)];
+    if (!pool) return;
+    pthread_mutex_lock(&server->pools.lock);
+    for (int i = 0; i < pool->count; i++) {
+        if (pool->idle[i] == fd) {
+            pool->idle[i] = pool->idle[--pool->count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&server->pools.lock);
+}
+
+static struct Protocol pool_protocol = {
+    .service = "pool",
+    .on_data = pool_on_data,
+    .on_close = pool_on_close,
+};
+
+/* replace a connection's protocol, as long as it's still `from` (see
+ * `set_protocol`). The server's lock is only tried: `on_close` holds it while
+ * taking the pools' lock, so waiting for it here could deadlock.
+ * @return -1 if the connection was closed (or is being closed), 1 if the
+ * server's lock is contended */
+static int pool_switch(struct Server *server, int fd, struct Protocol *from,
+                       struct Protocol *to)
+{
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    if (!chunk || chunk->protocol[_index_(fd)] != from)
+        return -1;
+    if (pthread_mutex_trylock(&server->lock))
+        return 1;
+    int ret = -1;
+    if (chunk->protocol[_index_(fd)] == from) {
+        chunk->protocol[_index_(fd)] = to;
+        index_link(server, fd, to);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&server->lock);
+    return ret;
+}
+
+/* find (or add) a destination. Must be called with the pools' lock held. */
+static struct ServerPool *pool_find(struct Server *server, const char *host,
+                                    const char *port)
+{
+    struct ServerPool *pool;
+    for (pool = server->pools.list; pool; pool = pool->next)
+        if (!strcmp(pool->host, host) && !strcmp(pool->port, port))
+            return pool;
+    size_t host_len = strlen(host) + 1, port_len = strlen(port) + 1;
+    int size = server->settings->pool_size;
+    pool = malloc(sizeof(*pool) + sizeof(int) * size + host_len + port_len);
+    if (!pool) return NULL;
+    *pool = (struct ServerPool) {.next = server->pools.list};
+    pool->host = (char *) (pool->idle + size);
+    pool->port = pool->host + host_len;
+    memcpy(pool->host, host, host_len);
+    memcpy(pool->port, port, port_len);
+    server->pools.list = pool;
+    return pool;
+}
 
-    /* destroy the mutexes */
-    pthread_mutex_destroy(&srv.lock);
-    pthread_mutex_destroy(&srv.task_lock);
+static void destroy_pools(struct Server *server)
+{
+    struct ServerPool *pool;
+    while ((pool = server->pools.list)) {
+        server->pools.list = pool->next;
+        free(pool);
+    }
+    pthread_mutex_destroy(&server->pools.lock);
+}
 
-    return 0;
+/* call `on_ready` for a connection taken from the pool */
+static void pool_ready(struct Server *server, int fd, void *arg)
+{
+    (void) arg;
+    struct Protocol *protocol = conn_protocol(server, fd);
+    if (protocol && protocol->on_ready)
+        protocol->on_ready(server, fd);
 }
 
-/* Socket actions */
+/* take an idle connection to the destination, for the new protocol.
+ * @return the connection (-1 == none). Called with the pools' lock held. */
+static int pool_take(struct Server *server, struct ServerPool *pool,
+                     struct Protocol *protocol)
+{
+    for (int i = pool->count - 1; i >= 0; i--) {
+        int fd = pool->idle[i];
+        int ret = pool_switch(server, fd, &pool_protocol, protocol);
+        /* a contended connection stays pooled, a connection that isn't
+         * pooled anymore is being closed */
+        if (ret > 0)
+            continue;
+        pool->idle[i] = pool->idle[--pool->count];
+        if (!ret)
+            return fd;
+    }
+    return -1;
+}
 
-static int srv_attach(server_pt server, int sockfd, struct Protocol *protocol)
+/* resolve the destination (the address is cached for `SERVER_DNS_TTL`).
+ * `flags` are added to the lookup's hints (`AI_NUMERICHOST` never blocks).
+ * @return 0, or the lookup's error (see `getaddrinfo`). */
+static int pool_resolve(struct Server *server, struct ServerPool *pool,
+                        struct sockaddr_storage *addr, socklen_t *addr_len,
+                        int flags)
 {
-    if (server->protocol_map[sockfd])
-        on_close((struct Reactor *)server, sockfd);
+    time_t now = _reactor_(server)->last_tick;
+    pthread_mutex_lock(&server->pools.lock);
+    if (pool->addr_len && now - pool->resolved < SERVER_DNS_TTL) {
+        memcpy(addr, &pool->addr, pool->addr_len);
+        *addr_len = pool->addr_len;
+        pthread_mutex_unlock(&server->pools.lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&server->pools.lock);
+
+    /* the lookup blocks, the lock isn't held while waiting */
+    struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                             .ai_socktype = SOCK_STREAM,
+                             .ai_flags = AI_ADDRCONFIG | flags};
+    struct addrinfo *info;
+    int error = getaddrinfo(pool->host, pool->port, &hints, &info);
+    if (error)
+        return error;
+    if (info->ai_addrlen > sizeof(*addr)) {
+        freeaddrinfo(info);
+        return EAI_FAMILY;
+    }
+    memcpy(addr, info->ai_addr, info->ai_addrlen);
+    *addr_len = info->ai_addrlen;
+    freeaddrinfo(info);
+
+    pthread_mutex_lock(&server->pools.lock);
+    memcpy(&pool->addr, addr, *addr_len);
+    pool->addr_len = *addr_len;
+    pool->resolved = now;
+    pthread_mutex_unlock(&server->pools.lock);
+    return 0;
+}
 
-    if (sockfd >= server->capacity)
+/* open a new connection to the destination's address.
+ * @return the connection's fd, or -1 on error */
+static int pool_open(struct Server *server, struct ServerPool *pool,
+                     struct sockaddr_storage *addr, socklen_t addr_len,
+                     struct Protocol *protocol)
+{
+    int fd = socket(addr->ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
         return -1;
-    /* setup protocol */
-    server->protocol_map[sockfd] = protocol;
-    /* setup timeouts */
-    server->tout[sockfd] = server->settings->timeout;
-    server->idle[sockfd] = 0;
+    /* outbound connections are mostly requests waiting for a response */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+    if (connect(fd, (struct sockaddr *) addr, addr_len) < 0 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        /* look the destination up again next time */
+        pthread_mutex_lock(&server->pools.lock);
+        pool->addr_len = 0;
+        pthread_mutex_unlock(&server->pools.lock);
+        return -1;
+    }
 
-    /* call `on_open` to register the client - start it off as
-     * busy, protocol still initializing.
-     * we don't need the mutex, because it is all fresh
-     */
-    server->busy[sockfd] = 1;
-    /* attach the socket to the reactor */
-    if (reactor_add((struct Reactor *) server, sockfd) < 0) {
-        clear_conn_data(server, sockfd);
+    /* the destination is set before the connection is attached (it might
+     * fail and close before `attach_to_reactor` returns) */
+    struct ConnChunk *chunk =
+        fd < server->capacity ? conn_chunk_new(server, fd) : NULL;
+    if (!chunk) {
+        close(fd);
         return -1;
     }
-    if (protocol->on_open)
-        protocol->on_open(server, sockfd);
-    server->busy[sockfd] = 0;
-    return 0;
+    if (chunk->protocol[_index_(fd)])
+        on_close(_reactor_(server), fd);
+    chunk->origin[_index_(fd)] = pool;
+    if (attach_to_reactor(server, _reactor_(server), fd, protocol, 0)) {
+        chunk->origin[_index_(fd)] = NULL;
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-static void srv_close(struct Server *server, int sockfd)
+/* report a connection that couldn't be opened after `srv_connect` returned
+ * `EINPROGRESS` (see `Protocol.on_connect_error`) */
+static void pool_failed(struct Server *server, struct ServerLookup *lookup,
+                        int error)
 {
-    if (!server->protocol_map[sockfd]) return;
-
-    if (Buffer.is_empty(server->buffer_map[sockfd]))
-        reactor_close((struct Reactor*)server, sockfd);
-    else
-        Buffer.close_when_done(server->buffer_map[sockfd], sockfd);
+    struct Protocol *protocol = lookup->protocol;
+    if (protocol->on_connect_error)
+        protocol->on_connect_error(server, lookup->pool->host,
+                                   lookup->pool->port, error);
+    else if (protocol->on_close)
+        protocol->on_close(server, -1);
 }
 
-static int srv_hijack(struct Server *server, int sockfd)
+/* look the destination up (blocking a low priority worker) and connect */
+static void pool_lookup(struct ServerLookup *lookup)
 {
-    if (!server->protocol_map[sockfd]) return -1;
-    reactor_remove((struct Reactor*)server, sockfd);
-    while (!Buffer.is_empty(server->buffer_map[sockfd]) &&
-            Buffer.flush(server->buffer_map[sockfd], sockfd) >= 0)
-        /* wait */ ;
-    clear_conn_data(server, sockfd);
-    return 0;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int error = pool_resolve(lookup->server, lookup->pool, &addr, &addr_len,
+                             0);
+    if (error)
+        pool_failed(lookup->server, lookup, error);
+    else if (pool_open(lookup->server, lookup->pool, &addr, addr_len,
+                       lookup->protocol) < 0)
+        pool_failed(lookup->server, lookup, EAI_SYSTEM);
+    free(lookup);
 }
 
-static long srv_count(struct Server *server, char *service)
+static int srv_connect(struct Server *server, const char *host,
+                       const char *port, struct Protocol *protocol)
 {
-    int c = 0;
-    if (service) {
-        for (int i = 0; i < server->capacity; i++) {
-            if (server->protocol_map[i] &&
-                (server->protocol_map[i]->service == service ||
-                !strcmp(server->protocol_map[i]->service, service)))
-                c++;
-        }
-    } else {
-        for (int i = 0; i < server->capacity; i++) {
-            if (server->protocol_map[i] &&
-                server->protocol_map[i]->service != timer_protocol_name)
-                c++;
-        }
+    if (!host || !port || !protocol)
+        return -1;
+    pthread_mutex_lock(&server->pools.lock);
+    struct ServerPool *pool = pool_find(server, host, port);
+    int fd = pool ? pool_take(server, pool, protocol) : -1;
+    pthread_mutex_unlock(&server->pools.lock);
+    if (!pool)
+        return -1;
+
+    if (fd >= 0) {
+        /* reuse an idle connection, it's ready as soon as it's attached */
+        set_timeout(server, fd, server->settings->timeout);
+        srv_touch(server, fd);
+        if (protocol->on_open)
+            protocol->on_open(server, fd);
+        fd_task(server, fd, pool_ready, NULL, NULL);
+        return fd;
     }
-    return c;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (!pool_resolve(server, pool, &addr, &addr_len, AI_NUMERICHOST))
+        return pool_open(server, pool, &addr, addr_len, protocol);
+
+    /* a name lookup blocks, a low priority task performs it */
+    struct ServerLookup *lookup = malloc(sizeof(*lookup));
+    if (!lookup)
+        return -1;
+    *lookup = (struct ServerLookup) {
+        .server = server, .pool = pool, .protocol = protocol};
+    if (Async.run_priority(server->async, ASYNC_PRIORITY_LOW,
+                           (void (*)(void *)) pool_lookup, lookup)) {
+        free(lookup);
+        return -1;
+    }
+    errno = EINPROGRESS;
+    return -1;
 }
 
-static void srv_touch(struct Server *server, int sockfd)
+static int srv_release(struct Server *server, int sockfd)
 {
-    server->idle[sockfd] = 0;
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    if (!chunk) return -1;
+    int i = _index_(sockfd);
+    struct ServerPool *pool = chunk->origin[i];
+    struct Protocol *protocol = chunk->protocol[i];
+    if (!pool || !protocol || protocol == &pool_protocol)
+        return -1;
+    /* a connection with unsent or unread data can't be reused */
+    if (chunk->input[i] || !Buffer.is_empty(chunk->buffer[i]))
+        goto close;
+    pthread_mutex_lock(&server->pools.lock);
+    if (pool->count >= server->settings->pool_size ||
+        pool_switch(server, sockfd, protocol, &pool_protocol)) {
+        pthread_mutex_unlock(&server->pools.lock);
+        goto close;
+    }
+    pool->idle[pool->count++] = sockfd;
+    chunk->udata[i] = NULL;
+    set_timeout(server, sockfd, server->settings->pool_timeout);
+    pthread_mutex_unlock(&server->pools.lock);
+    return 0;
+close:
+    srv_close(server, sockfd);
+    return -1;
 }
 
 /* Read and Write */
@@ -879,100 +3705,280 @@ void rw_hooks(server_pt srv, int sockfd,
               ssize_t (*writing_hook)(server_pt srv, int fd,
                                       void *data, size_t len))
 {
-    srv->reading_hooks[sockfd] = reading_hook;
-    Buffer.set_whook(srv->buffer_map[sockfd], writing_hook);
+    void *buffer = conn_buffer(srv, sockfd);
+    if (!buffer) return;
+    conn_chunk(srv, sockfd)->reading_hook[_index_(sockfd)] = reading_hook;
+    Buffer.set_whook(buffer, writing_hook);
 }
 
 static ssize_t srv_read(server_pt srv, int fd, void *buffer, size_t max_len)
 {
-    if (srv->reading_hooks[fd])  /* check for reading hook */
-        return srv->reading_hooks[fd](srv, fd, buffer, max_len);
+    struct ConnChunk *chunk = conn_chunk(srv, fd);
+    struct ReadBuffer *input = chunk ? chunk->input[_index_(fd)] : NULL;
+    /* unread data in the read buffer comes first */
+    if (input && input->start < input->end) {
+        if (max_len > input->end - input->start)
+            max_len = input->end - input->start;
+        memcpy(buffer, input->data + input->start, max_len);
+        input->start += max_len;
+        return max_len;
+    }
+    return conn_recv(srv, chunk, fd, buffer, max_len);
+}
 
-    ssize_t read = 0;
-    if ((read = recv(fd, buffer, max_len, 0)) > 0) {
-        /* reset timeout */
-        srv->idle[fd] = 0;
-        /* return data */
-        return read;
-    } else {
-        if (read && (errno & (EWOULDBLOCK | EAGAIN)))
-            return 0;
+static void *srv_peek(server_pt srv, int fd, size_t *length)
+{
+    struct ConnChunk *chunk = conn_chunk(srv, fd);
+    struct ReadBuffer *input = chunk ? chunk->input[_index_(fd)] : NULL;
+    if (!input) {
+        *length = 0;
+        return NULL;
     }
-    return -1;
+    *length = input->end - input->start;
+    return input->data + input->start;
+}
+
+static void srv_consume(server_pt srv, int fd, size_t length)
+{
+    struct ConnChunk *chunk = conn_chunk(srv, fd);
+    struct ReadBuffer *input = chunk ? chunk->input[_index_(fd)] : NULL;
+    if (!input) return;
+    if (length > input->end - input->start)
+        length = input->end - input->start;
+    input->start += length;
+}
+
+/* Write backpressure */
+
+/* @return true if queuing `length` more bytes exceeds the write limit */
+static inline int over_limit(struct Server *server, void *buffer,
+                             size_t length)
+{
+    size_t limit = server->settings->write_limit;
+    return limit && Buffer.pending(buffer) + length > limit;
+}
+
+/* review the connection's watermarks (after a write or a flush) */
+static inline void conn_watermarks(struct Server *server,
+                                   struct ConnChunk *chunk, int fd,
+                                   void *buffer)
+{
+    if (!server->settings->high_watermark)
+        return;
+    int i = _index_(fd);
+    size_t pending = Buffer.pending(buffer);
+    char state = chunk->full[i];
+    struct Protocol *protocol = chunk->protocol[i];
+    if (!state && pending >= server->settings->high_watermark) {
+        if (__atomic_compare_exchange_n(chunk->full + i, &state, 1, 0,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED) &&
+            protocol && protocol->on_full)
+            protocol->on_full(server, fd);
+    } else if (state && pending <= server->settings->low_watermark) {
+        if (__atomic_compare_exchange_n(chunk->full + i, &state, 0, 0,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED) &&
+            protocol && protocol->on_drain)
+            protocol->on_drain(server, fd);
+    }
+}
+
+static size_t srv_pending(struct Server *server, int sockfd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    void *buffer = chunk ? chunk->buffer[_index_(sockfd)] : NULL;
+    return buffer ? Buffer.pending(buffer) : 0;
+}
+
+/* Write batches */
+
+/* flush the connection's buffer, corked (`TCP_CORK`) when a file follows
+ * the batched data, so the data and the file share their segments */
+static ssize_t batch_flush(struct Server *server, struct ConnChunk *chunk,
+                           int fd)
+{
+    int i = _index_(fd), cork = chunk->batch_file[i];
+    void *buffer = chunk->buffer[i];
+    ssize_t sent;
+    chunk->batched[i] = 0;
+    chunk->batch_file[i] = 0;
+    if (!buffer || Buffer.is_empty(buffer))
+        return 0;
+    if (cork)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &(int) {1}, sizeof(int));
+    sent = Buffer.flush(buffer, fd);
+    if (cork)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &(int) {0}, sizeof(int));
+    if (sent >= 0) {
+        latency_flushed(server, fd, buffer);
+        conn_watermarks(server, chunk, fd, buffer);
+    }
+    return sent;
+}
+
+/**
+ * flush the buffer after `length` bytes were written (0 == a file), unless
+ * the connection is batching its writes, in which case the flush waits for
+ * the batch to end or for `SERVER_BATCH_LIMIT` bytes to be queued.
+ */
+static inline ssize_t conn_flush(struct Server *server, int fd, void *buffer,
+                                 size_t length)
+{
+    struct ConnChunk *chunk = conn_chunk(server, fd);
+    int i = _index_(fd);
+    if (__atomic_load_n(chunk->batch + i, __ATOMIC_SEQ_CST)) {
+        if (!length)
+            chunk->batch_file[i] = 1;
+        if ((chunk->batched[i] += length) >= SERVER_BATCH_LIMIT)
+            return batch_flush(server, chunk, fd) < 0 ? -1 : 0;
+        conn_watermarks(server, chunk, fd, buffer);
+        return 0;
+    }
+    if (Buffer.flush(buffer, fd) < 0)
+        return -1;
+    latency_flushed(server, fd, buffer);
+    conn_watermarks(server, chunk, fd, buffer);
+    return 0;
+}
+
+static int srv_begin_batch(struct Server *server, int sockfd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    if (!chunk || !chunk->protocol[_index_(sockfd)] ||
+        chunk->batch[_index_(sockfd)] == 255)
+        return -1;
+    __atomic_add_fetch(chunk->batch + _index_(sockfd), 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static int srv_end_batch(struct Server *server, int sockfd)
+{
+    struct ConnChunk *chunk = conn_chunk(server, sockfd);
+    if (!chunk || !chunk->batch[_index_(sockfd)])
+        return -1;
+    if (__atomic_sub_fetch(chunk->batch + _index_(sockfd), 1,
+                           __ATOMIC_SEQ_CST))
+        return 0;
+    return batch_flush(server, chunk, sockfd) < 0 ? -1 : 0;
 }
 
 static ssize_t srv_write(struct Server *server, int sockfd,
                          void *data, size_t len)
 {
-    /* make sure the socket is alive */
-    if (!server->protocol_map[sockfd]) return -1;
+    /* make sure the socket is alive (resets the timeout) */
+    void *buffer = conn_live_buffer(server, sockfd);
+    if (!buffer) return -1;
 
-    /* reset timeout */
-    server->idle[sockfd] = 0;
-    /* send data */
-    Buffer.write(server->buffer_map[sockfd], data, len);
-    if (Buffer.flush(server->buffer_map[sockfd], sockfd) < 0)
+    if (over_limit(server, buffer, len))
         return -1;
-    return 0;
+
+    /* send data */
+    latency_write(server, sockfd);
+    Buffer.write(buffer, data, len);
+    return conn_flush(server, sockfd, buffer, len);
 }
 
 static ssize_t srv_write_move(struct Server *server, int sockfd,
                               void *data, size_t len)
 {
-    /* make sure the socket is alive */
-    if (!server->protocol_map[sockfd])
+    /* make sure the socket is alive (resets the timeout) */
+    void *buffer = conn_live_buffer(server, sockfd);
+    if (!buffer) return -1;
+
+    if (over_limit(server, buffer, len))
         return -1;
-    /* reset timeout */
-    server->idle[sockfd] = 0;
+
     /* send data */
-    Buffer.write_move(server->buffer_map[sockfd], data, len);
-    if (Buffer.flush(server->buffer_map[sockfd], sockfd) < 0)
-        return -1;
-    return 0;
+    latency_write(server, sockfd);
+    Buffer.write_move(buffer, data, len);
+    return conn_flush(server, sockfd, buffer, len);
 }
 
 static ssize_t srv_write_urgent(struct Server *server, int sockfd,
                                 void *data, size_t len)
 {
-    /* make sure the socket is alive */
-    if (!server->protocol_map[sockfd]) return -1;
+    /* make sure the socket is alive (resets the timeout) */
+    void *buffer = conn_live_buffer(server, sockfd);
+    if (!buffer) return -1;
 
-    /* reset timeout */
-    server->idle[sockfd] = 0;
-    /* send data */
-    Buffer.write_next(server->buffer_map[sockfd], data, len);
-    if (Buffer.flush(server->buffer_map[sockfd], sockfd) < 0)
+    if (over_limit(server, buffer, len))
         return -1;
-    return 0;
+
+    /* send data */
+    latency_write(server, sockfd);
+    Buffer.write_next(buffer, data, len);
+    return conn_flush(server, sockfd, buffer, len);
 }
 
 static ssize_t srv_write_move_urgent(struct Server *server, int sockfd,
                                      void *data, size_t len)
 {
-    /* make sure the socket is alive */
-    if (!server->protocol_map[sockfd]) return -1;
+    /* make sure the socket is alive (resets the timeout) */
+    void *buffer = conn_live_buffer(server, sockfd);
+    if (!buffer) return -1;
+
+    if (over_limit(server, buffer, len))
+        return -1;
+
+    /* send data */
+    latency_write(server, sockfd);
+    Buffer.write_move_next(buffer, data, len);
+    return conn_flush(server, sockfd, buffer, len);
+}
+
+static void *srv_shared_new(void *data, size_t len)
+{
+    return Buffer.shared_new(data, len);
+}
+
+static void srv_shared_free(void *blob)
+{
+    Buffer.shared_free(blob);
+}
+
+static ssize_t srv_write_shared(struct Server *server, int sockfd,
+                                void *blob)
+{
+    /* make sure the socket is alive (resets the timeout) */
+    void *buffer = conn_live_buffer(server, sockfd);
+    if (!buffer) return -1;
+
+    if (over_limit(server, buffer, Buffer.shared_length(blob)))
+        return -1;
 
-    /* reset timeout */
-    server->idle[sockfd] = 0;
     /* send data */
-    Buffer.write_move_next(server->buffer_map[sockfd], data, len);
-    if (Buffer.flush(server->buffer_map[sockfd], sockfd) < 0)
+    latency_write(server, sockfd);
+    size_t len = Buffer.write_shared(buffer, blob);
+    if (!len)
         return -1;
-    return 0;
+    return conn_flush(server, sockfd, buffer, len);
 }
 
 static ssize_t srv_sendfile(struct Server *server, int sockfd, FILE *file)
 {
-    /* make sure the socket is alive */
-    if (!server->protocol_map[sockfd]) return -1;
+    /* make sure the socket is alive (resets the timeout) */
+    void *buffer = conn_live_buffer(server, sockfd);
+    if (!buffer) return -1;
+
+    /* send data */
+    latency_write(server, sockfd);
+    Buffer.sendfile(buffer, file);
+    return conn_flush(server, sockfd, buffer, 0);
+}
+
+static ssize_t srv_sendfd(struct Server *server, int sockfd, int file,
+                          off_t offset, size_t length)
+{
+    /* make sure the socket is alive (resets the timeout) */
+    void *buffer = conn_live_buffer(server, sockfd);
+    if (!buffer) return -1;
 
-    /* reset timeout */
-    server->idle[sockfd] = 0;
     /* send data */
-    Buffer.sendfile(server->buffer_map[sockfd], file);
-    if (Buffer.flush(server->buffer_map[sockfd], sockfd) < 0)
+    latency_write(server, sockfd);
+    if (Buffer.sendfd(buffer, file, offset, length))
         return -1;
-    return 0;
+    return conn_flush(server, sockfd, buffer, 0);
 }
 
 /* Tasks + Async */
@@ -986,7 +3992,7 @@ int perform_single_task(server_pt srv, int fd,
         /* perform the task */
         task(srv, fd, arg);
         /* release the busy flag */
-        srv->busy[fd] = 0;
+        release_busy(srv, fd);
         /* return completion flag */
         return 1;
     }
@@ -1037,14 +4043,14 @@ void destroy_fd_task(server_pt srv, struct FDTask *task)
 static void perform_fd_task(struct FDTask* task)
 {
     /* is it okay to perform the task? */
-    if (task->server->protocol_map[task->fd]) {
+    if (conn_protocol(task->server, task->fd)) {
         if (perform_single_task(task->server, task->fd,
                                 task->task, task->arg)) {
             /* free the memory */
             destroy_fd_task(task->server, task);
         } else
-            Async.run(task->server->async,
-                      (void (*)(void *)) perform_fd_task, task);
+            Async.defer(task->server->async,
+                        (void (*)(void *)) perform_fd_task, task);
     } else {
         if (task->fallback)  /* check for fallback, call if requested */
             task->fallback(task->server, task->fd, task->arg);
@@ -1053,99 +4059,34 @@ static void perform_fd_task(struct FDTask* task)
     }
 }
 
-struct GroupTask *new_group_task(server_pt srv)
+/* performs the group's task for a chunk of the connections, rescheduling
+ * the chunk for any busy connections */
+static void perform_group_chunk(struct GroupChunk *chunk)
 {
-    struct GroupTask *ret = NULL;
-    pthread_mutex_lock(&srv->task_lock);
-    if (srv->fd_task_pool) {
-        ret = srv->group_task_pool;
-        srv->group_task_pool = srv->group_task_pool->next;
-        --srv->group_task_pool_size;
-        pthread_mutex_unlock(&srv->task_lock);
-        return ret;
+    struct GroupTask *group = chunk->group;
+    int pending = chunk->start;
+    for (int i = chunk->start; i < chunk->end; i++) {
+        int fd = group->fds[i];
+        /* closed connections are skipped, busy connections are retried */
+        if (conn_protocol(group->server, fd) &&
+            !perform_single_task(group->server, fd, group->task, group->arg))
+            group->fds[pending++] = fd;
     }
-    pthread_mutex_unlock(&srv->task_lock);
-    ret = malloc(sizeof(*ret) + (srv_capacity() >> 3) + 1);
-    memset(ret, 0, sizeof(*ret) + (srv_capacity() >> 3) + 1);
-    return ret;
-}
-
-void destroy_group_task(server_pt srv, struct GroupTask *task)
-{
-    if (task == NULL) {
-        pthread_mutex_lock(&srv->task_lock);
-        struct FDTask *tmp;
-        srv->group_task_pool_size = 0;
-        while ((tmp = srv->fd_task_pool)) {
-            srv->fd_task_pool = srv->fd_task_pool->next;
-            free(tmp);
-        }
-        pthread_mutex_unlock(&srv->task_lock);
+    if (pending > chunk->start) {
+        chunk->end = pending;
+        Async.run_priority(group->server->async, ASYNC_PRIORITY_LOW,
+                           (void (*)(void *)) &perform_group_chunk, chunk);
         return;
     }
-    pthread_mutex_lock(&srv->task_lock);
-    if (srv->group_task_pool_size >= 64) {
-        free(task);
-        pthread_mutex_unlock(&srv->task_lock);
+    /* the last chunk to finish performs `on_finished` */
+    if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL))
         return;
+    if (group->on_finished) {
+        if (fd_task(group->server, group->fd_origin,
+                    group->on_finished, group->arg, group->on_finished))
+            group->on_finished(group->server, group->fd_origin, group->arg);
     }
-    task->next = srv->group_task_pool;
-    srv->group_task_pool = task;
-    ++srv->group_task_pool_size;
-    pthread_mutex_unlock(&srv->task_lock);
-}
-
-static void perform_group_task(struct GroupTask *task)
-{
-    /* the maximum number of bytes to review (each bit == 1 fd) */
-    long fds = (srv_capacity() >> 3) + 1;
-    /* flag for pending tasks */
-    int pending = 0;
-    unsigned int bit;
-    int fd_target;
-    while (fds) {
-        /* the byte contains at least one bit marker for a task related fd */
-        if (task->fds[fds]) {
-            bit = 0;
-            while (bit < 8) {
-                fd_target = bit + (fds << 3);
-                /* is it okay to perform the task? */
-                if (task->fds[fds] & (1 << bit)) {
-                    if (task->server->protocol_map[fd_target]) {
-                        if (perform_single_task(task->server, fd_target,
-                                                task->task, task->arg)) {
-                            task->fds[fds] &= ~(1 << bit);
-                            goto rescedule;
-                        }
-                        pending = 1;
-                    } else  /* closed connection,
-                               ignore it and clear its flag. */
-                        task->fds[fds] &= ~(1 << bit);
-                }
-                bit++;
-            }
-        }
-        fds--;
-    }
-    if (pending)
-        goto rescedule;
-    if (task->on_finished) {
-        if (fd_task(task->server, task->fd_origin,
-                    task->on_finished, task->arg, task->on_finished))
-            task->on_finished(task->server, task->fd_origin, task->arg);
-    }
-    destroy_group_task(task->server, task);
-    return;
-rescedule:
-    Async.run(task->server->async,
-              (void (*)(void *)) &perform_group_task, task);
-    return;
-}
-
-void add_to_group_task(struct Server *server, int fd, void *arg)
-{
-    struct GroupTask *task = arg;
-    task->fds[fd >> 3] |= (1 << (fd & 7));
+    free(group);
 }
 
 static int each(struct Server *server, char *service,
@@ -1154,17 +4095,40 @@ static int each(struct Server *server, char *service,
                 void (*on_finish)(struct Server *server,
                                   int fd, void *arg))
 {
-    struct GroupTask *gtask = new_group_task(server);
-    if (!gtask || !task) return -1;
-
+    if (!task) return -1;
+    int threads = server->settings->threads, count, chunks;
+    size_t head = sizeof(struct GroupTask) +
+                  threads * sizeof(struct GroupChunk);
+    struct GroupTask *gtask = index_snapshot(server, service, head, &count);
+    if (!gtask) return -1;
+
+    /* a chunk per worker, unless there are only a few connections */
+    chunks = (count + SERVER_EACH_BATCH - 1) / SERVER_EACH_BATCH;
+    if (chunks > threads)
+        chunks = threads;
+    if (!chunks)
+        chunks = 1;
+    gtask->fds = (int *)((char *)gtask + head);
     gtask->arg = arg;
     gtask->task = task;
     gtask->server = server;
+    gtask->fd_origin = 0;
     gtask->on_finished = on_finish;
-    int ret = each_block(server, service, add_to_group_task, gtask);
-    Async.run(server->async,
-              (void (*)(void *)) &perform_group_task, gtask);
-    return ret;
+    gtask->pending = chunks;
+    for (int i = 0; i < chunks; i++)
+        gtask->chunks[i] = (struct GroupChunk) {
+            .group = gtask,
+            .start = (long) count * i / chunks,
+            .end = (long) count * (i + 1) / chunks,
+        };
+    /* the task isn't released until all the chunks were performed */
+    for (int i = 0; i < chunks; i++) {
+        if (Async.run_priority(server->async, ASYNC_PRIORITY_LOW,
+                               (void (*)(void *)) &perform_group_chunk,
+                               gtask->chunks + i))
+            perform_group_chunk(gtask->chunks + i);
+    }
+    return count;
 }
 
 static int each_block(struct Server *server, char *service,
@@ -1172,26 +4136,17 @@ static int each_block(struct Server *server, char *service,
                                    int fd, void *arg),
                       void *arg)
 {
-    int c = 0;
-    if (service) {
-        for (int i = 0; i < server->capacity; i++) {
-            if (server->protocol_map[i] &&
-                server->protocol_map[i]->service &&
-                (server->protocol_map[i]->service == service ||
-                !strcmp(server->protocol_map[i]->service, service))) {
-                task(server, i, arg);
-                ++c;
-            }
-        }
-    } else {
-        for (int i = 0; i < server->capacity; i++) {
-            if (server->protocol_map[i] &&
-                server->protocol_map[i]->service != timer_protocol_name) {
-                task(server, i, arg);
-                ++c;
-            }
+    int c = 0, count;
+    /* a snapshot, since tasks might close (or open) connections */
+    int *fds = index_snapshot(server, service, 0, &count);
+    if (!fds) return -1;
+    for (int i = 0; i < count; i++) {
+        if (conn_protocol(server, fds[i])) {
+            task(server, fds[i], arg);
+            ++c;
         }
     }
+    free(fds);
     return c;
 }
 
@@ -1202,12 +4157,12 @@ static int fd_task(struct Server *server, int sockfd,
                    void (*fallback)(struct Server *server,
                                     int fd, void *arg))
 {
-    if (server->protocol_map[sockfd]) {
+    if (conn_protocol(server, sockfd)) {
         struct FDTask *msg = new_fd_task(server);
         if (!msg) return -1;
 
         *msg = (struct FDTask) {
-            .server = server,
+            .server = server, .fd = sockfd,
             .task = task, .arg = arg,
             .fallback = fallback
         };
@@ -1223,37 +4178,245 @@ static int run_async(struct Server *self, void task(void *), void *arg)
     return Async.run(self->async, task, arg);
 }
 
+static int run_async_priority(struct Server *self,
+                              enum AsyncPriority priority,
+                              void task(void *), void *arg)
+{
+    return Async.run_priority(self->async, priority, task, arg);
+}
+
 static int run_after(struct Server *self, long milliseconds,
                      void task(void *), void *arg)
 {
     return run_every(self, milliseconds, 1, task, arg);
 }
 
+/* User timers */
+
+/* the main reactor doesn't wait for events while tasks are waiting, since
+ * the reactor's cycle is performed ahead of the other tasks */
+static int srv_has_work(struct Reactor *reactor)
+{
+    return Async.pending(_server_(reactor)->async);
+}
+
+/* the reactor's `next_timer` callback (adaptive mode): the milliseconds
+ * until the earliest user timer or the next timeout review */
+static long srv_next_timer(struct Reactor *reactor)
+{
+    server_pt server = _server_(reactor);
+    long next = -1;
+    if (server->wheel.armed) {
+        /* the timeouts are reviewed once the (wall clock) second changes */
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        next = 1000 - now.tv_nsec / 1000000;
+    }
+    pthread_mutex_lock(&server->timers.lock);
+    if (server->timers.count) {
+        uint64_t due = server->timers.slots[server->timers.heap[0]].due,
+                 now = monotonic_ns();
+        long wait = due > now ? (long)((due - now + 999999) / 1000000) : 0;
+        if (next < 0 || wait < next)
+            next = wait;
+    }
+    pthread_mutex_unlock(&server->timers.lock);
+    return next;
+}
+
+#define _timer_(server, pos) \
+    ((server)->timers.slots + (server)->timers.heap[(pos)])
+
+/* swap two heap positions */
+static inline void timer_swap(struct Server *server, int a, int b)
+{
+    int tmp = server->timers.heap[a];
+    server->timers.heap[a] = server->timers.heap[b];
+    server->timers.heap[b] = tmp;
+    _timer_(server, a)->pos = a;
+    _timer_(server, b)->pos = b;
+}
+
+/* restore the heap order for a timer that might be due earlier */
+static void timer_sift_up(struct Server *server, int pos)
+{
+    while (pos && _timer_(server, (pos - 1) >> 1)->due >
+                  _timer_(server, pos)->due) {
+        timer_swap(server, pos, (pos - 1) >> 1);
+        pos = (pos - 1) >> 1;
+    }
+}
+
+/* restore the heap order for a timer that might be due later */
+static void timer_sift_down(struct Server *server, int pos)
+{
+    int child;
+    while ((child = (pos << 1) + 1) < server->timers.count) {
+        if (child + 1 < server->timers.count &&
+            _timer_(server, child + 1)->due < _timer_(server, child)->due)
+            child++;
+        if (_timer_(server, pos)->due <= _timer_(server, child)->due)
+            break;
+        timer_swap(server, pos, child);
+        pos = child;
+    }
+}
+
+/* remove a timer from the heap, releasing it's slot
+ * (the timers' lock must be held) */
+static void timer_release(struct Server *server, int slot)
+{
+    struct ServerTimer *timer = server->timers.slots + slot;
+    int pos = timer->pos;
+    if (--server->timers.count != pos) {
+        timer_swap(server, pos, server->timers.count);
+        timer_sift_down(server, pos);
+        timer_sift_up(server, pos);
+    }
+    timer->pos = -1;
+    timer->generation++;
+    timer->next_free = server->timers.unused;
+    server->timers.unused = slot;
+}
+
+/* arm the timerfd for the earliest timer (the timers' lock must be held) */
+static void timers_arm(struct Server *server)
+{
+    struct itimerspec due = {{0, 0}, {0, 0}};
+    if (server->timers.count) {
+        uint64_t ns = _timer_(server, 0)->due;
+        due.it_value.tv_sec = ns / 1000000000;
+        due.it_value.tv_nsec = ns % 1000000000;
+    }
+    timerfd_settime(server->timers.fd, TFD_TIMER_ABSTIME, &due, NULL);
+}
+
+/* perform the timers that are due (scheduled by the timerfd's `on_data`) */
+static void review_timers(struct Server *server)
+{
+    void (*task)(void *);
+    void *arg;
+    /* only timers that are due by now are performed (repeating timers are
+     * rescheduled for a later time) */
+    uint64_t now = monotonic_ns();
+    /* clear the timerfd's expiration count */
+    reactor_reset_timer(server->timers.fd);
+    while (1) {
+        pthread_mutex_lock(&server->timers.lock);
+        if (!server->timers.count || _timer_(server, 0)->due > now)
+            break;
+        struct ServerTimer *timer = _timer_(server, 0);
+        task = timer->task;
+        arg = timer->arg;
+        if (timer->repeat == 0) {
+            timer_release(server, server->timers.heap[0]);
+        } else {
+            if (timer->repeat > 0)
+                timer->repeat--;
+            /* keep the timer's cadence, unless it fell behind */
+            timer->due += timer->interval;
+            if (timer->due <= now)
+                timer->due = now + timer->interval;
+            timer_sift_down(server, 0);
+        }
+        pthread_mutex_unlock(&server->timers.lock);
+        /* perform the task */
+        if (task) task(arg);
+    }
+    timers_arm(server);
+    pthread_mutex_unlock(&server->timers.lock);
+}
+
+static int run_after_us(struct Server *self, long microseconds,
+                        void task(void *), void *arg)
+{
+    return run_every_us(self, microseconds, 1, task, arg);
+}
+
 static int run_every(struct Server *self, long milliseconds,
                      int repetitions,
                      void task(void *), void *arg)
 {
-    int tfd = reactor_make_timer();
-    if (tfd <= 0) return -1;
+    if (milliseconds > LONG_MAX / 1000)
+        return -1;
+    return run_every_us(self, milliseconds * 1000, repetitions, task, arg);
+}
 
-    struct Protocol *timer_protocol =
-        (struct Protocol *) TimerProtocol(task, arg, repetitions);
-    if (srv_attach(self, tfd, timer_protocol)) {
-        free(timer_protocol);
+static int run_every_us(struct Server *self, long microseconds,
+                        int repetitions, void task(void *), void *arg)
+{
+    /* a repeating timer without an interval would always be due */
+    if (self->timers.fd < 0 || microseconds < 0 ||
+        (!microseconds && repetitions != 1))
         return -1;
+
+    pthread_mutex_lock(&self->timers.lock);
+    int slot = self->timers.unused;
+    if (slot < 0) {
+        /* grow the timer slots and the heap */
+        int capacity = self->timers.capacity ? self->timers.capacity << 1 : 64;
+        if (capacity >= (1 << SERVER_TIMER_SLOT_BITS))
+            capacity = (1 << SERVER_TIMER_SLOT_BITS) - 1;
+        if (capacity <= self->timers.capacity)
+            goto error;
+        struct ServerTimer *slots =
+            realloc(self->timers.slots, capacity * sizeof(*slots));
+        if (!slots) goto error;
+        self->timers.slots = slots;
+        int *heap = realloc(self->timers.heap, capacity * sizeof(*heap));
+        if (!heap) goto error;
+        self->timers.heap = heap;
+        for (int i = capacity - 1; i >= self->timers.capacity; i--) {
+            slots[i] = (struct ServerTimer) {
+                .pos = -1, .next_free = self->timers.unused,
+            };
+            self->timers.unused = i;
+        }
+        self->timers.capacity = capacity;
+        slot = self->timers.unused;
     }
-    /* remove the default timeout (timers shouldn't timeout) */
-    self->tout[tfd] = 0;
+    struct ServerTimer *timer = self->timers.slots + slot;
+    self->timers.unused = timer->next_free;
+    timer->interval = (uint64_t) microseconds * 1000;
+    timer->due = monotonic_ns() + timer->interval;
+    timer->task = task;
+    timer->arg = arg;
+    timer->repeat = repetitions - 1;
+    timer->pos = self->timers.count;
+    self->timers.heap[self->timers.count++] = slot;
+    timer_sift_up(self, timer->pos);
+    /* re-arm the timerfd when this is the earliest timer */
+    if (timer->pos == 0)
+        timers_arm(self);
+    int handle = ((timer->generation &
+                   ((1U << (31 - SERVER_TIMER_SLOT_BITS)) - 1))
+                  << SERVER_TIMER_SLOT_BITS) | (slot + 1);
+    pthread_mutex_unlock(&self->timers.lock);
+    return handle;
+error:
+    pthread_mutex_unlock(&self->timers.lock);
+    return -1;
+}
 
-    /* `srv_attach` connected the fd as a regular socket -
-     * remove it and reconnect as a timer
-     */
-    reactor_remove((struct Reactor *) self, tfd);
-    if (reactor_add_timer((struct Reactor *) self, tfd, milliseconds) < 0) {
-        reactor_close((struct Reactor*)self, tfd);
-        return -1;
-    };
-    return 0;
+static int cancel_timer(struct Server *self, int timer)
+{
+    int slot = (timer & ((1 << SERVER_TIMER_SLOT_BITS) - 1)) - 1;
+    unsigned generation = (unsigned) timer >> SERVER_TIMER_SLOT_BITS;
+    int ret = -1;
+    if (timer <= 0) return -1;
+    pthread_mutex_lock(&self->timers.lock);
+    if (slot < self->timers.capacity &&
+        self->timers.slots[slot].pos >= 0 &&
+        (self->timers.slots[slot].generation &
+         ((1U << (31 - SERVER_TIMER_SLOT_BITS)) - 1)) == generation) {
+        int was_first = self->timers.slots[slot].pos == 0;
+        timer_release(self, slot);
+        if (was_first)
+            timers_arm(self);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&self->timers.lock);
+    return ret;
 }
 
 /*
@@ -1327,6 +4490,10 @@ static void srv_stop_all(void)
 /* handles signals */
 static void on_signal(int sig)
 {
+    if (supervising) {
+        supervisor_stop = 1;
+        return;
+    }
     if (!global_servers_set) {
         signal(sig, SIG_DFL);
         raise(sig);
@@ -1350,7 +4517,7 @@ static inline int set_non_blocking_socket(int fd)
 #endif
 }
 
-static int bind_server_socket(struct Server *self)
+static int bind_server_socket(struct Server *self, int reuse_port)
 {
     int srvfd;
     /* setup the address */
@@ -1387,6 +4554,17 @@ static int bind_server_socket(struct Server *self)
         int optval = 1;
         setsockopt(srvfd, SOL_SOCKET, SO_REUSEADDR,
                    &optval, sizeof(optval));
+#ifdef SO_REUSEPORT
+        /* allow each event loop to bind it's own listening socket */
+        if (reuse_port &&
+            setsockopt(srvfd, SOL_SOCKET, SO_REUSEPORT,
+                       &optval, sizeof(optval)) < 0) {
+            perror("couldn't set SO_REUSEPORT");
+            freeaddrinfo(servinfo);
+            close(srvfd);
+            return -1;
+        }
+#endif
     }
     /* bind the address to the socket */
     {
@@ -1438,31 +4616,8 @@ static long srv_capacity(void)
     if (flim < rlim.rlim_cur)
         flim = rlim.rlim_cur;
 
-    // review stack memory limits
-    // use 1 byte (char) for busy_map;
-    // use 1 byte (char) for idle_map;
-    // use 1 byte (char) for tout_map;
-    // use 8 byte (void *) for protocol_map;
-    // use 8 byte (void *) for server_map;
-    // ------
-    // total of 19 (assume 20) bytes per connection.
-    //
-    // assume a 2Kb stack allocation (per connection) for
-    // network IO buffer and request management...?
-    // (this would be almost wrong to assume, as buffer might be larger)
-    // -------
-    // 2068 Byte
-    // round up to page size?
-    // 4096
-    getrlimit(RLIMIT_STACK, &rlim);
-    if (flim * 4096 > rlim.rlim_cur && flim * 4096 < rlim.rlim_max) {
-        rlim.rlim_cur = flim * 4096;
-        setrlimit(RLIMIT_STACK, &rlim);
-        getrlimit(RLIMIT_STACK, &rlim);
-    }
-    if (flim > rlim.rlim_cur / 4096) {
-        flim = rlim.rlim_cur / 4096;
-    }
+    // the per-connection data is allocated on the heap as connections are
+    // attached (see `struct ConnChunk`), the stack limits don't matter.
 
     // how many Kb per connection? assume 8Kb for kernel? x2 (16Kb).
     // http://www.metabrew.com/article/a-million-user-comet-application-with-mochiweb-part-3
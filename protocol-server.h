@@ -53,6 +53,106 @@ struct Protocol {
     void (*ping)(struct Server *,
                  int sockfd); /**< called when the connection's timeout
                                    was reached */
+    /**
+     * called (once) when the data waiting to be sent reaches the
+     * `high_watermark` (see `ServerSettings`), so producers can pause.
+     * Called by the writing thread, right after the write.
+     */
+    void (*on_full)(struct Server *, int sockfd);
+    /**
+     * called once the data waiting to be sent falls to the `low_watermark`,
+     * after `on_full` was called, so producers can resume.
+     */
+    void (*on_drain)(struct Server *, int sockfd);
+    /**
+     * called when an outbound connection couldn't be opened after
+     * `Server.connect` returned -1 with `errno` set to `EINPROGRESS` (the
+     * destination had to be looked up). `error` is the lookup's error (see
+     * `gai_strerror`), or `EAI_SYSTEM` (with `errno` set) if the connection
+     * couldn't be opened. Protocols without it get `on_close` with a -1 fd.
+     */
+    void (*on_connect_error)(struct Server *, const char *host,
+                             const char *port, int error);
+    /**
+     * When set, `on_data` is called directly on the reactor's thread
+     * instead of being forwarded to the thread-pool. This is faster for
+     * short callbacks that never block, but a blocking callback will block
+     * the reactor (and every other connection). The connection's busy flag
+     * is still respected - a busy connection is forwarded to the
+     * thread-pool as usual.
+     */
+    unsigned char inline_on_data;
+    /**
+     * When set, the server reads the incoming data into a per-connection
+     * read buffer (until the socket is drained or the buffer is full)
+     * before calling `on_data`. `on_data` should use `Server.peek` and
+     * `Server.consume` to parse the data in place. Unconsumed data is kept
+     * for the next `on_data` call, a connection without unread data doesn't
+     * hold a read buffer.
+     *
+     * `on_data` is only called when there's unread data. A full buffer
+     * that isn't consumed stops the connection from reading.
+     */
+    unsigned char read_buffer;
+    /**
+     * When set, `on_data` runs on a fiber (a coroutine with it's own stack,
+     * see `ServerSettings.fiber_stack`), so it can suspend itself using
+     * `Server.await`, waiting for another file descriptor (i.e. an upstream
+     * connection) or a timer without blocking a worker thread. The
+     * connection stays busy while suspended, events arriving meanwhile call
+     * `on_data` again once the handler returns.
+     *
+     * The stack is small (64KB by default) and overflowing it crashes the
+     * process (a guard page), handlers using large buffers or deep
+     * recursion should allocate their buffers or set a larger stack.
+     *
+     * A suspended handler might resume on a different worker thread.
+     */
+    unsigned char fiber;
+};
+
+/** The strategies for accepting new connections (`ServerSettings.accept`) */
+enum ServerAccept {
+    /**
+     * the default: accepting is a (high priority) thread-pool task (a task
+     * per batch of connections).
+     */
+    SERVER_ACCEPT_POOL = 0,
+    /**
+     * accept on the reactor's thread, during the reactor's review. Any
+     * connections beyond the batch are accepted by the following review.
+     */
+    SERVER_ACCEPT_REACTOR,
+    /** a dedicated acceptor thread blocks on the listening socket */
+    SERVER_ACCEPT_THREAD,
+};
+
+/** Thread and process placement (`ServerSettings.affinity`) */
+enum ServerAffinity {
+    /** the default: threads and processes aren't pinned */
+    SERVER_AFFINITY_NONE = 0,
+    /**
+     * each process is restricted to a share of the CPUs: a NUMA node per
+     * process (round robin) when the machine has a number of nodes,
+     * otherwise an equal slice of the CPUs. Memory is allocated on first
+     * touch, so the connection table and packet pools of each process stay
+     * local to it's node.
+     */
+    SERVER_AFFINITY_PROCESS,
+    /**
+     * as above, and each worker thread (and event loop) is pinned to a
+     * single CPU of the process's share. Each event loop's listening socket
+     * prefers connections that arrive on it's CPU (`SO_INCOMING_CPU`), so
+     * the NIC's RSS queues line up with the loops serving them (when the
+     * queues' IRQs are spread over the same CPUs).
+     */
+    SERVER_AFFINITY_THREAD,
+};
+
+/** The events a suspended handler waits for (see `Server.await`) */
+enum ServerAwait {
+    SERVER_AWAIT_READ = 1,
+    SERVER_AWAIT_WRITE = 2,
 };
 
 /**
@@ -87,9 +187,21 @@ struct ServerSettings {
      */
     void (*on_init_thread)(struct Server *server);
 
+    /**
+     * called for each connection accepted while the server is at capacity
+     * (or once the process runs out of file descriptors), just before it's
+     * closed. `fd` is non-blocking and isn't attached to
+     * the server (`Server.write` and friends can't be used), but a short
+     * message can be sent using `send(fd, ..., MSG_DONTWAIT)`.
+     *
+     * Default to NULL - sending `busy_msg` (if set) and disconnecting.
+     */
+    void (*on_busy)(struct Server *server, int fd);
+
     char *busy_msg; /**< C-style string indicating the server is busy.
                          default to NULL, which means simple disconnection
-                         without messages */
+                         without messages. The message is sent without
+                         blocking (and might be cut short). */
     void *udata; /**< opaque user data */
 
     /**
@@ -100,16 +212,249 @@ struct ServerSettings {
      */
     int threads;
 
+    /**
+     * Set the thread-pool's task queue implementation (see `async.h`).
+     * Default to ASYNC_QUEUE_MUTEX.
+     */
+    enum AsyncQueueType task_queue;
+
+    /**
+     * Enable the thread-pool's work stealing scheduler, so follow-up tasks
+     * (i.e. a rescheduled `on_data`) stay on the scheduling worker.
+     * Default to 0 (disabled).
+     */
+    unsigned char work_stealing;
+
+    /**
+     * The most worker threads performing low priority tasks (`Server.each`
+     * and `ASYNC_PRIORITY_LOW` tasks) at the same time. Defaults to all the
+     * threads but one.
+     */
+    int low_threads;
+
     /**
      * Set the amount of processes to be used (processes will be forked).
      * Default to 1 working processes (no forking).
      */
     int processes;
 
+    /**
+     * Set the amount of event loops (reactors) per process.
+     *
+     * Default to 1 - a single reactor is reviewed by the thread-pool and
+     * every event is forwarded to a worker thread.
+     *
+     * When set to more than 1, each event loop runs on it's own thread
+     * (in addition to the thread-pool), with it's own reactor instance and
+     * it's own `SO_REUSEPORT` listening socket. Connections stay on the loop
+     * that accepted them and their `on_data` callback is performed on the
+     * loop's thread (shared-nothing design), so callbacks should avoid
+     * blocking. Timers and attached sockets use the main reactor.
+     */
+    int reactors;
+
+    /**
+     * Thread and process placement (see `enum ServerAffinity`). Default to
+     * `SERVER_AFFINITY_NONE`.
+     */
+    enum ServerAffinity affinity;
+
+    /**
+     * The CPUs used by the server when `affinity` is set, as a list of
+     * CPUs and ranges (i.e. "0-3,8-11"). Default to NULL - the CPUs the
+     * process is allowed to run on.
+     */
+    char *cpus;
+
+    /**
+     * Hot reload: the path of a Unix socket, used to hand the listening
+     * socket (and the idle connections) over to a newer process. Default to
+     * NULL (disabled).
+     *
+     * A server starting while another server listens on the path adopts
+     * the other server's listening sockets (`SCM_RIGHTS`) instead of
+     * binding the port, takes over the path and asks the other server to
+     * drain: the old server stops accepting, finishes the pending requests
+     * and writes, and passes each idle connection using the default
+     * protocol over to the new server (where it's attached using the
+     * default protocol, `on_open` is called). The old server's connection
+     * data isn't passed along (`on_close` is called by the old server),
+     * connections using other protocols are closed when draining is done.
+     * The old server stops once no connections remain, or after
+     * `SERVER_DRAIN_TIMEOUT` seconds.
+     *
+     * `SIGUSR1` drains the server without a handoff (idle connections are
+     * closed). The `reactors` setting should match the old server's.
+     */
+    char *handoff;
+
+    /**
+     * Supervise the worker processes (when `processes` > 1): the root
+     * process forks every worker and doesn't serve connections, restarting
+     * workers that crash (exit because of a signal or with a non-zero exit
+     * status) and forwarding `SIGINT`, `SIGTERM` and `SIGUSR1` to the
+     * workers. Adopting connections (see `handoff`) isn't supported by
+     * supervised servers, idle connections handed over to a supervised
+     * server are closed. Default to 0 (the root process is a worker and
+     * the workers are only waited for once the server stops).
+     */
+    unsigned char supervise;
+
+    /**
+     * The event backend used by the reactors (see `enum ReactorBackend`).
+     *
+     * Default to epoll. `REACTOR_BACKEND_IO_URING` falls back to epoll
+     * when io_uring isn't available.
+     */
+    enum ReactorBackend backend;
+
+    /**
+     * The number of events each reactor handles per review. Defaults to
+     * `REACTOR_MAX_EVENTS`.
+     */
+    int max_events;
+
+    /**
+     * The longest time (in milliseconds) a reactor waits for events.
+     * Defaults to `REACTOR_TICK`. Timeouts are reviewed once per tick, so
+     * the tick shouldn't exceed a second.
+     */
+    int tick;
+
+    /**
+     * Adaptive reactors: grow the number of events handled per review while
+     * the reviews return full batches (shrinking it once traffic calms
+     * down), and wake for pending timers and timeout reviews.
+     */
+    unsigned char adaptive;
+
+    /**
+     * The time (in microseconds) each reactor busy-polls (reviews without
+     * blocking) before waiting for events. Defaults to 0 (disabled).
+     */
+    int busy_poll;
+
+    /**
+     * How new connections are accepted (see `enum ServerAccept`). Ignored
+     * in multi-reactor mode, where each event loop accepts the connections
+     * of it's own listening socket.
+     */
+    enum ServerAccept accept;
+
+    /**
+     * The maximum number of connections accepted per wakeup (or per task),
+     * keeping connection storms from starving the existing connections.
+     * Defaults to `SERVER_ACCEPT_BATCH`.
+     */
+    int accept_batch;
+
+    /**
+     * Write backpressure: once a connection's unsent data reaches the high
+     * watermark (in bytes), `Protocol.on_full` is called, and once it falls
+     * back to the low watermark `Protocol.on_drain` is called. Default to 0
+     * (disabled), the low watermark defaults to half the high watermark.
+     */
+    size_t high_watermark;
+    size_t low_watermark;
+
+    /**
+     * The most unsent data (in bytes) a connection may hold: writes that
+     * would exceed it fail (returning -1, the data isn't queued). Files
+     * aren't counted until they are read. Default to 0 (unlimited).
+     */
+    size_t write_limit;
+
+    /**
+     * The most idle outbound connections kept per destination (see
+     * `Server.release`). Defaults to 16.
+     */
+    int pool_size;
+
+    /**
+     * The timeout (in seconds) of idle outbound connections, replacing
+     * `timeout` while a connection is pooled. Defaults to 30 seconds.
+     */
+    unsigned char pool_timeout;
+
+    /**
+     * The stack size (in bytes) of the fibers running `Protocol.fiber`
+     * handlers, rounded up to whole pages. Defaults to `SERVER_FIBER_STACK`
+     * (64KB).
+     */
+    size_t fiber_stack;
+
     unsigned char timeout; /**< set the timeout for new connections.
 			        Default to 5 seconds. */
 };
 
+/**
+ * A snapshot of a server's statistics (see `Server.stats`).
+ *
+ * The counters are kept per thread and summed up when read, so the values
+ * are only approximately consistent with each other.
+ */
+struct ServerStats {
+    /* connections */
+    long connections;       /**< the number of open connections */
+    size_t accepted;        /**< connections accepted */
+    size_t rejected;        /**< connections rejected (server at capacity,
+                                 or out of file descriptors) */
+    size_t closed;          /**< connections closed */
+    size_t timeouts;        /**< connections closed by a timeout */
+    size_t busy_contention; /**< tasks delayed by a busy connection */
+    /* reactors (the main reactor and any event loops) */
+    size_t reviews;             /**< reactor reviews */
+    size_t events;              /**< events handled */
+    unsigned long long wait_us; /**< the time spent waiting for events */
+    size_t reactor_accepted;    /**< connections accepted by the reactors'
+                                     backend (io_uring) */
+    size_t reactor_received;    /**< buffers received by the reactors'
+                                     backend (io_uring) */
+    /* the thread pool (zeroed once the server stopped) */
+    struct AsyncStats async;
+    /* buffers (all the process's buffers) */
+    size_t bytes_flushed;  /**< bytes sent by the buffers */
+    size_t flush_eagain;   /**< flushes that stopped on a full socket */
+    size_t packet_hits;    /**< buffer packets grabbed from the pool */
+    size_t packet_misses;  /**< buffer packets allocated using `malloc` */
+};
+
+/**
+ * Latency histograms are only collected when the library is compiled with
+ * `SERVER_LATENCY` set (i.e. `-DSERVER_LATENCY=1`), otherwise the
+ * measurements are compiled out.
+ */
+#ifndef SERVER_LATENCY
+#define SERVER_LATENCY 0
+#endif
+
+/** The measured latencies (see `Server.latency`) */
+enum ServerLatencyKind {
+    /** from an `on_data` event until the `on_data` task starts */
+    SERVER_LATENCY_QUEUE = 0,
+    /** the time spent by the `on_data` callback */
+    SERVER_LATENCY_ON_DATA,
+    /** from a `Server.write` (to an empty buffer) until the buffer drains */
+    SERVER_LATENCY_FLUSH,
+    SERVER_LATENCY_KINDS
+};
+
+/** the number of histogram buckets: 8 buckets per power of 2 (an error
+ * margin of 12.5%), up to 2^48 nanoseconds. */
+#define SERVER_LATENCY_BUCKETS 368
+
+/**
+ * A log-bucket latency histogram (in nanoseconds).
+ *
+ * Values below 8ns have their own buckets, any other value `v` belongs to
+ * the `(log2(v) - 2) * 8 + (v >> (log2(v) - 3)) - 8` bucket. Use
+ * `Server.latency_percentile` to read the histogram.
+ */
+struct ServerLatency {
+    size_t count; /**< the number of measurements */
+    size_t buckets[SERVER_LATENCY_BUCKETS];
+};
+
 /**
 * \brief Server API
 *
@@ -142,6 +487,26 @@ extern const struct __SERVER_API__ {
      */
     long (*capacity)(void);
 
+    /** Collect the server's statistics (see `struct ServerStats`). */
+    void (*stats)(struct Server *server, struct ServerStats *stats);
+
+    /**
+     * Merge the latency histograms of all the threads, for the connections
+     * using `service` (NULL == all the connections).
+     * @return -1 if the histograms were compiled out (see `SERVER_LATENCY`)
+     * @return  0 otherwise
+     */
+    int (*latency)(struct Server *server, char *service,
+                   enum ServerLatencyKind kind,
+                   struct ServerLatency *histogram);
+
+    /**
+     * @return the latency (in nanoseconds, rounded up to the bucket's upper
+     * bound) below which `percentile` percent of the measurements fall.
+     */
+    unsigned long long (*latency_percentile)(struct ServerLatency *histogram,
+                                             double percentile);
+
     /* Server actions */
 
     /**
@@ -169,6 +534,12 @@ extern const struct __SERVER_API__ {
      */
     unsigned char (*is_busy)(struct Server *server, int sockfd);
 
+    /**
+     * @return the number of bytes waiting to be sent to the connection (see
+     * `Buffer.pending` and `ServerSettings.high_watermark`).
+     */
+    size_t (*pending)(struct Server *server, int sockfd);
+
     /**
      * Retrive the active protocol object for the requested file descriptor */
     struct Protocol *(*get_protocol)(struct Server*server, int sockfd);
@@ -213,7 +584,10 @@ extern const struct __SERVER_API__ {
     /**
      * \brief Close the connection.
      * If any data is waiting to be written, close will return immediately
-     * and the connection will only be closed once all the data was sent. */
+     * and the connection will only be closed once all the data was sent.
+     *
+     * Connections should always be closed using `close` (or `hijack`), the
+     * server doesn't check for sockets closed by other means. */
     void (*close)(struct Server *server, int sockfd);
 
     /**
@@ -224,11 +598,51 @@ extern const struct __SERVER_API__ {
      * before releasing control of the socket. */
     int (*hijack)(struct Server *server, int sockfd);
 
+    /**
+     * \brief Open an outbound connection, using the protocol.
+     *
+     * An idle connection to the same `host` and `port` is reused when
+     * available (see `release`), otherwise a new connection is opened
+     * without waiting for it to complete: `on_open` is called once the
+     * connection is attached, `on_ready` once it's connected (or right away
+     * for a reused connection, by a worker) and `on_close` if it fails.
+     * Data written before the connection completes is sent once it does.
+     *
+     * The destination's address is cached for `SERVER_DNS_TTL` seconds and
+     * numeric hosts connect right away. Other hosts are looked up by a low
+     * priority task, which opens the connection: `connect` returns -1 with
+     * `errno` set to `EINPROGRESS` and the fd is reported by `on_open`, or
+     * the failure by `on_connect_error`. Outbound connections use the
+     * server's timeout (see `set_timeout`).
+     *
+     * @return the connection's fd, or -1 (`EINPROGRESS` while looking the
+     * destination up).
+     */
+    int (*connect)(struct Server *server, const char *host,
+                   const char *port, struct Protocol *protocol);
+
+    /**
+     * \brief Return an outbound connection to it's destination's pool.
+     *
+     * The connection's protocol is replaced (the `on_close` callback isn't
+     * called), it's udata is cleared and the connection is kept for the
+     * next `connect` to the same destination, using the `pool_timeout`.
+     * Idle connections are closed if they receive any data. Pooled
+     * connections are listed under the "pool" service (see `count`).
+     *
+     * @return 0 once pooled.
+     * @return -1 if it isn't an outbound connection, or if the connection
+     *         was closed instead (the pool is full or the connection has
+     *         unsent or unread data).
+     */
+    int (*release)(struct Server *server, int sockfd);
+
     /** Count the number of connections for the specified protocol
      * (NULL = all protocols). */
     long (*count)(struct Server *server, char *service);
 
-    /** Manipulate a socket, reseting its timeout counter */
+    /** Manipulate a socket, reseting its timeout counter (reading and
+     * writing reset the counter as well) */
     void (*touch)(struct Server *server, int sockfd);
 
     /* Read and Write */
@@ -276,7 +690,8 @@ extern const struct __SERVER_API__ {
      *   ssize_t writing_hook(server_pt srv, int fd,
      *                        void *data, size_t len) {
      *     int sent = write(fd, data, len);
-     *     if (sent < 0 && (errno & (EWOULDBLOCK | EAGAIN | EINTR)))
+     *     if (sent < 0 && (errno == EWOULDBLOCK || errno == EAGAIN ||
+     *                      errno == EINTR))
      *       sent = 0;
      *     return sent;
      *   }
@@ -293,13 +708,17 @@ extern const struct __SERVER_API__ {
      * The return values are the same as the writing hook's return values,
      * except the number of bytes returned refers to the number of bytes
      * written to the buffer.
+     * The reading hook should be set before the first read (i.e. during
+     * `on_open`), since the io_uring backend might have received the data
+     * of `read_buffer` connections in advance.
      * That is:
      * @code
      *   ssize_t reading_hook(server_pt srv, int fd,
      *                        void *buffer, size_t size) {
      *     ssize_t read = 0;
      *     if ((read = recv(fd, buffer, size, 0)) > 0) return read;
-     *     else if (read && (errno & (EWOULDBLOCK | EAGAIN))) return 0;
+     *     else if (read && (errno == EWOULDBLOCK || errno == EAGAIN))
+     *       return 0;
      *     return -1;
      *   }
      * @endcode
@@ -316,9 +735,30 @@ extern const struct __SERVER_API__ {
      * @return -1 if an error was raised and the connection was closed.
      * @return the number of bytes written to the buffer.
      * @return 0 if no data was available.
+     *
+     * Data waiting in the connection's read buffer (see
+     * `Protocol.read_buffer`) is returned before reading from the socket.
      */
     ssize_t (*read)(server_pt srv, int sockfd, void *buffer, size_t max_len);
 
+    /**
+     * Peek at the unread data in the connection's read buffer (see
+     * `Protocol.read_buffer`) without copying it. The data remains unread
+     * until it's consumed using `Server.consume`.
+     *
+     * Should only be called while handling the connection (i.e. from within
+     * `on_data`), as the pointer is invalidated once `on_data` returns.
+     * @return a pointer to the unread data (`length` is set to the number
+     * of unread bytes), or NULL if no data is available.
+     */
+    void *(*peek)(server_pt srv, int sockfd, size_t *length);
+
+    /**
+     * Mark `length` bytes of the connection's read buffer as read (see
+     * `Server.peek`).
+     */
+    void (*consume)(server_pt srv, int sockfd, size_t length);
+
     /** Copy and write data to the socket, managing an asyncronous buffer.
      * @return 0 on success. success means that the data is in a buffer
      *           waiting to be written. If the socket is forced to close
@@ -375,12 +815,100 @@ extern const struct __SERVER_API__ {
      * Send a whole file as if it were a single atomic packet.
      *
      * Once the file was sent, the `FILE *` will be closed using `fclose`.
-     * The file will be buffered to the socket chunk by chunk.
+     * Regular files are sent using `sendfile(2)` (see `sendfd`), other
+     * files will be buffered to the socket chunk by chunk.
      */
     ssize_t (*sendfile)(server_pt srv, int sockfd, FILE *file);
 
+    /**
+     * Send `length` bytes of a file, starting at `offset`, as if it were a
+     * single atomic packet (a `length` of 0 sends the rest of the file).
+     *
+     * The data is sent using `sendfile(2)` (zero-copy) unless a writing
+     * hook was set (see `rw_hooks`), in which case it is read chunk by
+     * chunk.
+     *
+     * Once the data was sent, the file descriptor will be closed.
+     * @return -1 on error
+     * @return  0 on success
+     */
+    ssize_t (*sendfd)(server_pt srv, int sockfd, int file,
+                      off_t offset, size_t length);
+
+    /**
+     * Create an immutable, reference counted copy of the data (a shared
+     * blob), for data sent to many connections (cached responses,
+     * broadcasts using `Server.each`): `write_shared` queues a reference to
+     * the blob, so fanning out costs a single allocation.
+     *
+     * The caller owns a reference, released using `shared_free` (the
+     * connections hold their own references until the data was sent).
+     * @return NULL on error
+     */
+    void *(*shared_new)(void *data, size_t len);
+
+    /** Release a reference to a shared blob (see `shared_new`). */
+    void (*shared_free)(void *blob);
+
+    /**
+     * Write a shared blob to the socket, without copying the data (see
+     * `shared_new`).
+     * @return -1 on error
+     * @return  0 on success
+     */
+    ssize_t (*write_shared)(server_pt srv, int sockfd, void *blob);
+
+    /**
+     * Start a write batch: until the matching `end_batch`, writes are only
+     * queued in the connection's buffer (up to `SERVER_BATCH_LIMIT` bytes),
+     * so a response written in pieces (headers, body, trailer) is sent
+     * using a single flush. Batches nest.
+     *
+     * `on_data` always runs inside a batch, so what it writes (i.e. the
+     * responses to a burst of pipelined requests) is flushed once it
+     * returns.
+     *
+     * Batches should be used by the task handling the connection.
+     * @return -1 on error (or too many nested batches)
+     * @return  0 on success
+     */
+    int (*begin_batch)(server_pt srv, int sockfd);
+
+    /**
+     * End a write batch, flushing the queued data once the outermost batch
+     * ends. When a file was queued, the flush is corked (`TCP_CORK`), so
+     * the data preceding the file isn't sent in a segment of its own.
+     * @return -1 on error (or if the connection isn't batching)
+     * @return  0 on success
+     */
+    int (*end_batch)(server_pt srv, int sockfd);
+
     /* Tasks + Async */
 
+    /**
+     * Suspend the current `on_data` handler (of a `Protocol.fiber`
+     * protocol) until `fd` is ready for the `enum ServerAwait` events, or
+     * until `milliseconds` passed, leaving the worker thread to other tasks
+     * meanwhile. A negative `fd` simply sleeps, a negative `milliseconds`
+     * waits without a timeout.
+     *
+     * `fd` is a non-blocking file descriptor owned by the handler (not a
+     * server connection) and it's only reviewed while awaited. Errors and
+     * hangups are reported as readiness (like `poll`), as are occasional
+     * spurious wakeups, so the handler should read until `EAGAIN` and await
+     * again.
+     *
+     * The handler might resume on a different thread, so it shouldn't keep
+     * thread specific data (i.e. the address of `errno`) across the call.
+     * @return 1 once the fd is ready.
+     * @return 0 if the timeout was reached.
+     * @return -1 on error, when not called by a fiber or if the connection
+     *         was closed (the handler should return without using the fd,
+     *         it might belong to a new connection).
+     */
+    int (*await)(struct Server *server, int fd, int events,
+                 long milliseconds);
+
     /**
      * Schedule a specific task to run asyncronously for each connection.
      * A NULL service identifier == all connections (all protocols).
@@ -444,31 +972,65 @@ extern const struct __SERVER_API__ {
     int (*run_async)(struct Server *self, void task(void *), void *arg);
 
     /**
-     * Create a system timer (at the cost of 1 file descriptor) and push
-     * the timer to the reactor. The task will NOT repeat.
+     * Run an asynchronous task using the specified priority (see
+     * `enum AsyncPriority`). `run_async` uses `ASYNC_PRIORITY_NORMAL`, the
+     * same priority as the `on_data` callbacks, while the reactor's cycle,
+     * accepting connections and timers use `ASYNC_PRIORITY_HIGH` and
+     * `Server.each` uses `ASYNC_PRIORITY_LOW`. Slow tasks should use
+     * `ASYNC_PRIORITY_LOW`, keeping a worker free for the connections
+     * (see `ServerSettings.low_threads`).
      * @return -1 on error
-     * @return the new file descriptor on succeess.
+     * @return  0 on succeess.
+     */
+    int (*run_async_priority)(struct Server *self,
+                              enum AsyncPriority priority,
+                              void task(void *), void *arg);
+
+    /**
+     * Schedule a task to run (once) after the specified number of
+     * milliseconds.
      *
-     * NOTICE: Do NOT create timers from within the on_close callback, as
-     * this might block resources from being properly freed (if the timer
-     * and the on_close object share the same fd number).
-    */
+     * Timers don't use file descriptors, all the timers are scheduled by
+     * the server (using a single timerfd) and performed by the thread pool.
+     * @return -1 on error
+     * @return the timer's handle (a positive number) on succeess.
+     */
     int (*run_after)(struct Server *self, long milliseconds,
                      void task(void *), void *arg);
 
     /**
-     * Create a system timer (at the cost of 1 file descriptor) and push
-     * the timer to the reactor. The task will repeat `repetitions` times.
-     * if `repetitions` is set to 0, task will repeat forever.
-     * @return -1 on error
-     * @return the new file descriptor on succeess.
-     *
-     * NOTICE: Do NOT create timers from within the on_close callback, as
-     * this might block resources from being properly freed (if the timer
-     * and the on_close object share the same fd number).
+     * Schedule a task to run every `milliseconds`. The task will repeat
+     * `repetitions` times. if `repetitions` is set to 0 (or less), task will
+     * repeat forever.
+     * @return -1 on error (repeating timers require an interval of at
+     *         least a millisecond)
+     * @return the timer's handle (a positive number) on succeess.
      */
     int (*run_every)(struct Server *self, long milliseconds, int repetitions,
                      void task(void *), void *arg);
+
+    /**
+     * Same as `run_after`, using microseconds (the timerfd and the timers'
+     * deadlines are kept in nanoseconds).
+     */
+    int (*run_after_us)(struct Server *self, long microseconds,
+                        void task(void *), void *arg);
+
+    /**
+     * Same as `run_every`, using microseconds (repeating timers require an
+     * interval of at least a microsecond).
+     */
+    int (*run_every_us)(struct Server *self, long microseconds,
+                        int repetitions, void task(void *), void *arg);
+
+    /**
+     * Cancel a timer created by `run_after` or `run_every` (or their
+     * microsecond variants), using the timer's handle. A task that is
+     * already running will finish.
+     * @return -1 if the timer had already finished (or wasn't found)
+     * @return  0 on succeess.
+     */
+    int (*cancel_timer)(struct Server *self, int timer);
 } Server;
 
 #endif
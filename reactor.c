@@ -1,41 +1,809 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "reactor.h"
 
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <time.h>
-#include <pthread.h>
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* the io_uring backend requires multishot polling (Linux 5.13), the
+ * multishot accept and recv requests are compiled using Linux 6.0 headers
+ * (older kernels reject them, falling back to polling) */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_POLL_ADD_MULTI) && defined(IORING_ENTER_EXT_ARG) && \
+    defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_RECV_MULTISHOT)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define REACTOR_IO_URING 1
+#endif
+#endif
+#endif
+
+/* The number of submission queue entries for the io_uring backend */
+#ifndef REACTOR_URING_ENTRIES
+#define REACTOR_URING_ENTRIES 1024
+#endif
+/* The number of buffers in the io_uring backend's buffer ring (a power of 2,
+ * up to 32768), shared by the reactor's `REACTOR_RECV` file descriptors */
+#ifndef REACTOR_URING_BUFFERS
+#define REACTOR_URING_BUFFERS 256
+#endif
+/* The size of each of the buffer ring's buffers */
+#ifndef REACTOR_URING_BUFFER_SIZE
+#define REACTOR_URING_BUFFER_SIZE 4096
+#endif
+/* The number of received buffers a file descriptor holds before receiving
+ * pauses (until `reactor_read` drains the socket), so a connection that isn't
+ * read doesn't take the whole ring */
+#ifndef REACTOR_URING_BACKLOG
+#define REACTOR_URING_BACKLOG 4
+#endif
+
+/* the events reviewed for each file descriptor */
+#define REACTOR_EVENTS \
+    (EPOLLOUT | EPOLLIN | EPOLLERR | EPOLLRDHUP | EPOLLHUP)
+
+/* a reviewed fd's map value (also used as the backend's polling mode) */
+#define REACTOR_POLL 1
+
+/* the `reactor_add_listener` flags kept by the map */
+#define REACTOR_FLAGS                                                      \
+    (REACTOR_LEVEL_TRIGGERED | REACTOR_EXCLUSIVE | REACTOR_KEEP_OPEN |    \
+     REACTOR_ACCEPT | REACTOR_RECV)
+
+/* An event backend */
+struct reactor_backend {
+    int (*init)(struct Reactor *reactor);
+    void (*destroy)(struct Reactor *reactor);
+    /* start (`mode` == REACTOR_POLL | listener flags) or stop (`mode` == 0)
+     * reviewing the fd's events */
+    int (*poll)(struct Reactor *reactor, int fd, int mode);
+    /* wait (up to `timeout` milliseconds) for up to `max_events` events and
+     * handle them */
+    int (*review)(struct Reactor *reactor, int max_events, int timeout);
+};
 
 /* private data used by reactor */
 struct reactor_private {
+    const struct reactor_backend *backend; /**< the event backend */
     int reactor_fd; /**< The file descriptor designated by epoll. */
     char *map; /**< a map for all active file descriptors added to
-                    the reactor */
+                    the reactor (holding their polling mode) */
     void *events; /** the reactor's events array */
+    int batch; /**< the number of events per review (the `events` length) */
+    int quiet; /**< the number of consecutive mostly empty reviews */
+    struct reactor_uring *uring; /**< the io_uring backend's data */
 };
 #define PRIV(r) ((struct reactor_private *) (r->priv))
 
-static inline
-int set_fd_polling(int queue, int fd, int action, long milliseconds)
+/* @return the CLOCK_MONOTONIC time, in microseconds */
+static inline long long monotonic_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* count the time a review blocked (waiting for events) */
+static inline void count_wait(struct Reactor *reactor, long long since)
+{
+    struct ReactorStats *stats = &reactor->stats;
+    __atomic_store_n(&stats->wait_us,
+                     stats->wait_us + (monotonic_us() - since),
+                     __ATOMIC_RELAXED);
+}
+
+/* handle a single event (shared by the backends) */
+static inline void reactor_event(struct Reactor *reactor, int fd,
+                                 uint32_t events)
+{
+    if (events & (~(EPOLLIN | EPOLLOUT))) {
+        /* errors are hendled as disconnections (on_close), unless the fd
+         * is left to it's owner (reported as both events) */
+        if (!(__atomic_load_n(PRIV(reactor)->map + fd, __ATOMIC_RELAXED) &
+              REACTOR_KEEP_OPEN)) {
+            reactor_close(reactor, fd);
+            return;
+        }
+        events = EPOLLIN | EPOLLOUT;
+    }
+    /* no error, then it is an active event */
+    if ((events & EPOLLOUT) && reactor->on_ready)
+        reactor->on_ready(reactor, fd);
+    if ((events & EPOLLIN) && reactor->on_data)
+        reactor->on_data(reactor, fd);
+}
+
+/* epoll backend */
+
+static int epoll_backend_init(struct Reactor *reactor)
+{
+    PRIV(reactor)->reactor_fd = epoll_create1(0);
+    PRIV(reactor)->events = calloc(sizeof(struct epoll_event),
+                                   PRIV(reactor)->batch);
+    if (PRIV(reactor)->reactor_fd < 0)
+        PRIV(reactor)->reactor_fd = 0;
+    return (PRIV(reactor)->reactor_fd && PRIV(reactor)->events) ? 0 : -1;
+}
+
+static void epoll_backend_destroy(struct Reactor *reactor)
+{
+    if (PRIV(reactor)->events)
+        free(PRIV(reactor)->events);
+    if (PRIV(reactor)->reactor_fd)
+        close(PRIV(reactor)->reactor_fd);
+}
+
+static int epoll_backend_poll(struct Reactor *reactor, int fd, int mode)
 {
     struct epoll_event chevent;
     chevent.data.fd = fd;
-    chevent.events = EPOLLOUT | EPOLLIN |
-                     EPOLLET | EPOLLERR |
-                     EPOLLRDHUP | EPOLLHUP;
-    if (milliseconds) {
-        struct itimerspec newtime;
-        newtime.it_value.tv_sec = newtime.it_interval.tv_sec =
-                                  milliseconds / 1000;
-        newtime.it_value.tv_nsec = newtime.it_interval.tv_nsec =
-                                  (milliseconds % 1000) * 1000000;
-        timerfd_settime(fd, 0, &newtime, NULL);
+    chevent.events = REACTOR_EVENTS;
+    if (!(mode & REACTOR_LEVEL_TRIGGERED))
+        chevent.events |= EPOLLET;
+    if (mode & REACTOR_EXCLUSIVE) /* limited to EPOLLIN, EPOLLOUT & EPOLLET */
+        chevent.events &= EPOLLIN | EPOLLET;
+    chevent.events |= (mode & REACTOR_EXCLUSIVE) ? EPOLLEXCLUSIVE : 0;
+    return epoll_ctl(PRIV(reactor)->reactor_fd,
+                     mode ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &chevent);
+}
+
+#define _WAIT_FOR_EVENTS_(max_events, timeout) \
+    epoll_wait(PRIV(reactor)->reactor_fd, \
+               ((struct epoll_event *) PRIV(reactor)->events), \
+               (max_events), (timeout))
+
+#define _GETFD_(_ev_) \
+    ((struct epoll_event *) PRIV(reactor)->events)[(_ev_)].data.fd
+#define _GETEVENTS_(_ev_) \
+    ((struct epoll_event *) PRIV(reactor)->events)[(_ev_)].events
+
+static int epoll_backend_review(struct Reactor *reactor, int max_events,
+                                int timeout)
+{
+    /* wait for events and handle them */
+    long long since = timeout ? monotonic_us() : 0;
+    int active_count = _WAIT_FOR_EVENTS_(max_events, timeout);
+    if (timeout)
+        count_wait(reactor, since);
+    if (active_count < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < active_count; i++)
+        reactor_event(reactor, _GETFD_(i), _GETEVENTS_(i));
+    return active_count;
+}
+
+static const struct reactor_backend epoll_backend = {
+    .init = epoll_backend_init,
+    .destroy = epoll_backend_destroy,
+    .poll = epoll_backend_poll,
+    .review = epoll_backend_review,
+};
+
+/* io_uring backend
+ *
+ * Each file descriptor is reviewed using an (edge triggered) multishot
+ * IORING_OP_POLL_ADD, so the backend reports the same readiness events as
+ * epoll (level triggered listeners use single-shot requests, renewed once
+ * reported). Polling requests are batched - requests made while the reactor
+ * reviews it's events are submitted once per `reactor_review` cycle, by the
+ * same `io_uring_enter` call that waits for the next events (the following
+ * cycle's), so a cycle costs a single system call.
+ *
+ * `REACTOR_ACCEPT` listeners are accepted by a multishot IORING_OP_ACCEPT
+ * instead of being polled, each connection reported to `on_accept`. When the
+ * request fails the listener is polled (reported to `on_data`) until the
+ * owner's `reactor_accept` finds nothing to accept, which arms the request.
+ *
+ * `REACTOR_RECV` file descriptors are polled the same as any file descriptor
+ * until `reactor_read` drains the socket, which arms a multishot
+ * IORING_OP_RECV selecting it's buffers from the reactor's buffer ring. The
+ * received buffers are kept by the file descriptor (reported to `on_data`)
+ * until `reactor_read` returns them to the ring, and the polling requests
+ * don't report the socket's input meanwhile. Once the request ends (i.e. the
+ * ring ran out of buffers, or the connection's backlog is full) the socket
+ * is read directly, until it's drained again.
+ *
+ * Writes aren't submitted by the backend, the buffers perform their own
+ * (vectored) `write` calls once notified.
+ */
+#ifdef REACTOR_IO_URING
+
+/* the completion's user data for requests without a reviewed completion */
+#define URING_IGNORE ((uint64_t) -1)
+/* the user data's request kind (the bits above the fd) */
+#define URING_ACCEPT (1U << 30)
+#define URING_RECV (1U << 29)
+#define URING_FD_MASK (URING_RECV - 1)
+
+/* a file descriptor's accept / recv request and received buffers */
+struct uring_fd {
+    uint64_t op;    /**< the armed request's user data (0 == none) */
+    int head, tail; /**< the received buffers (buffer id + 1, 0 == none) */
+    int count;      /**< the number of received buffers */
+    char cancelled; /**< set once the armed request was cancelled */
+};
+
+/* a received buffer's unread data */
+struct uring_buffer {
+    int next;       /**< the fd's next received buffer (id + 1, 0 == none) */
+    unsigned start; /**< the first unread byte */
+    unsigned end;   /**< the end of the received data */
+};
+
+struct reactor_uring {
+    int fd;               /**< the io_uring file descriptor */
+    pthread_mutex_t lock; /**< serializes the submission queue's producers */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned *gen; /**< each fd's polling generation (invalidates stale
+                        completions once an fd is removed or reused) */
+    struct uring_fd *fds; /**< each fd's accept / recv request */
+    struct io_uring_buf_ring *buf_ring; /**< the provided buffers' ring */
+    char *buf_data;                /**< the buffers (following the ring) */
+    size_t buf_size;               /**< the ring's and buffers' mapping */
+    struct uring_buffer *bufs;     /**< the received buffers' data */
+    unsigned short buf_tail;       /**< the ring's tail (under the lock) */
+    char no_accept, no_recv; /**< set once the kernel rejected a request */
+};
+
+/* the thread's reviewing reactor (polling requests are batched) */
+static __thread struct Reactor *reviewing_reactor;
+
+static inline int uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags,
+                              void *arg, size_t size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, size);
+}
+
+#define _URING_DATA_(fd, gen) (((uint64_t)(gen) << 32) | (uint32_t)(fd))
+
+static void uring_backend_destroy(struct Reactor *reactor)
+{
+    struct reactor_uring *ring = PRIV(reactor)->uring;
+    if (!ring) return;
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    /* the buffers are released once the ring was closed */
+    if (ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_size);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->bufs);
+    free(ring->fds);
+    free(ring->gen);
+    free(ring);
+    PRIV(reactor)->uring = NULL;
+}
+
+/* return a buffer to the buffer ring (the ring's lock must be held) */
+static void uring_buffer_put(struct reactor_uring *ring, unsigned bid)
+{
+    struct io_uring_buf *buf = ring->buf_ring->bufs +
+                               (ring->buf_tail & (REACTOR_URING_BUFFERS - 1));
+    buf->addr = (uint64_t)(uintptr_t)(ring->buf_data +
+                                      (size_t) bid * REACTOR_URING_BUFFER_SIZE);
+    buf->len = REACTOR_URING_BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&ring->buf_ring->tail, ++ring->buf_tail,
+                     __ATOMIC_RELEASE);
+}
+
+/* register the buffer ring (recv requests are disabled without it) */
+static void uring_buffers_init(struct reactor_uring *ring)
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_size = REACTOR_URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->no_recv = 1;
+    ring->buf_size = ring_size +
+                     (size_t) REACTOR_URING_BUFFERS * REACTOR_URING_BUFFER_SIZE;
+    ring->buf_ring = mmap(NULL, ring->buf_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return;
+    }
+    ring->buf_data = (char *) ring->buf_ring + ring_size;
+    ring->bufs = calloc(REACTOR_URING_BUFFERS, sizeof(*ring->bufs));
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t) ring->buf_ring;
+    reg.ring_entries = REACTOR_URING_BUFFERS;
+    if (!ring->bufs || syscall(__NR_io_uring_register, ring->fd,
+                               IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring->buf_ring, ring->buf_size);
+        ring->buf_ring = NULL;
+        return;
+    }
+    for (unsigned bid = 0; bid < REACTOR_URING_BUFFERS; bid++)
+        uring_buffer_put(ring, bid);
+    ring->no_recv = 0;
+}
+
+static int uring_backend_init(struct Reactor *reactor)
+{
+    struct io_uring_params params;
+    struct reactor_uring *ring = calloc(1, sizeof(*ring));
+    if (!ring) return -1;
+    ring->fd = -1;
+    pthread_mutex_init(&ring->lock, NULL);
+    PRIV(reactor)->uring = ring;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, REACTOR_URING_ENTRIES, &params);
+    if (ring->fd < 0 || !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_NODROP))
+        goto error;
+    ring->gen = calloc(reactor->maxfd + 1, sizeof(unsigned));
+    ring->fds = calloc(reactor->maxfd + 1, sizeof(*ring->fds));
+    if (!ring->gen || !ring->fds)
+        goto error;
+
+    /* map the rings */
+    ring->sq_ring_size = params.sq_off.array +
+                         params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto error;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto error;
+        }
+    }
+    ring->sq_entries = params.sq_entries;
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask =
+        (unsigned *) ((char *) ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array =
+        (unsigned *) ((char *) ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask =
+        (unsigned *) ((char *) ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring +
+                                          params.cq_off.cqes);
+    uring_buffers_init(ring);
+    return 0;
+error:
+    uring_backend_destroy(reactor);
+    return -1;
+}
+
+/* queue a request (the ring's lock must be held).
+ * The request isn't submitted until the next `io_uring_enter` call.
+ */
+static int uring_queue(struct reactor_uring *ring, uint8_t opcode, int fd,
+                       uint64_t addr, uint64_t user_data, int mode)
+{
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries) {
+        /* the submission queue is full, submit the queued requests */
+        if (uring_enter(ring->fd, ring->sq_entries, 0, 0, NULL, 0) < 0 ||
+            tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+                ring->sq_entries)
+            return -1;
+    }
+    struct io_uring_sqe *sqe = ring->sqes + (tail & *ring->sq_mask);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->user_data = user_data;
+    if (opcode == IORING_OP_POLL_ADD) {
+        sqe->poll32_events = REACTOR_EVENTS;
+        if (!(mode & REACTOR_LEVEL_TRIGGERED))
+            sqe->len = IORING_POLL_ADD_MULTI;
+    } else if (opcode == IORING_OP_ACCEPT) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+    } else if (opcode == IORING_OP_RECV) {
+        /* the buffers are selected from the ring (buffer group 0) */
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+    }
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    /* publish the request only once it's complete, so the kernel never
+     * reads a partial request (any `io_uring_enter` call might submit it) */
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* arm an accept (or recv) request using the fd's `gen` generation (the
+ * ring's lock must be held) */
+static int uring_arm(struct reactor_uring *ring, int fd, unsigned kind,
+                     unsigned gen)
+{
+    uint64_t data = _URING_DATA_(fd | kind, gen);
+    if (uring_queue(ring, kind == URING_ACCEPT ? IORING_OP_ACCEPT
+                                               : IORING_OP_RECV,
+                    fd, 0, data, 0))
+        return -1;
+    __atomic_store_n(&ring->fds[fd].op, data, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* cancel the fd's accept / recv request, returning it's received buffers to
+ * the ring (the ring's lock must be held) */
+static void uring_release(struct reactor_uring *ring, int fd)
+{
+    struct uring_fd *state = ring->fds + fd;
+    if (state->op && !state->cancelled)
+        uring_queue(ring, IORING_OP_ASYNC_CANCEL, -1, state->op, URING_IGNORE,
+                    0);
+    __atomic_store_n(&state->op, 0, __ATOMIC_RELAXED);
+    state->cancelled = 0;
+    while (state->head) {
+        int bid = state->head - 1;
+        state->head = ring->bufs[bid].next;
+        uring_buffer_put(ring, bid);
     }
-    return epoll_ctl(queue, action, fd, &chevent);
+    state->tail = state->count = 0;
+}
+
+static int uring_backend_poll(struct Reactor *reactor, int fd, int mode)
+{
+    struct reactor_uring *ring = PRIV(reactor)->uring;
+    int ret;
+    pthread_mutex_lock(&ring->lock);
+    uring_release(ring, fd);
+    /* the generation is read by the reviewing thread without the lock */
+    if (mode && (mode & REACTOR_ACCEPT) && reactor->on_accept &&
+        !ring->no_accept)
+        ret = uring_arm(ring, fd, URING_ACCEPT,
+                        __atomic_add_fetch(ring->gen + fd, 1,
+                                           __ATOMIC_RELEASE));
+    else if (mode)
+        ret = uring_queue(
+            ring, IORING_OP_POLL_ADD, fd, 0,
+            _URING_DATA_(fd, __atomic_add_fetch(ring->gen + fd, 1,
+                                                __ATOMIC_RELEASE)),
+            mode);
+    else
+        ret = uring_queue(
+            ring, IORING_OP_POLL_REMOVE, -1,
+            _URING_DATA_(fd, __atomic_fetch_add(ring->gen + fd, 1,
+                                                __ATOMIC_RELEASE)),
+            URING_IGNORE, 0);
+    pthread_mutex_unlock(&ring->lock);
+    if (ret < 0)
+        return -1;
+    /* requests made outside of the reactor's review are submitted now */
+    if (reviewing_reactor != reactor &&
+        uring_enter(ring->fd, ring->sq_entries, 0, 0, NULL, 0) < 0)
+        return -1;
+    return 0;
+}
+
+/* handle an accept completion */
+static void uring_accepted(struct Reactor *reactor, int fd, uint64_t data,
+                           int res, unsigned flags, int stale)
+{
+    struct reactor_uring *ring = PRIV(reactor)->uring;
+    /* connections accepted before the listener was removed are reported as
+     * well, they were already taken from the listener */
+    if (res >= 0) {
+        __atomic_store_n(&reactor->stats.accepted,
+                         reactor->stats.accepted + 1, __ATOMIC_RELAXED);
+        reactor->on_accept(reactor, fd, res);
+    }
+    if (flags & IORING_CQE_F_MORE)
+        return;
+    pthread_mutex_lock(&ring->lock);
+    if (!stale && ring->fds[fd].op == data) {
+        __atomic_store_n(&ring->fds[fd].op, 0, __ATOMIC_RELAXED);
+        if (res == -EINVAL)
+            ring->no_accept = 1;
+        /* the kernel might end the request, renew it. Failures are left to
+         * the owner, polling the listener until `reactor_accept` would block
+         */
+        if (res < 0 || uring_arm(ring, fd, URING_ACCEPT, data >> 32))
+            uring_queue(ring, IORING_OP_POLL_ADD, fd, 0,
+                        _URING_DATA_(fd, data >> 32),
+                        __atomic_load_n(PRIV(reactor)->map + fd,
+                                        __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* handle a recv completion
+ * @return 1 if the data (or the request's end) was reported */
+static int uring_received(struct Reactor *reactor, int fd, uint64_t data,
+                          int res, unsigned flags, int stale)
+{
+    struct reactor_uring *ring = PRIV(reactor)->uring;
+    struct uring_fd *state = ring->fds + fd;
+    int bid = (flags & IORING_CQE_F_BUFFER)
+                  ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    pthread_mutex_lock(&ring->lock);
+    if (stale || state->op != data) {
+        /* the data of a removed (or reused) file descriptor */
+        if (bid >= 0)
+            uring_buffer_put(ring, bid);
+        pthread_mutex_unlock(&ring->lock);
+        return 0;
+    }
+    if (bid >= 0 && res > 0) {
+        ring->bufs[bid] = (struct uring_buffer) {.end = res};
+        if (state->tail)
+            ring->bufs[state->tail - 1].next = bid + 1;
+        else
+            state->head = bid + 1;
+        state->tail = bid + 1;
+        /* a full backlog pauses receiving (the socket is read directly) */
+        if (++state->count >= REACTOR_URING_BACKLOG && !state->cancelled &&
+            (flags & IORING_CQE_F_MORE)) {
+            uring_queue(ring, IORING_OP_ASYNC_CANCEL, -1, data, URING_IGNORE,
+                        0);
+            state->cancelled = 1;
+        }
+        __atomic_store_n(&reactor->stats.received,
+                         reactor->stats.received + 1, __ATOMIC_RELAXED);
+    } else if (bid >= 0) {
+        uring_buffer_put(ring, bid);
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        __atomic_store_n(&state->op, 0, __ATOMIC_RELAXED);
+        state->cancelled = 0;
+        if (res == -EINVAL)
+            ring->no_recv = 1;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    /* errors (and the end of the stream) are reported by reading the socket
+     * once the received data was read (see `reactor_read`) */
+    reactor_event(reactor, fd, EPOLLIN);
+    return 1;
+}
+
+static int uring_backend_review(struct Reactor *reactor, int max_events,
+                                int timeout)
+{
+    struct reactor_uring *ring = PRIV(reactor)->uring;
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout / 1000,
+        .tv_nsec = (timeout % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = (uint64_t)(uintptr_t) &ts,
+    };
+    int count = 0;
+    unsigned head = *ring->cq_head;
+    /* submit the queued requests (including the previous cycle's) and wait
+     * for events, a single system call. When completions are already
+     * waiting the queued requests are submitted without waiting. */
+    if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(ring->sq_tail, __ATOMIC_ACQUIRE) !=
+            __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE))
+            uring_enter(ring->fd, ring->sq_entries, 0, 0, NULL, 0);
+    } else {
+        long long since = timeout ? monotonic_us() : 0;
+        int ret = uring_enter(ring->fd, ring->sq_entries, timeout ? 1 : 0,
+                              IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                              &arg, sizeof(arg));
+        if (timeout)
+            count_wait(reactor, since);
+        if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+            return -1;
+    }
+
+    reviewing_reactor = reactor;
+    while (count < max_events &&
+           head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        /* release the completion before performing any callbacks */
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+        int fd = (int)((uint32_t) data & URING_FD_MASK);
+        unsigned kind = (uint32_t) data & ~URING_FD_MASK;
+        if (data == URING_IGNORE || fd > reactor->maxfd)
+            continue;
+        /* a removed (or reused) file descriptor */
+        int stale = (unsigned)(data >> 32) !=
+                        __atomic_load_n(ring->gen + fd, __ATOMIC_ACQUIRE) ||
+                    !__atomic_load_n(PRIV(reactor)->map + fd,
+                                     __ATOMIC_ACQUIRE);
+        if (kind == URING_ACCEPT) {
+            uring_accepted(reactor, fd, data, res, flags, stale);
+            count += res >= 0;
+            continue;
+        }
+        if (kind == URING_RECV) {
+            count += uring_received(reactor, fd, data, res, flags, stale);
+            continue;
+        }
+        if (stale)
+            continue;
+        if (res < 0) {
+            reactor_event(reactor, fd, EPOLLERR);
+        } else {
+            count++;
+            /* the input is reported by the recv request, while armed */
+            if (__atomic_load_n(&ring->fds[fd].op, __ATOMIC_RELAXED))
+                res &= ~EPOLLIN;
+            if (res)
+                reactor_event(reactor, fd, res);
+            /* the kernel might end a multishot request, renew it (as well
+             * as single-shot requests) */
+            int mode;
+            if (!(flags & IORING_CQE_F_MORE) &&
+                (mode = __atomic_load_n(PRIV(reactor)->map + fd,
+                                        __ATOMIC_ACQUIRE))) {
+                /* the generation is reviewed again under the lock, so a
+                 * concurrent removal isn't undone */
+                pthread_mutex_lock(&ring->lock);
+                if ((unsigned)(data >> 32) ==
+                    __atomic_load_n(ring->gen + fd, __ATOMIC_RELAXED))
+                    uring_queue(ring, IORING_OP_POLL_ADD, fd, 0, data, mode);
+                pthread_mutex_unlock(&ring->lock);
+            }
+        }
+    }
+    reviewing_reactor = NULL;
+    /* the requests made by the callbacks are submitted by the next cycle's
+     * `io_uring_enter`, together with its wait */
+    return count;
+}
+
+/* submit the requests made outside of the reactor's review */
+static inline void uring_submit(struct Reactor *reactor)
+{
+    struct reactor_uring *ring = PRIV(reactor)->uring;
+    if (reviewing_reactor != reactor)
+        uring_enter(ring->fd, ring->sq_entries, 0, 0, NULL, 0);
+}
+
+/* the listener has no pending connections, accept them using the request
+ * instead of polling the listener */
+static void uring_resume_accept(struct Reactor *reactor, int fd)
+{
+    struct reactor_uring *ring = PRIV(reactor)->uring;
+    int armed = 0;
+    if (__atomic_load_n(&ring->fds[fd].op, __ATOMIC_RELAXED) ||
+        ring->no_accept)
+        return;
+    pthread_mutex_lock(&ring->lock);
+    if (!ring->fds[fd].op &&
+        (__atomic_load_n(PRIV(reactor)->map + fd, __ATOMIC_RELAXED) &
+         REACTOR_ACCEPT)) {
+        /* the new generation invalidates the polling request's completions */
+        uring_queue(ring, IORING_OP_POLL_REMOVE, -1,
+                    _URING_DATA_(fd, __atomic_fetch_add(ring->gen + fd, 1,
+                                                        __ATOMIC_RELEASE)),
+                    URING_IGNORE, 0);
+        armed = !uring_arm(ring, fd, URING_ACCEPT,
+                           __atomic_load_n(ring->gen + fd, __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&ring->lock);
+    if (armed)
+        uring_submit(reactor);
+}
+
+/* read the fd's received buffers, or the socket once they were read (see
+ * `reactor_read`) */
+static ssize_t uring_read(struct Reactor *reactor, int fd, char *buffer,
+                          size_t length)
+{
+    struct reactor_uring *ring = PRIV(reactor)->uring;
+    struct uring_fd *state = ring->fds + fd;
+    size_t copied = 0;
+    ssize_t ret;
+    pthread_mutex_lock(&ring->lock);
+    while (state->head && copied < length) {
+        int bid = state->head - 1;
+        struct uring_buffer *buf = ring->bufs + bid;
+        size_t chunk = buf->end - buf->start;
+        if (chunk > length - copied)
+            chunk = length - copied;
+        memcpy(buffer + copied,
+               ring->buf_data + (size_t) bid * REACTOR_URING_BUFFER_SIZE +
+                   buf->start,
+               chunk);
+        copied += chunk;
+        if ((buf->start += chunk) == buf->end) {
+            if (!(state->head = buf->next))
+                state->tail = 0;
+            state->count--;
+            uring_buffer_put(ring, bid);
+        }
+    }
+    int armed = state->op != 0;
+    pthread_mutex_unlock(&ring->lock);
+    if (copied)
+        return copied;
+    if (armed) {
+        errno = EAGAIN;
+        return -1;
+    }
+    ret = recv(fd, buffer, length, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        !ring->no_recv) {
+        /* the socket was drained, the following data is received by the
+         * backend */
+        pthread_mutex_lock(&ring->lock);
+        armed = !state->op &&
+                (__atomic_load_n(PRIV(reactor)->map + fd, __ATOMIC_RELAXED) &
+                 REACTOR_RECV) &&
+                !uring_arm(ring, fd, URING_RECV,
+                           __atomic_load_n(ring->gen + fd, __ATOMIC_RELAXED));
+        pthread_mutex_unlock(&ring->lock);
+        if (armed)
+            uring_submit(reactor);
+        errno = EAGAIN;
+    }
+    return ret;
+}
+
+static const struct reactor_backend uring_backend = {
+    .init = uring_backend_init,
+    .destroy = uring_backend_destroy,
+    .poll = uring_backend_poll,
+    .review = uring_backend_review,
+};
+#endif
+
+/* timers */
+
+static void set_timer(int fd, long milliseconds)
+{
+    struct itimerspec newtime;
+    newtime.it_value.tv_sec = newtime.it_interval.tv_sec =
+                              milliseconds / 1000;
+    newtime.it_value.tv_nsec = newtime.it_interval.tv_nsec =
+                              (milliseconds % 1000) * 1000000;
+    timerfd_settime(fd, 0, &newtime, NULL);
 }
 
 int reactor_add(struct Reactor *reactor, int fd)
@@ -47,44 +815,75 @@ int reactor_add(struct Reactor *reactor, int fd)
      * before calling this, and a new handler was probably assigned
      * (or mapped) to the fd.
      */
-    PRIV(reactor)->map[fd] = 1;
-    return set_fd_polling(PRIV(reactor)->reactor_fd, fd,
-                          EPOLL_CTL_ADD, 0);
+    __atomic_store_n(PRIV(reactor)->map + fd, REACTOR_POLL, __ATOMIC_RELEASE);
+    return PRIV(reactor)->backend->poll(reactor, fd, REACTOR_POLL);
+}
+
+int reactor_add_listener(struct Reactor *reactor, int fd, int flags)
+{
+    assert(PRIV(reactor)->reactor_fd);
+    assert(reactor->maxfd >= fd);
+    int mode = REACTOR_POLL | (flags & REACTOR_FLAGS);
+    __atomic_store_n(PRIV(reactor)->map + fd, mode, __ATOMIC_RELEASE);
+    return PRIV(reactor)->backend->poll(reactor, fd, mode);
 }
 
 int reactor_add_timer(struct Reactor *reactor, int fd, long milliseconds)
 {
     assert(PRIV(reactor)->reactor_fd);
     assert(reactor->maxfd >= fd);
-    PRIV(reactor)->map[fd] = 1;
-    return set_fd_polling(PRIV(reactor)->reactor_fd, fd,
-                          EPOLL_CTL_ADD, milliseconds);
+    if (milliseconds)
+        set_timer(fd, milliseconds);
+    __atomic_store_n(PRIV(reactor)->map + fd, REACTOR_POLL, __ATOMIC_RELEASE);
+    return PRIV(reactor)->backend->poll(reactor, fd, REACTOR_POLL);
 }
 
 int reactor_remove(struct Reactor *reactor, int fd)
 {
     assert(PRIV(reactor)->reactor_fd);
     assert(reactor->maxfd >= fd);
-    PRIV(reactor)->map[fd] = 0;
-    return set_fd_polling(PRIV(reactor)->reactor_fd, fd,
-                          EPOLL_CTL_DEL, 0);
+    __atomic_store_n(PRIV(reactor)->map + fd, 0, __ATOMIC_RELEASE);
+    return PRIV(reactor)->backend->poll(reactor, fd, 0);
 }
 
 void reactor_close(struct Reactor *reactor, int fd)
 {
     assert(reactor->maxfd >= fd);
-    static pthread_mutex_t locker = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_lock(&locker);
-    if (PRIV(reactor)->map[fd]) {
+    /* only the thread that clears the flag closes the file descriptor */
+    if (__atomic_exchange_n(PRIV(reactor)->map + fd, 0, __ATOMIC_ACQ_REL)) {
+        /* remove before closing, once closed the fd might be reused */
+        PRIV(reactor)->backend->poll(reactor, fd, 0);
         close(fd);
-        PRIV(reactor)->map[fd] = 0;
-        pthread_mutex_unlock(&locker);
         if (reactor->on_close)
             reactor->on_close(reactor, fd);
-        set_fd_polling(PRIV(reactor)->reactor_fd, fd, EPOLL_CTL_DEL, 0);
-        return;
     }
-    pthread_mutex_unlock(&locker);
+}
+
+int reactor_accept(struct Reactor *reactor, int fd)
+{
+    int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK);
+#ifdef REACTOR_IO_URING
+    if (client < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        PRIV(reactor)->uring && reactor->on_accept &&
+        (__atomic_load_n(PRIV(reactor)->map + fd, __ATOMIC_RELAXED) &
+         REACTOR_ACCEPT)) {
+        uring_resume_accept(reactor, fd);
+        errno = EAGAIN;
+    }
+#endif
+    return client;
+}
+
+ssize_t reactor_read(struct Reactor *reactor, int fd, void *buffer,
+                     size_t length)
+{
+#ifdef REACTOR_IO_URING
+    if (PRIV(reactor)->uring &&
+        (__atomic_load_n(PRIV(reactor)->map + fd, __ATOMIC_RELAXED) &
+         REACTOR_RECV))
+        return uring_read(reactor, fd, buffer, length);
+#endif
+    return recv(fd, buffer, length, 0);
 }
 
 void reactor_reset_timer(int fd)
@@ -99,54 +898,70 @@ int reactor_make_timer(void)
     return timerfd_create(CLOCK_MONOTONIC, O_NONBLOCK);
 }
 
-#define _WAIT_FOR_EVENTS_ \
-    epoll_wait(PRIV(reactor)->reactor_fd, \
-               ((struct epoll_event *) PRIV(reactor)->events), \
-               REACTOR_MAX_EVENTS, REACTOR_TICK)
-
-#define _GETFD_(_ev_) \
-    ((struct epoll_event *) PRIV(reactor)->events)[(_ev_)].data.fd
-#define _EVENTERROR_(_ev_) \
-    (((struct epoll_event *) PRIV(reactor)->events)[(_ev_)].events & \
-     (~(EPOLLIN | EPOLLOUT)))
-#define _EVENTREADY_(_ev_) \
-    (((struct epoll_event *) PRIV(reactor)->events)[(_ev_)].events & \
-     EPOLLOUT)
-#define _EVENTDATA_(_ev_) \
-    (((struct epoll_event *) PRIV(reactor)->events)[(_ev_)].events & \
-     EPOLLIN)
-
 static void reactor_destroy(struct Reactor *reactor)
 {
+    if (PRIV(reactor)->backend)
+        PRIV(reactor)->backend->destroy(reactor);
     if (PRIV(reactor)->map)
         free(PRIV(reactor)->map);
-    if (PRIV(reactor)->events)
-        free(PRIV(reactor)->events);
-    if (PRIV(reactor)->reactor_fd)
-        close(PRIV(reactor)->reactor_fd);
-
     free(PRIV(reactor));
+    reactor->priv = NULL;
 }
 
 int reactor_init(struct Reactor *reactor)
 {
     if (reactor->maxfd <= 0) return -1;
+    if (reactor->max_events <= 0)
+        reactor->max_events = REACTOR_MAX_EVENTS;
+    if (reactor->max_events > REACTOR_MAX_EVENTS_LIMIT)
+        reactor->max_events = REACTOR_MAX_EVENTS_LIMIT;
+    if (reactor->tick <= 0)
+        reactor->tick = REACTOR_TICK;
     reactor->priv = calloc(1, sizeof(struct reactor_private));
-    PRIV(reactor)->reactor_fd = epoll_create1(0);
+    if (!reactor->priv) return -1;
+    PRIV(reactor)->batch = reactor->max_events;
     PRIV(reactor)->map = calloc(1, reactor->maxfd + 1);
-    PRIV(reactor)->events = calloc(sizeof(struct epoll_event),
-                                     REACTOR_MAX_EVENTS);
-    if (!PRIV(reactor)->reactor_fd || !PRIV(reactor)->map ||
-        !PRIV(reactor)->events) {
+    if (!PRIV(reactor)->map) {
+        reactor_destroy(reactor);
+        return -1;
+    }
+#ifdef REACTOR_IO_URING
+    if (reactor->backend == REACTOR_BACKEND_IO_URING) {
+        if (!uring_backend_init(reactor)) {
+            PRIV(reactor)->backend = &uring_backend;
+            /* the map's guard (the io_uring backend has no epoll fd) */
+            PRIV(reactor)->reactor_fd = PRIV(reactor)->uring->fd;
+            return 0;
+        }
+    }
+#endif
+    /* fall back to epoll */
+    reactor->backend = REACTOR_BACKEND_EPOLL;
+    PRIV(reactor)->backend = &epoll_backend;
+    if (epoll_backend_init(reactor)) {
         reactor_destroy(reactor);
         return -1;
     }
     return 0;
 }
 
+void reactor_stats(struct Reactor *reactor, struct ReactorStats *stats)
+{
+    struct ReactorStats *own = &reactor->stats;
+    *stats = (struct ReactorStats) {
+        .reviews = __atomic_load_n(&own->reviews, __ATOMIC_RELAXED),
+        .events = __atomic_load_n(&own->events, __ATOMIC_RELAXED),
+        .wait_us = __atomic_load_n(&own->wait_us, __ATOMIC_RELAXED),
+        .batch = __atomic_load_n(&own->batch, __ATOMIC_RELAXED),
+        .accepted = __atomic_load_n(&own->accepted, __ATOMIC_RELAXED),
+        .received = __atomic_load_n(&own->received, __ATOMIC_RELAXED),
+    };
+}
+
 void reactor_stop(struct Reactor *reactor)
 {
-    if (!PRIV(reactor)->map || !PRIV(reactor)->reactor_fd)
+    if (!reactor->priv || !PRIV(reactor)->map ||
+        !PRIV(reactor)->reactor_fd)
         return;
     for (int i = 0; i <= reactor->maxfd; i++) {
         if (PRIV(reactor)->map[i]) {
@@ -158,30 +973,78 @@ void reactor_stop(struct Reactor *reactor)
     reactor_destroy(reactor);
 }
 
+/* adaptive mode: resize the events batch according to the last review */
+static void adapt_batch(struct Reactor *reactor, int count)
+{
+    int batch = PRIV(reactor)->batch;
+    if (count >= batch && batch < REACTOR_MAX_EVENTS_LIMIT) {
+        /* a full batch, more events are probably waiting */
+        batch <<= 1;
+        if (batch > REACTOR_MAX_EVENTS_LIMIT)
+            batch = REACTOR_MAX_EVENTS_LIMIT;
+    } else if (count < (batch >> 2) && batch > reactor->max_events) {
+        /* shrink slowly, bursts are likely to return */
+        if (++PRIV(reactor)->quiet < 16)
+            return;
+        batch >>= 1;
+        if (batch < reactor->max_events)
+            batch = reactor->max_events;
+    } else {
+        PRIV(reactor)->quiet = 0;
+        return;
+    }
+    PRIV(reactor)->quiet = 0;
+    if (PRIV(reactor)->backend == &epoll_backend) {
+        void *events = realloc(PRIV(reactor)->events,
+                               batch * sizeof(struct epoll_event));
+        if (!events) return;
+        PRIV(reactor)->events = events;
+    }
+    PRIV(reactor)->batch = batch;
+}
+
 int reactor_review(struct Reactor *reactor)
 {
-    if (!PRIV(reactor)->reactor_fd) return -1;
+    if (!reactor->priv || !PRIV(reactor)->reactor_fd) return -1;
 
     /* set the last tick */
     time(&reactor->last_tick);
 
+    int timeout = reactor->tick, count;
+    if (reactor->adaptive && reactor->next_timer) {
+        /* don't wait beyond the owner's next timer */
+        long next = reactor->next_timer(reactor);
+        if (next >= 0 && next < timeout)
+            timeout = next;
+    }
+    if (reactor->has_work && reactor->has_work(reactor))
+        timeout = 0;
+    /* busy polling: review without blocking for a while */
+    if (reactor->busy_poll > 0 && timeout) {
+        long long until = monotonic_us() + reactor->busy_poll;
+        do {
+            count = PRIV(reactor)->backend->review(reactor,
+                                                   PRIV(reactor)->batch, 0);
+            if (count)
+                goto reviewed;
+        } while (monotonic_us() < until);
+    }
     /* wait for events and handle them */
-    int active_count = _WAIT_FOR_EVENTS_;
-    if (active_count < 0) return -1;
-
-    if (active_count > 0) {
-        for (int i = 0; i < active_count; i++) {
-            if (_EVENTERROR_(i)) {
-                /* errors are hendled as disconnections (on_close) */
-                reactor_close(reactor, _GETFD_(i));
-            } else {
-                /* no error, then it is an active event */
-                if (_EVENTREADY_(i) && reactor->on_ready)
-                    reactor->on_ready(reactor, _GETFD_(i));
-                if (_EVENTDATA_(i) && reactor->on_data)
-                    reactor->on_data(reactor, _GETFD_(i));
-            }
-        }
+    count = PRIV(reactor)->backend->review(reactor, PRIV(reactor)->batch,
+                                           timeout);
+reviewed:
+    if (count > 0)
+        __atomic_store_n(&reactor->stats.events, reactor->stats.events + count,
+                         __ATOMIC_RELAXED);
+    __atomic_store_n(&reactor->stats.reviews, reactor->stats.reviews + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&reactor->stats.batch, PRIV(reactor)->batch,
+                     __ATOMIC_RELAXED);
+    if (count >= 0 && reactor->adaptive) {
+        adapt_batch(reactor, count);
+        /* woken for a timer, update the tick for the owner's review */
+        if (timeout < reactor->tick)
+            time(&reactor->last_tick);
     }
-    return active_count;
+    return count;
 }
@@ -4,6 +4,10 @@
 #ifndef REACTOR_MAX_EVENTS
 #define REACTOR_MAX_EVENTS 64
 #endif
+/* the maximum number of events per review (adaptive mode) */
+#ifndef REACTOR_MAX_EVENTS_LIMIT
+#define REACTOR_MAX_EVENTS_LIMIT 4096
+#endif
 #ifndef REACTOR_TICK
 #define REACTOR_TICK 1000
 #endif
@@ -11,9 +15,28 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+/**
+ * \brief A reactor's statistics (see `reactor_stats`).
+ */
+struct ReactorStats {
+    size_t reviews; /**< the number of `reactor_review` calls */
+    size_t events;  /**< the number of events handled */
+    unsigned long long wait_us; /**< the time spent waiting for events */
+    int batch;      /**< the current number of events per review */
+    size_t accepted; /**< connections accepted by the backend (io_uring) */
+    size_t received; /**< buffers received by the backend (io_uring) */
+};
+
+/** The reactor's event backends */
+enum ReactorBackend {
+    REACTOR_BACKEND_EPOLL = 0, /**< epoll (the default) */
+    REACTOR_BACKEND_IO_URING,  /**< io_uring multishot polling, accept and
+                                    buffer-ring recv */
+};
+
 /**
  * \brief [Reactor pattern](https://en.wikipedia.org/wiki/Reactor_pattern)
- *        implementation using callbacks as Linux epoll abstraction
+ *        implementation using callbacks as Linux epoll (or io_uring) abstraction
  *
  * Supported events (and corresponding callbacks):
  *  - Ready to Read (`on_data` callback).
@@ -49,6 +72,13 @@ struct Reactor {
      */
     void (*on_close)(struct Reactor *reactor, int fd);
 
+    /**
+     * (optional) Called with each connection accepted by the backend on a
+     * `REACTOR_ACCEPT` listening socket (a non-blocking socket, owned by the
+     * callback). Without it the listener is reported to `on_data`.
+     */
+    void (*on_accept)(struct Reactor *reactor, int fd, int client);
+
     /* global data and settings */
 
     /** the time (seconds since epoch) of the last "tick" (event cycle) */
@@ -60,6 +90,64 @@ struct Reactor {
      */
     int maxfd;
 
+    /**
+     * the reactor's event backend, set before calling `reactor_init`.
+     *
+     * The io_uring backend batches the reactor's system calls (a single
+     * `io_uring_enter` per `reactor_review` cycle), accepting and receiving
+     * for `REACTOR_ACCEPT` and `REACTOR_RECV` file descriptors without any
+     * system calls of their own. When io_uring isn't
+     * supported by the system, `reactor_init` falls back to epoll (and
+     * updates this value).
+     */
+    enum ReactorBackend backend;
+
+    /**
+     * the number of events handled by each review. Defaults to
+     * `REACTOR_MAX_EVENTS` (set by `reactor_init`).
+     */
+    int max_events;
+
+    /**
+     * the maximum time (in milliseconds) a review waits for events. Defaults
+     * to `REACTOR_TICK` (set by `reactor_init`).
+     */
+    int tick;
+
+    /**
+     * adaptive mode: the number of events per review grows (up to
+     * `REACTOR_MAX_EVENTS_LIMIT`) while reviews keep returning a full batch
+     * and shrinks back towards `max_events` once the reviews are mostly
+     * empty. Reviews also don't wait beyond `next_timer`.
+     */
+    unsigned char adaptive;
+
+    /**
+     * busy polling: the time (in microseconds) to spin on non-blocking
+     * reviews before blocking (0 == disabled). Lowers latency at the price
+     * of CPU time.
+     */
+    int busy_poll;
+
+    /**
+     * (optional, adaptive mode) returns the number of milliseconds until
+     * the owner's next timer is due (-1 == no pending timers).
+     */
+    long (*next_timer)(struct Reactor *reactor);
+
+    /**
+     * (optional) returns non-zero while the owner has pending work (i.e.
+     * tasks waiting for the thread reviewing the reactor), so the review
+     * doesn't wait for events.
+     */
+    int (*has_work)(struct Reactor *reactor);
+
+    /**
+     * the reactor's statistics, updated by the reviewing thread (and kept
+     * once the reactor is stopped). Use `reactor_stats` to read them.
+     */
+    struct ReactorStats stats;
+
     /* private data */
     void *priv;
 };
@@ -76,7 +164,7 @@ struct Reactor {
 int reactor_init(struct Reactor *);
 
 /**
- * \brief Review any pending events (up to REACTOR_MAX_EVENTS)
+ * \brief Review any pending events (up to `max_events`, see `adaptive`)
  * @return -1 on error
  * @return the number of events handled by the reactor.
  */
@@ -90,6 +178,13 @@ int reactor_review(struct Reactor *);
  */
 void reactor_stop(struct Reactor *);
 
+/**
+ * \brief Collect the reactor's statistics. The counters are updated by the
+ * reviewing thread without locks, so a snapshot taken on another thread is
+ * only approximately consistent.
+ */
+void reactor_stats(struct Reactor *, struct ReactorStats *stats);
+
 /**
  * \brief Add a file descriptor to the reactor
  * Callbacks will be called for its events.
@@ -97,6 +192,67 @@ void reactor_stop(struct Reactor *);
  */
 int reactor_add(struct Reactor *, int fd);
 
+/** `reactor_add_listener` flags */
+enum ReactorListenerFlags {
+    /**
+     * report the socket for as long as it has pending connections (instead
+     * of once per new connection), so connections can be accepted in
+     * bounded batches, leaving the rest for the following reviews.
+     */
+    REACTOR_LEVEL_TRIGGERED = 2,
+    /**
+     * wake a single reactor (EPOLLEXCLUSIVE) when a listening socket is
+     * shared by a number of processes (epoll only).
+     */
+    REACTOR_EXCLUSIVE = 4,
+    /**
+     * report errors and hangups as events (both `on_ready` and `on_data`)
+     * instead of closing the file descriptor, for file descriptors owned
+     * by someone else, who discovers the condition on the next read or
+     * write.
+     */
+    REACTOR_KEEP_OPEN = 8,
+    /**
+     * accept the connections using a multishot accept request (io_uring
+     * only), reporting them to `on_accept` instead of reporting the
+     * listener. Once the backend's accept fails (i.e. `EMFILE`) the listener
+     * is reported to `on_data` until `reactor_accept` has nothing to accept.
+     */
+    REACTOR_ACCEPT = 16,
+    /**
+     * once `reactor_read` drains the socket, receive the data using a
+     * multishot buffer-ring recv request (io_uring only), reporting the
+     * received data to `on_data`. The data must be read using
+     * `reactor_read`.
+     */
+    REACTOR_RECV = 32,
+};
+
+/**
+ * \brief Add a listening socket (or any file descriptor) to the reactor,
+ * using the `enum ReactorListenerFlags` flags (0 behaves the same as
+ * `reactor_add`).
+ * @return -1 on error
+ */
+int reactor_add_listener(struct Reactor *, int fd, int flags);
+
+/**
+ * \brief Accept a connection from a listening socket (the same as
+ * `accept4(fd, NULL, NULL, SOCK_NONBLOCK)`). Once there are no pending
+ * connections, `REACTOR_ACCEPT` listeners are accepted by the backend again.
+ * @return -1 on error (errno set)
+ * @return the accepted (non-blocking) socket
+ */
+int reactor_accept(struct Reactor *, int fd);
+
+/**
+ * \brief Read from a file descriptor (the same as `recv(fd, buffer, length,
+ * 0)`), returning the data received by the backend first (`REACTOR_RECV`).
+ * @return -1 on error (errno set, `EAGAIN` once the data was read)
+ * @return the number of bytes read (0 once the peer closed the connection)
+ */
+ssize_t reactor_read(struct Reactor *, int fd, void *buffer, size_t length);
+
 /**
  * \brief Remove a file descriptor from the reactor.
  * Further callbacks will not be called.
@@ -2,8 +2,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 static struct timespec start, now;
 
@@ -53,14 +55,12 @@ static void schedule_tasks(void *arg)
               schedule_tasks2, async /* as the argument to tasks2 */);
 }
 
-int main(void)
+static void test_queue(enum AsyncQueueType queue, unsigned char stealing)
 {
-    fprintf(stderr, "# Test async\n");
-
-    /* create the thread pool with a single threads.
-     * the callback is optional (we can pass NULL)
-     */
-    async_p async = Async.create(32);
+    /* create the thread pool with 32 threads. */
+    async_p async = Async.create_with((struct AsyncSettings) {
+                                          .threads = 32, .queue = queue,
+                                          .work_stealing = stealing});
     if (!async) {
         perror("Async creation failed");
         exit(1);
@@ -73,5 +73,250 @@ int main(void)
     Async.wait(async);
     clock_gettime(CLOCK_REALTIME, &now);
     fprintf(stderr, "# elapsed time: (%lf) ms\n", time_diff(start, now));
+}
+
+/* the order in which the priority test's tasks were performed */
+static char performed[2048];
+static int performed_count = 0;
+
+static void record_task(void *arg)
+{
+    performed[performed_count++] = *(char *)arg;
+}
+
+static void schedule_priorities(void *arg)
+{
+    static char lanes[] = "HNL";
+    async_p async = arg;
+    for (int i = 0; i < 200; i++)
+        Async.run_priority(async, ASYNC_PRIORITY_LOW, record_task, lanes + 2);
+    for (int i = 0; i < 200; i++)
+        Async.run(async, record_task, lanes + 1);
+    Async.run_priority(async, ASYNC_PRIORITY_HIGH, record_task, lanes);
+    Async.signal(async);
+}
+
+static void test_priorities(void)
+{
+    /* a single worker, so the order is deterministic */
+    async_p async = Async.create(1);
+    if (!async) {
+        perror("Async creation failed");
+        exit(1);
+    }
+    Async.run(async, schedule_priorities, async);
+    Async.wait(async);
+    int high = (int)(strchr(performed, 'H') - performed);
+    int low = (int)(strchr(performed, 'L') - performed);
+    fprintf(stderr, "# high priority task performed %d, first low priority "
+            "task performed %d (of %d)\n", high, low, performed_count);
+    if (performed_count != 401 || high > ASYNC_PRIORITY_BATCH ||
+        low > ASYNC_LOW_SHARE)
+        exit(1);
+}
+
+/* a high priority task queued behind normal tasks (right after a high
+ * priority task) is performed next, and a run of high priority tasks is
+ * bounded by ASYNC_PRIORITY_BATCH */
+static void schedule_high_first(void *arg)
+{
+    static char lanes[] = "HN";
+    async_p async = arg;
+    for (int i = 0; i < 1000; i++)
+        Async.run(async, record_task, lanes + 1);
+    for (int i = 0; i < 200; i++)
+        Async.run_priority(async, ASYNC_PRIORITY_HIGH, record_task, lanes);
+    Async.signal(async);
+}
+
+static void test_high_first(void)
+{
+    async_p async = Async.create(1);
+    if (!async) {
+        perror("Async creation failed");
+        exit(1);
+    }
+    performed_count = 0;
+    Async.run_priority(async, ASYNC_PRIORITY_HIGH, schedule_high_first,
+                       async);
+    Async.wait(async);
+    int high = (int)(strchr(performed, 'H') - performed);
+    int normal = (int)(strchr(performed, 'N') - performed);
+    fprintf(stderr, "# first high priority task performed %d, first normal "
+            "task performed %d (of %d)\n", high, normal, performed_count);
+    if (performed_count != 1200 || high > 2 ||
+        normal > ASYNC_PRIORITY_BATCH)
+        exit(1);
+}
+
+/* follow-up tasks scheduled by a worker stay on the worker's deque: the
+ * worker performs the newest first and the idle workers steal the rest */
+#define FOLLOW_UPS 256
+static pthread_t submitter;
+static int follow_ups[FOLLOW_UPS];
+static int follow_up_count = 0, stolen = 0;
+
+static void follow_up(void *arg)
+{
+    int i = __atomic_fetch_add(&follow_up_count, 1, __ATOMIC_RELAXED);
+    follow_ups[i] = (int)(size_t) arg;
+    if (!pthread_equal(pthread_self(), submitter)) {
+        __atomic_add_fetch(&stolen, 1, __ATOMIC_RELAXED);
+        usleep(100);
+    }
+}
+
+static void submit_follow_ups(void *arg)
+{
+    async_p async = arg;
+    submitter = pthread_self();
+    for (size_t i = 0; i < FOLLOW_UPS; i++)
+        Async.run(async, follow_up, (void *) i);
+    /* keep the submitter busy, so the others steal */
+    usleep(20000);
+    Async.signal(async);
+}
+
+static void test_follow_ups(int threads)
+{
+    async_p async = Async.create_with((struct AsyncSettings) {
+                                          .threads = threads,
+                                          .queue = ASYNC_QUEUE_RING,
+                                          .work_stealing = 1});
+    if (!async) {
+        perror("Async creation failed");
+        exit(1);
+    }
+    follow_up_count = stolen = 0;
+    Async.run(async, submit_follow_ups, async);
+    Async.wait(async);
+    fprintf(stderr, "# %d workers: %d follow-up tasks, %d stolen, the "
+            "first performed #%d\n", threads, follow_up_count, stolen,
+            follow_ups[0]);
+    if (follow_up_count != FOLLOW_UPS)
+        exit(1);
+    /* a single worker performs the newest first (LIFO) */
+    if (threads == 1) {
+        for (int i = 0; i < FOLLOW_UPS; i++)
+            if (follow_ups[i] != FOLLOW_UPS - 1 - i)
+                exit(1);
+    } else if (!stolen) {
+        exit(1);
+    }
+}
+
+/* the statistics count the tasks a fresh pool performed */
+#define STATS_TASKS 100
+static int stats_count = 0;
+
+static void count_stats(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&stats_count, 1, __ATOMIC_RELAXED);
+}
+
+static void test_stats(void)
+{
+    struct AsyncStats stats;
+    /* a dirty heap (the pool's memory isn't zeroed by the allocator) */
+    for (int i = 0; i < 8; i++) {
+        void *dirty = malloc(4096);
+        if (dirty)
+            memset(dirty, 0xa5, 4096);
+        free(dirty);
+    }
+    async_p async = Async.create(2);
+    if (!async) {
+        perror("Async creation failed");
+        exit(1);
+    }
+    for (int i = 0; i < STATS_TASKS; i++)
+        Async.run(async, count_stats, NULL);
+    /* a task is counted once it returns */
+    for (int i = 0; i < 1000; i++) {
+        Async.stats(async, &stats);
+        if (stats.executed >= STATS_TASKS)
+            break;
+        usleep(1000);
+    }
+    fprintf(stderr, "# stats: %zu queued, %zu executed, %zu waiting, %d "
+            "threads\n", stats.queued, stats.executed, stats.depth,
+            stats.threads);
+    Async.finish(async);
+    if (stats.queued != STATS_TASKS || stats.executed != STATS_TASKS ||
+        stats.depth || stats.threads != 2 ||
+        __atomic_load_n(&stats_count, __ATOMIC_RELAXED) != STATS_TASKS)
+        exit(1);
+}
+
+/* a batch larger than the ring overflows into the list, in `run` order */
+#define BATCH_TASKS 40
+static int batch_order[BATCH_TASKS];
+static int batch_count = 0;
+static volatile int batch_blocked;
+
+static void block_worker(void *arg)
+{
+    (void) arg;
+    while (batch_blocked)
+        usleep(1000);
+}
+
+static void record_batch(void *arg)
+{
+    batch_order[batch_count++] = (int)(size_t) arg;
+}
+
+static void test_batch(void)
+{
+    struct AsyncJob jobs[BATCH_TASKS];
+    struct AsyncStats stats;
+    /* a single worker (so the order is deterministic), kept busy while the
+     * batch is scheduled, so the ring fills up */
+    async_p async = Async.create_with((struct AsyncSettings) {
+                                          .threads = 1,
+                                          .queue = ASYNC_QUEUE_RING,
+                                          .ring_size = 8});
+    if (!async) {
+        perror("Async creation failed");
+        exit(1);
+    }
+    for (size_t i = 0; i < BATCH_TASKS; i++)
+        jobs[i] = (struct AsyncJob) {.task = record_batch, .arg = (void *) i};
+    batch_blocked = 1;
+    Async.run(async, block_worker, NULL);
+    int scheduled = Async.run_batch(async, jobs, BATCH_TASKS);
+    int empty = Async.run_batch(async, jobs, 0);
+    Async.stats(async, &stats);
+    batch_blocked = 0;
+    Async.finish(async);
+    fprintf(stderr, "# batch: %d of %d scheduled (%zu queued), %d "
+            "performed\n", scheduled, BATCH_TASKS, stats.queued, batch_count);
+    if (scheduled != BATCH_TASKS || empty != -1 ||
+        stats.queued != BATCH_TASKS + 1 || batch_count != BATCH_TASKS)
+        exit(1);
+    for (int i = 0; i < BATCH_TASKS; i++)
+        if (batch_order[i] != i)
+            exit(1);
+}
+
+int main(void)
+{
+    fprintf(stderr, "# Test async (mutex queue)\n");
+    test_queue(ASYNC_QUEUE_MUTEX, 0);
+    fprintf(stderr, "# Test async (lock-free ring)\n");
+    test_queue(ASYNC_QUEUE_RING, 0);
+    fprintf(stderr, "# Test async (work stealing)\n");
+    test_queue(ASYNC_QUEUE_RING, 1);
+    fprintf(stderr, "# Test async (priorities)\n");
+    test_priorities();
+    test_high_first();
+    fprintf(stderr, "# Test async (follow-up tasks)\n");
+    test_follow_ups(1);
+    test_follow_ups(4);
+    fprintf(stderr, "# Test async (batches)\n");
+    test_batch();
+    fprintf(stderr, "# Test async (statistics)\n");
+    test_stats();
     return 0;
 }
@@ -1,10 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "buffer.h"
 
+/* a thread writing (allocating) the packets another thread frees */
+#define ROUNDS 1000
+static pthread_barrier_t barrier;
+
+static void *writer(void *buf)
+{
+    static char data[100];
+    for (int i = 0; i < ROUNDS; i++) {
+        for (int j = 0; j < 10; j++)
+            Buffer.write(buf, data, sizeof(data));
+        pthread_barrier_wait(&barrier); /* written */
+        pthread_barrier_wait(&barrier); /* cleared */
+    }
+    return NULL;
+}
+
+/* packets freed by another thread return to the writer (not the pool) */
+static int test_cross_thread(void)
+{
+    struct BufferStats before, after;
+    pthread_t thread;
+    void *buf = Buffer.new(0);
+    pthread_barrier_init(&barrier, NULL, 2);
+    pthread_create(&thread, NULL, writer, buf);
+    for (int i = 0; i < ROUNDS; i++) {
+        pthread_barrier_wait(&barrier);
+        Buffer.clear(buf);
+        if (i == 0)
+            Buffer.stats(&before);
+        pthread_barrier_wait(&barrier);
+    }
+    pthread_join(thread, NULL);
+    Buffer.stats(&after);
+    Buffer.destroy(buf);
+    pthread_barrier_destroy(&barrier);
+    printf("cross thread packets: %zu grabbed from the pool, %zu allocated "
+           "after the first round\n",
+           after.packet_hits - before.packet_hits,
+           after.packet_misses - before.packet_misses);
+    return after.packet_hits + after.packet_misses !=
+           before.packet_hits + before.packet_misses;
+}
+
+/* a temporary file holding "0123456789" */
+static int ten_bytes(void)
+{
+    char path[] = "/tmp/test-buffer.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (write(fd, "0123456789", 10) != 10) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* files sent without copying (`Buffer.sendfd`) over a socket pair: a range
+ * past the end of the file is limited to it, a file truncated while it's
+ * sent closes the connection */
+static int test_sendfd(void)
+{
+    char data[64];
+    int sv[2], fd, failed = 0;
+    void *buf = Buffer.new(0);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) || (fd = ten_bytes()) < 0)
+        return 1;
+    /* longer than the file */
+    failed |= Buffer.sendfd(buf, dup(fd), 0, 1000) ||
+              Buffer.flush(buf, sv[0]) != 10 || !Buffer.is_empty(buf);
+    /* the offset is past the end of the file */
+    failed |= Buffer.sendfd(buf, dup(fd), 100, 10) ||
+              Buffer.flush(buf, sv[0]) != 0 || !Buffer.is_empty(buf);
+    Buffer.write(buf, "after", 5);
+    failed |= Buffer.flush(buf, sv[0]) != 5 ||
+              read(sv[1], data, sizeof(data)) != 15 ||
+              memcmp(data, "0123456789after", 15);
+    /* truncated before it's sent, the rest of the buffer is discarded */
+    failed |= Buffer.sendfd(buf, fd, 0, 0) || ftruncate(fd, 4);
+    Buffer.write(buf, "lost", 4);
+    failed |= Buffer.flush(buf, sv[0]) != 4;
+    /* a short write, the end of the file is found by the next flush */
+    failed |= Buffer.flush(buf, sv[0]) != 0 || !Buffer.is_empty(buf) ||
+              read(sv[1], data, sizeof(data)) != 4 ||
+              read(sv[1], data, sizeof(data)) != 0;
+    printf("sendfd: %s\n", failed ? "failed" : "passed");
+    Buffer.destroy(buf);
+    close(sv[1]);
+    return failed;
+}
+
+/* a connection reset by the peer is an error, not a full socket */
+static int test_reset(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    int srv = socket(AF_INET, SOCK_STREAM, 0), client, peer, failed = 1;
+    void *buf = Buffer.new(0);
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (!bind(srv, (struct sockaddr *) &addr, len) && !listen(srv, 1) &&
+        !getsockname(srv, (struct sockaddr *) &addr, &len) &&
+        !connect(client, (struct sockaddr *) &addr, len) &&
+        (peer = accept(srv, NULL, NULL)) >= 0) {
+        /* closing with a zero linger resets the connection */
+        setsockopt(peer, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        close(peer);
+        usleep(10000);
+        Buffer.write(buf, "data", 4);
+        failed = Buffer.flush(buf, client) != -1;
+    }
+    printf("reset connection: %s\n", failed ? "failed" : "passed");
+    Buffer.destroy(buf);
+    close(client);
+    close(srv);
+    return failed;
+}
+
+/* @return non-zero unless the write added exactly `small`, `medium` and
+ * `large` packets (256B, 4KB and 64KB) to the classes' `in_use` counts */
+static int write_uses(void *buf, size_t length, size_t small, size_t medium,
+                      size_t large)
+{
+    static char data[1024 * 100];
+    struct BufferPoolStats before[BUFFER_SIZE_CLASSES],
+        after[BUFFER_SIZE_CLASSES];
+    Buffer.pool_stats(before);
+    Buffer.write(buf, data, length);
+    Buffer.pool_stats(after);
+    printf("a %zu bytes write: %zu, %zu and %zu packets of %zu, %zu and %zu "
+           "bytes\n", length, after[0].in_use - before[0].in_use,
+           after[1].in_use - before[1].in_use,
+           after[2].in_use - before[2].in_use, after[0].size, after[1].size,
+           after[2].size);
+    return after[0].in_use - before[0].in_use != small ||
+           after[1].in_use - before[1].in_use != medium ||
+           after[2].in_use - before[2].in_use != large;
+}
+
+/* writes use the smallest class that fits, larger writes are chained using
+ * 64KB packets (and the smallest class that fits the rest). Without any live
+ * buffer the pool and the thread caches are empty, so every packet is
+ * counted by the write that allocated it. */
+static int test_size_classes(void *buf)
+{
+    int failed = write_uses(buf, 100, 1, 0, 0);
+    failed |= write_uses(buf, 1000, 0, 1, 0);
+    failed |= write_uses(buf, 1024 * 64 + 1000, 0, 1, 1);
+    failed |= write_uses(buf, 1024 * 100, 0, 0, 2);
+    return failed;
+}
+
 int main(void)
 {
+    struct BufferPoolStats stats[BUFFER_SIZE_CLASSES];
+    int failed = test_cross_thread();
+    failed |= test_sendfd();
+    signal(SIGPIPE, SIG_IGN);
+    failed |= test_reset();
     void *buf = Buffer.new(0);
 
+    failed |= test_size_classes(buf);
+
     Buffer.destroy(buf);
 
-    return 0;
+    /* the last buffer releases every packet (the thread caches too) */
+    Buffer.pool_stats(stats);
+    for (int i = 0; i < BUFFER_SIZE_CLASSES; i++)
+        if (stats[i].in_use || stats[i].pooled) {
+            printf("packets of %lu bytes: %lu left in use, %lu pooled\n",
+                   stats[i].size, stats[i].in_use, stats[i].pooled);
+            failed = 1;
+        }
+    return failed;
 }
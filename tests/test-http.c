@@ -0,0 +1,121 @@
+#include "http.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int failed = 0;
+
+#define check(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__,     \
+                    #cond);                                                \
+            failed++;                                                      \
+        }                                                                  \
+    } while (0)
+
+/* parse a complete request (a fresh parse) */
+static ssize_t parse(struct HttpRequest *request, const char *data)
+{
+    unsigned int progress = 0;
+    return Http.parse(request, data, strlen(data), &progress);
+}
+
+static void test_request(void)
+{
+    static char data[] =
+        "GET /path?a=1 HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "X-Spaces:   padded \t\r\n"
+        "\r\n";
+    struct HttpRequest request;
+    size_t length;
+    const char *value;
+    check(parse(&request, data) == (ssize_t) strlen(data));
+    check(request.method_len == 3 && !memcmp(request.method, "GET", 3));
+    check(request.path_len == 9 && !memcmp(request.path, "/path?a=1", 9));
+    check(request.query_len == 3 && !memcmp(request.query, "a=1", 3));
+    check(request.version == 1 && request.keep_alive);
+    check(request.header_count == 2 && !request.body);
+    value = Http.header(&request, "host", &length);
+    check(value && length == 9 && !memcmp(value, "localhost", 9));
+    value = Http.header(&request, "X-SPACES", &length);
+    check(value && length == 6 && !memcmp(value, "padded", 6));
+    check(!Http.header(&request, "Missing", &length) && !length);
+}
+
+/* a request arriving a byte at a time resumes the search */
+static void test_partial(void)
+{
+    static char data[] =
+        "POST /form HTTP/1.0\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: 5\r\n"
+        "\r\n"
+        "hello";
+    struct HttpRequest request;
+    unsigned int progress = 0;
+    size_t length = strlen(data);
+    for (size_t i = 1; i < length; i++) {
+        check(Http.parse(&request, data, i, &progress) == 0);
+        check(progress <= i);
+    }
+    check(Http.parse(&request, data, length, &progress) == (ssize_t) length);
+    check(request.body_len == 5 && !memcmp(request.body, "hello", 5));
+    check(request.version == 0 && request.keep_alive);
+    check(progress == 0);
+}
+
+/* pipelined requests are parsed one at a time */
+static void test_pipelined(void)
+{
+    static char data[] =
+        "\r\nGET /1 HTTP/1.1\r\n\r\n"
+        "GET /2 HTTP/1.1\r\nConnection: close\r\n\r\n"
+        "GET /3 HTTP/1.0\n\n";
+    struct HttpRequest request;
+    const char *pos = data;
+    ssize_t length;
+    for (int i = 1; i <= 3; i++) {
+        unsigned int progress = 0;
+        length = Http.parse(&request, pos, strlen(pos), &progress);
+        check(length > 0);
+        check(request.path_len == 2 && request.path[1] == '0' + i);
+        check(request.keep_alive == (i == 1));
+        pos += length > 0 ? length : 0;
+    }
+    check(!*pos);
+}
+
+static void test_errors(void)
+{
+    struct HttpRequest request;
+    static char huge[HTTP_MAX_HEAD + 64];
+    check(parse(&request, "GET\r\n\r\n") == -400);
+    check(parse(&request, "GET / HTTP/2.0\r\n\r\n") == -400);
+    check(parse(&request, "GET / HTTP/1.1\r\nNo colon\r\n\r\n") == -400);
+    check(parse(&request, "GET / HTTP/1.1\r\nName : value\r\n\r\n") == -400);
+    check(parse(&request, "GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n") ==
+          -400);
+    check(parse(&request, "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n") ==
+          -400);
+    check(parse(&request, "POST / HTTP/1.1\r\nContent-Length: 1\r\n"
+                          "Content-Length: 2\r\n\r\n") == -400);
+    check(parse(&request, "POST / HTTP/1.1\r\nContent-Length: 99999\r\n\r\n") ==
+          -413);
+    check(parse(&request, "POST / HTTP/1.1\r\n"
+                          "Transfer-Encoding: chunked\r\n\r\n") == -501);
+    memset(huge, 'a', sizeof(huge) - 1);
+    memcpy(huge, "GET / HTTP/1.1\r\nX: ", 19);
+    check(parse(&request, huge) == -431);
+}
+
+int main(void)
+{
+    test_request();
+    test_partial();
+    test_pipelined();
+    test_errors();
+    printf("# HTTP parser tests: %s\n", failed ? "failed" : "passed");
+    return failed != 0;
+}
@@ -1,48 +1,928 @@
 #include "protocol-server.h"
+#include "buffer.h"
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 
-// we don't have to, but printing stuff is nice...
-void on_open(server_pt server, int sockfd)
+static int failed = 0;
+
+/* the server's high watermark (the low one defaults to half of it) */
+#define TEST_HIGH_WATERMARK (256 * 1024)
+
+#define check(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__,     \
+                    #cond);                                                \
+            failed++;                                                      \
+        }                                                                  \
+    } while (0)
+
+/* wait (up to `ms` milliseconds) for a condition set by the server */
+#define wait_for(cond, ms)                                                 \
+    do {                                                                   \
+        for (int wait_ = 0; wait_ < (ms) && !(cond); wait_++)              \
+            usleep(1000);                                                  \
+    } while (0)
+
+/* the test cases run on their own thread, once the server is running */
+static server_pt server;
+static pthread_t tests;
+static volatile int running = 0;
+
+/* a connection is attached with one end of a socket pair, the test drives
+ * it using the other end.
+ * @return the server's end (the test's end is stored in `peer`) */
+static int attach_pair(struct Protocol *protocol, int *peer)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        return -1;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    if (Server.attach(server, fds[0], protocol)) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    *peer = fds[1];
+    return fds[0];
+}
+
+/* read from the test's end (waiting up to `ms` milliseconds for the data)
+ * @return 0 once the server closed the connection, -1 on timeout */
+static ssize_t peer_read_within(int fd, void *data, size_t length, int ms)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, ms) <= 0)
+        return -1;
+    return read(fd, data, length);
+}
+
+static ssize_t peer_read(int fd, void *data, size_t length)
+{
+    return peer_read_within(fd, data, length, 1000);
+}
+
+/* an echo protocol */
+static void echo_on_data(server_pt srv, int fd)
+{
+    char buff[1024];
+    ssize_t incoming;
+    while ((incoming = Server.read(srv, fd, buff, sizeof(buff))) > 0)
+        Server.write(srv, fd, buff, incoming);
+}
+
+static struct Protocol echo = {.service = "echo", .on_data = echo_on_data};
+
+static void test_echo(void)
+{
+    static struct ServerLatency latency;
+    char buff[16];
+    int peer, fd = attach_pair(&echo, &peer);
+    check(fd >= 0);
+    if (fd < 0) return;
+    check(write(peer, "hello", 5) == 5);
+    check(peer_read(peer, buff, sizeof(buff)) == 5 &&
+          !memcmp(buff, "hello", 5));
+    close(peer);
+    /* the histograms are only collected by a SERVER_LATENCY build
+     * (`test-protocol-server-latency`), the callback is measured once it
+     * returned */
+#if SERVER_LATENCY
+    wait_for(!Server.latency(server, "echo", SERVER_LATENCY_ON_DATA,
+                             &latency) && latency.count, 1000);
+    check(latency.count && Server.latency_percentile(&latency, 100) > 0);
+    check(!Server.latency(server, "echo", SERVER_LATENCY_FLUSH, &latency) &&
+          latency.count);
+#else
+    check(Server.latency(server, "echo", SERVER_LATENCY_ON_DATA,
+                         &latency) == -1);
+#endif
+}
+
+/* Timers */
+
+static void count_tick(void *arg) { __atomic_add_fetch((int *) arg, 1,
+                                                       __ATOMIC_SEQ_CST); }
+
+static void test_timers(void)
+{
+    static int once, every, fine;
+    struct timespec start, end;
+    /* repeating timers require an interval */
+    check(Server.run_every(server, 0, 0, count_tick, &every) == -1);
+    check(Server.run_every(server, 0, 5, count_tick, &every) == -1);
+    check(Server.run_after(server, 0, count_tick, &once) > 0);
+    int timer = Server.run_every(server, 1, 0, count_tick, &every);
+    check(timer > 0);
+    wait_for(once && every >= 5, 1000);
+    check(once == 1 && every >= 5);
+    check(!Server.cancel_timer(server, timer));
+    int ticks = __atomic_load_n(&every, __ATOMIC_SEQ_CST);
+    usleep(20000);
+    /* a task that was already running might finish */
+    check(__atomic_load_n(&every, __ATOMIC_SEQ_CST) <= ticks + 1);
+    check(Server.cancel_timer(server, timer) == -1);
+    /* sub-millisecond timers: 20 ticks of 100us (well within a second) */
+    check(Server.run_every_us(server, 0, 0, count_tick, &fine) == -1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    check(Server.run_every_us(server, 100, 20, count_tick, &fine) > 0);
+    wait_for(__atomic_load_n(&fine, __ATOMIC_SEQ_CST) == 20, 1000);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    check(fine == 20);
+    check((end.tv_sec - start.tv_sec) * 1000000000L +
+          (end.tv_nsec - start.tv_nsec) >= 2000000);
+    check(Server.run_after_us(server, 50, count_tick, &once) > 0);
+    wait_for(__atomic_load_n(&once, __ATOMIC_SEQ_CST) == 2, 1000);
+    check(once == 2);
+}
+
+/* Connection timeouts (the timeout wheel) */
+
+static int pinged;
+
+static void ping_on_ping(server_pt srv, int fd)
+{
+    (void) srv;
+    (void) fd;
+    __atomic_add_fetch(&pinged, 1, __ATOMIC_SEQ_CST);
+}
+
+static struct Protocol ping = {.service = "ping", .on_data = echo_on_data,
+                               .ping = ping_on_ping};
+
+static void test_timeouts(void)
+{
+    struct ServerStats before, after;
+    char buff[16];
+    int idle, active, pinging;
+    Server.stats(server, &before);
+    int idle_fd = attach_pair(&echo, &idle);
+    int active_fd = attach_pair(&echo, &active);
+    int pinging_fd = attach_pair(&ping, &pinging);
+    check(idle_fd >= 0 && active_fd >= 0 && pinging_fd >= 0);
+    if (idle_fd < 0 || active_fd < 0 || pinging_fd < 0) return;
+    Server.set_timeout(server, idle_fd, 1);
+    /* the wheel ticks once a second, a touch might be a second late */
+    Server.set_timeout(server, active_fd, 2);
+    Server.set_timeout(server, pinging_fd, 1);
+    /* the active connection is touched by it's traffic */
+    for (int i = 0; i < 12; i++) {
+        check(write(active, "x", 1) == 1);
+        check(peer_read(active, buff, sizeof(buff)) == 1);
+        usleep(250000);
+    }
+    /* the idle connection timed out (it's review happens within a tick) */
+    check(peer_read_within(idle, buff, sizeof(buff), 0) == 0);
+    /* a protocol with a `ping` callback is pinged instead */
+    check(pinged > 0);
+    check(write(pinging, "x", 1) == 1);
+    check(peer_read(pinging, buff, sizeof(buff)) == 1);
+    /* the active connection times out once it's idle */
+    check(peer_read_within(active, buff, sizeof(buff), 4000) == 0);
+    Server.stats(server, &after);
+    check(after.timeouts - before.timeouts == 2);
+    Server.close(server, pinging_fd);
+    close(idle);
+    close(active);
+    close(pinging);
+}
+
+/* The read buffer: a line protocol parsing the data in place */
+
+static size_t left_unread; /**< the unread bytes following the last line */
+
+static void lines_on_data(server_pt srv, int fd)
+{
+    size_t length;
+    char *data, *eol;
+    while ((data = Server.peek(srv, fd, &length)) &&
+           (eol = memchr(data, '\n', length))) {
+        Server.write(srv, fd, data, eol + 1 - data);
+        Server.consume(srv, fd, eol + 1 - data);
+    }
+    left_unread = data ? length : 0;
+}
+
+static struct Protocol lines = {.service = "lines", .on_data = lines_on_data,
+                                .read_buffer = 1};
+
+/* @return non-zero if the server's reactors use the io_uring backend */
+static int uring_backend(void)
+{
+    return Server.reactor(server)->backend == REACTOR_BACKEND_IO_URING;
+}
+
+static void test_read_buffer(void)
+{
+    struct ServerStats before, after;
+    char buff[64];
+    Server.stats(server, &before);
+    int peer, fd = attach_pair(&lines, &peer);
+    check(fd >= 0);
+    if (fd < 0) return;
+    /* a line spread over a number of reads */
+    check(write(peer, "hel", 3) == 3);
+    check(peer_read_within(peer, buff, sizeof(buff), 50) == -1);
+    wait_for(left_unread == 3, 1000);
+    check(left_unread == 3);
+    check(write(peer, "lo\nwor", 6) == 6);
+    check(peer_read(peer, buff, sizeof(buff)) == 6 &&
+          !memcmp(buff, "hello\n", 6));
+    wait_for(left_unread == 3, 1000);
+    check(left_unread == 3);
+    check(write(peer, "ld\n", 3) == 3);
+    check(peer_read(peer, buff, sizeof(buff)) == 6 &&
+          !memcmp(buff, "world\n", 6));
+    /* a number of lines read at once */
+    check(write(peer, "a\nb\nc", 5) == 5);
+    check(peer_read(peer, buff, sizeof(buff)) == 4 &&
+          !memcmp(buff, "a\nb\n", 4));
+    wait_for(left_unread == 1, 1000);
+    check(left_unread == 1);
+    /* once drained, the following data was received by the backend */
+    Server.stats(server, &after);
+    if (uring_backend() && Server.settings(server)->threads <= 1)
+        check(after.reactor_received > before.reactor_received);
+    close(peer);
+}
+
+/* The live connection index */
+
+static struct Protocol index_a = {.service = "index-a",
+                                  .on_data = echo_on_data};
+static struct Protocol index_b = {.service = "index-b",
+                                  .on_data = echo_on_data};
+
+static void test_index(void)
+{
+    int peers[5], fds[5];
+    /* the earlier tests' connections might still be closing */
+    wait_for(!Server.count(server, NULL), 1000);
+    long all = Server.count(server, NULL);
+    for (int i = 0; i < 5; i++) {
+        fds[i] = attach_pair(i < 3 ? &index_a : &index_b, peers + i);
+        check(fds[i] >= 0);
+        if (fds[i] < 0) return;
+    }
+    check(Server.count(server, "index-a") == 3);
+    check(Server.count(server, "index-b") == 2);
+    check(Server.count(server, NULL) == all + 5);
+    /* closed connections are unlisted (a peer closing, or the server) */
+    close(peers[0]);
+    Server.close(server, fds[1]);
+    wait_for(Server.count(server, "index-a") == 1, 1000);
+    check(Server.count(server, "index-a") == 1);
+    check(Server.count(server, NULL) == all + 3);
+    /* a connection switching protocols moves to the new service */
+    check(!Server.set_protocol(server, fds[3], &index_a));
+    check(Server.count(server, "index-a") == 2);
+    check(Server.count(server, "index-b") == 1);
+    for (int i = 2; i < 5; i++)
+        close(peers[i]);
+    wait_for(!Server.count(server, "index-a") &&
+                 !Server.count(server, "index-b"), 1000);
+    check(!Server.count(server, "index-a") && !Server.count(server, "index-b"));
+    check(!Server.count(server, "missing"));
+    close(peers[1]);
+}
+
+/* Write batches */
+
+static size_t batched; /**< the data pending once `on_data` wrote it all */
+
+static void pieces_on_data(server_pt srv, int fd)
+{
+    char buff[64];
+    while (Server.read(srv, fd, buff, sizeof(buff)) > 0)
+        ;
+    Server.write(srv, fd, "head,", 5);
+    Server.write(srv, fd, "body,", 5);
+    Server.write(srv, fd, "tail", 4);
+    batched = Server.pending(srv, fd);
+}
+
+static struct Protocol pieces = {.service = "pieces",
+                                 .on_data = pieces_on_data};
+
+static void test_batches(void)
+{
+    static char large[1024 * 100];
+    char buff[64];
+    int peer, fd = attach_pair(&pieces, &peer);
+    check(fd >= 0);
+    if (fd < 0) return;
+    /* `on_data`'s writes are queued, and flushed once it returns */
+    check(write(peer, "go", 2) == 2);
+    check(peer_read(peer, buff, sizeof(buff)) == 14 &&
+          !memcmp(buff, "head,body,tail", 14));
+    check(batched == 14);
+    /* an explicit batch is flushed once it ends (batches belong to the task
+     * handling the connection, wait for `on_data` to return) */
+    wait_for(!Server.is_busy(server, fd), 1000);
+    check(!Server.begin_batch(server, fd));
+    check(!Server.begin_batch(server, fd));
+    check(Server.write(server, fd, "one", 3) >= 0);
+    check(!Server.end_batch(server, fd));
+    check(peer_read_within(peer, buff, sizeof(buff), 50) == -1);
+    check(!Server.end_batch(server, fd));
+    check(peer_read(peer, buff, sizeof(buff)) == 3);
+    check(Server.end_batch(server, fd) == -1);
+    /* a large batch is flushed before it ends */
+    check(!Server.begin_batch(server, fd));
+    check(Server.write(server, fd, large, sizeof(large)) >= 0);
+    check(peer_read_within(peer, buff, sizeof(buff), 50) > 0);
+    check(!Server.end_batch(server, fd));
+    close(peer);
+}
+
+/* Shared blobs */
+
+static void test_shared(void)
+{
+    static char large[1024 * 1024];
+    char buff[16];
+    int peers[3], fds[3];
+    void *blob = Server.shared_new("shared", 6);
+    check(blob && Buffer.shared_refs(blob) == 1);
+    if (!blob) return;
+    for (int i = 0; i < 3; i++) {
+        fds[i] = attach_pair(&echo, peers + i);
+        check(fds[i] >= 0);
+        if (fds[i] < 0) return;
+    }
+    /* sent blobs release their references */
+    for (int i = 0; i < 2; i++) {
+        check(!Server.write_shared(server, fds[i], blob));
+        check(peer_read(peers[i], buff, sizeof(buff)) == 6 &&
+              !memcmp(buff, "shared", 6));
+    }
+    wait_for(Buffer.shared_refs(blob) == 1, 1000);
+    check(Buffer.shared_refs(blob) == 1);
+    /* an unsent blob holds a reference, until the connection closes */
+    check(Server.write(server, fds[2], large, sizeof(large)) >= 0);
+    check(!Server.write_shared(server, fds[2], blob));
+    check(Buffer.shared_refs(blob) == 2);
+    close(peers[2]);
+    wait_for(Buffer.shared_refs(blob) == 1, 1000);
+    check(Buffer.shared_refs(blob) == 1);
+    Server.shared_free(blob);
+    close(peers[0]);
+    close(peers[1]);
+}
+
+/* Watermarks */
+
+static int filled, drained;
+
+static void flow_on_full(server_pt srv, int fd)
+{
+    (void) srv, (void) fd;
+    __atomic_add_fetch(&filled, 1, __ATOMIC_SEQ_CST);
+}
+
+static void flow_on_drain(server_pt srv, int fd)
+{
+    (void) srv, (void) fd;
+    __atomic_add_fetch(&drained, 1, __ATOMIC_SEQ_CST);
+}
+
+static struct Protocol flow = {.service = "flow", .on_data = echo_on_data,
+                               .on_full = flow_on_full,
+                               .on_drain = flow_on_drain};
+
+static void test_watermarks(void)
 {
-    printf("A connection was accepted on socket #%d.\n", sockfd);
+    static char chunk[16 * 1024];
+    char buff[64 * 1024];
+    int peer, fd = attach_pair(&flow, &peer);
+    ssize_t got;
+    check(fd >= 0);
+    if (fd < 0) return;
+    /* the peer doesn't read, until the high watermark is reached */
+    for (int i = 0; i < 256 && !__atomic_load_n(&filled, __ATOMIC_SEQ_CST);
+         i++)
+        check(Server.write(server, fd, chunk, sizeof(chunk)) >= 0);
+    check(filled == 1 && !drained);
+    check(Server.pending(server, fd) >= TEST_HIGH_WATERMARK);
+    /* once the peer reads, the buffer drains to the low watermark */
+    while ((got = peer_read_within(peer, buff, sizeof(buff), 100)) > 0)
+        ;
+    wait_for(__atomic_load_n(&drained, __ATOMIC_SEQ_CST), 1000);
+    check(filled == 1 && drained == 1);
+    check(Server.pending(server, fd) <= TEST_HIGH_WATERMARK / 2);
+    close(peer);
 }
 
-// server_pt is just a nicely typed pointer,
-void on_close(server_pt server, int sockfd)
+/* Fibers (Server.await) */
+
+static int awaited = -1;  /**< the descriptor the handler awaits */
+static long await_ms;     /**< the handler's timeout */
+static int await_result;  /**< the value `Server.await` returned */
+static int await_calls;   /**< the handlers that returned */
+static int await_close;   /**< the handler closes it's connection first */
+
+static void waiter_on_data(server_pt srv, int fd)
 {
-    printf("Socket #%d is now disconnected.\n", sockfd);
+    char buff[16];
+    ssize_t got;
+    while (Server.read(srv, fd, buff, sizeof(buff)) > 0)
+        ;
+    if (await_close)
+        Server.close(srv, fd);
+    int ret = Server.await(srv, awaited, SERVER_AWAIT_READ, await_ms);
+    /* the connection (and the fd) can only be used if the await succeeded */
+    if (ret > 0 && (got = read(awaited, buff, sizeof(buff))) > 0)
+        Server.write(srv, fd, buff, got);
+    else if (!ret)
+        Server.write(srv, fd, "timeout", 7);
+    __atomic_store_n(&await_result, ret, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&await_calls, 1, __ATOMIC_SEQ_CST);
 }
 
-// a simple echo... this is the main callback
-void on_data(server_pt server, int sockfd)
+static struct Protocol waiter = {.service = "waiter",
+                                 .on_data = waiter_on_data, .fiber = 1};
+
+/* start the handler on a new connection, awaiting `fd` */
+static int start_waiter(int fd, long ms, int *peer)
 {
-    char buff[1024]; // We'll assign a reading buffer on the stack
-    ssize_t incoming = 0;
-    // Read everything, this is edge triggered, `on_data` won't be called
-    // again until all the data was read.
-    while ((incoming = Server.read(server, sockfd, buff, 1024)) > 0) {
-        // since the data is stack allocated, we'll write a copy
-        // optionally, we could avoid a copy using Server.write_move
-        Server.write(server, sockfd, buff, incoming);
-        if (!memcmp(buff, "bye", 3)) {
-            ; // closes the connection automatically AFTER the buffer was sent.
-            Server.close(server, sockfd);
-        }
+    int conn = attach_pair(&waiter, peer);
+    awaited = fd;
+    await_ms = ms;
+    await_calls = 0;
+    await_result = -2;
+    if (conn >= 0 && write(*peer, "go", 2) != 2)
+        return -1;
+    return conn;
+}
+
+static void test_await(void)
+{
+    char buff[16];
+    int pipes[2], peer, conn;
+    check(!pipe(pipes));
+    fcntl(pipes[0], F_SETFL, fcntl(pipes[0], F_GETFL) | O_NONBLOCK);
+    /* resumed once the fd is readable */
+    conn = start_waiter(pipes[0], 1000, &peer);
+    check(conn >= 0);
+    usleep(50000);
+    check(!await_calls && Server.is_busy(server, conn));
+    check(write(pipes[1], "ready", 5) == 5);
+    wait_for(await_calls, 1000);
+    check(await_calls == 1 && await_result == 1);
+    check(peer_read(peer, buff, sizeof(buff)) == 5 &&
+          !memcmp(buff, "ready", 5));
+    close(peer);
+    /* resumed once the timeout is reached */
+    conn = start_waiter(pipes[0], 50, &peer);
+    wait_for(await_calls, 1000);
+    check(await_calls == 1 && !await_result);
+    check(peer_read(peer, buff, sizeof(buff)) == 7 &&
+          !memcmp(buff, "timeout", 7));
+    close(peer);
+    /* the peer closing the connection wakes the handler */
+    conn = start_waiter(pipes[0], -1, &peer);
+    usleep(50000);
+    check(!await_calls);
+    close(peer);
+    wait_for(await_calls, 1000);
+    check(await_calls == 1 && await_result == -1);
+    /* the connection's fd is reused while the handler is suspended: the
+     * handler is woken (without the fd), the new connection is left alone */
+    wait_for(!Server.count(server, "waiter"), 1000);
+    conn = start_waiter(pipes[0], -1, &peer);
+    usleep(50000);
+    Server.close(server, conn);
+    close(peer);
+    wait_for(!Server.count(server, NULL), 1000);
+    /* the lowest descriptors are reused */
+    check(attach_pair(&echo, &peer) == conn);
+    wait_for(await_calls, 1000);
+    check(await_calls == 1 && await_result == -1);
+    check(write(peer, "echo", 4) == 4);
+    check(peer_read(peer, buff, sizeof(buff)) == 4 &&
+          !memcmp(buff, "echo", 4));
+    check(peer_read_within(peer, buff, sizeof(buff), 50) < 0);
+    close(peer);
+    /* handlers closing their connection before awaiting: the await fails,
+     * and the fd it named (then attached by another connection) is left
+     * alone by the (pooled) fiber's next handler */
+    int pair[2], echoed = pipes[0];
+    wait_for(!Server.count(server, NULL), 1000);
+    await_close = 1;
+    conn = start_waiter(echoed, -1, &peer);
+    wait_for(await_calls, 1000);
+    check(await_calls == 1 && await_result == -1);
+    close(peer);
+    wait_for(!Server.count(server, NULL), 1000);
+    check(!socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+    check(dup2(pair[0], echoed) == echoed);
+    close(pair[0]);
+    fcntl(echoed, F_SETFL, fcntl(echoed, F_GETFL) | O_NONBLOCK);
+    check(!Server.attach(server, echoed, &echo));
+    conn = start_waiter(-1, -1, &peer);
+    wait_for(await_calls, 1000);
+    check(await_calls == 1 && await_result == -1);
+    await_close = 0;
+    close(peer);
+    check(write(pair[1], "echo", 4) == 4);
+    check(peer_read(pair[1], buff, sizeof(buff)) == 4 &&
+          !memcmp(buff, "echo", 4));
+    close(pair[1]);
+    close(pipes[1]);
+}
+
+/* Running out of file descriptors */
+
+/* connect a socket to the server's port (the connection waits in the
+ * backlog until it's accepted) */
+static int connect_server(int fd)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(8094),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    return connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+}
+
+static void test_exhausted(void)
+{
+    struct ServerStats before, after;
+    struct rlimit limit;
+    char buff[16];
+    int clients[3], *held, count = 0;
+    wait_for(!Server.count(server, NULL), 1000);
+    for (int i = 0; i < 3; i++)
+        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    held = malloc(limit.rlim_cur * sizeof(int));
+    check(held != NULL);
+    if (!held) return;
+    Server.stats(server, &before);
+    /* no descriptors are left for the server (taken rather than limited,
+     * the io_uring accept requests keep the limit they were armed with) */
+    while ((held[count] = dup(0)) >= 0)
+        count++;
+    check(errno == EMFILE);
+    /* the pending connections are rejected (rather than left pending) */
+    for (int i = 0; i < 3; i++) {
+        check(!connect_server(clients[i]));
+        check(peer_read(clients[i], buff, sizeof(buff)) == 0);
+    }
+    Server.stats(server, &after);
+    check(after.rejected == before.rejected + 3);
+    check(after.accepted == before.accepted);
+    while (count)
+        close(held[--count]);
+    free(held);
+    for (int i = 0; i < 3; i++)
+        close(clients[i]);
+    /* once descriptors are available, connections are accepted again (by
+     * the backend once the accept loop drained the listener, the event
+     * loops' listeners are each drained by their next connection) */
+    for (int i = 0; i < 8; i++) {
+        int client = socket(AF_INET, SOCK_STREAM, 0);
+        check(!connect_server(client) && write(client, "ok", 2) == 2);
+        check(peer_read(client, buff, sizeof(buff)) == 2);
+        close(client);
+        Server.stats(server, &after);
+        if (i && after.reactor_accepted > before.reactor_accepted)
+            break;
     }
+    if (uring_backend())
+        check(after.reactor_accepted > before.reactor_accepted);
 }
 
-int main(void)
+/* Outbound connections: an upstream listens on the test's thread */
+
+static volatile int opened = -1; /**< the fd reported by `on_open` */
+static int readied, received, closed;
+static int failures, failed_fd; /**< `on_connect_error` (and it's error) */
+
+static void outbound_on_open(server_pt srv, int fd)
+{
+    (void) srv;
+    opened = fd;
+}
+
+static void outbound_on_ready(server_pt srv, int fd)
+{
+    (void) srv;
+    (void) fd;
+    __atomic_add_fetch(&readied, 1, __ATOMIC_SEQ_CST);
+}
+
+static void outbound_on_data(server_pt srv, int fd)
+{
+    char buff[64];
+    ssize_t got;
+    while ((got = Server.read(srv, fd, buff, sizeof(buff))) > 0)
+        __atomic_add_fetch(&received, got, __ATOMIC_SEQ_CST);
+}
+
+static void outbound_on_close(server_pt srv, int fd)
+{
+    (void) srv;
+    if (fd < 0)
+        failed_fd = 1;
+    __atomic_add_fetch(&closed, 1, __ATOMIC_SEQ_CST);
+}
+
+static void outbound_on_connect_error(server_pt srv, const char *host,
+                                      const char *port, int error)
+{
+    (void) srv;
+    (void) port;
+    if (error && !strcmp(host, "nothing.invalid"))
+        __atomic_add_fetch(&failures, 1, __ATOMIC_SEQ_CST);
+}
+
+static struct Protocol outbound = {.service = "outbound",
+                                   .on_open = outbound_on_open,
+                                   .on_ready = outbound_on_ready,
+                                   .on_data = outbound_on_data,
+                                   .on_close = outbound_on_close,
+                                   .on_connect_error =
+                                       outbound_on_connect_error};
+
+/* the same, reporting failures to `on_close` */
+static struct Protocol outbound_closes = {.service = "outbound",
+                                          .on_open = outbound_on_open,
+                                          .on_close = outbound_on_close};
+
+static void reset_outbound(void)
 {
-    // We'll create the echo protocol object as the server's default
-    struct Protocol protocol = {
-        .on_open = on_open,
-        .on_close = on_close,
-        .on_data = on_data,
-        .service = "echo"
-    };
-    // We'll use the macro start_server, because our settings are simple.
-    // (this will call Server.listen(settings) with our settings)
-    start_server(.protocol = &protocol, .timeout = 10, .threads = 8);
+    opened = -1;
+    readied = received = closed = failures = failed_fd = 0;
+}
+
+/* listen on the host's (first) address, using any free port.
+ * @return the listening socket (the port is stored in `port`) */
+static int listen_upstream(const char *host, char *port, size_t port_len)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                             .ai_socktype = SOCK_STREAM,
+                             .ai_flags = AI_ADDRCONFIG};
+    struct addrinfo *info;
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getaddrinfo(host, "0", &hints, &info))
+        return -1;
+    int fd = socket(info->ai_family, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, info->ai_addr, info->ai_addrlen) ||
+        listen(fd, 8) ||
+        getsockname(fd, (struct sockaddr *) &addr, &addr_len) ||
+        getnameinfo((struct sockaddr *) &addr, addr_len, NULL, 0, port,
+                    port_len, NI_NUMERICSERV)) {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+    return fd;
+}
+
+/* accept the server's connection (waiting up to a second for it) */
+static int accept_upstream(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, 1000) <= 0)
+        return -1;
+    return accept(fd, NULL, NULL);
+}
+
+static void test_connect(void)
+{
+    char port[16], buff[16];
+    int upstream = listen_upstream("127.0.0.1", port, sizeof(port)), peer, fd;
+    check(upstream >= 0);
+    if (upstream < 0) return;
+    reset_outbound();
+    /* a numeric host connects right away */
+    fd = Server.connect(server, "127.0.0.1", port, &outbound);
+    check(fd >= 0 && opened == fd);
+    check((peer = accept_upstream(upstream)) >= 0);
+    wait_for(readied, 1000);
+    check(readied);
+    check(!Server.write(server, fd, "request", 7));
+    check(peer_read(peer, buff, sizeof(buff)) == 7);
+    check(write(peer, "response", 8) == 8);
+    wait_for(received == 8, 1000);
+    check(received == 8);
+    /* a released connection is reused, without connecting again */
+    check(!Server.release(server, fd));
+    check(Server.count(server, "pool") == 1);
+    readied = 0;
+    check(Server.connect(server, "127.0.0.1", port, &outbound) == fd);
+    check(!Server.count(server, "pool"));
+    wait_for(readied, 1000);
+    check(readied);
+    check(peer_read_within(upstream, buff, sizeof(buff), 50) < 0);
+    check(!Server.write(server, fd, "again", 5));
+    check(peer_read(peer, buff, sizeof(buff)) == 5);
+    /* an idle pooled connection closes on stray data */
+    check(!Server.release(server, fd));
+    check(Server.count(server, "pool") == 1);
+    check(write(peer, "stray", 5) == 5);
+    wait_for(!Server.count(server, "pool"), 1000);
+    check(!Server.count(server, "pool"));
+    /* the stray data is left unread, so the connection is reset */
+    errno = 0;
+    ssize_t got = peer_read(peer, buff, sizeof(buff));
+    check(!got || (got < 0 && errno == ECONNRESET));
+    check(!closed);
+    close(peer);
+    /* a refused connection is opened, and closed */
+    close(upstream);
+    reset_outbound();
+    fd = Server.connect(server, "127.0.0.1", port, &outbound);
+    check(fd >= 0);
+    wait_for(closed == 1, 1000);
+    check(closed == 1 && opened == fd && !readied);
+}
+
+static void test_lookup(void)
+{
+    char port[16];
+    int upstream = listen_upstream("localhost", port, sizeof(port)), peer;
+    check(upstream >= 0);
+    if (upstream < 0) return;
+    reset_outbound();
+    /* the lookup doesn't block the caller, `on_open` reports the fd */
+    errno = 0;
+    check(Server.connect(server, "localhost", port, &outbound) == -1 &&
+          errno == EINPROGRESS);
+    check((peer = accept_upstream(upstream)) >= 0);
+    wait_for(readied && opened >= 0, 1000);
+    check(readied && opened >= 0);
+    check(write(peer, "data", 4) == 4);
+    wait_for(received == 4, 1000);
+    check(received == 4);
+    Server.close(server, opened);
+    wait_for(closed == 1, 1000);
+    check(closed == 1);
+    close(peer);
+    close(upstream);
+    /* a failed lookup is reported once, without a connection */
+    reset_outbound();
+    errno = 0;
+    check(Server.connect(server, "nothing.invalid", port, &outbound) == -1 &&
+          errno == EINPROGRESS);
+    wait_for(failures, 5000);
+    usleep(50000);
+    check(failures == 1 && !closed && opened < 0);
+    /* or using `on_close`, with a -1 fd */
+    reset_outbound();
+    errno = 0;
+    check(Server.connect(server, "nothing.invalid", port,
+                         &outbound_closes) == -1 && errno == EINPROGRESS);
+    wait_for(closed, 5000);
+    usleep(50000);
+    check(closed == 1 && failed_fd && opened < 0);
+}
+
+/* Hot reload: a newer process (this program, running `newer`) adopts the
+ * listening socket and the idle connections */
+
+static char handoff_path[64];
+static int loops = 1; /**< the event loops (the newer process matches them) */
+static volatile int finished = 0; /**< set once the older server stopped */
+
+/* the newer process's protocol: tagged echoes ("stop" stops it) */
+static void newer_on_data(server_pt srv, int fd)
+{
+    char buff[64] = "newer:";
+    ssize_t got = Server.read(srv, fd, buff + 6, sizeof(buff) - 6);
+    if (got == 4 && !memcmp(buff + 6, "stop", 4))
+        Server.stop(srv);
+    else if (got > 0)
+        Server.write(srv, fd, buff, got + 6);
+}
+
+static struct Protocol newer = {.service = "newer", .on_data = newer_on_data};
+
+static void test_handoff(void)
+{
+    char buff[64];
+    int live = socket(AF_INET, SOCK_STREAM, 0), fresh, sts = -1;
+    pid_t pid;
+    /* a live (idle) connection, served by this process */
+    check(!connect_server(live) && write(live, "old", 3) == 3);
+    check(peer_read(live, buff, sizeof(buff)) == 3);
+    if (!(pid = fork())) {
+        execl("/proc/self/exe", "test-protocol-server", "newer", handoff_path,
+              loops > 1 ? "loops" : NULL, NULL);
+        _exit(1);
+    }
+    check(pid > 0);
+    if (pid <= 0) return;
+    /* this server drains, passing the connection, and stops */
+    wait_for(finished, 10000);
+    check(finished);
+    check(write(live, "two", 3) == 3);
+    check(peer_read(live, buff, sizeof(buff)) == 9 &&
+          !memcmp(buff, "newer:two", 9));
+    /* the newer process accepts the new connections */
+    fresh = socket(AF_INET, SOCK_STREAM, 0);
+    check(!connect_server(fresh) && write(fresh, "three", 5) == 5);
+    check(peer_read(fresh, buff, sizeof(buff)) == 11 &&
+          !memcmp(buff, "newer:three", 11));
+    check(write(fresh, "stop", 4) == 4);
+    check(waitpid(pid, &sts, 0) == pid && WIFEXITED(sts) &&
+          !WEXITSTATUS(sts));
+    close(live);
+    close(fresh);
+}
+
+static void *run_tests(void *arg)
+{
+    (void) arg;
+    wait_for(running, 1000);
+    test_echo();
+    test_timers();
+    test_timeouts();
+    test_read_buffer();
+    test_index();
+    test_batches();
+    test_shared();
+    test_watermarks();
+    test_await();
+    test_exhausted();
+    test_connect();
+    test_lookup();
+    /* the server stops once it's connections were handed off */
+    test_handoff();
+    if (!finished)
+        Server.stop(server);
+    return NULL;
+}
+
+static void set_running(void *arg) { (void) arg; running = 1; }
+
+static void on_init(server_pt srv)
+{
+    server = srv;
+    Server.run_after(srv, 0, set_running, NULL);
+    pthread_create(&tests, NULL, run_tests, NULL);
+}
+
+static void on_finish(server_pt srv)
+{
+    (void) srv;
+    finished = 1;
+}
+
+/* the suite runs using epoll, or using io_uring (`test-protocol-server
+ * io_uring`, which falls back to epoll where io_uring isn't supported).
+ * Options following the backend:
+ * - `single`: a single worker thread;
+ * - `loops`: two event loops, each pinned to a CPU (`SERVER_AFFINITY_THREAD`);
+ * - `inline`: the echo protocol runs `on_data` on the reactor's thread.
+ */
+int main(int argc, char *argv[])
+{
+    int uring = 0, single = 0, inlined = 0;
+    char options[64] = "";
+    for (int i = 2; i < argc; i++) {
+        single |= !strcmp(argv[i], "single");
+        inlined |= !strcmp(argv[i], "inline");
+        if (!strcmp(argv[i], "loops"))
+            loops = 2;
+    }
+    if (argc > 2 && !strcmp(argv[1], "newer"))
+        return start_server(.protocol = &newer, .port = "8094",
+                            .handoff = argv[2], .timeout = 10,
+                            .threads = 2, .reactors = loops) < 0;
+    uring = argc > 1 && !strcmp(argv[1], "io_uring");
+    echo.inline_on_data = inlined;
+    for (int i = 2; i < argc; i++)
+        snprintf(options + strlen(options), sizeof(options) - strlen(options),
+                 ", %s", argv[i]);
+    snprintf(handoff_path, sizeof(handoff_path), "/tmp/test-protocol-server.%d",
+             (int) getpid());
+    start_server(.protocol = &echo, .port = "8094", .timeout = 10,
+                 .threads = single ? 1 : 4, .reactors = loops,
+                 .affinity = loops > 1 ? SERVER_AFFINITY_THREAD
+                                       : SERVER_AFFINITY_NONE,
+                 .high_watermark = TEST_HIGH_WATERMARK,
+                 .backend = uring ? REACTOR_BACKEND_IO_URING
+                                  : REACTOR_BACKEND_EPOLL,
+                 .handoff = handoff_path, .on_init = on_init,
+                 .on_finish = on_finish);
+    pthread_join(tests, NULL);
+    printf("# server tests (%s%s%s): %s\n", uring ? "io_uring" : "epoll",
+           options, SERVER_LATENCY ? ", latency" : "",
+           failed ? "failed" : "passed");
+    return failed != 0;
 }